@@ -198,6 +198,7 @@ static const u8* main_payload_32 =
 #else
   "  incb (%edx, %edi, 1)\n"
 #endif /* ^SKIP_COUNTS */
+  "  incl " STRINGIFY(MAP_EPOCH_OFF) "(%edx)\n"
   "\n"
   "__afl_return:\n"
   "\n"
@@ -426,6 +427,7 @@ static const u8* main_payload_64 =
 #else
   "  incb (%rdx, %rcx, 1)\n"
 #endif /* ^SKIP_COUNTS */
+  "  incl " STRINGIFY(MAP_EPOCH_OFF) "(%rdx)\n"
   "\n"
   "__afl_return:\n"
   "\n"
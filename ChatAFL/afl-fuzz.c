@@ -57,6 +57,7 @@
 #include <termios.h>
 #include <dlfcn.h>
 #include <sched.h>
+#include <pthread.h>
 
 #include <sys/wait.h>
 #include <sys/time.h>
@@ -68,9 +69,14 @@
 #include <sys/ioctl.h>
 #include <sys/file.h>
 #include <sys/capability.h>
+#include <sys/syscall.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/prctl.h>
+#include <net/if.h>
 
 #include "aflnet.h"
-#include <graphviz/gvc.h>
 #include <math.h>
 
 #if defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__)
@@ -225,7 +231,8 @@ static u64 stage_finds[32], /* Patterns found per fuzz stage    */
 static u32 rand_cnt; /* Random number counter            */
 
 static u64 total_cal_us, /* Total calibration time (us)      */
-    total_cal_cycles;    /* Total calibration cycles         */
+    total_cal_cycles,    /* Total calibration cycles         */
+    cal_runs_saved;      /* Runs saved by adaptive calibration */
 
 static u64 total_bitmap_size, /* Total bit count for all bitmaps  */
     total_bitmap_entries;     /* Number of bitmaps counted        */
@@ -274,6 +281,7 @@ struct queue_entry
   u32 generating_state_id; /* ID of the start at which the new seed was generated */
   u8 is_initial_seed;      /* Is this an initial seed */
   u32 unique_state_count;  /* Unique number of states traversed by this queue entry */
+  u32 *state_sequence;     /* State sequence of this queue entry, the regions' annotations point into it */
 };
 
 static struct queue_entry *queue, /* Fuzzing queue (linked list)      */
@@ -349,6 +357,22 @@ enum
   /* 05 */ FAULT_NOBITS
 };
 
+/* Phases of an execution, timed for the latency histograms */
+
+enum
+{
+  /* 00 */ PHASE_CLEANUP,
+  /* 01 */ PHASE_FORK,
+  /* 02 */ PHASE_STARTUP,
+  /* 03 */ PHASE_CONNECT,
+  /* 04 */ PHASE_SEND,
+  /* 05 */ PHASE_RECV,
+  /* 06 */ PHASE_COVERAGE,
+  /* 07 */ PHASE_TEARDOWN,
+  /* 08 */ PHASE_TOTAL,
+  PHASE_COUNT
+};
+
 char **use_argv; /* argument to run the target program. In vanilla AFL, this is a local variable in main. */
 /* add these declarations here so we can call these functions earlier */
 static u8 run_target(char **argv, u32 timeout);
@@ -368,19 +392,72 @@ int response_buf_size = 0;  // the size of the whole response buffer
 u32 *response_bytes = NULL; // an array keeping accumulated response buffer size
                             // e.g., response_bytes[i] keeps the response buffer size
                             // once messages 0->i have been received and processed by the SUT
+// Both buffers form a response arena: they are reset rather than freed before each execution
+// and only grow (geometrically), so a steady-state execution does not allocate for responses
+u32 response_buf_cap = 0;   // allocated size of response_buf
+u32 response_bytes_cap = 0; // entries allocated in response_bytes
+u32 response_buf_peak = 0;  // largest response_buf_size of any execution
 u32 max_annotated_regions = 0;
 u32 target_state_id = 0;
 u32 *state_ids = NULL;
 u32 state_ids_count = 0;
+khash_t(hm32) *khm_state_index;     // state ID -> index in state_ids
+state_info_t **state_infos = NULL;  // the entry of every state of state_ids in the states hashtable, by index
+static u32 *state_seen = NULL;      // generation stamps by index in state_ids (see scan_exec_states())
+static u32 state_seen_gen = 0;
+fenwick_t *state_score_tree;        // state scores by index in state_ids, for weighted selection
+u32 *stale_state_indices = NULL;    // states whose score has to be recomputed before the next selection
+u32 stale_state_count = 0;
 u32 selected_state_index = 0;
 u32 state_cycles = 0;
 u32 messages_sent = 0;
-EXP_ST u8 session_virgin_bits[MAP_SIZE]; /* Regions yet untouched while the SUT is still running */
+
+// The state sequence of the last execution, parsed from response_buf once (see parse_exec_states())
+// and shared by everything that looks at the states of an execution
+static u32 *exec_states = NULL;     // the whole state sequence
+static u32 exec_state_count = 0;
+static u32 *exec_msg_states = NULL; // states (the initial one included) in the responses to messages 0..i,
+                                    // 0 if message i got no response
+static u32 exec_msg_states_cap = 0;
+static u32 *exec_trimmed = NULL;    // the sequence with repeated states trimmed
+static u32 exec_states_hash = 0;    // hash of exec_trimmed
+static u32 *exec_unique = NULL;     // every state of the sequence once, by index in state_ids ...
+static u32 exec_unique_count = 0;
+static u32 *exec_unseen = NULL;     // ... or by ID for the states not in state_ids yet
+static u32 exec_unseen_count = 0;
+static u32 exec_scan_cap = 0;       // entries allocated in exec_trimmed, exec_unique and exec_unseen
+static u8 exec_states_parsed = 0;   // the above are up to date with response_buf
+EXP_ST u8 session_virgin_bits[MAP_SIZE]; /* Regions yet untouched while the SUT is still running (binaries without edge epoch) */
 EXP_ST u8 *cleanup_script;               /* script to clean up the environment of the SUT -- make fuzzing more deterministic */
+EXP_ST u8 *cleanup_dir;                  /* directory the SUT modifies: watched for changes, restored from a snapshot without -c */
+static u8 *cleanup_pristine, *cleanup_spare; /* pristine snapshot of cleanup_dir and a ready-to-use copy of it */
+static s32 cleanup_cmd_fd = -1,          /* pipe to the long-lived cleanup shell (write end) */
+    cleanup_ack_fd = -1,                 /* exit codes reported back by that shell (read end) */
+    cleanup_inotify_fd = -1;             /* inotify watches on cleanup_dir */
+static u8 cleanup_in_place;              /* refresh cleanup_dir itself instead of swapping in cleanup_spare */
+static pthread_t cleanup_refill_thread;  /* refills cleanup_spare while the next execution runs ... */
+static pthread_mutex_t cleanup_refill_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cleanup_refill_cond = PTHREAD_COND_INITIALIZER;
+static u8 cleanup_refill_pending;        /* ... when this is set, and clears it once done */
+u64 cleanup_runs = 0, cleanup_skips = 0; /* cleanups done/skipped as cleanup_dir did not change */
 EXP_ST u8 *netns_name;                   /* network namespace name to run server in */
-char **was_fuzzed_map = NULL;            /* A 2D array keeping state-specific was_fuzzed information */
-u32 fuzzed_map_states = 0;
-u32 fuzzed_map_qentries = 0;
+EXP_ST u8 netns_pool = 0;                /* a private network namespace per instance and per worker (-G) */
+static s32 netns_fd = -1,                /* ... the one of this process */
+    host_netns_fd = -1;                  /* the one we started in */
+u8 *was_fuzzed_map = NULL;               /* State-specific was_fuzzed information, 2 bits per (state, seed) cell, one column per seed */
+u32 fuzzed_map_states = 0;               /* rows (states) in use */
+u32 fuzzed_map_qentries = 0;             /* columns (queue entries) in use */
+static u32 fuzzed_map_state_cap = 0,     /* rows allocated in each column */
+    fuzzed_map_qentry_cap = 0;           /* columns allocated */
+
+/* Values of the cells in was_fuzzed_map. Unreachable is zero, so that newly
+   allocated cells need no initialization. */
+
+enum {
+  /* 00 */ WF_UNREACHABLE,
+  /* 01 */ WF_NOT_FUZZED,
+  /* 10 */ WF_FUZZED
+};
 u32 max_seed_region_count = 0;
 u32 local_port; /* TCP/UDP port number to use as source */
 
@@ -392,6 +469,58 @@ u8 socket_timeout = 0;
 u8 protocol_selected = 0;
 u8 terminate_child = 0;
 u8 corpus_read_or_sync = 0;
+u8 detect_response_end = 0;             /* stop receiving once a reply is complete (-r) */
+u8 listen_ready = 0;                    /* the server reports when it is listening on net_port */
+u8 teardown_killed = 0;                 /* the server ignored SIGTERM (-K) and was SIGKILLed by us */
+u64 teardown_us_total = 0;              /* total time spent waiting for the server to exit */
+u64 teardown_count = 0;                 /* number of such waits */
+u64 teardown_kills = 0;                 /* number of servers escalated to SIGKILL */
+
+/* Latency histograms: every power of two of microseconds is split into 4 buckets */
+#define PHASE_BUCKETS 160
+static u8 *phase_names[PHASE_COUNT] = {"cleanup", "fork", "startup", "connect", "send",
+                                       "recv", "coverage", "teardown", "total"};
+static u64 phase_hist[PHASE_COUNT][PHASE_BUCKETS]; /* executions per latency bucket */
+static u64 phase_us[PHASE_COUNT];                  /* time spent so far in the current execution */
+static u32 phase_seen;                             /* phases the current execution went through */
+static u64 phase_t, phase_t0;                      /* end of the last phase, start of the execution */
+static u32 term_rows;                              /* terminal height, 0 if unknown */
+EXP_ST s32 listen_fd = -1;              /* read end of the listen-ready pipe */
+u8 use_desock = 0;                      /* talk to the server through shared memory (-U) */
+static desock_shm_t *desock_shm;        /* request/response rings shared with libdesock.so */
+static s32 desock_shm_id = -1;
+static s32 desock_efds[3] = {-1, -1, -1}; /* accept, conn and bell eventfds (see desock.h) */
+EXP_ST u8 prefix_snapshot = 0;          /* run M2 and M3 in forks of a server parked after M1 (-Z) */
+static s32 snap_root_pid = -1;          /* the parked server, -1 if none */
+static s32 snap_root_fd = -1;           /* pidfd of the parked server */
+static u32 snap_key;                    /* hash of the M1 it has gone through */
+static u8 snap_failed;                  /* it could not be parked for snap_key */
+static u8 snap_building;                /* the current execution drives a new server through M1 */
+static u8 snap_in_use;                  /* the current execution runs in a fork of the parked server */
+static u32 snap_done_before;            /* snap_done before that fork was asked for */
+static u8 *snap_trace_bits;             /* coverage of M1 */
+static char *snap_response_buf;         /* responses to M1 ... */
+static u32 snap_response_size;
+static u32 *snap_response_bytes;        /* ... and where they end */
+static u32 snap_messages;               /* number of messages in M1 */
+u64 snap_execs = 0, snap_builds = 0, snap_parks = 0; /* snapshot executions, parking attempts, successes */
+EXP_ST u32 persist_sessions = 0;        /* sessions per server process in persistent mode (-p), 0: no limit */
+u8 persistent_net = 0;                  /* the server stops itself after every session (persistent mode) */
+u8 server_stopped = 0;                  /* ... and has done so at the end of the last one */
+static u32 server_sessions;             /* sessions the current server process has run */
+u64 server_resumes = 0;                 /* sessions run by a resumed (-p) or reused (-L) server */
+EXP_ST u32 reuse_sessions = 0;          /* sessions per server process when reusing it (-L), 0: off */
+static u8 server_alive;                 /* the server survived the last session and waits for more */
+static u8 server_reused;                /* ... and runs the current one */
+static u8 reuse_fresh;                  /* the next execution needs a new server (calibration) */
+static u8 *reuse_msgs;                  /* the messages of the session the kept server ran last, */
+static u32 reuse_msgs_len, reuse_msgs_cap; /* in the replayable format, in case it dies later */
+EXP_ST u8 virtual_time = 0;             /* skip the server's idle waits with libvtime.so (-v) */
+EXP_ST u32 worker_count = 0;            /* execution workers, each with a server of its own (-J) */
+static struct worker *workers;          /* ... and what we know about them (see start_workers()) */
+static u32 *worker_done;                /* bumped by a worker whenever it moves on */
+static u8 workers_async;                /* common_fuzz_stuff() hands executions to the workers */
+static struct worker *cal_worker;       /* ran the test case being calibrated in the dry run */
 u8 state_aware_mode = 0;
 u8 region_level_mutation = 0;
 u8 state_selection_algo = ROUND_ROBIN, seed_selection_algo = RANDOM_SELECTION;
@@ -403,8 +532,8 @@ u32 uninteresting_times = 0;
 u32 chat_times = 0;
 
 /* Implemented state machine */
-Agraph_t *ipsm;
-static FILE *ipsm_dot_file;
+ipsm_t *ipsm;
+static u8 ipsm_changed;               /* IPSM changed since last export   */
 
 /* Hash table/map and list */
 klist_t(lms) * kl_messages;
@@ -420,6 +549,8 @@ kliter_t(lms) * M2_prev, *M2_next;
 // Function pointers pointing to Protocol-specific functions
 unsigned int *(*extract_response_codes)(unsigned char *buf, unsigned int buf_size, unsigned int *state_count_ref) = NULL;
 region_t *(*extract_requests)(unsigned char *buf, unsigned int buf_size, unsigned int *region_count_ref) = NULL;
+int (*response_complete)(unsigned char *buf, unsigned int buf_size) = NULL;
+int (*reply_matches)(unsigned char *req, unsigned int req_len, unsigned char *resp, unsigned int resp_len) = NULL;
 
 // Patterns generated from the Language Model
 klist_t(rang) * protocol_patterns;
@@ -595,23 +726,24 @@ range_list parse_buffer(char *buf, size_t buf_len)
   return best_decomposition;
 }
 
-/* Initialize the implemented state machine as a graphviz graph */
+/* Initialize the implemented state machine */
 void setup_ipsm()
 {
-  ipsm = agopen("g", Agdirected, 0);
-
-  agattr(ipsm, AGNODE, "color", "black"); // Default node colr is black
-  agattr(ipsm, AGEDGE, "color", "black"); // Default edge color is black
+  ipsm = ipsm_create();
 
   khs_ipsm_paths = kh_init(hs32);
 
   khms_states = kh_init(hms);
+
+  khm_state_index = kh_init(hm32);
+
+  state_score_tree = fenwick_create();
 }
 
 /* Free memory allocated to state-machine variables */
 void destroy_ipsm()
 {
-  agclose(ipsm);
+  ipsm_destroy(ipsm);
 
   kh_destroy(hs32, khs_ipsm_paths);
 
@@ -619,91 +751,136 @@ void destroy_ipsm()
   kh_foreach_value(khms_states, state, {ck_free(state->seeds); ck_free(state); });
   kh_destroy(hms, khms_states);
 
+  kh_destroy(hm32, khm_state_index);
+  ck_free(state_infos);
+  ck_free(state_seen);
+  fenwick_destroy(state_score_tree);
+  ck_free(stale_state_indices);
   ck_free(state_ids);
+  ck_free(was_fuzzed_map);
 }
 
-/* Get state index in the state IDs list, given a state ID */
+/* Get state index in the state IDs list, given a state ID. Returns
+   state_ids_count for states that have not been seen. */
 u32 get_state_index(u32 state_id)
 {
-  u32 index = 0;
-  for (index = 0; index < state_ids_count; index++)
-  {
-    if (state_ids[index] == state_id)
-      break;
-  }
-  return index;
+  khint_t k = kh_get(hm32, khm_state_index, state_id);
+
+  return k == kh_end(khm_state_index) ? state_ids_count : kh_val(khm_state_index, k);
 }
 
-/* Expand the size of the map when a new seed or a new state has been discovered */
+/* Expand the size of the map when a new seed or a new state has been discovered.
+   The map is column-major: the cells of one seed are contiguous, and both
+   dimensions grow geometrically, so that adding a seed or a state does not touch
+   the existing cells most of the time. */
 void expand_was_fuzzed_map(u32 new_states, u32 new_qentries)
 {
-  int i, j;
-  // Realloc the memory
-  was_fuzzed_map = (char **)ck_realloc(was_fuzzed_map, (fuzzed_map_states + new_states) * sizeof(char *));
-  for (i = 0; i < fuzzed_map_states + new_states; i++)
-    was_fuzzed_map[i] = (char *)ck_realloc(was_fuzzed_map[i], (fuzzed_map_qentries + new_qentries) * sizeof(char));
+  u32 states = fuzzed_map_states + new_states;
+  u32 qentries = fuzzed_map_qentries + new_qentries;
+  u32 cap, j;
+
+  if (states > fuzzed_map_state_cap || !fuzzed_map_state_cap)
+  {
+    u8 *map;
 
-  // All new cells are marked as -1 -- meaning UNREACHABLE
-  // Keep other cells untouched
-  for (i = 0; i < fuzzed_map_states + new_states; i++)
-    for (j = 0; j < fuzzed_map_qentries + new_qentries; j++)
-      if ((i >= fuzzed_map_states) || (j >= fuzzed_map_qentries))
-        was_fuzzed_map[i][j] = -1;
+    cap = fuzzed_map_state_cap ? fuzzed_map_state_cap : 16;
+    while (cap < states)
+      cap *= 2;
+
+    // Longer columns: copy them over, the new cells are zero -- meaning UNREACHABLE
+    if (cap != fuzzed_map_state_cap)
+    {
+      map = ck_alloc(fuzzed_map_qentry_cap * (cap / 4) + 1);
+      for (j = 0; j < fuzzed_map_qentries; j++)
+        memcpy(map + j * (cap / 4), was_fuzzed_map + j * (fuzzed_map_state_cap / 4), fuzzed_map_state_cap / 4);
+
+      ck_free(was_fuzzed_map);
+      was_fuzzed_map = map;
+      fuzzed_map_state_cap = cap;
+    }
+  }
+
+  if (qentries > fuzzed_map_qentry_cap)
+  {
+    cap = fuzzed_map_qentry_cap ? fuzzed_map_qentry_cap : 64;
+    while (cap < qentries)
+      cap *= 2;
+
+    // More columns: ck_realloc() zeroes the new ones
+    was_fuzzed_map = ck_realloc(was_fuzzed_map, cap * (fuzzed_map_state_cap / 4) + 1);
+    fuzzed_map_qentry_cap = cap;
+  }
 
   // Update total number of states (rows) and total number of queue entries (columns) in the was_fuzzed_map
-  fuzzed_map_states += new_states;
-  fuzzed_map_qentries += new_qentries;
+  fuzzed_map_states = states;
+  fuzzed_map_qentries = qentries;
 }
 
-/* Get unique state count, given a state sequence */
-u32 get_unique_state_count(unsigned int *state_sequence, unsigned int state_count)
+/* Get the was_fuzzed information of a seed for the state at state_index */
+static inline u8 get_was_fuzzed(u32 state_index, u32 qentry)
 {
-  // A hash set is used so that no state is counted twice
-  khash_t(hs32) * khs_state_ids;
-  khs_state_ids = kh_init(hs32);
+  u32 cell;
 
-  unsigned int discard, state_id, i;
-  u32 result = 0;
+  if (state_index >= fuzzed_map_states || qentry >= fuzzed_map_qentries)
+    return WF_UNREACHABLE;
 
-  for (i = 0; i < state_count; i++)
-  {
-    state_id = state_sequence[i];
+  cell = qentry * fuzzed_map_state_cap + state_index;
+  return (was_fuzzed_map[cell >> 2] >> ((cell & 3) << 1)) & 3;
+}
 
-    if (kh_get(hs32, khs_state_ids, state_id) != kh_end(khs_state_ids))
-    {
-      continue;
-    }
-    else
-    {
-      kh_put(hs32, khs_state_ids, state_id, &discard);
-      result++;
-    }
-  }
+/* Set the was_fuzzed information of a seed for the state at state_index */
+static inline void set_was_fuzzed(u32 state_index, u32 qentry, u8 val)
+{
+  u32 cell;
 
-  kh_destroy(hs32, khs_state_ids);
-  return result;
+  if (state_index >= fuzzed_map_states || qentry >= fuzzed_map_qentries)
+    return;
+
+  cell = qentry * fuzzed_map_state_cap + state_index;
+  was_fuzzed_map[cell >> 2] = (was_fuzzed_map[cell >> 2] & ~(3 << ((cell & 3) << 1))) | (val << ((cell & 3) << 1));
 }
 
-/* Check if a state sequence is interesting (e.g., new state is discovered). Loop is taken into account */
-u8 is_state_sequence_interesting(unsigned int *state_sequence, unsigned int state_count)
+/* Queue a state for rescoring, to be called whenever one of the inputs of its score changes */
+void mark_state_stale(state_info_t *state)
 {
-  // limit the loop count to only 1
-  u32 *trimmed_state_sequence = NULL;
-  u32 i, count = 0;
-  for (i = 0; i < state_count; i++)
-  {
-    if ((i >= 2) && (state_sequence[i] == state_sequence[i - 1]) && (state_sequence[i] == state_sequence[i - 2]))
-      continue;
-    count++;
-    trimmed_state_sequence = (u32 *)realloc(trimmed_state_sequence, count * sizeof(unsigned int));
-    trimmed_state_sequence[count - 1] = state_sequence[i];
-  }
+  if (state->score_stale)
+    return;
+  state->score_stale = 1;
+
+  stale_state_indices = (u32 *)ck_realloc(stale_state_indices, (stale_state_count + 1) * sizeof(u32));
+  stale_state_indices[stale_state_count++] = get_state_index(state->id);
+}
+
+/* Insert a newly discovered state into the state IDs list and give it a row in the was_fuzzed map.
+   The state must already be in the states hashtable. */
+void add_state_id(u32 state_id)
+{
+  int discard;
+  khint_t k = kh_put(hm32, khm_state_index, state_id, &discard);
 
-  // Calculate the hash based on the shortened state sequence
-  u32 hashKey = hash32(trimmed_state_sequence, count * sizeof(unsigned int), 0);
-  if (trimmed_state_sequence)
-    free(trimmed_state_sequence);
+  kh_val(khm_state_index, k) = state_ids_count;
 
+  state_ids = (u32 *)ck_realloc(state_ids, (state_ids_count + 1) * sizeof(u32));
+  state_ids[state_ids_count] = state_id;
+
+  k = kh_get(hms, khms_states, state_id);
+  state_infos = (state_info_t **)ck_realloc(state_infos, (state_ids_count + 1) * sizeof(state_info_t *));
+  state_infos[state_ids_count] = k != kh_end(khms_states) ? kh_val(khms_states, k) : NULL;
+
+  // The new stamp is zero, i.e., not seen in the current generation
+  state_seen = (u32 *)ck_realloc(state_seen, (state_ids_count + 1) * sizeof(u32));
+
+  state_ids_count++;
+  expand_was_fuzzed_map(1, 0);
+
+  if (state_infos[state_ids_count - 1])
+    mark_state_stale(state_infos[state_ids_count - 1]);
+}
+
+/* Check if a state sequence is interesting (e.g., new state is discovered), given the hash
+   of its trimmed form (see scan_exec_states()). Loop is taken into account */
+u8 is_state_sequence_interesting(u32 hashKey)
+{
   if (kh_get(hs32, khs_ipsm_paths, hashKey) != kh_end(khs_ipsm_paths))
   {
     return 0;
@@ -716,25 +893,139 @@ u8 is_state_sequence_interesting(unsigned int *state_sequence, unsigned int stat
   }
 }
 
-/* Update the annotations of regions (i.e., state sequence received from the server) */
-void update_region_annotations(struct queue_entry *q)
+/* Make room for count entries in response_bytes */
+static void reserve_response_bytes(u32 count)
 {
-  u32 i = 0;
+  if (count <= response_bytes_cap)
+    return;
 
-  for (i = 0; i < messages_sent; i++)
+  response_bytes_cap = MAX(count, response_bytes_cap * 2);
+  response_bytes = (u32 *)ck_realloc(response_bytes, response_bytes_cap * sizeof(u32));
+}
+
+/* The response to message i, as a slice of response_buf (not NUL-terminated) */
+static inline char *response_slice(u32 i, u32 *len)
+{
+  u32 start = i ? response_bytes[i - 1] : 0;
+
+  *len = response_bytes[i] - start;
+  return response_buf + start;
+}
+
+/* One pass over exec_states for the hash of the sequence with repeated states trimmed and for
+   every state in it once, in exec_unique or exec_unseen. Allocates nothing once the scratch
+   arrays are large enough: a known state has been seen in this pass if its stamp in state_seen
+   is the current generation. To be run again once new states have been added */
+static void scan_exec_states(void)
+{
+  u32 i, j, k, idx, id;
+
+  if (exec_state_count > exec_scan_cap)
+  {
+    exec_scan_cap = MAX(exec_state_count, exec_scan_cap * 2);
+    exec_trimmed = (u32 *)ck_realloc(exec_trimmed, exec_scan_cap * sizeof(u32));
+    exec_unique = (u32 *)ck_realloc(exec_unique, exec_scan_cap * sizeof(u32));
+    exec_unseen = (u32 *)ck_realloc(exec_unseen, exec_scan_cap * sizeof(u32));
+  }
+
+  // A new generation forgets the states seen in the last pass, the stamps are only cleared when it wraps
+  if (!++state_seen_gen)
+  {
+    memset(state_seen, 0, state_ids_count * sizeof(u32));
+    state_seen_gen = 1;
+  }
+
+  exec_unique_count = exec_unseen_count = 0;
+
+  for (i = 0, k = 0; i < exec_state_count; i++)
   {
-    if ((response_bytes[i] == 0) || (i > 0 && (response_bytes[i] - response_bytes[i - 1] == 0)))
+    id = exec_states[i];
+
+    // Limit the loop count to only 1, i.e., drop a state seen twice in a row already
+    if ((i >= 2) && (id == exec_states[i - 1]) && (id == exec_states[i - 2]))
+      continue;
+    exec_trimmed[k++] = id;
+
+    if (i && id == exec_states[i - 1])
+      continue;
+
+    idx = get_state_index(id);
+    if (idx < state_ids_count)
     {
-      q->regions[i].state_sequence = NULL;
-      q->regions[i].state_count = 0;
+      if (state_seen[idx] != state_seen_gen)
+      {
+        state_seen[idx] = state_seen_gen;
+        exec_unique[exec_unique_count++] = idx;
+      }
     }
     else
     {
-      unsigned int state_count;
-      q->regions[i].state_sequence = (*extract_response_codes)(response_buf, response_bytes[i], &state_count);
-      q->regions[i].state_count = state_count;
+      // New states are rare, a look at the ones found so far will do
+      for (j = 0; j < exec_unseen_count && exec_unseen[j] != id; j++)
+        ;
+      if (j == exec_unseen_count)
+        exec_unseen[exec_unseen_count++] = id;
     }
   }
+
+  exec_states_hash = hash32(exec_trimmed, k * sizeof(u32), 0);
+}
+
+/* Parse the states out of response_buf, unless that has been done since the last execution.
+   One pass gives the whole sequence, the states the responses to every message add up to
+   (from where the states end in the buffer) and the hash telling whether it is interesting */
+static void parse_exec_states(void)
+{
+  unsigned int state_count;
+  u32 i, k, len;
+
+  if (exec_states_parsed)
+    return;
+  exec_states_parsed = 1;
+
+  if (exec_states)
+    ck_free(exec_states);
+  exec_states = (*extract_response_codes)(response_buf, response_buf_size, &state_count);
+  exec_state_count = state_count;
+
+  scan_exec_states();
+
+  if (messages_sent > exec_msg_states_cap)
+  {
+    exec_msg_states_cap = MAX(messages_sent, exec_msg_states_cap * 2);
+    exec_msg_states = (u32 *)ck_realloc(exec_msg_states, exec_msg_states_cap * sizeof(u32));
+  }
+
+  // A state belongs to the responses to messages 0..i if it ends within response_bytes[i].
+  // States cut short by the end of the buffer end with it
+  k = MIN(1, exec_state_count);
+  for (i = 0; i < messages_sent; i++)
+  {
+    while (k < exec_state_count && MIN(state_ends[k], (u32)response_buf_size) <= response_bytes[i])
+      k++;
+
+    response_slice(i, &len);
+    exec_msg_states[i] = len ? k : 0;
+  }
+}
+
+/* Update the annotations of regions (i.e., state sequence received from the server). Each region
+   gets the states up to the response to its message, as a prefix of the state sequence of the seed */
+void update_region_annotations(struct queue_entry *q)
+{
+  u32 i;
+
+  parse_exec_states();
+
+  if (q->state_sequence)
+    ck_free(q->state_sequence);
+  q->state_sequence = exec_state_count ? ck_memdup(exec_states, exec_state_count * sizeof(u32)) : NULL;
+
+  for (i = 0; i < messages_sent; i++)
+  {
+    q->regions[i].state_sequence = exec_msg_states[i] ? q->state_sequence : NULL;
+    q->regions[i].state_count = exec_msg_states[i];
+  }
 }
 
 /* Choose a region data for region-level mutations */
@@ -774,101 +1065,129 @@ u8 *choose_source_region(u32 *out_len)
   return out;
 }
 
-/* Update #fuzzs visiting a specific state */
-void update_fuzzs()
+/* Tell whether a state often shows variable behavior when new finds reaching it are
+   calibrated */
+static u8 state_is_flaky(state_info_t *state)
 {
-  unsigned int state_count, i, discard;
-  unsigned int *state_sequence = (*extract_response_codes)(response_buf, response_buf_size, &state_count);
+  return state->cal_variable * 100 > state->cal_count * CAL_FLAKY_PERC;
+}
 
-  // A hash set is used so that the #paths is not updated more than once for one specific state
-  khash_t(hs32) * khs_state_ids;
+/* Hash the state sequence of the last execution, for calibrate_case() to see whether it
+   changes from one run to the next. Sets *flaky if one of the states is flaky */
+static u32 hash_state_sequence(u8 *flaky)
+{
+  u32 h = 2166136261U, i;
   khint_t k;
-  khs_state_ids = kh_init(hs32);
 
-  for (i = 0; i < state_count; i++)
+  parse_exec_states();
+
+  for (i = 0; i < exec_state_count; i++)
   {
-    unsigned int state_id = state_sequence[i];
+    h = (h ^ exec_states[i]) * 16777619U;
 
-    if (kh_get(hs32, khs_state_ids, state_id) != kh_end(khs_state_ids))
-    {
-      continue;
-    }
-    else
+    k = kh_get(hms, khms_states, exec_states[i]);
+    if (k != kh_end(khms_states) && state_is_flaky(kh_val(khms_states, k)))
+      *flaky = 1;
+  }
+
+  return h;
+}
+
+/* Account for the calibration of a new find in the states of its last execution */
+static void update_state_calibration(u8 variable)
+{
+  state_info_t *state;
+  u32 i;
+
+  parse_exec_states();
+
+  for (i = 0; i < exec_unique_count; i++)
+  {
+    state = state_infos[exec_unique[i]];
+    if (state)
     {
-      kh_put(hs32, khs_state_ids, state_id, &discard);
-      k = kh_get(hms, khms_states, state_id);
-      if (k != kh_end(khms_states))
-      {
-        kh_val(khms_states, k)->fuzzs++;
-      }
+      state->cal_count++;
+      state->cal_variable += variable;
     }
   }
-  ck_free(state_sequence);
-  kh_destroy(hs32, khs_state_ids);
 }
 
-/* Return the index of the "region" containing a given value */
-u32 index_search(u32 *A, u32 n, u32 val)
+/* Update #fuzzs visiting a specific state */
+void update_fuzzs()
 {
-  u32 index = 0;
-  for (index = 0; index < n; index++)
+  state_info_t *state;
+  u32 i;
+
+  // exec_unique has every state once, so that #fuzzs is not updated more than once for one specific state
+  parse_exec_states();
+
+  for (i = 0; i < exec_unique_count; i++)
   {
-    if (val <= A[index])
-      break;
+    state = state_infos[exec_unique[i]];
+    if (state)
+    {
+      state->fuzzs++;
+      mark_state_stale(state);
+    }
   }
-  return index;
 }
 
-/* Calculate state scores and select the next state */
+/* Score of a state under FAVOR: favor states that have led to new paths, and
+   states that have not been selected or fuzzed much */
+u32 favor_state_score(state_info_t *state)
+{
+  return ceil(1000 * pow(2, -log10(log10(state->fuzzs + 1) * state->selected_times + 1)) * pow(2, log(state->paths_discovered + 1)));
+}
+
+/* State scoring policies, by state selection algorithm. A policy turns the
+   statistics of a state into its weight for update_scores_and_select_next_state();
+   new policies only need an entry here. */
+static u32 (*state_score_policies[])(state_info_t *state) = {
+  [FAVOR] = favor_state_score
+};
+
+/* Rescore the states whose statistics changed since the last selection, then
+   select the next state, with probability proportional to its score */
 u32 update_scores_and_select_next_state(u8 mode)
 {
-  u32 result = 0, i;
+  u32 i, idx;
+  u64 total, randV;
+  khint_t k;
+  state_info_t *state;
 
   if (state_ids_count == 0)
     return 0;
 
-  u32 *state_scores = NULL;
-  state_scores = (u32 *)ck_alloc(state_ids_count * sizeof(u32));
-  if (!state_scores)
-    PFATAL("Cannot allocate memory for state_scores");
+  if (mode >= sizeof(state_score_policies) / sizeof(state_score_policies[0]) || !state_score_policies[mode])
+    FATAL("AFLNet - no scoring policy for state selection algorithm %u", mode);
 
-  khint_t k;
-  state_info_t *state;
   // Update the states' score
-  for (i = 0; i < state_ids_count; i++)
+  for (i = 0; i < stale_state_count; i++)
   {
-    u32 state_id = state_ids[i];
+    idx = stale_state_indices[i];
 
-    k = kh_get(hms, khms_states, state_id);
+    k = kh_get(hms, khms_states, state_ids[idx]);
     if (k != kh_end(khms_states))
     {
       state = kh_val(khms_states, k);
-      switch (mode)
-      {
-      case FAVOR:
-        state->score = ceil(1000 * pow(2, -log10(log10(state->fuzzs + 1) * state->selected_times + 1)) * pow(2, log(state->paths_discovered + 1)));
-        break;
-        // other cases are reserved
-      }
-
-      if (i == 0)
-      {
-        state_scores[i] = state->score;
-      }
-      else
-      {
-        state_scores[i] = state_scores[i - 1] + state->score;
-      }
+      state->score = state_score_policies[mode](state);
+      state->score_stale = 0;
+      fenwick_set(state_score_tree, idx, state->score);
     }
   }
+  stale_state_count = 0;
 
-  u32 randV = UR(state_scores[state_ids_count - 1]);
-  u32 idx = index_search(state_scores, state_ids_count, randV);
-  result = state_ids[idx];
+  total = fenwick_total(state_score_tree);
+  if (!total)
+    return state_ids[UR(state_ids_count)];
 
-  if (state_scores)
-    ck_free(state_scores);
-  return result;
+  // UR() only has 31 bits of randomness, make up larger values from two draws
+  if (total <= 0x80000000)
+    randV = UR(total);
+  else
+    randV = (((u64)UR(0x80000000) << 31) | UR(0x80000000)) % total;
+
+  return state_ids[fenwick_find(state_score_tree, randV)];
 }
 
 /* Select a target state at which we do state-aware fuzzing */
@@ -944,6 +1263,7 @@ struct queue_entry *choose_seed(u32 target_state_id, u8 mode)
         // Do seed selection similar to AFL + take into account state-aware information
         // e.g., was_fuzzed information becomes state-aware
         u32 passed_cycles = 0;
+        u32 target_state_index = get_state_index(target_state_id);
         while (passed_cycles < 5)
         {
           result = state->seeds[state->selected_seed_index];
@@ -960,13 +1280,12 @@ struct queue_entry *choose_seed(u32 target_state_id, u8 mode)
           if (result->generating_state_id != target_state_id && !result->is_initial_seed && UR(100) < 90)
             continue;
 
-          u32 target_state_index = get_state_index(target_state_id);
           if (pending_favored)
           {
             /* If we have any favored, non-fuzzed new arrivals in the queue,
                possibly skip to them at the expense of already-fuzzed or non-favored
                cases. */
-            if (((was_fuzzed_map[target_state_index][result->index] == 1) || !result->favored) && UR(100) < SKIP_TO_NEW_PROB)
+            if (((get_was_fuzzed(target_state_index, result->index) == WF_FUZZED) || !result->favored) && UR(100) < SKIP_TO_NEW_PROB)
               continue;
 
             /* Otherwise, this seed is selected */
@@ -977,7 +1296,7 @@ struct queue_entry *choose_seed(u32 target_state_id, u8 mode)
             /* Otherwise, still possibly skip non-favored cases, albeit less often.
                The odds of skipping stuff are higher for already-fuzzed inputs and
                lower for never-fuzzed entries. */
-            if (queue_cycle > 1 && (was_fuzzed_map[target_state_index][result->index] == 0))
+            if (queue_cycle > 1 && (get_was_fuzzed(target_state_index, result->index) == WF_NOT_FUZZED))
             {
               if (UR(100) < SKIP_NFAV_NEW_PROB)
                 continue;
@@ -1015,6 +1334,41 @@ struct queue_entry *choose_seed(u32 target_state_id, u8 mode)
 }
 
 static u64 get_cur_time(void);
+static u64 get_cur_time_us(void);
+
+/* Return the index of a state in the IPSM, adding the state to the graph and
+   to the states hashtable if it has not been seen before */
+static u32 add_ipsm_state(u32 state_id, u64 now, u8 dry_run)
+{
+  khint_t k;
+  int discard;
+  u8 added;
+  u32 idx = ipsm_add_state(ipsm, state_id, now, dry_run, &added);
+
+  if (!added)
+    return idx;
+
+  // Insert this newly discovered state into the states hashtable
+  state_info_t *newState = (state_info_t *)ck_alloc(sizeof(state_info_t));
+  newState->id = state_id;
+  newState->is_covered = 1;
+  newState->paths = 0;
+  newState->paths_discovered = 0;
+  newState->selected_times = 0;
+  newState->fuzzs = 0;
+  newState->score = 1;
+  newState->selected_seed_index = 0;
+  newState->seeds = NULL;
+  newState->seeds_count = 0;
+
+  k = kh_put(hms, khms_states, state_id, &discard);
+  kh_value(khms_states, k) = newState;
+
+  // Insert this into the state_ids array too
+  add_state_id(state_id);
+
+  return idx;
+}
 
 /* Update state-aware variables */
 void update_state_aware_variables(struct queue_entry *q, u8 dry_run)
@@ -1024,14 +1378,18 @@ void update_state_aware_variables(struct queue_entry *q, u8 dry_run)
   state_info_t *state;
   unsigned int state_count;
 
-  if (!response_buf_size || !response_bytes)
+  if (!response_buf_size || !messages_sent)
     return;
 
-  unsigned int *state_sequence = (*extract_response_codes)(response_buf, response_buf_size, &state_count);
+  parse_exec_states();
 
-  q->unique_state_count = get_unique_state_count(state_sequence, state_count);
+  // Shared with the other users of the states of this execution, not to be freed here
+  unsigned int *state_sequence = exec_states;
+  state_count = exec_state_count;
 
-  if (is_state_sequence_interesting(state_sequence, state_count))
+  q->unique_state_count = exec_unique_count + exec_unseen_count;
+
+  if (is_state_sequence_interesting(exec_states_hash))
   {
     // Save the current kl_messages to a file which can be used to replay the newly discovered paths on the ipsm
     u8 *temp_str = state_sequence_to_string(state_sequence, state_count);
@@ -1043,124 +1401,24 @@ void update_state_aware_variables(struct queue_entry *q, u8 dry_run)
     u8 *responses_fname = alloc_printf("%s/responses-ipsm/id:%s", out_dir, basename(q->fname));
     save_responses_to_file(response_buf, response_buf_size, response_bytes, responses_fname, messages_sent);
     ck_free(responses_fname);
+  }
 
-    // Update the IPSM graph
-    if (state_count > 1)
-    {
-      unsigned int prevStateID = state_sequence[0];
-
-      for (i = 1; i < state_count; i++)
-      {
-        unsigned int curStateID = state_sequence[i];
-        char fromState[STATE_STR_LEN], toState[STATE_STR_LEN];
-        snprintf(fromState, STATE_STR_LEN, "%d", prevStateID);
-        snprintf(toState, STATE_STR_LEN, "%d", curStateID);
-
-        // Check if the prevStateID and curStateID have been added to the state machine as vertices
-        // Check also if the edge prevStateID->curStateID has been added
-        Agnode_t *from, *to;
-        Agedge_t *edge;
-        from = agnode(ipsm, fromState, FALSE);
-        if (!from)
-        {
-          // Add a node to the graph
-          from = agnode(ipsm, fromState, TRUE);
-          if (dry_run)
-            agset(from, "color", "blue");
-          else
-            agset(from, "color", "red");
-
-          // Insert this newly discovered state into the states hashtable
-          state_info_t *newState_From = (state_info_t *)ck_alloc(sizeof(state_info_t));
-          newState_From->id = prevStateID;
-          newState_From->is_covered = 1;
-          newState_From->paths = 0;
-          newState_From->paths_discovered = 0;
-          newState_From->selected_times = 0;
-          newState_From->fuzzs = 0;
-          newState_From->score = 1;
-          newState_From->selected_seed_index = 0;
-          newState_From->seeds = NULL;
-          newState_From->seeds_count = 0;
-
-          k = kh_put(hms, khms_states, prevStateID, &discard);
-          kh_value(khms_states, k) = newState_From;
-
-          // Insert this into the state_ids array too
-          state_ids = (u32 *)ck_realloc(state_ids, (state_ids_count + 1) * sizeof(u32));
-          state_ids[state_ids_count++] = prevStateID;
-
-          if (prevStateID != 0)
-            expand_was_fuzzed_map(1, 0);
-        }
-
-        to = agnode(ipsm, toState, FALSE);
-        if (!to)
-        {
-          // Add a node to the graph
-          to = agnode(ipsm, toState, TRUE);
-          if (dry_run)
-            agset(to, "color", "blue");
-          else
-            agset(to, "color", "red");
-
-          // Insert this newly discovered state into the states hashtable
-          state_info_t *newState_To = (state_info_t *)ck_alloc(sizeof(state_info_t));
-          newState_To->id = curStateID;
-          newState_To->is_covered = 1;
-          newState_To->paths = 0;
-          newState_To->paths_discovered = 0;
-          newState_To->selected_times = 0;
-          newState_To->fuzzs = 0;
-          newState_To->score = 1;
-          newState_To->selected_seed_index = 0;
-          newState_To->seeds = NULL;
-          newState_To->seeds_count = 0;
-
-          k = kh_put(hms, khms_states, curStateID, &discard);
-          kh_value(khms_states, k) = newState_To;
-
-          // Insert this into the state_ids array too
-          state_ids = (u32 *)ck_realloc(state_ids, (state_ids_count + 1) * sizeof(u32));
-          state_ids[state_ids_count++] = curStateID;
-
-          if (curStateID != 0)
-            expand_was_fuzzed_map(1, 0);
-        }
+  // Update the IPSM graph. Every seed walks its transitions so that the edges count hits,
+  // new states and transitions only show up in sequences which are interesting
+  if (state_count > 1)
+  {
+    u64 now = get_cur_time() - start_time;
+    u32 from = add_ipsm_state(state_sequence[0], now, dry_run), to;
 
-        // Check if an edge from->to exists
-        edge = agedge(ipsm, from, to, NULL, FALSE);
-        if (!edge)
-        {
-          // Add an edge to the graph
-          edge = agedge(ipsm, from, to, "new_edge", TRUE);
-          if (dry_run)
-            agset(edge, "color", "blue");
-          else
-            agset(edge, "color", "red");
-        }
+    for (i = 1; i < state_count; i++)
+    {
+      to = add_ipsm_state(state_sequence[i], now, dry_run);
 
-        // Update prevStateID
-        prevStateID = curStateID;
-      }
+      ipsm_add_transition(ipsm, from, to, now, dry_run);
+      from = to;
     }
 
-    // Update the dot file
-    s32 fd;
-    u8 *tmp;
-    tmp = alloc_printf("%s/ipsm.dot", out_dir);
-    fd = open(tmp, O_WRONLY | O_CREAT, 0600);
-    if (fd < 0)
-    {
-      PFATAL("Unable to create %s", tmp);
-    }
-    else
-    {
-      ipsm_dot_file = fdopen(fd, "w");
-      agwrite(ipsm, ipsm_dot_file);
-      close(fileno(ipsm_dot_file));
-      ck_free(tmp);
-    }
+    ipsm_changed = 1;
   }
 
   // Update others no matter the new seed leads to interesting state sequence or not
@@ -1179,7 +1437,7 @@ void update_state_aware_variables(struct queue_entry *q, u8 dry_run)
     state->seeds[state->seeds_count] = (void *)q;
     state->seeds_count++;
 
-    was_fuzzed_map[0][q->index] = 0; // Mark it as reachable but not fuzzed
+    set_was_fuzzed(get_state_index(0), q->index, WF_NOT_FUZZED); // Mark it as reachable but not fuzzed
   }
   else
   {
@@ -1229,42 +1487,23 @@ void update_state_aware_variables(struct queue_entry *q, u8 dry_run)
         kh_value(khms_states, k) = newState;
 
         // Insert this into the state_ids array too
-        state_ids = (u32 *)ck_realloc(state_ids, (state_ids_count + 1) * sizeof(u32));
-        state_ids[state_ids_count++] = reachable_state_id;
-
-        if (reachable_state_id != 0)
-          expand_was_fuzzed_map(1, 0);
+        add_state_id(reachable_state_id);
       }
 
-      was_fuzzed_map[get_state_index(reachable_state_id)][q->index] = 0; // Mark it as reachable but not fuzzed
+      set_was_fuzzed(get_state_index(reachable_state_id), q->index, WF_NOT_FUZZED); // Mark it as reachable but not fuzzed
     }
   }
 
   // Update the number of paths which have traversed a specific state
   // It can be used for calculating fuzzing energy
-  // A hash set is used so that the #paths is not updated more than once for one specific state
-  khash_t(hs32) * khs_state_ids;
-  khs_state_ids = kh_init(hs32);
+  // Scan again as the states new to this sequence are known by now, exec_unique has each of them once
+  scan_exec_states();
 
-  for (i = 0; i < state_count; i++)
+  for (i = 0; i < exec_unique_count; i++)
   {
-    unsigned int state_id = state_sequence[i];
-
-    if (kh_get(hs32, khs_state_ids, state_id) != kh_end(khs_state_ids))
-    {
-      continue;
-    }
-    else
-    {
-      kh_put(hs32, khs_state_ids, state_id, &discard);
-      k = kh_get(hms, khms_states, state_id);
-      if (k != kh_end(khms_states))
-      {
-        kh_val(khms_states, k)->paths++;
-      }
-    }
+    if (state_infos[exec_unique[i]])
+      state_infos[exec_unique[i]]->paths++;
   }
-  kh_destroy(hs32, khs_state_ids);
 
   // Update paths_discovered
   if (!dry_run)
@@ -1273,4879 +1512,7459 @@ void update_state_aware_variables(struct queue_entry *q, u8 dry_run)
     if (k != kh_end(khms_states))
     {
       kh_val(khms_states, k)->paths_discovered++;
+      mark_state_stale(kh_val(khms_states, k));
     }
   }
-
-  // Free state sequence
-  if (state_sequence)
-    ck_free(state_sequence);
 }
 
-/* Send (mutated) messages in order to the server under test */
-int send_over_network()
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif /* !FICLONE */
+
+/* Copy a file, sharing its data blocks (reflink) if the file system supports it. */
+static void clone_file(s32 src_dir, s32 dst_dir, u8 *name, mode_t mode)
 {
-  int n;
-  u8 likely_buggy = 0;
-  struct sockaddr_in serv_addr;
-  struct sockaddr_in local_serv_addr;
+  s32 sfd, dfd, i;
+  u8 *tmp;
 
-  // Clean up the server if needed
-  if (cleanup_script)
-    system(cleanup_script);
+  sfd = openat(src_dir, name, O_RDONLY | O_CLOEXEC);
+  if (sfd < 0)
+    PFATAL("Unable to open '%s'", name);
 
-  // Wait a bit for the server initialization
-  usleep(server_wait_usecs);
+  dfd = openat(dst_dir, name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode & 07777);
+  if (dfd < 0)
+    PFATAL("Unable to create '%s'", name);
 
-  // Clear the response buffer and reset the response buffer size
-  if (response_buf)
+  if (ioctl(dfd, FICLONE, sfd))
   {
-    ck_free(response_buf);
-    response_buf = NULL;
-    response_buf_size = 0;
-  }
+    tmp = ck_alloc(64 * 1024);
 
-  if (response_bytes)
-  {
-    ck_free(response_bytes);
-    response_bytes = NULL;
-  }
+    while ((i = read(sfd, tmp, 64 * 1024)) > 0)
+      ck_write(dfd, tmp, i, name);
 
-  // Create a TCP/UDP socket
-  int sockfd = -1;
-  if (net_protocol == PRO_TCP)
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-  else if (net_protocol == PRO_UDP)
-    sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (i < 0)
+      PFATAL("read() failed");
 
-  if (sockfd < 0)
-  {
-    PFATAL("Cannot create a socket");
+    ck_free(tmp);
   }
 
-  // Set timeout for socket data sending/receiving -- otherwise it causes a big delay
-  // if the server is still alive after processing all the requests
-  struct timeval timeout;
-  timeout.tv_sec = 0;
-  timeout.tv_usec = socket_timeout_usecs;
-  setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, (char *)&timeout, sizeof(timeout));
+  close(sfd);
+  close(dfd);
+}
 
-  memset(&serv_addr, '0', sizeof(serv_addr));
+/* Recursively copy the contents of directory src_dir into (empty) dst_dir. */
+static void copy_tree(s32 src_dir, s32 dst_dir)
+{
+  DIR *d;
+  struct dirent *de;
+  s32 fd = fcntl(src_dir, F_DUPFD_CLOEXEC, 0);
 
-  serv_addr.sin_family = AF_INET;
-  serv_addr.sin_port = htons(net_port);
-  serv_addr.sin_addr.s_addr = inet_addr(net_ip);
+  if (fd < 0 || !(d = fdopendir(fd)))
+    PFATAL("Unable to read directory");
 
-  // This piece of code is only used for targets that send responses to a specific port number
-  // The Kamailio SIP server is an example. After running this code, the intialized sockfd
-  // will be bound to the given local port
-  if (local_port > 0)
+  while ((de = readdir(d)))
   {
-    local_serv_addr.sin_family = AF_INET;
-    local_serv_addr.sin_addr.s_addr = INADDR_ANY;
-    local_serv_addr.sin_port = htons(local_port);
+    struct stat st;
 
-    local_serv_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
-    if (bind(sockfd, (struct sockaddr *)&local_serv_addr, sizeof(struct sockaddr_in)))
+    if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+      continue;
+
+    if (fstatat(src_dir, de->d_name, &st, AT_SYMLINK_NOFOLLOW))
+      PFATAL("Unable to stat '%s'", de->d_name);
+
+    if (S_ISDIR(st.st_mode))
     {
-      FATAL("Unable to bind socket on local source port");
-    }
-  }
+      s32 sub_src, sub_dst;
 
-  if (connect(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
-  {
-    // If it cannot connect to the server under test
-    // try it again as the server initial startup time is varied
-    for (n = 0; n < 1000; n++)
+      if (mkdirat(dst_dir, de->d_name, st.st_mode & 07777))
+        PFATAL("Unable to create '%s'", de->d_name);
+
+      sub_src = openat(src_dir, de->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      sub_dst = openat(dst_dir, de->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      if (sub_src < 0 || sub_dst < 0)
+        PFATAL("Unable to open '%s'", de->d_name);
+
+      copy_tree(sub_src, sub_dst);
+
+      close(sub_src);
+      close(sub_dst);
+    }
+    else if (S_ISLNK(st.st_mode))
     {
-      if (connect(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) == 0)
-        break;
-      usleep(1000);
+      u8 target[PATH_MAX];
+      s32 len = readlinkat(src_dir, de->d_name, target, sizeof(target) - 1);
+
+      if (len < 0)
+        PFATAL("Unable to read link '%s'", de->d_name);
+      target[len] = 0;
+
+      if (symlinkat(target, dst_dir, de->d_name))
+        PFATAL("Unable to create link '%s'", de->d_name);
     }
-    if (n == 1000)
+    else if (S_ISREG(st.st_mode))
     {
-      close(sockfd);
-      return 1;
+      clone_file(src_dir, dst_dir, de->d_name, st.st_mode);
     }
   }
 
-  // retrieve early server response if needed
-  if (net_recv(sockfd, timeout, poll_wait_msecs, &response_buf, &response_buf_size))
-    goto HANDLE_RESPONSES;
-
-  // write the request messages
-  kliter_t(lms) * it;
-  messages_sent = 0;
+  closedir(d);
+}
 
-  for (it = kl_begin(kl_messages); it != kl_end(kl_messages); it = kl_next(it))
-  {
-    n = net_send(sockfd, timeout, kl_val(it)->mdata, kl_val(it)->msize);
-    messages_sent++;
+/* Recursively remove the contents of a directory. */
+static void remove_tree_contents(s32 dir_fd)
+{
+  DIR *d;
+  struct dirent *de;
+  s32 fd = fcntl(dir_fd, F_DUPFD_CLOEXEC, 0);
 
-    // Allocate memory to store new accumulated response buffer size
-    response_bytes = (u32 *)ck_realloc(response_bytes, messages_sent * sizeof(u32));
+  if (fd < 0 || !(d = fdopendir(fd)))
+    PFATAL("Unable to read directory");
 
-    // Jump out if something wrong leading to incomplete message sent
-    if (n != kl_val(it)->msize)
-    {
-      goto HANDLE_RESPONSES;
-    }
+  while ((de = readdir(d)))
+  {
+    if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+      continue;
 
-    // retrieve server response
-    u32 prev_buf_size = response_buf_size;
-    if (net_recv(sockfd, timeout, poll_wait_msecs, &response_buf, &response_buf_size))
+    if (unlinkat(dir_fd, de->d_name, 0) && (errno == EISDIR || errno == EPERM))
     {
-      goto HANDLE_RESPONSES;
-    }
+      s32 sub = openat(dir_fd, de->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
 
-    // Update accumulated response buffer size
-    response_bytes[messages_sent - 1] = response_buf_size;
+      if (sub >= 0)
+      {
+        remove_tree_contents(sub);
+        close(sub);
+      }
 
-    // set likely_buggy flag if AFLNet does not receive any feedback from the server
-    // it could be a signal of a potentiall server crash, like the case of CVE-2019-7314
-    if (prev_buf_size == response_buf_size)
-      likely_buggy = 1;
-    else
-      likely_buggy = 0;
+      if (unlinkat(dir_fd, de->d_name, AT_REMOVEDIR))
+        PFATAL("Unable to remove '%s'", de->d_name);
+    }
   }
 
-HANDLE_RESPONSES:
+  closedir(d);
+}
 
-  net_recv(sockfd, timeout, poll_wait_msecs, &response_buf, &response_buf_size);
+/* Make path an exact copy of the pristine snapshot of cleanup_dir. This runs on the refill
+   thread while the server may be forked and exec'd, so the helpers above open every file
+   and directory close-on-exec. */
+static void copy_pristine_to(u8 *path)
+{
+  s32 src, dst;
+  struct stat st;
 
-  if (messages_sent > 0 && response_bytes != NULL)
+  if (!lstat(path, &st))
   {
-    response_bytes[messages_sent - 1] = response_buf_size;
+    dst = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (dst < 0)
+      PFATAL("Unable to open '%s'", path);
+    remove_tree_contents(dst);
   }
-
-  // wait a bit letting the server to complete its remaining task(s)
-  memset(session_virgin_bits, 255, MAP_SIZE);
-  while (1)
+  else
   {
-    if (has_new_bits(session_virgin_bits) != 2)
-      break;
+    if (stat(cleanup_pristine, &st) || mkdir(path, st.st_mode & 07777))
+      PFATAL("Unable to create '%s'", path);
+    dst = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dst < 0)
+      PFATAL("Unable to open '%s'", path);
   }
 
-  close(sockfd);
+  src = open(cleanup_pristine, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (src < 0)
+    PFATAL("Unable to open '%s'", cleanup_pristine);
 
-  if (likely_buggy && false_negative_reduction)
-    return 0;
+  copy_tree(src, dst);
 
-  if (terminate_child && (child_pid > 0))
-    kill(child_pid, SIGTERM);
+  close(src);
+  close(dst);
+}
 
-  // give the server a bit more time to gracefully terminate
-  while (1)
+/* Watch cleanup_dir and all its subdirectories for modifications. inotify
+   watches belong to inodes, so this is redone whenever the tree is replaced. */
+static void watch_tree(u8 *path)
+{
+  DIR *d;
+  struct dirent *de;
+
+  if (inotify_add_watch(cleanup_inotify_fd, path, IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE |
+                                                      IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF) < 0)
+    PFATAL("Unable to watch '%s'", path);
+
+  if (!(d = opendir(path)))
+    PFATAL("Unable to open '%s'", path);
+
+  while ((de = readdir(d)))
   {
-    int status = kill(child_pid, 0);
-    if ((status != 0) && (errno == ESRCH))
-      break;
+    u8 is_dir = de->d_type == DT_DIR;
+    struct stat st;
+
+    // Some file systems do not fill in d_type
+    if (de->d_type == DT_UNKNOWN)
+      is_dir = !fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) && S_ISDIR(st.st_mode);
+
+    if (is_dir && strcmp(de->d_name, ".") && strcmp(de->d_name, ".."))
+    {
+      u8 *sub = alloc_printf("%s/%s", path, de->d_name);
+      watch_tree(sub);
+      ck_free(sub);
+    }
   }
 
-  return 0;
+  closedir(d);
 }
-/* End of AFLNet-specific variables & functions */
-
-/* Get unix time in milliseconds */
 
-static u64 get_cur_time(void)
+static void rewatch_cleanup_dir(void)
 {
+  if (cleanup_inotify_fd >= 0)
+    close(cleanup_inotify_fd);
 
-  struct timeval tv;
-  struct timezone tz;
-
-  gettimeofday(&tv, &tz);
+  cleanup_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (cleanup_inotify_fd < 0)
+    PFATAL("inotify_init1() failed");
 
-  return (tv.tv_sec * 1000ULL) + (tv.tv_usec / 1000);
+  watch_tree(cleanup_dir);
 }
 
-/* Get unix time in microseconds */
-
-static u64 get_cur_time_us(void)
+/* Check (and forget) whether anything changed in cleanup_dir since the last call. */
+static u8 cleanup_dir_changed(void)
 {
+  u8 buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  u8 changed = 0;
 
-  struct timeval tv;
-  struct timezone tz;
-
-  gettimeofday(&tv, &tz);
+  while (read(cleanup_inotify_fd, buf, sizeof(buf)) > 0)
+    changed = 1;
 
-  return (tv.tv_sec * 1000000ULL) + tv.tv_usec;
+  return changed;
 }
 
-/* Generate a random number (from 0 to limit - 1). This may
-   have slight bias. */
-
-static inline u32 UR(u32 limit)
+/* Start a shell that stays around for the whole session and runs the cleanup
+   script on request, so that we do not fork afl-fuzz and exec /bin/sh for
+   every single execution. Commands come in on its stdin, exit codes go back
+   on fd 3. */
+static void start_cleanup_helper(void)
 {
+  s32 cmd_pipe[2], ack_pipe[2];
+  s32 pid;
 
-  if (unlikely(!rand_cnt--))
+  if (pipe(cmd_pipe) || pipe(ack_pipe))
+    PFATAL("pipe() failed");
+
+  pid = fork();
+  if (pid < 0)
+    PFATAL("fork() failed");
+
+  if (!pid)
   {
+    // Keep the output directory lock and our other files from the cleanup script, as run_target() does
+    close(out_dir_fd);
+    close(dev_urandom_fd);
+    close(fileno(plot_file));
 
-    u32 seed[2];
+    dup2(cmd_pipe[0], 0);
+    dup2(ack_pipe[1], 3);
+    dup2(dev_null_fd, 1);
+    dup2(dev_null_fd, 2);
 
-    ck_read(dev_urandom_fd, &seed, sizeof(seed), "/dev/urandom");
+    close(cmd_pipe[0]);
+    close(cmd_pipe[1]);
+    close(ack_pipe[0]);
+    close(ack_pipe[1]);
 
-    srandom(seed[0]);
-    rand_cnt = (RESEED_RNG / 2) + (seed[1] % RESEED_RNG);
+    execl("/bin/sh", "sh", NULL);
+    exit(1);
   }
 
-  return random() % limit;
-}
+  close(cmd_pipe[0]);
+  close(ack_pipe[1]);
 
-/* Shuffle an array of pointers. Might be slightly biased. */
+  cleanup_cmd_fd = cmd_pipe[1];
+  cleanup_ack_fd = ack_pipe[0];
 
-static void shuffle_ptrs(void **ptrs, u32 cnt)
+  fcntl(cleanup_cmd_fd, F_SETFD, FD_CLOEXEC);
+  fcntl(cleanup_ack_fd, F_SETFD, FD_CLOEXEC);
+}
+
+/* Run the cleanup script through the helper shell. Each run gets its own
+   subshell, so the script cannot change the helper's state. Falls back to
+   system() if the helper is gone. */
+static void run_cleanup_script(void)
 {
+  u8 *cmd, c;
+  s32 len;
 
-  u32 i;
+  if (cleanup_cmd_fd < 0)
+  {
+    system(cleanup_script);
+    return;
+  }
 
-  for (i = 0; i < cnt - 2; i++)
+  cmd = alloc_printf("(%s) </dev/null; echo $? >&3\n", cleanup_script);
+  len = strlen(cmd);
+
+  if (write(cleanup_cmd_fd, cmd, len) != len)
+    goto helper_gone;
+
+  // Wait until the script is done: its exit code ends with a newline
+  while (1)
   {
+    s32 res = read(cleanup_ack_fd, &c, 1);
 
-    u32 j = i + UR(cnt - i);
-    void *s = ptrs[i];
-    ptrs[i] = ptrs[j];
-    ptrs[j] = s;
+    if (res == 1 && c == '\n')
+      break;
+    if (res == 0 || (res < 0 && errno != EINTR))
+      goto helper_gone;
   }
-}
 
-#ifdef HAVE_AFFINITY
+  ck_free(cmd);
+  return;
 
-/* Build a list of processes bound to specific cores. Returns -1 if nothing
-   can be found. Assumes an upper bound of 4k CPUs. */
+helper_gone:
 
-static void bind_to_free_cpu(void)
+  WARNF("The cleanup helper shell is gone, falling back to system().");
+  close(cleanup_cmd_fd);
+  close(cleanup_ack_fd);
+  cleanup_cmd_fd = cleanup_ack_fd = -1;
+  ck_free(cmd);
+  system(cleanup_script);
+}
+
+/* Check whether our working directory is dir or below it. */
+static u8 cwd_within(u8 *dir)
 {
+  char *cwd = getcwd(NULL, 0), *real = realpath(dir, NULL);
+  u8 within = 0;
 
-  DIR *d;
-  struct dirent *de;
-  cpu_set_t c;
+  if (cwd && real)
+  {
+    size_t len = strlen(real);
+    within = !strncmp(cwd, real, len) && (cwd[len] == '/' || !cwd[len] || len == 1);
+  }
 
-  u8 cpu_used[4096] = {0};
-  u32 i;
+  free(cwd);
+  free(real);
+  return within;
+}
 
-  if (cpu_core_count < 2)
-    return;
+/* Refill cleanup_spare from the pristine snapshot whenever restore_cleanup_dir() asks
+   for it. Signals are left to the main thread. */
+static void *cleanup_refill_main(void *arg)
+{
+  sigset_t all;
 
-  if (getenv("AFL_NO_AFFINITY"))
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+  pthread_mutex_lock(&cleanup_refill_lock);
+
+  while (1)
   {
+    while (!cleanup_refill_pending)
+      pthread_cond_wait(&cleanup_refill_cond, &cleanup_refill_lock);
 
-    WARNF("Not binding to a CPU core (AFL_NO_AFFINITY set).");
-    return;
+    pthread_mutex_unlock(&cleanup_refill_lock);
+    copy_pristine_to(cleanup_spare);
+    pthread_mutex_lock(&cleanup_refill_lock);
+
+    cleanup_refill_pending = 0;
+    pthread_cond_broadcast(&cleanup_refill_cond);
   }
 
-  d = opendir("/proc");
+  return NULL;
+}
 
-  if (!d)
+/* Swap cleanup_dir with the ready-made pristine copy, then have the refill thread prepare
+   a new copy from what used to be cleanup_dir while the server runs. Processes that live
+   on from one execution to the next (a deferred fork server, -L, -p, -Z) may hold on to
+   cleanup_dir through their working directory or open files, and would go on using the
+   old tree after a swap: for them, the directory is refreshed in place. */
+static void restore_cleanup_dir(void)
+{
+  if (cleanup_in_place || deferred_mode || reuse_sessions || persistent_net || prefix_snapshot)
   {
+    copy_pristine_to(cleanup_dir);
+    return;
+  }
 
-    WARNF("Unable to access /proc - can't scan for free CPU cores.");
+  pthread_mutex_lock(&cleanup_refill_lock);
+  while (cleanup_refill_pending)
+    pthread_cond_wait(&cleanup_refill_cond, &cleanup_refill_lock);
+  pthread_mutex_unlock(&cleanup_refill_lock);
+
+  if (renameat2(AT_FDCWD, cleanup_dir, AT_FDCWD, cleanup_spare, RENAME_EXCHANGE))
+  {
+    // e.g. the file system does not support RENAME_EXCHANGE: refresh in place from now on
+    cleanup_in_place = 1;
+    copy_pristine_to(cleanup_dir);
     return;
   }
 
-  ACTF("Checking CPU core loadout...");
+  pthread_mutex_lock(&cleanup_refill_lock);
+  cleanup_refill_pending = 1;
+  pthread_cond_signal(&cleanup_refill_cond);
+  pthread_mutex_unlock(&cleanup_refill_lock);
+}
 
-  /* Introduce some jitter, in case multiple AFL tasks are doing the same
-     thing at the same time... */
+/* Monotonic time in microseconds, for timing the phases of an execution. */
+static inline u64 get_mono_time_us(void)
+{
+  struct timespec ts;
 
-  usleep(R(1000) * 250);
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
 
-  /* Scan all /proc/<pid>/status entries, checking for Cpus_allowed_list.
-     Flag all processes bound to a specific CPU using cpu_used[]. This will
-     fail for some exotic binding setups, but is likely good enough in almost
-     all real-world use cases. */
+/* Start timing a new execution. */
+static void phase_begin(void)
+{
+  memset(phase_us, 0, sizeof(phase_us));
+  phase_seen = 0;
+  phase_t = phase_t0 = get_mono_time_us();
+}
 
-  while ((de = readdir(d)))
-  {
+/* Charge the time since the end of the previous phase to the given one. */
+static void phase_mark(u8 phase)
+{
+  u64 now = get_mono_time_us();
 
-    u8 *fn;
-    FILE *f;
-    u8 tmp[MAX_LINE];
-    u8 has_vmsize = 0;
+  phase_us[phase] += now - phase_t;
+  phase_seen |= 1 << phase;
+  phase_t = now;
+}
 
-    if (!isdigit(de->d_name[0]))
-      continue;
+static u32 phase_bucket(u64 us)
+{
+  u32 o, b;
 
-    fn = alloc_printf("/proc/%s/status", de->d_name);
+  if (us < 4)
+    return us;
 
-    if (!(f = fopen(fn, "r")))
-    {
-      ck_free(fn);
-      continue;
-    }
+  o = 63 - __builtin_clzll(us);
+  b = 4 * (o - 1) + ((us >> (o - 2)) & 3);
 
-    while (fgets(tmp, MAX_LINE, f))
-    {
+  return b < PHASE_BUCKETS ? b : PHASE_BUCKETS - 1;
+}
 
-      u32 hval;
+/* Add the phases of the execution that just finished to the histograms. */
+static void phase_commit(void)
+{
+  u32 i;
 
-      /* Processes without VmSize are probably kernel tasks. */
+  phase_us[PHASE_TOTAL] = get_mono_time_us() - phase_t0;
+  phase_seen |= 1 << PHASE_TOTAL;
 
-      if (!strncmp(tmp, "VmSize:\t", 8))
-        has_vmsize = 1;
+  for (i = 0; i < PHASE_COUNT; i++)
+    if (phase_seen & (1 << i))
+      phase_hist[i][phase_bucket(phase_us[i])]++;
+}
 
-      if (!strncmp(tmp, "Cpus_allowed_list:\t", 19) &&
-          !strchr(tmp, '-') && !strchr(tmp, ',') &&
-          sscanf(tmp + 19, "%u", &hval) == 1 && hval < sizeof(cpu_used) &&
-          has_vmsize)
-      {
+/* Latency under which pct% of the executions went through a phase, as the upper
+   bound of its bucket; 0 if no execution went through it yet. */
+static u64 phase_percentile(u8 phase, u32 pct)
+{
+  u64 total = 0, seen = 0, target;
+  u32 b;
 
-        cpu_used[hval] = 1;
-        break;
-      }
-    }
+  for (b = 0; b < PHASE_BUCKETS; b++)
+    total += phase_hist[phase][b];
 
-    ck_free(fn);
-    fclose(f);
-  }
+  if (!total)
+    return 0;
 
-  closedir(d);
+  target = (total * pct + 99) / 100;
 
-  for (i = 0; i < cpu_core_count; i++)
-    if (!cpu_used[i])
+  for (b = 0; b < PHASE_BUCKETS; b++)
+  {
+    seen += phase_hist[phase][b];
+    if (seen >= target)
       break;
+  }
 
-  if (i == cpu_core_count)
-  {
+  if (b < 4)
+    return b;
 
-    SAYF("\n" cLRD "[-] " cRST
-         "Uh-oh, looks like all %u CPU cores on your system are allocated to\n"
-         "    other instances of afl-fuzz (or similar CPU-locked tasks). Starting\n"
-         "    another fuzzer on this machine is probably a bad plan, but if you are\n"
-         "    absolutely sure, you can set AFL_NO_AFFINITY and try again.\n",
-         cpu_core_count);
+  return ((4ULL + b % 4 + 1) << (b / 4 - 1)) - 1;
+}
 
-    FATAL("No more free CPU cores");
+/* Bring the environment of the server under test back to its initial state
+   before the server starts. With -O, nothing is done if the previous session
+   left cleanup_dir untouched. */
+static void cleanup_server_env(void)
+{
+  static u8 first_run = 1;
+
+  if (!cleanup_script && !cleanup_dir)
+    return;
+
+  // A cleanup script always runs once: we do not know what the last fuzzing session left
+  if (cleanup_dir && !cleanup_dir_changed() && !(cleanup_script && first_run))
+  {
+    cleanup_skips++;
+    return;
   }
 
-  OKF("Found a free CPU core, binding to #%u.", i);
+  first_run = 0;
 
-  cpu_aff = i;
+  if (cleanup_script)
+    run_cleanup_script();
+  else
+    restore_cleanup_dir();
 
-  CPU_ZERO(&c);
-  CPU_SET(i, &c);
+  cleanup_runs++;
 
-  if (sched_setaffinity(0, sizeof(c), &c))
-    PFATAL("sched_setaffinity failed");
+  // What the cleanup itself did does not count; the tree may have been replaced as well
+  if (cleanup_dir)
+    rewatch_cleanup_dir();
 }
 
-#endif /* HAVE_AFFINITY */
+/* Set up cleanup: start the helper shell for -c and, with -O, take a pristine
+   snapshot of the directory (next to it, so that it can be swapped in by a
+   rename) and start watching it. */
+static void setup_server_cleanup(void)
+{
+  if (cleanup_script)
+    start_cleanup_helper();
 
-#ifndef IGNORE_FINDS
+  if (!cleanup_dir)
+    return;
 
-/* Helper function to compare buffers; returns first and last differing offset. We
-   use this to find reasonable locations for splicing two files. */
+  u8 *base = strrchr(cleanup_dir, '/');
+  u8 *parent = base ? ck_strdup(cleanup_dir) : ck_strdup(".");
 
-static void locate_diffs(u8 *ptr1, u8 *ptr2, u32 len, s32 *first, s32 *last)
-{
+  if (base)
+    parent[base - cleanup_dir] = 0;
+  base = base ? base + 1 : cleanup_dir;
 
-  s32 f_loc = -1;
-  s32 l_loc = -1;
-  u32 pos;
+  if (!*base)
+    FATAL("Please specify the -O directory without a trailing slash");
 
-  for (pos = 0; pos < len; pos++)
+  cleanup_pristine = alloc_printf("%s/.%s.aflnet-pristine", *parent ? parent : (u8 *)"/", base);
+  cleanup_spare = alloc_printf("%s/.%s.aflnet-spare", *parent ? parent : (u8 *)"/", base);
+  ck_free(parent);
+
+  if (!cleanup_script)
   {
+    s32 src, dst;
+    struct stat st, snap_st;
 
-    if (*(ptr1++) != *(ptr2++))
+    ACTF("Taking a snapshot of '%s'...", cleanup_dir);
+
+    if (stat(cleanup_dir, &st) || !S_ISDIR(st.st_mode))
+      FATAL("'%s' is not a directory", cleanup_dir);
+
+    if (!lstat(cleanup_pristine, &snap_st))
+    {
+      src = open(cleanup_pristine, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+      if (src < 0)
+        PFATAL("Unable to open '%s'", cleanup_pristine);
+      remove_tree_contents(src);
+      close(src);
+    }
+    else if (mkdir(cleanup_pristine, 0700))
     {
+      PFATAL("Unable to create '%s'", cleanup_pristine);
+    }
 
-      if (f_loc == -1)
-        f_loc = pos;
-      l_loc = pos;
+    src = open(cleanup_dir, O_RDONLY | O_DIRECTORY);
+    dst = open(cleanup_pristine, O_RDONLY | O_DIRECTORY);
+    if (src < 0 || dst < 0)
+      PFATAL("Unable to open '%s'", cleanup_dir);
+
+    copy_tree(src, dst);
+    fchmod(dst, st.st_mode & 07777);
+
+    close(src);
+    close(dst);
+
+    // The server and the fork server start out in our working directory
+    cleanup_in_place = cwd_within(cleanup_dir);
+
+    if (!cleanup_in_place)
+    {
+      copy_pristine_to(cleanup_spare);
+
+      if (pthread_create(&cleanup_refill_thread, NULL, cleanup_refill_main, NULL))
+        FATAL("Unable to start the cleanup refill thread");
     }
   }
 
-  *first = f_loc;
-  *last = l_loc;
+  rewatch_cleanup_dir();
 
-  return;
+  OKF("Watching '%s' for changes made by the server.", cleanup_dir);
 }
 
-#endif /* !IGNORE_FINDS */
-
-/* Describe integer. Uses 12 cyclic static buffers for return values. The value
-   returned should be five characters or less for all the integers we reasonably
-   expect to see. */
+static void remove_desock_shm(void)
+{
+  shmctl(desock_shm_id, IPC_RMID, NULL);
+}
 
-static u8 *DI(u64 val)
+/* Create the request/response rings and the three eventfds libdesock.so finds at
+   DESOCK_ACCEPT_FD, DESOCK_CONN_FD and DESOCK_BELL_FD, and point the server at them */
+static void create_desock(void)
 {
+  u8 *env_str;
+  int i;
 
-  static u8 tmp[12][16];
-  static u8 cur;
+  desock_shm_id = shmget(IPC_PRIVATE, sizeof(desock_shm_t), IPC_CREAT | IPC_EXCL | 0600);
+  if (desock_shm_id < 0)
+    PFATAL("shmget() failed");
 
-  cur = (cur + 1) % 12;
+  atexit(remove_desock_shm);
 
-#define CHK_FORMAT(_divisor, _limit_mult, _fmt, _cast)    \
-  do                                                      \
-  {                                                       \
-    if (val < (_divisor) * (_limit_mult))                 \
-    {                                                     \
-      sprintf(tmp[cur], _fmt, ((_cast)val) / (_divisor)); \
-      return tmp[cur];                                    \
-    }                                                     \
-  } while (0)
+  desock_shm = shmat(desock_shm_id, NULL, 0);
+  if (desock_shm == (void *)-1)
+    PFATAL("shmat() failed");
 
-  /* 0-9999 */
-  CHK_FORMAT(1, 10000, "%llu", u64);
+  desock_shm->dgram = (net_protocol == PRO_UDP);
 
-  /* 10.0k - 99.9k */
-  CHK_FORMAT(1000, 99.95, "%0.01fk", double);
+  // Only the bell is read by us alone; the other two are waited on by the server
+  for (i = 0; i < 3; i++)
+  {
+    desock_efds[i] = eventfd(0, EFD_CLOEXEC | (i == 2 ? EFD_NONBLOCK : 0));
+    if (desock_efds[i] < 0)
+      PFATAL("eventfd() failed");
+  }
 
-  /* 100k - 999k */
-  CHK_FORMAT(1000, 1000, "%lluk", u64);
+  env_str = alloc_printf("%d:%u", desock_shm_id, net_port);
+  setenv(DESOCK_ENV_VAR, env_str, 1);
+  ck_free(env_str);
+}
 
-  /* 1.00M - 9.99M */
-  CHK_FORMAT(1000 * 1000, 9.995, "%0.02fM", double);
+/* Set up the shared-memory transport (-U) */
+static void setup_desock(void)
+{
+  create_desock();
 
-  /* 10.0M - 99.9M */
-  CHK_FORMAT(1000 * 1000, 99.95, "%0.01fM", double);
+  OKF("Talking to the server through shared memory (needs libdesock.so).");
 
-  /* 100M - 999M */
-  CHK_FORMAT(1000 * 1000, 1000, "%lluM", u64);
+  if (prefix_snapshot)
+  {
+    // the forks of the parked server are not our children: pidfds are how we watch them
+#ifdef SYS_pidfd_open
+    s32 fd = syscall(SYS_pidfd_open, getpid(), 0);
+    if (fd < 0)
+      PFATAL("-Z needs pidfd_open() (Linux 5.3+)");
+    close(fd);
+#else
+    FATAL("-Z needs pidfd_open() (Linux 5.3+)");
+#endif /* ^SYS_pidfd_open */
 
-  /* 1.00G - 9.99G */
-  CHK_FORMAT(1000LL * 1000 * 1000, 9.995, "%0.02fG", double);
+    snap_trace_bits = ck_alloc(MAP_SIZE);
+    OKF("Forking the server after M1 instead of replaying it (-Z).");
+  }
+}
 
-  /* 10.0G - 99.9G */
-  CHK_FORMAT(1000LL * 1000 * 1000, 99.95, "%0.01fG", double);
+/* Start every execution with empty rings and a fresh (unconnected, blocking) connection */
+static void reset_desock(void)
+{
+  struct pollfd pfd = {0};
+  eventfd_t val;
+  int i;
 
-  /* 100G - 999G */
-  CHK_FORMAT(1000LL * 1000 * 1000, 1000, "%lluG", u64);
+  desock_shm->req.head = desock_shm->req.tail = desock_shm->req.waiting = 0;
+  desock_shm->resp.head = desock_shm->resp.tail = desock_shm->resp.waiting = 0;
+  desock_shm->accepts = desock_shm->conn_refs = 0;
+  desock_shm->conn_closed = desock_shm->closed = 0;
+  desock_shm->idle_at = (u32)-1;
+  desock_shm->snap_at = desock_shm->snap_parked = 0;
 
-  /* 1.00T - 9.99G */
-  CHK_FORMAT(1000LL * 1000 * 1000 * 1000, 9.995, "%0.02fT", double);
+  for (i = 0; i < 3; i++)
+  {
+    pfd.fd = desock_efds[i];
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, 0) > 0)
+      eventfd_read(desock_efds[i], &val);
+    if (i < 2)
+      fcntl(desock_efds[i], F_SETFL, 0);
+  }
 
-  /* 10.0T - 99.9T */
-  CHK_FORMAT(1000LL * 1000 * 1000 * 1000, 99.95, "%0.01fT", double);
+  MEM_BARRIER();
+}
 
-  /* 100T+ */
-  strcpy(tmp[cur], "infty");
-  return tmp[cur];
+/* Hand the eventfds to the server (in the child) */
+static void dup_desock_fds(void)
+{
+  if (dup2(desock_efds[0], DESOCK_ACCEPT_FD) < 0 || dup2(desock_efds[1], DESOCK_CONN_FD) < 0 ||
+      dup2(desock_efds[2], DESOCK_BELL_FD) < 0)
+    PFATAL("dup2() failed");
 }
 
-/* Describe float. Similar to the above, except with a single
-   static buffer. */
+/* Hash of M1, i.e. the messages up to and including M2_prev */
+static u32 hash_prefix(void)
+{
+  kliter_t(lms) * it;
+  u32 h = 0;
 
-static u8 *DF(double val)
+  for (it = kl_begin(kl_messages); it != kl_end(kl_messages); it = kl_next(it))
+  {
+    h = hash32(kl_val(it)->mdata, kl_val(it)->msize, h + kl_val(it)->msize);
+    if (it == M2_prev)
+      break;
+  }
+
+  return h;
+}
+
+/* Kill the parked server (-Z). The fork server cannot hand out another process while
+   it waits for this one */
+static void snapshot_drop(void)
 {
+  int status;
+  s32 res;
 
-  static u8 tmp[16];
+  if (snap_root_pid <= 0)
+    return;
 
-  if (val < 99.995)
+  kill(snap_root_pid, SIGKILL);
+
+  if (dumb_mode == 1 || no_forkserver)
   {
-    sprintf(tmp, "%0.02f", val);
-    return tmp;
+    if (waitpid(snap_root_pid, &status, 0) <= 0)
+      PFATAL("waitpid() failed");
   }
-
-  if (val < 999.95)
+  else if ((res = read(fsrv_st_fd, &status, 4)) != 4)
   {
-    sprintf(tmp, "%0.01f", val);
-    return tmp;
+    RPFATAL(res, "Unable to communicate with fork server (OOM?)");
   }
 
-  return DI((u64)val);
+  close(snap_root_fd);
+  snap_root_fd = snap_root_pid = -1;
 }
 
-/* Describe integer as memory size. */
-
-static u8 *DMS(u64 val)
+/* Make sure a server parked right after the current M1 is waiting for the next
+   execution, driving a new one through M1 if needed. Returns 0 if the execution
+   has to replay M1 as usual */
+static u8 snapshot_prepare(char **argv)
 {
+  u32 key = hash_prefix();
 
-  static u8 tmp[12][16];
-  static u8 cur;
+  if (key == snap_key && snap_failed)
+    return 0;
 
-  cur = (cur + 1) % 12;
+  if (key == snap_key && snap_root_pid > 0)
+  {
+    struct pollfd pfd = {snap_root_fd, POLLIN, 0};
 
-  /* 0-9999 */
-  CHK_FORMAT(1, 10000, "%llu B", u64);
+    // still parked, unless something killed it
+    if (!poll(&pfd, 1, 0))
+      return 1;
+  }
 
-  /* 10.0k - 99.9k */
-  CHK_FORMAT(1024, 99.95, "%0.01f kB", double);
+  snapshot_drop();
 
-  /* 100k - 999k */
-  CHK_FORMAT(1024, 1000, "%llu kB", u64);
+  snap_key = key;
+  snap_building = 1;
+  run_target(argv, exec_tmout);
+  snap_building = 0;
 
-  /* 1.00M - 9.99M */
-  CHK_FORMAT(1024 * 1024, 9.995, "%0.02f MB", double);
+  snap_builds++;
+  snap_failed = snap_root_pid <= 0;
 
-  /* 10.0M - 99.9M */
-  CHK_FORMAT(1024 * 1024, 99.95, "%0.01f MB", double);
+  if (snap_failed && !snap_parks && snap_builds >= SNAPSHOT_GIVE_UP)
+  {
+    WARNF("The server never parked after M1 (is libdesock.so preloaded?), giving up on -Z.");
+    prefix_snapshot = 0;
+  }
 
-  /* 100M - 999M */
-  CHK_FORMAT(1024 * 1024, 1000, "%llu MB", u64);
+  return !snap_failed;
+}
 
-  /* 1.00G - 9.99G */
-  CHK_FORMAT(1024LL * 1024 * 1024, 9.995, "%0.02f GB", double);
+/* The server went through M1 (snap_building). If it parked, keep what M1 produced for
+   the executions to come */
+static u8 snapshot_keep(void)
+{
+  pid_t pid = __atomic_load_n(&desock_shm->snap_parked, __ATOMIC_ACQUIRE);
 
-  /* 10.0G - 99.9G */
-  CHK_FORMAT(1024LL * 1024 * 1024, 99.95, "%0.01f GB", double);
+  if (!pid)
+    return 0;
 
-  /* 100G - 999G */
-  CHK_FORMAT(1024LL * 1024 * 1024, 1000, "%llu GB", u64);
+#ifdef SYS_pidfd_open
+  snap_root_fd = syscall(SYS_pidfd_open, pid, 0);
+#endif /* SYS_pidfd_open */
+  if (snap_root_fd < 0)
+    return 0;
 
-  /* 1.00T - 9.99G */
-  CHK_FORMAT(1024LL * 1024 * 1024 * 1024, 9.995, "%0.02f TB", double);
+  snap_root_pid = pid;
+  snap_parks++;
 
-  /* 10.0T - 99.9T */
-  CHK_FORMAT(1024LL * 1024 * 1024 * 1024, 99.95, "%0.01f TB", double);
+  memcpy(snap_trace_bits, trace_bits, MAP_SIZE);
 
-#undef CHK_FORMAT
+  snap_response_buf = ck_realloc(snap_response_buf, response_buf_size + 1);
+  memcpy(snap_response_buf, response_buf, response_buf_size);
+  snap_response_buf[response_buf_size] = '\0';
+  snap_response_size = response_buf_size;
 
-  /* 100T+ */
-  strcpy(tmp[cur], "infty");
-  return tmp[cur];
-}
+  snap_response_bytes = ck_realloc(snap_response_bytes, messages_sent * sizeof(u32));
+  memcpy(snap_response_bytes, response_bytes, messages_sent * sizeof(u32));
+  snap_messages = messages_sent;
 
-/* Describe time delta. Returns one static buffer, 34 chars of less. */
+  return 1;
+}
 
-static u8 *DTD(u64 cur_ms, u64 event_ms)
+/* Start the execution in a fork of the parked server: it already holds the responses
+   to M1 */
+static void snapshot_fork(void)
 {
+  struct timespec ts = {0, 10 * 1000 * 1000};
+  u64 deadline = get_cur_time() + 1000;
+  eventfd_t val;
+  u32 pid;
 
-  static u8 tmp[64];
-  u64 delta;
-  s32 t_d, t_h, t_m, t_s;
+  eventfd_read(desock_efds[2], &val);
 
-  if (!event_ms)
-    return "none seen yet";
+  desock_shm->snap_child = 0;
+  snap_done_before = __atomic_load_n(&desock_shm->snap_done, __ATOMIC_ACQUIRE);
+  __atomic_add_fetch(&desock_shm->snap_go, 1, __ATOMIC_SEQ_CST);
+  desock_futex_wake(&desock_shm->snap_go);
 
-  delta = cur_ms - event_ms;
+  while (!(pid = __atomic_load_n(&desock_shm->snap_child, __ATOMIC_ACQUIRE)))
+  {
+    if (get_cur_time() > deadline)
+      FATAL("The parked server does not respond (-Z)");
+    desock_futex_wait(&desock_shm->snap_child, 0, &ts);
+  }
 
-  t_d = delta / 1000 / 60 / 60 / 24;
-  t_h = (delta / 1000 / 60 / 60) % 24;
-  t_m = (delta / 1000 / 60) % 60;
-  t_s = (delta / 1000) % 60;
+  if (pid == (u32)-1)
+    FATAL("The parked server could not fork (OOM?)");
 
-  sprintf(tmp, "%s days, %u hrs, %u min, %u sec", DI(t_d), t_h, t_m, t_s);
-  return tmp;
+  child_pid = pid;
+
+  if (response_buf_cap < snap_response_size + 1)
+  {
+    response_buf = ck_realloc(response_buf, snap_response_size + 1);
+    response_buf_cap = snap_response_size + 1;
+  }
+  memcpy(response_buf, snap_response_buf, snap_response_size + 1);
+  response_buf_size = snap_response_size;
+  exec_states_parsed = 0;
+
+  reserve_response_bytes(snap_messages);
+  memcpy(response_bytes, snap_response_bytes, snap_messages * sizeof(u32));
+  messages_sent = snap_messages;
 }
 
-/* Mark deterministic checks as done for a particular queue entry. We use the
-   .state file to avoid repeating deterministic fuzzing when resuming aborted
-   scans. */
+/* The exec timeout and the teardown deadline are timerfds rather than ITIMER_REAL: they are
+   waited on together with the server (status pipe, pidfd) and the session socket, are not
+   rounded to the millisecond, and leave no SIGALRM for the network code to deal with. SIGALRM
+   is only used while the fork server starts up */
+static s32 exec_tmr_fd = -1, teardown_tmr_fd = -1;
 
-static void mark_as_det_done(struct queue_entry *q)
+/* Create both timers. A forked process shares them with its parent, so execution workers (-J)
+   call this again to get their own */
+static void setup_exec_timers(void)
 {
+  if (exec_tmr_fd >= 0)
+    close(exec_tmr_fd);
+  if (teardown_tmr_fd >= 0)
+    close(teardown_tmr_fd);
 
-  u8 *fn = strrchr(q->fname, '/');
-  s32 fd;
+  exec_tmr_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  teardown_tmr_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
 
-  fn = alloc_printf("%s/queue/.state/deterministic_done/%s", out_dir, fn + 1);
+  if (exec_tmr_fd < 0 || teardown_tmr_fd < 0)
+    PFATAL("timerfd_create() failed");
+}
 
-  fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, 0600);
-  if (fd < 0)
-    PFATAL("Unable to create '%s'", fn);
-  close(fd);
+/* Have the timer fire msecs from now; 0 disarms it. Either way, an expiration that was not
+   consumed yet is discarded */
+static void arm_timer(s32 fd, u32 msecs)
+{
+  struct itimerspec its;
 
-  ck_free(fn);
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = msecs / 1000;
+  its.it_value.tv_nsec = (msecs % 1000) * 1000000;
 
-  q->passed_det = 1;
+  if (timerfd_settime(fd, 0, &its, NULL))
+    PFATAL("timerfd_settime() failed");
 }
 
-/* Mark as variable. Create symlinks if possible to make it easier to examine
-   the files. */
-
-static void mark_as_variable(struct queue_entry *q)
+/* Microseconds until the timer fires, 0 once it has */
+static u64 timer_left_us(s32 fd)
 {
+  struct itimerspec its;
 
-  u8 *fn = strrchr(q->fname, '/') + 1, *ldest;
-
-  ldest = alloc_printf("../../%s", fn);
-  fn = alloc_printf("%s/queue/.state/variable_behavior/%s", out_dir, fn);
-
-  if (symlink(ldest, fn))
-  {
+  if (timerfd_gettime(fd, &its))
+    PFATAL("timerfd_gettime() failed");
 
-    s32 fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, 0600);
-    if (fd < 0)
-      PFATAL("Unable to create '%s'", fn);
-    close(fd);
-  }
+  return its.it_value.tv_sec * 1000000ULL + its.it_value.tv_nsec / 1000;
+}
 
-  ck_free(ldest);
-  ck_free(fn);
+/* Consume the expiration of the timer, if it has fired. Returns 1 if it has */
+static u8 timer_fired(s32 fd)
+{
+  u64 ticks;
 
-  q->var_behavior = 1;
+  return read(fd, &ticks, sizeof(ticks)) == sizeof(ticks);
 }
 
-/* Mark / unmark as redundant (edge-only). This is not used for restoring state,
-   but may be useful for post-processing datasets. */
-
-static void mark_as_redundant(struct queue_entry *q, u8 state)
+/* Kill the server if the exec timeout has passed, like handle_timeout() does for SIGALRM.
+   Returns 1 if it has */
+static u8 check_exec_timeout(void)
 {
+  if (!timer_fired(exec_tmr_fd))
+    return 0;
 
-  u8 *fn;
-  s32 fd;
-
-  if (state == q->fs_redundant)
-    return;
+  child_timed_out = 1;
+  if (child_pid > 0)
+    kill(child_pid, SIGKILL);
 
-  q->fs_redundant = state;
+  return 1;
+}
 
-  fn = strrchr(q->fname, '/');
-  fn = alloc_printf("%s/queue/.state/redundant_edges/%s", out_dir, fn + 1);
+/* Wait for the fork of the parked server to be gone, and return its status */
+static int snapshot_wait(void)
+{
+  struct timespec ts;
+  u32 done;
 
-  if (state)
+  while ((done = __atomic_load_n(&desock_shm->snap_done, __ATOMIC_ACQUIRE)) == snap_done_before)
   {
+    struct pollfd pfd = {snap_root_fd, POLLIN, 0};
+    u64 left_us = timer_left_us(exec_tmr_fd);
 
-    fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, 0600);
-    if (fd < 0)
-      PFATAL("Unable to create '%s'", fn);
-    close(fd);
-  }
-  else
-  {
+    // the parked server reports on its fork once the exec timeout has killed it
+    check_exec_timeout();
 
-    if (unlink(fn))
-      PFATAL("Unable to remove '%s'", fn);
+    // sleep until the exec timeout, but check on the parked server at least every 100ms
+    if (!left_us || left_us > 100 * 1000)
+      left_us = 100 * 1000;
+    ts.tv_sec = 0;
+    ts.tv_nsec = left_us * 1000;
+
+    // nobody is left to report on the child if the parked server died
+    if (poll(&pfd, 1, 0) > 0)
+    {
+      kill(child_pid, SIGKILL);
+      return 0;
+    }
+
+    desock_futex_wait(&desock_shm->snap_done, done, &ts);
   }
 
-  ck_free(fn);
+  return desock_shm->snap_status;
 }
 
-/* Append new test case to the queue. */
-
-static void add_to_queue(u8 *fname, u32 len, u8 passed_det)
+/* Wait for the server under test to report (over the listen-ready pipe) that it listens
+   on net_port. Returns 1 once it does, 0 if it terminated before and -1 if it stayed
+   silent for LISTEN_READY_TMOUT milliseconds */
+static int wait_for_listen_ready(void)
 {
+  struct pollfd pfd[3];
+  int nfds = 2;
+  u64 deadline = get_cur_time() + LISTEN_READY_TMOUT;
 
-  struct queue_entry *q = ck_alloc(sizeof(struct queue_entry));
+  pfd[0].fd = listen_fd;
+  pfd[0].events = POLLIN;
 
-  q->fname = fname;
-  q->len = len;
-  q->depth = cur_depth + 1;
-  q->passed_det = passed_det;
-  q->regions = NULL;
-  q->region_count = 0;
-  q->index = queued_paths;
-  q->generating_state_id = target_state_id;
-  q->is_initial_seed = 0;
-  q->unique_state_count = 0;
+  // A server still starting up at the exec timeout is killed and reported as a hang
+  pfd[1].fd = exec_tmr_fd;
+  pfd[1].events = POLLIN;
 
-  if (q->depth > max_depth)
-    max_depth = q->depth;
+  // With a fork server, a readable status pipe means the child is already gone
+  if (!(dumb_mode == 1 || no_forkserver))
+  {
+    pfd[2].fd = fsrv_st_fd;
+    pfd[2].events = POLLIN;
+    nfds = 3;
+  }
 
-  if (queue_top)
+  while (1)
   {
+    u32 sig;
+    s32 res = read(listen_fd, &sig, 4);
 
-    queue_top->next = q;
-    queue_top = q;
-  }
-  else
-    q_prev100 = queue = queue_top = q;
+    if (res == 4 && sig == LISTEN_READY_SIG)
+      return 1;
 
-  queued_paths++;
-  pending_not_fuzzed++;
+    // In dumb mode the pipe only lives as long as the child
+    if (res == 0)
+      return 0;
 
-  cycles_wo_finds = 0;
+    if (res < 0 && errno != EAGAIN && errno != EINTR)
+      PFATAL("Unable to read from the listen-ready pipe");
 
-  if (!(queued_paths % 100))
-  {
+    u64 cur_ms = get_cur_time();
+    if (cur_ms >= deadline)
+      return -1;
 
-    q_prev100->next_100 = q;
-    q_prev100 = q;
+    pfd[0].revents = pfd[1].revents = pfd[2].revents = 0;
+    if (poll(pfd, nfds, deadline - cur_ms) < 0 && errno != EINTR)
+      PFATAL("poll() failed");
+
+    if ((pfd[1].revents & POLLIN) && check_exec_timeout())
+      return 0;
+
+    if ((pfd[2].revents & POLLIN) && !(pfd[0].revents & POLLIN))
+      return 0;
   }
+}
 
-  /* AFLNet: extract regions keeping client requests if needed */
-  if (corpus_read_or_sync)
+/* Wait for the server to complete its remaining task(s), i.e., until the edge epoch kept
+   by the instrumentation right after the bitmap has not moved for EPOCH_QUIET_USECS.
+   The epoch is sampled once per sleep of that length, so that the wait leaves the CPU to
+   the server. Binaries instrumented before the epoch existed never move it: for them,
+   wait until no new bits show up in trace_bits as before */
+static void wait_for_coverage_quiescence(void)
+{
+  static u8 epoch_checked, epoch_missing;
+  volatile u32 *epoch = (volatile u32 *)(trace_bits + MAP_EPOCH_OFF);
+  u32 last_epoch = *epoch;
+
+  if (!epoch_checked)
   {
-    FILE *fp;
-    unsigned char *buf;
+    epoch_checked = 1;
+    if (!last_epoch && !dumb_mode)
+    {
+      WARNF("The target does not keep an edge epoch, please rebuild it with this version of afl.");
+      epoch_missing = 1;
+    }
 
-    /* opening file for reading */
-    fp = fopen(fname, "rb");
+    // The default timer slack (50us) would stretch every sleep below well past the window
+    prctl(PR_SET_TIMERSLACK, 1000UL);
+  }
 
-    buf = (unsigned char *)ck_alloc(len);
-    u32 byte_count = fread(buf, 1, len, fp);
-    fclose(fp);
+  if (epoch_missing)
+  {
+    memset(session_virgin_bits, 255, MAP_SIZE);
+    while (1)
+    {
+      if (has_new_bits(session_virgin_bits) != 2)
+        break;
+    }
+    return;
+  }
 
-    if (byte_count != len)
-      PFATAL("AFLNet - Inconsistent file length '%s'", fname);
-    q->regions = (*extract_requests)(buf, len, &q->region_count);
-    ck_free(buf);
+  u64 start_us = get_cur_time_us();
 
-    // Keep track the maximal number of seed regions
-    // We use this for some optimization to reduce the overhead while following the server's sequence diagram
-    if ((corpus_read_or_sync == 1) && (q->region_count > max_seed_region_count))
-      max_seed_region_count = q->region_count;
-  }
-  else
+  while (1)
   {
-    // Convert the linked list kl_messages to regions
-    q->regions = convert_kl_messages_to_regions(kl_messages, &q->region_count, messages_sent);
+    struct timespec quiet = {0, EPOCH_QUIET_USECS * 1000};
+    u32 cur_epoch;
+
+    while (nanosleep(&quiet, &quiet) && errno == EINTR)
+      ;
+
+    cur_epoch = *epoch;
+    if (cur_epoch == last_epoch)
+      break;
+    last_epoch = cur_epoch;
+
+    if (get_cur_time_us() - start_us >= EPOCH_WAIT_USECS)
+      break;
   }
+}
 
-  /* save the regions' information to file for debugging purpose */
-  u8 *fn = alloc_printf("%s/regions/%s", out_dir, basename(fname));
-  save_regions_to_file(q->regions, q->region_count, fn);
-  ck_free(fn);
+/* Block until the server under test has terminated, or until msecs (-1: no limit) elapse.
+   A pidfd (Linux 5.3+) becomes readable once the process is gone. Without one, use the fork
+   server status pipe (readable once the child was reaped, or stopped in persistent mode) or,
+   in dumb mode, poll waitid(). The deadline is teardown_tmr_fd, and the server is killed if
+   the exec timeout passes in the meantime. Returns 1 if the server is gone, 0 on timeout */
+static u8 wait_for_child_gone(s32 pidfd, int msecs)
+{
+  u8 gone = 0;
 
-  last_path_time = get_cur_time();
+  if (msecs >= 0)
+    arm_timer(teardown_tmr_fd, MAX(msecs, 1));
 
-  // Add a new column to the was_fuzzed map
-  if (fuzzed_map_states)
+  if (pidfd >= 0 || !(dumb_mode == 1 || no_forkserver))
   {
-    expand_was_fuzzed_map(0, 1);
+    struct pollfd pfd[3];
+
+    pfd[0].fd = pidfd >= 0 ? pidfd : fsrv_st_fd;
+    pfd[1].fd = exec_tmr_fd;
+    pfd[2].fd = teardown_tmr_fd;
+    pfd[0].events = pfd[1].events = pfd[2].events = POLLIN;
+
+    while (1)
+    {
+      if (poll(pfd, 3, -1) < 0)
+      {
+        if (errno == EINTR)
+          continue;
+        PFATAL("poll() failed");
+      }
+
+      // a fork server that died (e.g., killed by handle_stop_sig()) only hangs up
+      if (pfd[0].revents & (POLLIN | POLLHUP | POLLERR))
+      {
+        gone = 1;
+        break;
+      }
+
+      if (pfd[1].revents & POLLIN)
+        check_exec_timeout();
+
+      if ((pfd[2].revents & POLLIN) && timer_fired(teardown_tmr_fd))
+        break;
+    }
   }
   else
   {
-    // Also add a new row (for state 0) if needed
-    expand_was_fuzzed_map(1, 1);
+    while (1)
+    {
+      siginfo_t info;
+
+      info.si_pid = 0;
+      if ((waitid(P_PID, child_pid, &info, WEXITED | WNOHANG | WNOWAIT) < 0 && errno != EINTR) ||
+          info.si_pid)
+      {
+        gone = 1;
+        break;
+      }
+
+      check_exec_timeout();
+
+      if (msecs >= 0 && timer_fired(teardown_tmr_fd))
+        break;
+
+      usleep(100);
+    }
   }
-}
 
-/* Destroy the entire queue. */
+  if (msecs >= 0)
+    arm_timer(teardown_tmr_fd, 0);
 
-EXP_ST void destroy_queue(void)
+  return gone;
+}
+
+/* Send SIGTERM to the server if requested (-K) and wait for it to terminate. A server that
+   ignores SIGTERM for TEARDOWN_TERM_MSECS gets SIGKILL, which is not reported as a crash */
+static void terminate_server(void)
 {
+  u64 start_us = get_cur_time_us();
+  s32 pidfd = -1;
 
-  struct queue_entry *q = queue, *n;
+  if (child_pid <= 0)
+    return;
 
-  while (q)
+#ifdef SYS_pidfd_open
+  pidfd = syscall(SYS_pidfd_open, child_pid, 0);
+  if (pidfd < 0 && errno == ESRCH)
+    return; // already gone (and reaped by the fork server)
+#endif /* SYS_pidfd_open */
+
+  if (terminate_child)
   {
+    kill(child_pid, SIGTERM);
 
-    n = q->next;
-    ck_free(q->fname);
-    ck_free(q->trace_mini);
-    u32 i;
-    // Free AFLNet-specific data structure
-    for (i = 0; i < q->region_count; i++)
+    if (!wait_for_child_gone(pidfd, TEARDOWN_TERM_MSECS))
     {
-      if (q->regions[i].state_sequence)
-        ck_free(q->regions[i].state_sequence);
+      teardown_killed = 1;
+      teardown_kills++;
+      kill(child_pid, SIGKILL);
     }
-    if (q->regions)
-      ck_free(q->regions);
-    ck_free(q);
-    q = n;
   }
-}
-
-/* Write bitmap to file. The bitmap is useful mostly for the secret
-   -B option, to focus a separate fuzzing session on a particular
-   interesting input without rediscovering all the others. */
 
-EXP_ST void write_bitmap(void)
-{
+  // give the server a bit more time to gracefully terminate; the exec timeout bounds this
+  wait_for_child_gone(pidfd, -1);
 
-  u8 *fname;
-  s32 fd;
+  if (pidfd >= 0)
+    close(pidfd);
 
-  if (!bitmap_changed)
-    return;
-  bitmap_changed = 0;
+  teardown_us_total += get_cur_time_us() - start_us;
+  teardown_count++;
+}
 
-  fname = alloc_printf("%s/fuzz_bitmap", out_dir);
-  fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+/* In persistent mode the server is not terminated: with the connection closed, it gets back to
+   __AFL_LOOP() (or closes its end over shared memory, -p) and stops itself, which the fork server
+   reports on the status pipe. A server still running TEARDOWN_TERM_MSECS later is killed, which
+   is not reported as a crash */
+static void stop_server_session(void)
+{
+  u64 start_us = get_cur_time_us();
 
-  if (fd < 0)
-    PFATAL("Unable to open '%s'", fname);
+  if (child_pid <= 0)
+    return;
 
-  ck_write(fd, virgin_bits, MAP_SIZE, fname);
+  if (!wait_for_child_gone(-1, TEARDOWN_TERM_MSECS))
+  {
+    teardown_killed = 1;
+    teardown_kills++;
+    kill(child_pid, SIGKILL);
+  }
 
-  close(fd);
-  ck_free(fname);
+  teardown_us_total += get_cur_time_us() - start_us;
+  teardown_count++;
 }
 
-/* Read bitmap from file. This is for the -B option again. */
-
-EXP_ST void read_bitmap(u8 *fname)
+/* Tell whether the server has started to exit. A crash closes its connection before the fork
+   server gets to report it on the status pipe, so look at the process itself: PF_EXITING is
+   set in its flags from the start of the exit, and it is a zombie (or gone) at the end */
+static u8 server_exiting(void)
 {
+  u8 path[32], buf[512], *p;
+  unsigned long flags;
+  s32 fd, len;
 
-  s32 fd = open(fname, O_RDONLY);
+  sprintf((char *)path, "/proc/%d/stat", child_pid);
 
+  fd = open((char *)path, O_RDONLY);
   if (fd < 0)
-    PFATAL("Unable to open '%s'", fname);
-
-  ck_read(fd, virgin_bits, MAP_SIZE, fname);
+    return 1;
 
+  len = read(fd, buf, sizeof(buf) - 1);
   close(fd);
-}
 
-/* Check if the current execution path brings anything new to the table.
-   Update virgin bits to reflect the finds. Returns 1 if the only change is
-   the hit-count for a particular tuple; 2 if there are new tuples seen.
-   Updates the map, so subsequent calls will always return 0.
+  if (len <= 0)
+    return 1;
+  buf[len] = 0;
 
-   This function is called after every exec() on a fairly large buffer, so
-   it needs to be fast. We do this in 32-bit and 64-bit flavors. */
+  // the command name in parentheses may contain anything, the state follows the last ')'
+  p = (u8 *)strrchr((char *)buf, ')');
+  if (!p || sscanf((char *)p + 2, "%*c %*d %*d %*d %*d %*d %lu", &flags) != 1)
+    return 1;
 
-static inline u8 has_new_bits(u8 *virgin_map)
+  return p[2] == 'Z' || p[2] == 'X' || (flags & 0x4 /* PF_EXITING */);
+}
+
+/* With -L the server is not terminated either: send_over_network() ends the session from our
+   side and waits for the server to close its end of the connection, on its way back to accept()
+   (or recvfrom()). A server that did so, and is still alive once its coverage settles, is kept
+   for the next session; one that did not within TEARDOWN_TERM_MSECS is terminated as usual */
+static void end_reused_session(u8 server_closed)
 {
+  struct pollfd pfd = {fsrv_st_fd, POLLIN, 0};
+  kliter_t(lms) *it;
+  u32 count = 0;
 
-#ifdef WORD_SIZE_64
+  if (child_pid <= 0 || child_timed_out)
+    return;
 
-  u64 *current = (u64 *)trace_bits;
-  u64 *virgin = (u64 *)virgin_map;
+  if (!server_closed)
+  {
+    terminate_server();
+    return;
+  }
 
-  u32 i = (MAP_SIZE >> 3);
+  wait_for_coverage_quiescence();
 
-#else
+  if (poll(&pfd, 1, 0) || server_exiting())
+    return;
 
-  u32 *current = (u32 *)trace_bits;
-  u32 *virgin = (u32 *)virgin_map;
+  server_alive = 1;
 
-  u32 i = (MAP_SIZE >> 2);
+  // The server may still crash before the next session; the messages are gone by then
+  reuse_msgs_len = 0;
+  for (it = kl_begin(kl_messages); it != kl_end(kl_messages) && count < messages_sent; it = kl_next(it), count++)
+  {
+    u32 size = kl_val(it)->msize;
 
-#endif /* ^WORD_SIZE_64 */
+    if (reuse_msgs_len + 4 + size > reuse_msgs_cap)
+    {
+      reuse_msgs_cap = (reuse_msgs_len + 4 + size) * 2;
+      reuse_msgs = ck_realloc(reuse_msgs, reuse_msgs_cap);
+    }
 
-  u8 ret = 0;
+    memcpy(reuse_msgs + reuse_msgs_len, &size, 4);
+    memcpy(reuse_msgs + reuse_msgs_len + 4, kl_val(it)->mdata, size);
+    reuse_msgs_len += 4 + size;
+  }
+}
 
-  while (i--)
-  {
+static void write_crash_readme(void);
 
-    /* Optimize for (*current & *virgin) == 0 - i.e., no bits in current bitmap
-       that have not been already cleared from the virgin map - since this will
-       almost always be the case. */
+/* The server kept after the last session (-L) died of a signal we did not send before it
+   got the next one: count it as a crash, and save the messages of that session. */
+static void save_reused_crash(u8 sig)
+{
+  u8 *fn;
+  s32 fd;
 
-    if (unlikely(*current) && unlikely(*current & *virgin))
-    {
+  WARNF("A server kept for the next session died of signal %u, saving its last session as a crash", sig);
 
-      if (likely(ret < 2))
-      {
+  total_crashes++;
 
-        u8 *cur = (u8 *)current;
-        u8 *vir = (u8 *)virgin;
+  if (unique_crashes >= KEEP_UNIQUE_CRASH)
+    return;
 
-        /* Looks like we have not found any new bytes yet; see if any non-zero
-           bytes in current[] are pristine in virgin[]. */
+  if (!unique_crashes)
+    write_crash_readme();
 
-#ifdef WORD_SIZE_64
+#ifndef SIMPLE_FILES
 
-        if ((cur[0] && vir[0] == 0xff) || (cur[1] && vir[1] == 0xff) ||
-            (cur[2] && vir[2] == 0xff) || (cur[3] && vir[3] == 0xff) ||
-            (cur[4] && vir[4] == 0xff) || (cur[5] && vir[5] == 0xff) ||
-            (cur[6] && vir[6] == 0xff) || (cur[7] && vir[7] == 0xff))
-          ret = 2;
-        else
-          ret = 1;
+  fn = alloc_printf("%s/replayable-crashes/id:%06llu,sig:%02u,reused", out_dir, unique_crashes, sig);
 
 #else
 
-        if ((cur[0] && vir[0] == 0xff) || (cur[1] && vir[1] == 0xff) ||
-            (cur[2] && vir[2] == 0xff) || (cur[3] && vir[3] == 0xff))
-          ret = 2;
-        else
-          ret = 1;
-
-#endif /* ^WORD_SIZE_64 */
-      }
+  fn = alloc_printf("%s/replayable-crashes/id_%06llu_%02u_reused", out_dir, unique_crashes, sig);
 
-      *virgin &= ~*current;
-    }
+#endif /* ^!SIMPLE_FILES */
 
-    current++;
-    virgin++;
-  }
+  fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, 0600);
+  if (fd < 0)
+    PFATAL("Unable to create '%s'", fn);
+  ck_write(fd, reuse_msgs, reuse_msgs_len, fn);
+  close(fd);
+  ck_free(fn);
 
-  if (ret && virgin_map == virgin_bits)
-    bitmap_changed = 1;
+  unique_crashes++;
 
-  return ret;
+  last_crash_time = get_cur_time();
+  last_crash_execs = total_execs;
 }
 
-/* Count the number of bits set in the provided bitmap. Used for the status
-   screen several times every second, does not have to be fast. */
-
-static u32 count_bits(u8 *mem)
+/* Decide whether the server that survived the last session (-L) takes the next one: up to
+   reuse_sessions times, unless it has died in between or a new one is needed. Otherwise it
+   is killed and reaped, and the fork server hands out a new one. Returns 1 if it is reused */
+static u8 reuse_server(void)
 {
+  struct pollfd pfd = {fsrv_st_fd, POLLIN, 0};
+  u8 killed = 0;
+  int status;
+  s32 res;
 
-  u32 *ptr = (u32 *)mem;
-  u32 i = (MAP_SIZE >> 2);
-  u32 ret = 0;
+  if (!server_alive)
+    return 0;
 
-  while (i--)
-  {
+  server_alive = 0;
 
-    u32 v = *(ptr++);
+  if (!poll(&pfd, 1, 0))
+  {
+    if (!reuse_fresh && server_sessions < reuse_sessions)
+      return 1;
 
-    /* This gets called on the inverse, virgin bitmap; optimize for sparse
-       data. */
+    kill(child_pid, SIGKILL);
+    killed = 1;
+  }
 
-    if (v == 0xffffffff)
-    {
-      ret += 32;
-      continue;
-    }
-
-    v -= ((v >> 1) & 0x55555555);
-    v = (v & 0x33333333) + ((v >> 2) & 0x33333333);
-    ret += (((v + (v >> 4)) & 0xF0F0F0F) * 0x01010101) >> 24;
+  if ((res = read(fsrv_st_fd, &status, 4)) != 4)
+  {
+    if (stop_soon)
+      return 0;
+    RPFATAL(res, "Unable to communicate with fork server (OOM?)");
   }
 
-  return ret;
-}
+  child_pid = 0;
 
-#define FF(_b) (0xff << ((_b) << 3))
+  if (WIFSIGNALED(status) && !stop_soon && !(killed && WTERMSIG(status) == SIGKILL))
+    save_reused_crash(WTERMSIG(status));
 
-/* Count the number of bytes set in the bitmap. Called fairly sporadically,
-   mostly to update the status screen or calibrate and examine confirmed
-   new paths. */
+  return 0;
+}
 
-static u32 count_bytes(u8 *mem)
+/* Send (mutated) messages in order to the server under test */
+int send_over_network()
 {
+  int n;
+  u8 likely_buggy = 0;
+  u8 server_closed = 0;
+  struct sockaddr_in serv_addr;
+  struct sockaddr_in local_serv_addr;
+  kliter_t(lms) * it, *first_message = kl_begin(kl_messages);
 
-  u32 *ptr = (u32 *)mem;
-  u32 i = (MAP_SIZE >> 2);
-  u32 ret = 0;
-
-  while (i--)
+  // Wait for the server to listen on the target port. If it cannot tell us, wait a bit
+  // for the server initialization and retry connecting until it accepts. Over shared
+  // memory, connecting itself waits for the server to accept, and a server resumed in
+  // persistent mode is listening already
+  u8 server_listening = use_desock || server_stopped || server_reused;
+  if (listen_ready && !server_listening && !snap_in_use)
   {
+    int rv = wait_for_listen_ready();
+    if (rv == 0)
+    {
+      phase_mark(PHASE_STARTUP);
+      return 1;
+    }
 
-    u32 v = *(ptr++);
-
-    if (!v)
-      continue;
-    if (v & FF(0))
-      ret++;
-    if (v & FF(1))
-      ret++;
-    if (v & FF(2))
-      ret++;
-    if (v & FF(3))
-      ret++;
+    if (rv > 0)
+    {
+      server_listening = 1;
+    }
+    else
+    {
+      WARNF("The server did not report listening on port %u, falling back to -D and connect() retries.", net_port);
+      listen_ready = 0;
+    }
   }
 
-  return ret;
-}
+  if (!server_listening)
+    usleep(server_wait_usecs);
 
-/* Count the number of non-255 bytes set in the bitmap. Used strictly for the
-   status screen, several calls per second or so. */
+  phase_mark(PHASE_STARTUP);
 
-static u32 count_non_255_bytes(u8 *mem)
-{
+  // Reset the response arena; its memory is kept for the next responses. A fork of the
+  // parked server (-Z) starts with the responses to M1 instead
+  exec_states_parsed = 0;
+  if (!snap_in_use)
+  {
+    response_buf_size = 0;
+    if (response_buf)
+      response_buf[0] = '\0';
+    messages_sent = 0;
+  }
 
-  u32 *ptr = (u32 *)mem;
-  u32 i = (MAP_SIZE >> 2);
-  u32 ret = 0;
+  net_session_t session;
+  s32 pidfd = -1;
 
-  while (i--)
+  if (use_desock)
   {
+    // Without a socket, the session learns that the server died from the fork server's
+    // status pipe or, in dumb mode and for forks of the parked server, a pidfd
+    u8 own_pidfd = dumb_mode == 1 || no_forkserver || snap_in_use;
+    if (own_pidfd)
+    {
+#ifdef SYS_pidfd_open
+      pidfd = syscall(SYS_pidfd_open, child_pid, 0);
+#endif /* SYS_pidfd_open */
+    }
 
-    u32 v = *(ptr++);
+    if (net_session_open_shm(&session, desock_shm, desock_efds, own_pidfd ? pidfd : fsrv_st_fd,
+                             socket_timeout_usecs, response_complete) ||
+        net_session_watch(&session, exec_tmr_fd))
+      PFATAL("Unable to set up the network session");
+    session.buf_cap = response_buf_cap;
 
-    /* This is called on the virgin bitmap, so optimize for the most likely
-       case. */
+    // A fork of the parked server is connected already, and M1 is behind it
+    if (snap_in_use)
+    {
+      phase_mark(PHASE_CONNECT);
+      first_message = kl_next(M2_prev);
+      goto SEND_MESSAGES;
+    }
 
-    if (v == 0xffffffff)
-      continue;
-    if ((v & FF(0)) != FF(0))
-      ret++;
-    if ((v & FF(1)) != FF(1))
-      ret++;
-    if ((v & FF(2)) != FF(2))
-      ret++;
-    if ((v & FF(3)) != FF(3))
-      ret++;
-  }
+    // Have the server park once it has consumed M1
+    if (snap_building)
+    {
+      u32 hdr = desock_shm->dgram ? 4 : 0;
 
-  return ret;
-}
+      for (it = kl_begin(kl_messages); it != kl_end(kl_messages); it = kl_next(it))
+      {
+        desock_shm->snap_at += kl_val(it)->msize + hdr;
+        if (it == M2_prev)
+          break;
+      }
+    }
 
-/* Destructively simplify trace by eliminating hit count information
-   and replacing it with 0x80 or 0x01 depending on whether the tuple
-   is hit or not. Called on every new crash or timeout, should be
-   reasonably fast. */
+    if (net_session_connect(&session, NULL, 0, 1001))
+    {
+      phase_mark(PHASE_CONNECT);
+      net_session_close(&session);
+      if (pidfd >= 0)
+        close(pidfd);
+      if (!desock_shm->attached)
+        FATAL("The server did not load libdesock.so (-U needs AFL_PRELOAD=/path/to/libdesock.so)");
+      return 1;
+    }
 
-static const u8 simplify_lookup[256] = {
+    goto SESSION;
+  }
 
-    [0] = 1,
-    [1 ... 255] = 128
+  // Create a TCP/UDP socket, next to the server with -G
+  int sockfd = -1;
+  if (netns_pool && setns(netns_fd, CLONE_NEWNET))
+    PFATAL("setns failed");
+  if (net_protocol == PRO_TCP)
+    sockfd = socket(AF_INET, SOCK_STREAM, 0);
+  else if (net_protocol == PRO_UDP)
+    sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (netns_pool && setns(host_netns_fd, CLONE_NEWNET))
+    PFATAL("setns failed");
 
-};
+  if (sockfd < 0)
+  {
+    PFATAL("Cannot create a socket");
+  }
 
-#ifdef WORD_SIZE_64
+  // All socket I/O of this session goes through one epoll set: the socket is non-blocking,
+  // responses are read straight into response_buf and the only waits are bounded by
+  // poll_wait_msecs (first byte of a response) and socket_timeout_usecs (gap between chunks).
+  // The exec timeout is in the set too: a hang ends the session right away
+  if (net_session_open(&session, sockfd, socket_timeout_usecs, response_complete) ||
+      net_session_watch(&session, exec_tmr_fd))
+    PFATAL("Unable to set up the network session");
+  session.buf_cap = response_buf_cap;
 
-static void simplify_trace(u64 *mem)
-{
+  memset(&serv_addr, '0', sizeof(serv_addr));
 
-  u32 i = MAP_SIZE >> 3;
+  serv_addr.sin_family = AF_INET;
+  serv_addr.sin_port = htons(net_port);
+  serv_addr.sin_addr.s_addr = inet_addr(net_ip);
 
-  while (i--)
+  // This piece of code is only used for targets that send responses to a specific port number
+  // The Kamailio SIP server is an example. After running this code, the intialized sockfd
+  // will be bound to the given local port
+  if (local_port > 0)
   {
+    local_serv_addr.sin_family = AF_INET;
+    local_serv_addr.sin_addr.s_addr = INADDR_ANY;
+    local_serv_addr.sin_port = htons(local_port);
 
-    /* Optimize for sparse bitmaps. */
-
-    if (unlikely(*mem))
+    local_serv_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    if (bind(sockfd, (struct sockaddr *)&local_serv_addr, sizeof(struct sockaddr_in)))
     {
-
-      u8 *mem8 = (u8 *)mem;
-
-      mem8[0] = simplify_lookup[mem8[0]];
-      mem8[1] = simplify_lookup[mem8[1]];
-      mem8[2] = simplify_lookup[mem8[2]];
-      mem8[3] = simplify_lookup[mem8[3]];
-      mem8[4] = simplify_lookup[mem8[4]];
-      mem8[5] = simplify_lookup[mem8[5]];
-      mem8[6] = simplify_lookup[mem8[6]];
-      mem8[7] = simplify_lookup[mem8[7]];
+      FATAL("Unable to bind socket on local source port");
     }
-    else
-      *mem = 0x0101010101010101ULL;
+  }
 
-    mem++;
+  // If it cannot connect to the server under test, try it again
+  // as the server initial startup time is varied (unless it told us it is listening)
+  if (net_session_connect(&session, (struct sockaddr *)&serv_addr, sizeof(serv_addr), server_listening ? 1 : 1001))
+  {
+    phase_mark(PHASE_CONNECT);
+    net_session_close(&session);
+    return 1;
   }
-}
 
-#else
+SESSION:
 
-static void simplify_trace(u32 *mem)
-{
+  phase_mark(PHASE_CONNECT);
 
-  u32 i = MAP_SIZE >> 2;
+  // retrieve early server response if needed
+  int early_failed = net_session_recv(&session, poll_wait_msecs, &response_buf, &response_buf_size);
+  phase_mark(PHASE_RECV);
+  if (early_failed)
+    goto HANDLE_RESPONSES;
 
-  while (i--)
-  {
+  // write the request messages
 
-    /* Optimize for sparse bitmaps. */
+  // Requests of a stateless UDP protocol do not depend on the previous replies: send them
+  // all with sendmmsg() and sort the replies out afterwards
+  if (reply_matches && net_protocol == PRO_UDP && !use_desock)
+  {
+    u32 count = 0, i = 0;
+    for (it = kl_begin(kl_messages); it != kl_end(kl_messages); it = kl_next(it))
+      count++;
 
-    if (unlikely(*mem))
+    if (count)
     {
+      struct iovec *reqs = ck_alloc(count * sizeof(struct iovec));
+      for (it = kl_begin(kl_messages); it != kl_end(kl_messages); it = kl_next(it), i++)
+      {
+        reqs[i].iov_base = kl_val(it)->mdata;
+        reqs[i].iov_len = kl_val(it)->msize;
+      }
 
-      u8 *mem8 = (u8 *)mem;
+      reserve_response_bytes(count);
+      u32 base = response_buf_size;
 
-      mem8[0] = simplify_lookup[mem8[0]];
-      mem8[1] = simplify_lookup[mem8[1]];
-      mem8[2] = simplify_lookup[mem8[2]];
-      mem8[3] = simplify_lookup[mem8[3]];
+      int sent = net_session_exchange_batch(&session, reqs, count, poll_wait_msecs, reply_matches,
+                                            &response_buf, &response_buf_size, response_bytes);
+      ck_free(reqs);
+
+      // sending takes no time next to waiting for the replies: count it all as recv
+      phase_mark(PHASE_RECV);
+
+      if (sent > 0)
+      {
+        messages_sent = sent;
+        likely_buggy = response_bytes[sent - 1] == (sent > 1 ? response_bytes[sent - 2] : base);
+      }
     }
-    else
-      *mem = 0x01010101;
 
-    mem++;
+    goto HANDLE_RESPONSES;
   }
-}
 
-#endif /* ^WORD_SIZE_64 */
+SEND_MESSAGES:
 
-/* Destructively classify execution counts in a trace. This is used as a
-   preprocessing step for any newly acquired traces. Called on every exec,
-   must be fast. */
+  for (it = first_message; it != kl_end(kl_messages); it = kl_next(it))
+  {
+    n = net_session_send(&session, kl_val(it)->mdata, kl_val(it)->msize);
+    messages_sent++;
+    phase_mark(PHASE_SEND);
 
-static const u8 count_class_lookup8[256] = {
+    // Make room to store the new accumulated response buffer size
+    reserve_response_bytes(messages_sent);
 
-    [0] = 0,
-    [1] = 1,
-    [2] = 2,
-    [3] = 4,
-    [4 ... 7] = 8,
-    [8 ... 15] = 16,
-    [16 ... 31] = 32,
-    [32 ... 127] = 64,
-    [128 ... 255] = 128
+    // Jump out if something wrong leading to incomplete message sent
+    if (n != kl_val(it)->msize)
+    {
+      goto HANDLE_RESPONSES;
+    }
 
-};
+    // retrieve server response
+    u32 prev_buf_size = response_buf_size;
+    int recv_failed = net_session_recv(&session, poll_wait_msecs, &response_buf, &response_buf_size);
+    phase_mark(PHASE_RECV);
+    if (recv_failed)
+    {
+      goto HANDLE_RESPONSES;
+    }
 
-static u16 count_class_lookup16[65536];
+    // Update accumulated response buffer size
+    response_bytes[messages_sent - 1] = response_buf_size;
 
-EXP_ST void init_count_class16(void)
-{
+    // set likely_buggy flag if AFLNet does not receive any feedback from the server
+    // it could be a signal of a potentiall server crash, like the case of CVE-2019-7314
+    if (prev_buf_size == response_buf_size)
+      likely_buggy = 1;
+    else
+      likely_buggy = 0;
 
-  u32 b1, b2;
+    // Through M1, a server about to become the parked one (-Z) should be parked now
+    if (snap_building && it == M2_prev)
+    {
+      if (!desock_shm->snap_parked)
+      {
+        net_session_recv(&session, poll_wait_msecs, &response_buf, &response_buf_size);
+        response_bytes[messages_sent - 1] = response_buf_size;
+        phase_mark(PHASE_RECV);
+      }
 
-  for (b1 = 0; b1 < 256; b1++)
-    for (b2 = 0; b2 < 256; b2++)
-      count_class_lookup16[(b1 << 8) + b2] =
-          (count_class_lookup8[b1] << 8) |
-          count_class_lookup8[b2];
-}
+      if (snapshot_keep())
+      {
+        net_session_detach(&session);
+        if (pidfd >= 0)
+          close(pidfd);
+        return 0;
+      }
 
-#ifdef WORD_SIZE_64
+      goto HANDLE_RESPONSES;
+    }
+  }
 
-static inline void classify_counts(u64 *mem)
-{
+HANDLE_RESPONSES:
 
-  u32 i = MAP_SIZE >> 3;
+  net_session_recv(&session, poll_wait_msecs, &response_buf, &response_buf_size);
+  phase_mark(PHASE_RECV);
 
-  while (i--)
+  if (messages_sent > 0 && response_bytes != NULL)
   {
+    response_bytes[messages_sent - 1] = response_buf_size;
+  }
 
-    /* Optimize for sparse bitmaps. */
+  // a hung server is killed right away, there is no point waiting on its coverage
+  if (session.timed_out)
+    check_exec_timeout();
+  else
+    wait_for_coverage_quiescence(); // wait a bit letting the server to complete its remaining task(s)
+  phase_mark(PHASE_COVERAGE);
 
-    if (unlikely(*mem))
-    {
+  response_buf_cap = session.buf_cap;
+  if (response_buf_size > response_buf_peak)
+    response_buf_peak = response_buf_size;
 
-      u16 *mem16 = (u16 *)mem;
+  if (reuse_sessions && !session.timed_out)
+    server_closed = net_session_finish(&session, TEARDOWN_TERM_MSECS);
 
-      mem16[0] = count_class_lookup16[mem16[0]];
-      mem16[1] = count_class_lookup16[mem16[1]];
-      mem16[2] = count_class_lookup16[mem16[2]];
-      mem16[3] = count_class_lookup16[mem16[3]];
-    }
+  net_session_close(&session);
+  if (pidfd >= 0)
+    close(pidfd);
 
-    mem++;
-  }
+  if (likely_buggy && false_negative_reduction)
+    return 0;
+
+  if (persistent_net)
+    stop_server_session();
+  else if (reuse_sessions)
+    end_reused_session(server_closed);
+  else
+    terminate_server();
+
+  return 0;
 }
+/* End of AFLNet-specific variables & functions */
 
-#else
+/* Get unix time in milliseconds */
 
-static inline void classify_counts(u32 *mem)
+static u64 get_cur_time(void)
 {
 
-  u32 i = MAP_SIZE >> 2;
+  struct timeval tv;
+  struct timezone tz;
 
-  while (i--)
-  {
+  gettimeofday(&tv, &tz);
 
-    /* Optimize for sparse bitmaps. */
+  return (tv.tv_sec * 1000ULL) + (tv.tv_usec / 1000);
+}
 
-    if (unlikely(*mem))
-    {
+/* Get unix time in microseconds */
 
-      u16 *mem16 = (u16 *)mem;
+static u64 get_cur_time_us(void)
+{
 
-      mem16[0] = count_class_lookup16[mem16[0]];
-      mem16[1] = count_class_lookup16[mem16[1]];
-    }
+  struct timeval tv;
+  struct timezone tz;
 
-    mem++;
-  }
-}
+  gettimeofday(&tv, &tz);
 
-#endif /* ^WORD_SIZE_64 */
+  return (tv.tv_sec * 1000000ULL) + tv.tv_usec;
+}
 
-/* Get rid of shared memory (atexit handler). */
+/* Generate a random number (from 0 to limit - 1). This may
+   have slight bias. */
 
-static void remove_shm(void)
+static inline u32 UR(u32 limit)
 {
 
-  shmctl(shm_id, IPC_RMID, NULL);
+  if (unlikely(!rand_cnt--))
+  {
+
+    u32 seed[2];
+
+    ck_read(dev_urandom_fd, &seed, sizeof(seed), "/dev/urandom");
+
+    srandom(seed[0]);
+    rand_cnt = (RESEED_RNG / 2) + (seed[1] % RESEED_RNG);
+  }
+
+  return random() % limit;
 }
 
-/* Compact trace bytes into a smaller bitmap. We effectively just drop the
-   count information here. This is called only sporadically, for some
-   new paths. */
+/* Shuffle an array of pointers. Might be slightly biased. */
 
-static void minimize_bits(u8 *dst, u8 *src)
+static void shuffle_ptrs(void **ptrs, u32 cnt)
 {
 
-  u32 i = 0;
+  u32 i;
 
-  while (i < MAP_SIZE)
+  for (i = 0; i < cnt - 2; i++)
   {
 
-    if (*(src++))
-      dst[i >> 3] |= 1 << (i & 7);
-    i++;
+    u32 j = i + UR(cnt - i);
+    void *s = ptrs[i];
+    ptrs[i] = ptrs[j];
+    ptrs[j] = s;
   }
 }
 
-/* When we bump into a new path, we call this to see if the path appears
-   more "favorable" than any of the existing ones. The purpose of the
-   "favorables" is to have a minimal set of paths that trigger all the bits
-   seen in the bitmap so far, and focus on fuzzing them at the expense of
-   the rest.
+#ifdef HAVE_AFFINITY
 
-   The first step of the process is to maintain a list of top_rated[] entries
-   for every byte in the bitmap. We win that slot if there is no previous
-   contender, or if the contender has smaller unique state count or
-   it has a more favorable speed x size factor. */
+/* Build a list of processes bound to specific cores. Returns -1 if nothing
+   can be found. Assumes an upper bound of 4k CPUs. */
 
-static void update_bitmap_score(struct queue_entry *q)
+static void bind_to_free_cpu(void)
 {
 
-  u32 i;
-  u64 fav_factor = q->exec_us * q->len;
+  DIR *d;
+  struct dirent *de;
+  cpu_set_t c;
 
-  /* For every byte set in trace_bits[], see if there is a previous winner,
-     and how it compares to us. */
+  u8 cpu_used[4096] = {0};
+  u32 i;
 
-  for (i = 0; i < MAP_SIZE; i++)
+  if (cpu_core_count < 2)
+    return;
 
-    if (trace_bits[i])
-    {
+  if (getenv("AFL_NO_AFFINITY"))
+  {
 
-      if (top_rated[i])
-      {
+    WARNF("Not binding to a CPU core (AFL_NO_AFFINITY set).");
+    return;
+  }
 
-        /* AFLNet check unique state count first */
+  d = opendir("/proc");
 
-        if (q->unique_state_count < top_rated[i]->unique_state_count)
-          continue;
+  if (!d)
+  {
 
-        /* Faster-executing or smaller test cases are favored. */
+    WARNF("Unable to access /proc - can't scan for free CPU cores.");
+    return;
+  }
 
-        if ((q->unique_state_count < top_rated[i]->unique_state_count) && (fav_factor > top_rated[i]->exec_us * top_rated[i]->len))
-          continue;
+  ACTF("Checking CPU core loadout...");
 
-        /* Looks like we're going to win. Decrease ref count for the
-           previous winner, discard its trace_bits[] if necessary. */
+  /* Introduce some jitter, in case multiple AFL tasks are doing the same
+     thing at the same time... */
 
-        if (!--top_rated[i]->tc_ref)
-        {
-          ck_free(top_rated[i]->trace_mini);
-          top_rated[i]->trace_mini = 0;
-        }
-      }
+  usleep(R(1000) * 250);
 
-      /* Insert ourselves as the new winner. */
+  /* Scan all /proc/<pid>/status entries, checking for Cpus_allowed_list.
+     Flag all processes bound to a specific CPU using cpu_used[]. This will
+     fail for some exotic binding setups, but is likely good enough in almost
+     all real-world use cases. */
 
-      top_rated[i] = q;
-      q->tc_ref++;
+  while ((de = readdir(d)))
+  {
 
-      if (!q->trace_mini)
-      {
-        q->trace_mini = ck_alloc(MAP_SIZE >> 3);
-        minimize_bits(q->trace_mini, trace_bits);
-      }
+    u8 *fn;
+    FILE *f;
+    u8 tmp[MAX_LINE];
+    u8 has_vmsize = 0;
 
-      score_changed = 1;
-    }
-}
+    if (!isdigit(de->d_name[0]))
+      continue;
 
-/* The second part of the mechanism discussed above is a routine that
-   goes over top_rated[] entries, and then sequentially grabs winners for
-   previously-unseen bytes (temp_v) and marks them as favored, at least
-   until the next run. The favored entries are given more air time during
-   all fuzzing steps. */
+    fn = alloc_printf("/proc/%s/status", de->d_name);
 
-static void cull_queue(void)
-{
+    if (!(f = fopen(fn, "r")))
+    {
+      ck_free(fn);
+      continue;
+    }
 
-  struct queue_entry *q;
-  static u8 temp_v[MAP_SIZE >> 3];
-  u32 i;
+    while (fgets(tmp, MAX_LINE, f))
+    {
 
-  if (dumb_mode || !score_changed)
-    return;
+      u32 hval;
 
-  score_changed = 0;
+      /* Processes without VmSize are probably kernel tasks. */
 
-  memset(temp_v, 255, MAP_SIZE >> 3);
+      if (!strncmp(tmp, "VmSize:\t", 8))
+        has_vmsize = 1;
 
-  queued_favored = 0;
-  pending_favored = 0;
+      if (!strncmp(tmp, "Cpus_allowed_list:\t", 19) &&
+          !strchr(tmp, '-') && !strchr(tmp, ',') &&
+          sscanf(tmp + 19, "%u", &hval) == 1 && hval < sizeof(cpu_used) &&
+          has_vmsize)
+      {
 
-  q = queue;
+        cpu_used[hval] = 1;
+        break;
+      }
+    }
 
-  while (q)
-  {
-    if (!q->is_initial_seed)
-      q->favored = 0;
-    q = q->next;
+    ck_free(fn);
+    fclose(f);
   }
 
-  /* Let's see if anything in the bitmap isn't captured in temp_v.
-     If yes, and if it has a top_rated[] contender, let's use it. */
+  closedir(d);
 
-  for (i = 0; i < MAP_SIZE; i++)
-    if (top_rated[i] && (temp_v[i >> 3] & (1 << (i & 7))))
-    {
+  for (i = 0; i < cpu_core_count; i++)
+    if (!cpu_used[i])
+      break;
 
-      u32 j = MAP_SIZE >> 3;
+  if (i == cpu_core_count)
+  {
 
-      /* Remove all bits belonging to the current entry from temp_v. */
+    SAYF("\n" cLRD "[-] " cRST
+         "Uh-oh, looks like all %u CPU cores on your system are allocated to\n"
+         "    other instances of afl-fuzz (or similar CPU-locked tasks). Starting\n"
+         "    another fuzzer on this machine is probably a bad plan, but if you are\n"
+         "    absolutely sure, you can set AFL_NO_AFFINITY and try again.\n",
+         cpu_core_count);
 
-      while (j--)
-        if (top_rated[i]->trace_mini[j])
-          temp_v[j] &= ~top_rated[i]->trace_mini[j];
+    FATAL("No more free CPU cores");
+  }
 
-      top_rated[i]->favored = 1;
-      queued_favored++;
+  OKF("Found a free CPU core, binding to #%u.", i);
 
-      // if (!top_rated[i]->was_fuzzed) pending_favored++;
-      /* AFLNet takes into account more information to make this decision */
-      if ((top_rated[i]->generating_state_id == target_state_id || top_rated[i]->is_initial_seed) && (was_fuzzed_map[get_state_index(target_state_id)][top_rated[i]->index] == 0))
-        pending_favored++;
-    }
+  cpu_aff = i;
 
-  q = queue;
+  CPU_ZERO(&c);
+  CPU_SET(i, &c);
 
-  while (q)
-  {
-    mark_as_redundant(q, !q->favored);
-    q = q->next;
-  }
+  if (sched_setaffinity(0, sizeof(c), &c))
+    PFATAL("sched_setaffinity failed");
 }
 
-/* Configure shared memory and virgin_bits. This is called at startup. */
+#endif /* HAVE_AFFINITY */
 
-EXP_ST void setup_shm(void)
-{
+#ifndef IGNORE_FINDS
 
-  u8 *shm_str;
+/* Helper function to compare buffers; returns first and last differing offset. We
+   use this to find reasonable locations for splicing two files. */
 
-  if (!in_bitmap)
-    memset(virgin_bits, 255, MAP_SIZE);
+static void locate_diffs(u8 *ptr1, u8 *ptr2, u32 len, s32 *first, s32 *last)
+{
 
-  memset(virgin_tmout, 255, MAP_SIZE);
-  memset(virgin_crash, 255, MAP_SIZE);
+  s32 f_loc = -1;
+  s32 l_loc = -1;
+  u32 pos;
 
-  shm_id = shmget(IPC_PRIVATE, MAP_SIZE, IPC_CREAT | IPC_EXCL | 0600);
+  for (pos = 0; pos < len; pos++)
+  {
 
-  if (shm_id < 0)
-    PFATAL("shmget() failed");
+    if (*(ptr1++) != *(ptr2++))
+    {
 
-  atexit(remove_shm);
+      if (f_loc == -1)
+        f_loc = pos;
+      l_loc = pos;
+    }
+  }
 
-  shm_str = alloc_printf("%d", shm_id);
+  *first = f_loc;
+  *last = l_loc;
 
-  /* If somebody is asking us to fuzz instrumented binaries in dumb mode,
-     we don't want them to detect instrumentation, since we won't be sending
-     fork server commands. This should be replaced with better auto-detection
-     later on, perhaps? */
+  return;
+}
 
-  if (!dumb_mode)
-    setenv(SHM_ENV_VAR, shm_str, 1);
+#endif /* !IGNORE_FINDS */
 
-  ck_free(shm_str);
+/* Describe integer. Uses 12 cyclic static buffers for return values. The value
+   returned should be five characters or less for all the integers we reasonably
+   expect to see. */
 
-  trace_bits = shmat(shm_id, NULL, 0);
+static u8 *DI(u64 val)
+{
 
-  if (!trace_bits)
-    PFATAL("shmat() failed");
-}
+  static u8 tmp[12][16];
+  static u8 cur;
 
-/* Load postprocessor, if available. */
+  cur = (cur + 1) % 12;
 
-static void setup_post(void)
-{
+#define CHK_FORMAT(_divisor, _limit_mult, _fmt, _cast)    \
+  do                                                      \
+  {                                                       \
+    if (val < (_divisor) * (_limit_mult))                 \
+    {                                                     \
+      sprintf(tmp[cur], _fmt, ((_cast)val) / (_divisor)); \
+      return tmp[cur];                                    \
+    }                                                     \
+  } while (0)
 
-  void *dh;
-  u8 *fn = getenv("AFL_POST_LIBRARY");
-  u32 tlen = 6;
+  /* 0-9999 */
+  CHK_FORMAT(1, 10000, "%llu", u64);
 
-  if (!fn)
-    return;
+  /* 10.0k - 99.9k */
+  CHK_FORMAT(1000, 99.95, "%0.01fk", double);
 
-  ACTF("Loading postprocessor from '%s'...", fn);
+  /* 100k - 999k */
+  CHK_FORMAT(1000, 1000, "%lluk", u64);
 
-  dh = dlopen(fn, RTLD_NOW);
-  if (!dh)
-    FATAL("%s", dlerror());
+  /* 1.00M - 9.99M */
+  CHK_FORMAT(1000 * 1000, 9.995, "%0.02fM", double);
 
-  post_handler = dlsym(dh, "afl_postprocess");
-  if (!post_handler)
-    FATAL("Symbol 'afl_postprocess' not found.");
+  /* 10.0M - 99.9M */
+  CHK_FORMAT(1000 * 1000, 99.95, "%0.01fM", double);
 
-  /* Do a quick test. It's better to segfault now than later =) */
+  /* 100M - 999M */
+  CHK_FORMAT(1000 * 1000, 1000, "%lluM", u64);
 
-  post_handler("hello", &tlen);
+  /* 1.00G - 9.99G */
+  CHK_FORMAT(1000LL * 1000 * 1000, 9.995, "%0.02fG", double);
 
-  OKF("Postprocessor installed successfully.");
+  /* 10.0G - 99.9G */
+  CHK_FORMAT(1000LL * 1000 * 1000, 99.95, "%0.01fG", double);
+
+  /* 100G - 999G */
+  CHK_FORMAT(1000LL * 1000 * 1000, 1000, "%lluG", u64);
+
+  /* 1.00T - 9.99G */
+  CHK_FORMAT(1000LL * 1000 * 1000 * 1000, 9.995, "%0.02fT", double);
+
+  /* 10.0T - 99.9T */
+  CHK_FORMAT(1000LL * 1000 * 1000 * 1000, 99.95, "%0.01fT", double);
+
+  /* 100T+ */
+  strcpy(tmp[cur], "infty");
+  return tmp[cur];
 }
 
-void get_seeds_with_messsage_types(const char *in_dir, khash_t(strSet) * message_types_set)
+/* Describe float. Similar to the above, except with a single
+   static buffer. */
+
+static u8 *DF(double val)
 {
-  struct dirent **nl_files;
-  int nl_cnt = scandir(in_dir, &nl_files, NULL, alphasort);
-  if (nl_cnt < 0)
+
+  static u8 tmp[16];
+
+  if (val < 99.995)
   {
-    printf("Error in reading the directory %s\n", in_dir);
-    exit(1);
+    sprintf(tmp, "%0.02f", val);
+    return tmp;
   }
 
-  // traverse the directory to read the files
-  for (int i = 0; i < nl_cnt; i++)
+  if (val < 999.95)
   {
-    char *nl_file_name = nl_files[i]->d_name;
-    // skip the . and .. files and files whose name includes "enriched"
-    if (strcmp(nl_file_name, ".") == 0 || strcmp(nl_file_name, "..") == 0 || strstr(nl_file_name, "enriched") != NULL)
-    {
-      continue;
-    }
-    char *nl_file_path = malloc(strlen(in_dir) + strlen(nl_file_name) + 2);
-    strcpy(nl_file_path, in_dir);
-    strcat(nl_file_path, "/");
-    strcat(nl_file_path, nl_file_name);
-    // printf("## File path: %s\n", nl_file_path);
+    sprintf(tmp, "%0.01f", val);
+    return tmp;
+  }
 
-    FILE *nl_file = fopen(nl_file_path, "r");
-    if (nl_file == NULL)
-    {
-      printf("Error in opening the file %s\n", nl_file_path);
-      exit(1);
-    }
+  return DI((u64)val);
+}
 
-    // read the whole file into a buffer
-    fseek(nl_file, 0, SEEK_END);
-    size_t fsize = ftell(nl_file);
-    fseek(nl_file, 0, SEEK_SET);
-    char *nl_file_content = malloc(fsize + 1);
-    fread(nl_file_content, fsize, 1, nl_file);
-    nl_file_content[fsize] = '\0';
-    // printf("## File content:\n %s\n", nl_file_content);
-    fclose(nl_file);
-    free(nl_file_path);
+/* Describe integer as memory size. */
 
-    u32 region_count = 0;
-    region_t *regions = (*extract_requests)(nl_file_content, fsize, &region_count);
+static u8 *DMS(u64 val)
+{
 
-    khash_t(strSet) *messages = duplicate_hash(message_types_set); // duplicate the message set
+  static u8 tmp[12][16];
+  static u8 cur;
 
-    for (int j = 0; j < region_count; j++)
-    { 
-      // remove all messages that are observed
-      int header_len = 0;
-      while (regions[j].start_byte + header_len < regions[j].end_byte 
-      && nl_file_content[regions[j].start_byte + header_len] != ' ' 
-      && nl_file_content[regions[j].start_byte + header_len] != '\r' 
-      && nl_file_content[regions[j].start_byte + header_len] != '\n'
-      && nl_file_content[regions[j].start_byte + header_len] != '\\')
-      {
-        header_len++;
-      }
+  cur = (cur + 1) % 12;
 
-      char *header = ck_alloc(header_len + 1);
-      memcpy(header, nl_file_content + regions[j].start_byte, header_len);
-      header[header_len] = '\0';
+  /* 0-9999 */
+  CHK_FORMAT(1, 10000, "%llu B", u64);
 
-      khiter_t k = kh_get(strSet, messages, header);
-      if (kh_exist(messages, k))
-      {
-        kh_del(strSet, messages, k);
-      }
-      ck_free(header);
-    }
+  /* 10.0k - 99.9k */
+  CHK_FORMAT(1024, 99.95, "%0.01f kB", double);
 
-    ck_free(regions);
+  /* 100k - 999k */
+  CHK_FORMAT(1024, 1000, "%llu kB", u64);
 
-    if(kh_size(messages) == 0) 
-    {
-      kh_destroy(strSet,messages);
-      // No missing message types, cannot enrich
-      WARNF("Message %s already has all message types. Skipping enrichment",nl_file_name);
-      continue;
-    }
+  /* 1.00M - 9.99M */
+  CHK_FORMAT(1024 * 1024, 9.995, "%0.02f MB", double);
 
-    while(kh_size(messages) > MAX_ENRICHMENT_CORPUS_SIZE) 
-    {
-      khiter_t x =UR(kh_end(messages));
-      if (kh_exist(messages, x))
-      {
-        kh_del(strSet, messages, x);
-      }
-    }
+  /* 10.0M - 99.9M */
+  CHK_FORMAT(1024 * 1024, 99.95, "%0.01f MB", double);
 
-    message_set_list message_subsets = message_combinations(messages,MAX_ENRICHMENT_MESSAGE_TYPES);
+  /* 100M - 999M */
+  CHK_FORMAT(1024 * 1024, 1000, "%llu MB", u64);
 
-    for(int i = 0;i < kv_size(message_subsets);i++) {
+  /* 1.00G - 9.99G */
+  CHK_FORMAT(1024LL * 1024 * 1024, 9.995, "%0.02f GB", double);
 
-      khash_t(strSet)* subset = kv_A(message_subsets,i); 
+  /* 10.0G - 99.9G */
+  CHK_FORMAT(1024LL * 1024 * 1024, 99.95, "%0.01f GB", double);
 
-      // Try enriching the sequence
-        char *client_request_answer = enrich_sequence(nl_file_content, subset);
+  /* 100G - 999G */
+  CHK_FORMAT(1024LL * 1024 * 1024, 1000, "%llu GB", u64);
 
-        if (client_request_answer == NULL)
-          continue;
+  /* 1.00T - 9.99G */
+  CHK_FORMAT(1024LL * 1024 * 1024 * 1024, 9.995, "%0.02f TB", double);
 
-        // Check whether the client_request_answer is the same as the nl_file_content or if the client_request_answer is empty
-        char *formatted_nl_file_content = format_string(nl_file_content);
-        char *unescaped_client_requests = unescape_string(client_request_answer);
-        char *formatted_unescaped_client_requests = format_string(unescaped_client_requests);
-        // printf("## Formatted answer from LLM:\n %s\n", formatted_unescaped_client_requests);
-        // printf("## Formatted file content:\n %s\n", formatted_nl_file_content);
-        if (formatted_unescaped_client_requests == NULL || strcmp(formatted_unescaped_client_requests, formatted_nl_file_content) == 0)
-        {
-          printf("## Skip the same seed\n");
-          continue;
-        }
+  /* 10.0T - 99.9T */
+  CHK_FORMAT(1024LL * 1024 * 1024 * 1024, 99.95, "%0.01f TB", double);
 
-        unescaped_client_requests = format_request_message(unescaped_client_requests);
+#undef CHK_FORMAT
 
-        // Create the file in the same directory with the name enriched_state_<file_name>
-        char *enriched_file_name = malloc(strlen(nl_file_name) + 10 + 20);
-        strcpy(enriched_file_name, "enriched_");
-        sprintf(enriched_file_name+9,"%d_",i);
-        strcat(enriched_file_name, nl_file_name);
-        char *enriched_file_path = malloc(strlen(in_dir) + strlen(enriched_file_name) + 2);
-        strcpy(enriched_file_path, in_dir);
-        strcat(enriched_file_path, "/");
-        strcat(enriched_file_path, enriched_file_name);
-        
-        // printf("## Enriched file path: %s\n", enriched_file_path);
+  /* 100T+ */
+  strcpy(tmp[cur], "infty");
+  return tmp[cur];
+}
 
-        write_new_seeds(enriched_file_path, unescaped_client_requests);
+/* Describe a duration given in microseconds. Returns static buffer, 8 chars
+   or less. */
 
-        free(enriched_file_name);
-        free(enriched_file_path);
-    }
+static u8 *DUS(u64 val)
+{
 
-    for(int i = 0;i < kv_size(message_subsets);i++) {
-      khash_t(strSet)* subset = kv_A(message_subsets,i);
-      kh_destroy(strSet,subset);
-    } 
+  static u8 tmp[24][16];
+  static u8 cur;
 
-    kh_destroy(strSet, messages);
-  }
-}
+  cur = (cur + 1) % 24;
 
-/* Enrich the testcases before startup */
-static void enrich_testcases(void)
-{
-  ACTF("Enriching test cases from LLM...");
+#define CHK_FORMAT(_divisor, _limit_mult, _fmt, _cast)    \
+  do                                                      \
+  {                                                       \
+    if (val < (_divisor) * (_limit_mult))                 \
+    {                                                     \
+      sprintf(tmp[cur], _fmt, ((_cast)val) / (_divisor)); \
+      return tmp[cur];                                    \
+    }                                                     \
+  } while (0)
 
-  // char *message_prompt = construct_prompt_for_protocol_message_types(protocol_name);
+  /* 0-999us */
+  CHK_FORMAT(1, 1000, "%lluus", u64);
 
-  // // Get protocol states
-  // get_protocol_message_types(message_prompt, message_type_set);
+  /* 1.0ms - 9.9ms */
+  CHK_FORMAT(1000, 9.95, "%0.01fms", double);
 
-  // free(message_prompt);
+  /* 10ms - 999ms */
+  CHK_FORMAT(1000, 1000, "%llums", u64);
 
-  // Get seeds to states and save them to the in_dir
-  get_seeds_with_messsage_types(in_dir, message_types_set);
-}
+  /* 1.0s - 9.9s */
+  CHK_FORMAT(1000000ULL, 9.95, "%0.01fs", double);
 
-/* Read all testcases from the input directory, then queue them for testing.
-   Called at startup. */
+  /* 10s - 99999s */
+  CHK_FORMAT(1000000ULL, 100000, "%llus", u64);
 
-static void read_testcases(void)
-{
+#undef CHK_FORMAT
 
-  struct dirent **nl;
-  s32 nl_cnt;
-  u32 i;
-  u8 *fn;
+  strcpy(tmp[cur], "infty");
+  return tmp[cur];
+}
 
-  /* AFLNet: set this flag to enable request extractions while adding new seed to the queue */
-  corpus_read_or_sync = 1;
+/* Describe time delta. Returns one static buffer, 34 chars of less. */
 
-  /* Auto-detect non-in-place resumption attempts. */
+static u8 *DTD(u64 cur_ms, u64 event_ms)
+{
 
-  fn = alloc_printf("%s/queue", in_dir);
-  if (!access(fn, F_OK))
-    in_dir = fn;
-  else
-    ck_free(fn);
+  static u8 tmp[64];
+  u64 delta;
+  s32 t_d, t_h, t_m, t_s;
 
-  ACTF("Scanning '%s'...", in_dir);
+  if (!event_ms)
+    return "none seen yet";
 
-  /* We use scandir() + alphasort() rather than readdir() because otherwise,
-     the ordering  of test cases would vary somewhat randomly and would be
-     difficult to control. */
+  delta = cur_ms - event_ms;
 
-  nl_cnt = scandir(in_dir, &nl, NULL, alphasort);
+  t_d = delta / 1000 / 60 / 60 / 24;
+  t_h = (delta / 1000 / 60 / 60) % 24;
+  t_m = (delta / 1000 / 60) % 60;
+  t_s = (delta / 1000) % 60;
 
-  if (nl_cnt < 0)
-  {
+  sprintf(tmp, "%s days, %u hrs, %u min, %u sec", DI(t_d), t_h, t_m, t_s);
+  return tmp;
+}
 
-    if (errno == ENOENT || errno == ENOTDIR)
+/* Mark deterministic checks as done for a particular queue entry. We use the
+   .state file to avoid repeating deterministic fuzzing when resuming aborted
+   scans. */
 
-      SAYF("\n" cLRD "[-] " cRST
-           "The input directory does not seem to be valid - try again. The fuzzer needs\n"
-           "    one or more test case to start with - ideally, a small file under 1 kB\n"
-           "    or so. The cases must be stored as regular files directly in the input\n"
-           "    directory.\n");
+static void mark_as_det_done(struct queue_entry *q)
+{
 
-    PFATAL("Unable to open '%s'", in_dir);
-  }
+  u8 *fn = strrchr(q->fname, '/');
+  s32 fd;
 
-  if (shuffle_queue && nl_cnt > 1)
-  {
+  fn = alloc_printf("%s/queue/.state/deterministic_done/%s", out_dir, fn + 1);
 
-    ACTF("Shuffling queue...");
-    shuffle_ptrs((void **)nl, nl_cnt);
-  }
+  fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, 0600);
+  if (fd < 0)
+    PFATAL("Unable to create '%s'", fn);
+  close(fd);
 
-  for (i = 0; i < nl_cnt; i++)
-  {
+  ck_free(fn);
 
-    struct stat st;
+  q->passed_det = 1;
+}
 
-    u8 *fn = alloc_printf("%s/%s", in_dir, nl[i]->d_name);
-    u8 *dfn = alloc_printf("%s/.state/deterministic_done/%s", in_dir, nl[i]->d_name);
+/* Mark as variable. Create symlinks if possible to make it easier to examine
+   the files. */
 
-    u8 passed_det = 0;
+static void mark_as_variable(struct queue_entry *q)
+{
 
-    free(nl[i]); /* not tracked */
+  u8 *fn = strrchr(q->fname, '/') + 1, *ldest;
 
-    if (lstat(fn, &st) || access(fn, R_OK))
-      PFATAL("Unable to access '%s'", fn);
+  ldest = alloc_printf("../../%s", fn);
+  fn = alloc_printf("%s/queue/.state/variable_behavior/%s", out_dir, fn);
 
-    /* This also takes care of . and .. */
+  if (symlink(ldest, fn))
+  {
 
-    if (!S_ISREG(st.st_mode) || !st.st_size || strstr(fn, "/README.txt"))
-    {
+    s32 fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (fd < 0)
+      PFATAL("Unable to create '%s'", fn);
+    close(fd);
+  }
 
-      ck_free(fn);
-      ck_free(dfn);
-      continue;
-    }
+  ck_free(ldest);
+  ck_free(fn);
 
-    if (st.st_size > MAX_FILE)
-      FATAL("Test case '%s' is too big (%s, limit is %s)", fn,
-            DMS(st.st_size), DMS(MAX_FILE));
+  q->var_behavior = 1;
+}
 
-    /* Check for metadata that indicates that deterministic fuzzing
-       is complete for this entry. We don't want to repeat deterministic
-       fuzzing when resuming aborted scans, because it would be pointless
-       and probably very time-consuming. */
+/* Mark / unmark as redundant (edge-only). This is not used for restoring state,
+   but may be useful for post-processing datasets. */
 
-    if (!access(dfn, F_OK))
-      passed_det = 1;
-    ck_free(dfn);
+static void mark_as_redundant(struct queue_entry *q, u8 state)
+{
 
-    add_to_queue(fn, st.st_size, passed_det);
-  }
+  u8 *fn;
+  s32 fd;
 
-  /* AFLNet: unset this flag to disable request extractions while adding new seed to the queue */
-  corpus_read_or_sync = 0;
+  if (state == q->fs_redundant)
+    return;
 
-  free(nl); /* not tracked */
+  q->fs_redundant = state;
 
-  if (!queued_paths)
+  fn = strrchr(q->fname, '/');
+  fn = alloc_printf("%s/queue/.state/redundant_edges/%s", out_dir, fn + 1);
+
+  if (state)
   {
 
-    SAYF("\n" cLRD "[-] " cRST
-         "Looks like there are no valid test cases in the input directory! The fuzzer\n"
-         "    needs one or more test case to start with - ideally, a small file under\n"
-         "    1 kB or so. The cases must be stored as regular files directly in the\n"
-         "    input directory.\n");
+    fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (fd < 0)
+      PFATAL("Unable to create '%s'", fn);
+    close(fd);
+  }
+  else
+  {
 
-    FATAL("No usable test cases in '%s'", in_dir);
+    if (unlink(fn))
+      PFATAL("Unable to remove '%s'", fn);
   }
 
-  last_path_time = 0;
-  queued_at_start = queued_paths;
+  ck_free(fn);
 }
 
-/* Helper function for load_extras. */
+/* Append new test case to the queue. */
 
-static int compare_extras_len(const void *p1, const void *p2)
+static void add_to_queue(u8 *fname, u32 len, u8 passed_det)
 {
-  struct extra_data *e1 = (struct extra_data *)p1,
-                    *e2 = (struct extra_data *)p2;
-
-  return e1->len - e2->len;
-}
 
-static int compare_extras_use_d(const void *p1, const void *p2)
-{
-  struct extra_data *e1 = (struct extra_data *)p1,
-                    *e2 = (struct extra_data *)p2;
+  struct queue_entry *q = ck_alloc(sizeof(struct queue_entry));
 
-  return e2->hit_cnt - e1->hit_cnt;
-}
+  q->fname = fname;
+  q->len = len;
+  q->depth = cur_depth + 1;
+  q->passed_det = passed_det;
+  q->regions = NULL;
+  q->region_count = 0;
+  q->index = queued_paths;
+  q->generating_state_id = target_state_id;
+  q->is_initial_seed = 0;
+  q->unique_state_count = 0;
 
-/* Read extras from a file, sort by size. */
+  if (q->depth > max_depth)
+    max_depth = q->depth;
 
-static void load_extras_file(u8 *fname, u32 *min_len, u32 *max_len,
-                             u32 dict_level)
-{
+  if (queue_top)
+  {
 
-  FILE *f;
-  u8 buf[MAX_LINE];
-  u8 *lptr;
-  u32 cur_line = 0;
+    queue_top->next = q;
+    queue_top = q;
+  }
+  else
+    q_prev100 = queue = queue_top = q;
 
-  f = fopen(fname, "r");
+  queued_paths++;
+  pending_not_fuzzed++;
 
-  if (!f)
-    PFATAL("Unable to open '%s'", fname);
+  cycles_wo_finds = 0;
 
-  while ((lptr = fgets(buf, MAX_LINE, f)))
+  if (!(queued_paths % 100))
   {
 
-    u8 *rptr, *wptr;
-    u32 klen = 0;
-
-    cur_line++;
+    q_prev100->next_100 = q;
+    q_prev100 = q;
+  }
 
-    /* Trim on left and right. */
+  /* AFLNet: extract regions keeping client requests if needed */
+  if (corpus_read_or_sync)
+  {
+    FILE *fp;
+    unsigned char *buf;
 
-    while (isspace(*lptr))
-      lptr++;
+    /* opening file for reading */
+    fp = fopen(fname, "rb");
 
-    rptr = lptr + strlen(lptr) - 1;
-    while (rptr >= lptr && isspace(*rptr))
-      rptr--;
-    rptr++;
-    *rptr = 0;
+    buf = (unsigned char *)ck_alloc(len);
+    u32 byte_count = fread(buf, 1, len, fp);
+    fclose(fp);
 
-    /* Skip empty lines and comments. */
-
-    if (!*lptr || *lptr == '#')
-      continue;
-
-    /* All other lines must end with '"', which we can consume. */
+    if (byte_count != len)
+      PFATAL("AFLNet - Inconsistent file length '%s'", fname);
+    q->regions = (*extract_requests)(buf, len, &q->region_count);
+    ck_free(buf);
 
-    rptr--;
+    // Keep track the maximal number of seed regions
+    // We use this for some optimization to reduce the overhead while following the server's sequence diagram
+    if ((corpus_read_or_sync == 1) && (q->region_count > max_seed_region_count))
+      max_seed_region_count = q->region_count;
+  }
+  else
+  {
+    // Convert the linked list kl_messages to regions
+    q->regions = convert_kl_messages_to_regions(kl_messages, &q->region_count, messages_sent);
+  }
 
-    if (rptr < lptr || *rptr != '"')
-      FATAL("Malformed name=\"value\" pair in line %u.", cur_line);
+  /* save the regions' information to file for debugging purpose */
+  u8 *fn = alloc_printf("%s/regions/%s", out_dir, basename(fname));
+  save_regions_to_file(q->regions, q->region_count, fn);
+  ck_free(fn);
 
-    *rptr = 0;
+  last_path_time = get_cur_time();
 
-    /* Skip alphanumerics and dashes (label). */
+  // Add a new column to the was_fuzzed map
+  expand_was_fuzzed_map(0, 1);
+}
 
-    while (isalnum(*lptr) || *lptr == '_')
-      lptr++;
+/* Destroy the entire queue. */
 
-    /* If @number follows, parse that. */
+EXP_ST void destroy_queue(void)
+{
 
-    if (*lptr == '@')
-    {
+  struct queue_entry *q = queue, *n;
 
-      lptr++;
-      if (atoi(lptr) > dict_level)
-        continue;
-      while (isdigit(*lptr))
-        lptr++;
-    }
+  while (q)
+  {
 
-    /* Skip whitespace and = signs. */
+    n = q->next;
+    ck_free(q->fname);
+    ck_free(q->trace_mini);
+    // Free AFLNet-specific data structure, the regions' annotations point into state_sequence
+    if (q->state_sequence)
+      ck_free(q->state_sequence);
+    if (q->regions)
+      ck_free(q->regions);
+    ck_free(q);
+    q = n;
+  }
+}
 
-    while (isspace(*lptr) || *lptr == '=')
-      lptr++;
+/* Write bitmap to file. The bitmap is useful mostly for the secret
+   -B option, to focus a separate fuzzing session on a particular
+   interesting input without rediscovering all the others. */
 
-    /* Consume opening '"'. */
+EXP_ST void write_bitmap(void)
+{
 
-    if (*lptr != '"')
-      FATAL("Malformed name=\"keyword\" pair in line %u.", cur_line);
+  u8 *fname;
+  s32 fd;
 
-    lptr++;
+  if (!bitmap_changed)
+    return;
+  bitmap_changed = 0;
 
-    if (!*lptr)
-      FATAL("Empty keyword in line %u.", cur_line);
+  fname = alloc_printf("%s/fuzz_bitmap", out_dir);
+  fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0600);
 
-    /* Okay, let's allocate memory and copy data between "...", handling
-       \xNN escaping, \\, and \". */
+  if (fd < 0)
+    PFATAL("Unable to open '%s'", fname);
 
-    extras = ck_realloc_block(extras, (extras_cnt + 1) *
-                                          sizeof(struct extra_data));
+  ck_write(fd, virgin_bits, MAP_SIZE, fname);
 
-    wptr = extras[extras_cnt].data = ck_alloc(rptr - lptr);
+  close(fd);
+  ck_free(fname);
+}
 
-    while (*lptr)
-    {
+/* Export the implemented state machine, as ipsm.dot for viewing and as
+   ipsm.bin for scripts. Done periodically and at exit rather than on every
+   new find, since a rewrite is linear in the size of the graph. */
 
-      char *hexdigits = "0123456789abcdef";
+static void write_ipsm(void)
+{
 
-      switch (*lptr)
-      {
+  u8 *fname;
+  s32 fd;
+  FILE *f;
 
-      case 1 ... 31:
-      case 128 ... 255:
-        FATAL("Non-printable characters in line %u.", cur_line);
+  if (!ipsm_changed)
+    return;
+  ipsm_changed = 0;
 
-      case '\\':
+  fname = alloc_printf("%s/ipsm.dot", out_dir);
+  fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0600);
 
-        lptr++;
+  if (fd < 0)
+    PFATAL("Unable to open '%s'", fname);
 
-        if (*lptr == '\\' || *lptr == '"')
-        {
-          *(wptr++) = *(lptr++);
-          klen++;
-          break;
-        }
+  f = fdopen(fd, "w");
+  if (!f)
+    PFATAL("fdopen() failed");
 
-        if (*lptr != 'x' || !isxdigit(lptr[1]) || !isxdigit(lptr[2]))
-          FATAL("Invalid escaping (not \\xNN) in line %u.", cur_line);
+  ipsm_write_dot(ipsm, f);
+  fclose(f);
+  ck_free(fname);
 
-        *(wptr++) =
-            ((strchr(hexdigits, tolower(lptr[1])) - hexdigits) << 4) |
-            (strchr(hexdigits, tolower(lptr[2])) - hexdigits);
+  fname = alloc_printf("%s/ipsm.bin", out_dir);
+  fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0600);
 
-        lptr += 3;
-        klen++;
+  if (fd < 0)
+    PFATAL("Unable to open '%s'", fname);
 
-        break;
+  f = fdopen(fd, "w");
+  if (!f)
+    PFATAL("fdopen() failed");
 
-      default:
+  ipsm_write_bin(ipsm, f);
+  fclose(f);
+  ck_free(fname);
+}
 
-        *(wptr++) = *(lptr++);
-        klen++;
-      }
-    }
+/* Read bitmap from file. This is for the -B option again. */
 
-    extras[extras_cnt].len = klen;
+EXP_ST void read_bitmap(u8 *fname)
+{
 
-    if (extras[extras_cnt].len > MAX_DICT_FILE)
-      FATAL("Keyword too big in line %u (%s, limit is %s)", cur_line,
-            DMS(klen), DMS(MAX_DICT_FILE));
+  s32 fd = open(fname, O_RDONLY);
 
-    if (*min_len > klen)
-      *min_len = klen;
-    if (*max_len < klen)
-      *max_len = klen;
+  if (fd < 0)
+    PFATAL("Unable to open '%s'", fname);
 
-    extras_cnt++;
-  }
+  ck_read(fd, virgin_bits, MAP_SIZE, fname);
 
-  fclose(f);
+  close(fd);
 }
 
-/* Read extras from the extras directory and sort them by size. */
-
-static void load_extras(u8 *dir)
-{
+/* Check if the current execution path brings anything new to the table.
+   Update virgin bits to reflect the finds. Returns 1 if the only change is
+   the hit-count for a particular tuple; 2 if there are new tuples seen.
+   Updates the map, so subsequent calls will always return 0.
 
-  DIR *d;
-  struct dirent *de;
-  u32 min_len = MAX_DICT_FILE, max_len = 0, dict_level = 0;
-  u8 *x;
+   This function is called after every exec() on a fairly large buffer, so
+   it needs to be fast. We do this in 32-bit and 64-bit flavors. */
 
-  /* If the name ends with @, extract level and continue. */
+static inline u8 has_new_bits(u8 *virgin_map)
+{
 
-  if ((x = strchr(dir, '@')))
-  {
+#ifdef WORD_SIZE_64
 
-    *x = 0;
-    dict_level = atoi(x + 1);
-  }
+  u64 *current = (u64 *)trace_bits;
+  u64 *virgin = (u64 *)virgin_map;
 
-  ACTF("Loading extra dictionary from '%s' (level %u)...", dir, dict_level);
+  u32 i = (MAP_SIZE >> 3);
 
-  d = opendir(dir);
+#else
 
-  if (!d)
-  {
+  u32 *current = (u32 *)trace_bits;
+  u32 *virgin = (u32 *)virgin_map;
 
-    if (errno == ENOTDIR)
-    {
-      load_extras_file(dir, &min_len, &max_len, dict_level);
-      goto check_and_sort;
-    }
+  u32 i = (MAP_SIZE >> 2);
 
-    PFATAL("Unable to open '%s'", dir);
-  }
+#endif /* ^WORD_SIZE_64 */
 
-  if (x)
-    FATAL("Dictionary levels not supported for directories.");
+  u8 ret = 0;
 
-  while ((de = readdir(d)))
+  while (i--)
   {
 
-    struct stat st;
-    u8 *fn = alloc_printf("%s/%s", dir, de->d_name);
-    s32 fd;
-
-    if (lstat(fn, &st) || access(fn, R_OK))
-      PFATAL("Unable to access '%s'", fn);
+    /* Optimize for (*current & *virgin) == 0 - i.e., no bits in current bitmap
+       that have not been already cleared from the virgin map - since this will
+       almost always be the case. */
 
-    /* This also takes care of . and .. */
-    if (!S_ISREG(st.st_mode) || !st.st_size)
+    if (unlikely(*current) && unlikely(*current & *virgin))
     {
 
-      ck_free(fn);
-      continue;
-    }
+      if (likely(ret < 2))
+      {
 
-    if (st.st_size > MAX_DICT_FILE)
-      FATAL("Extra '%s' is too big (%s, limit is %s)", fn,
-            DMS(st.st_size), DMS(MAX_DICT_FILE));
+        u8 *cur = (u8 *)current;
+        u8 *vir = (u8 *)virgin;
 
-    if (min_len > st.st_size)
-      min_len = st.st_size;
-    if (max_len < st.st_size)
-      max_len = st.st_size;
+        /* Looks like we have not found any new bytes yet; see if any non-zero
+           bytes in current[] are pristine in virgin[]. */
 
-    extras = ck_realloc_block(extras, (extras_cnt + 1) *
-                                          sizeof(struct extra_data));
+#ifdef WORD_SIZE_64
 
-    extras[extras_cnt].data = ck_alloc(st.st_size);
-    extras[extras_cnt].len = st.st_size;
+        if ((cur[0] && vir[0] == 0xff) || (cur[1] && vir[1] == 0xff) ||
+            (cur[2] && vir[2] == 0xff) || (cur[3] && vir[3] == 0xff) ||
+            (cur[4] && vir[4] == 0xff) || (cur[5] && vir[5] == 0xff) ||
+            (cur[6] && vir[6] == 0xff) || (cur[7] && vir[7] == 0xff))
+          ret = 2;
+        else
+          ret = 1;
 
-    fd = open(fn, O_RDONLY);
+#else
 
-    if (fd < 0)
-      PFATAL("Unable to open '%s'", fn);
+        if ((cur[0] && vir[0] == 0xff) || (cur[1] && vir[1] == 0xff) ||
+            (cur[2] && vir[2] == 0xff) || (cur[3] && vir[3] == 0xff))
+          ret = 2;
+        else
+          ret = 1;
 
-    ck_read(fd, extras[extras_cnt].data, st.st_size, fn);
+#endif /* ^WORD_SIZE_64 */
+      }
 
-    close(fd);
-    ck_free(fn);
+      *virgin &= ~*current;
+    }
 
-    extras_cnt++;
+    current++;
+    virgin++;
   }
 
-  closedir(d);
-
-check_and_sort:
-
-  if (!extras_cnt)
-    FATAL("No usable files in '%s'", dir);
-
-  qsort(extras, extras_cnt, sizeof(struct extra_data), compare_extras_len);
-
-  OKF("Loaded %u extra tokens, size range %s to %s.", extras_cnt,
-      DMS(min_len), DMS(max_len));
-
-  if (max_len > 32)
-    WARNF("Some tokens are relatively large (%s) - consider trimming.",
-          DMS(max_len));
-
-  if (extras_cnt > MAX_DET_EXTRAS)
-    WARNF("More than %u tokens - will use them probabilistically.",
-          MAX_DET_EXTRAS);
-}
-
-/* Helper function for maybe_add_auto() */
-
-static inline u8 memcmp_nocase(u8 *m1, u8 *m2, u32 len)
-{
+  if (ret && virgin_map == virgin_bits)
+    bitmap_changed = 1;
 
-  while (len--)
-    if (tolower(*(m1++)) ^ tolower(*(m2++)))
-      return 1;
-  return 0;
+  return ret;
 }
 
-/* Maybe add automatic extra. */
+/* Count the number of bits set in the provided bitmap. Used for the status
+   screen several times every second, does not have to be fast. */
 
-static void maybe_add_auto(u8 *mem, u32 len)
+static u32 count_bits(u8 *mem)
 {
 
-  u32 i;
-
-  /* Allow users to specify that they don't want auto dictionaries. */
-
-  if (!MAX_AUTO_EXTRAS || !USE_AUTO_EXTRAS)
-    return;
-
-  /* Skip runs of identical bytes. */
-
-  for (i = 1; i < len; i++)
-    if (mem[0] ^ mem[i])
-      break;
-
-  if (i == len)
-    return;
-
-  /* Reject builtin interesting values. */
+  u32 *ptr = (u32 *)mem;
+  u32 i = (MAP_SIZE >> 2);
+  u32 ret = 0;
 
-  if (len == 2)
+  while (i--)
   {
 
-    i = sizeof(interesting_16) >> 1;
-
-    while (i--)
-      if (*((u16 *)mem) == interesting_16[i] ||
-          *((u16 *)mem) == SWAP16(interesting_16[i]))
-        return;
-  }
+    u32 v = *(ptr++);
 
-  if (len == 4)
-  {
+    /* This gets called on the inverse, virgin bitmap; optimize for sparse
+       data. */
 
-    i = sizeof(interesting_32) >> 2;
+    if (v == 0xffffffff)
+    {
+      ret += 32;
+      continue;
+    }
 
-    while (i--)
-      if (*((u32 *)mem) == interesting_32[i] ||
-          *((u32 *)mem) == SWAP32(interesting_32[i]))
-        return;
+    v -= ((v >> 1) & 0x55555555);
+    v = (v & 0x33333333) + ((v >> 2) & 0x33333333);
+    ret += (((v + (v >> 4)) & 0xF0F0F0F) * 0x01010101) >> 24;
   }
 
-  /* Reject anything that matches existing extras. Do a case-insensitive
-     match. We optimize by exploiting the fact that extras[] are sorted
-     by size. */
+  return ret;
+}
 
-  for (i = 0; i < extras_cnt; i++)
-    if (extras[i].len >= len)
-      break;
+#define FF(_b) (0xff << ((_b) << 3))
 
-  for (; i < extras_cnt && extras[i].len == len; i++)
-    if (!memcmp_nocase(extras[i].data, mem, len))
-      return;
+/* Count the number of bytes set in the bitmap. Called fairly sporadically,
+   mostly to update the status screen or calibrate and examine confirmed
+   new paths. */
 
-  /* Last but not least, check a_extras[] for matches. There are no
-     guarantees of a particular sort order. */
+static u32 count_bytes(u8 *mem)
+{
 
-  auto_changed = 1;
+  u32 *ptr = (u32 *)mem;
+  u32 i = (MAP_SIZE >> 2);
+  u32 ret = 0;
 
-  for (i = 0; i < a_extras_cnt; i++)
+  while (i--)
   {
 
-    if (a_extras[i].len == len && !memcmp_nocase(a_extras[i].data, mem, len))
-    {
+    u32 v = *(ptr++);
 
-      a_extras[i].hit_cnt++;
-      goto sort_a_extras;
-    }
+    if (!v)
+      continue;
+    if (v & FF(0))
+      ret++;
+    if (v & FF(1))
+      ret++;
+    if (v & FF(2))
+      ret++;
+    if (v & FF(3))
+      ret++;
   }
 
-  /* At this point, looks like we're dealing with a new entry. So, let's
-     append it if we have room. Otherwise, let's randomly evict some other
-     entry from the bottom half of the list. */
+  return ret;
+}
 
-  if (a_extras_cnt < MAX_AUTO_EXTRAS)
-  {
+/* Count the number of non-255 bytes set in the bitmap. Used strictly for the
+   status screen, several calls per second or so. */
 
-    a_extras = ck_realloc_block(a_extras, (a_extras_cnt + 1) *
-                                              sizeof(struct extra_data));
+static u32 count_non_255_bytes(u8 *mem)
+{
 
-    a_extras[a_extras_cnt].data = ck_memdup(mem, len);
-    a_extras[a_extras_cnt].len = len;
-    a_extras_cnt++;
-  }
-  else
+  u32 *ptr = (u32 *)mem;
+  u32 i = (MAP_SIZE >> 2);
+  u32 ret = 0;
+
+  while (i--)
   {
 
-    i = MAX_AUTO_EXTRAS / 2 +
-        UR((MAX_AUTO_EXTRAS + 1) / 2);
+    u32 v = *(ptr++);
 
-    ck_free(a_extras[i].data);
+    /* This is called on the virgin bitmap, so optimize for the most likely
+       case. */
 
-    a_extras[i].data = ck_memdup(mem, len);
-    a_extras[i].len = len;
-    a_extras[i].hit_cnt = 0;
+    if (v == 0xffffffff)
+      continue;
+    if ((v & FF(0)) != FF(0))
+      ret++;
+    if ((v & FF(1)) != FF(1))
+      ret++;
+    if ((v & FF(2)) != FF(2))
+      ret++;
+    if ((v & FF(3)) != FF(3))
+      ret++;
   }
 
-sort_a_extras:
+  return ret;
+}
 
-  /* First, sort all auto extras by use count, descending order. */
+/* Destructively simplify trace by eliminating hit count information
+   and replacing it with 0x80 or 0x01 depending on whether the tuple
+   is hit or not. Called on every new crash or timeout, should be
+   reasonably fast. */
 
-  qsort(a_extras, a_extras_cnt, sizeof(struct extra_data),
-        compare_extras_use_d);
+static const u8 simplify_lookup[256] = {
 
-  /* Then, sort the top USE_AUTO_EXTRAS entries by size. */
+    [0] = 1,
+    [1 ... 255] = 128
 
-  qsort(a_extras, MIN(USE_AUTO_EXTRAS, a_extras_cnt),
-        sizeof(struct extra_data), compare_extras_len);
-}
+};
 
-/* Save automatically generated extras. */
+#ifdef WORD_SIZE_64
 
-static void save_auto(void)
+static void simplify_trace(u64 *mem)
 {
 
-  u32 i;
-
-  if (!auto_changed)
-    return;
-  auto_changed = 0;
+  u32 i = MAP_SIZE >> 3;
 
-  for (i = 0; i < MIN(USE_AUTO_EXTRAS, a_extras_cnt); i++)
+  while (i--)
   {
 
-    u8 *fn = alloc_printf("%s/queue/.state/auto_extras/auto_%06u", out_dir, i);
-    s32 fd;
+    /* Optimize for sparse bitmaps. */
 
-    fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (unlikely(*mem))
+    {
 
-    if (fd < 0)
-      PFATAL("Unable to create '%s'", fn);
+      u8 *mem8 = (u8 *)mem;
 
-    ck_write(fd, a_extras[i].data, a_extras[i].len, fn);
+      mem8[0] = simplify_lookup[mem8[0]];
+      mem8[1] = simplify_lookup[mem8[1]];
+      mem8[2] = simplify_lookup[mem8[2]];
+      mem8[3] = simplify_lookup[mem8[3]];
+      mem8[4] = simplify_lookup[mem8[4]];
+      mem8[5] = simplify_lookup[mem8[5]];
+      mem8[6] = simplify_lookup[mem8[6]];
+      mem8[7] = simplify_lookup[mem8[7]];
+    }
+    else
+      *mem = 0x0101010101010101ULL;
 
-    close(fd);
-    ck_free(fn);
+    mem++;
   }
 }
 
-/* Load automatically generated extras. */
+#else
 
-static void load_auto(void)
+static void simplify_trace(u32 *mem)
 {
 
-  u32 i;
+  u32 i = MAP_SIZE >> 2;
 
-  for (i = 0; i < USE_AUTO_EXTRAS; i++)
+  while (i--)
   {
 
-    u8 tmp[MAX_AUTO_EXTRA + 1];
-    u8 *fn = alloc_printf("%s/.state/auto_extras/auto_%06u", in_dir, i);
-    s32 fd, len;
-
-    fd = open(fn, O_RDONLY, 0600);
+    /* Optimize for sparse bitmaps. */
 
-    if (fd < 0)
+    if (unlikely(*mem))
     {
 
-      if (errno != ENOENT)
-        PFATAL("Unable to open '%s'", fn);
-      ck_free(fn);
-      break;
-    }
-
-    /* We read one byte more to cheaply detect tokens that are too
-       long (and skip them). */
+      u8 *mem8 = (u8 *)mem;
 
-    len = read(fd, tmp, MAX_AUTO_EXTRA + 1);
-
-    if (len < 0)
-      PFATAL("Unable to read from '%s'", fn);
-
-    if (len >= MIN_AUTO_EXTRA && len <= MAX_AUTO_EXTRA)
-      maybe_add_auto(tmp, len);
+      mem8[0] = simplify_lookup[mem8[0]];
+      mem8[1] = simplify_lookup[mem8[1]];
+      mem8[2] = simplify_lookup[mem8[2]];
+      mem8[3] = simplify_lookup[mem8[3]];
+    }
+    else
+      *mem = 0x01010101;
 
-    close(fd);
-    ck_free(fn);
+    mem++;
   }
-
-  if (i)
-    OKF("Loaded %u auto-discovered dictionary tokens.", i);
-  else
-    OKF("No auto-generated dictionary tokens to reuse.");
 }
 
-/* Destroy extras. */
-
-static void destroy_extras(void)
-{
-
-  u32 i;
+#endif /* ^WORD_SIZE_64 */
 
-  for (i = 0; i < extras_cnt; i++)
-    ck_free(extras[i].data);
+/* Destructively classify execution counts in a trace. This is used as a
+   preprocessing step for any newly acquired traces. Called on every exec,
+   must be fast. */
 
-  ck_free(extras);
+static const u8 count_class_lookup8[256] = {
 
-  for (i = 0; i < a_extras_cnt; i++)
-    ck_free(a_extras[i].data);
+    [0] = 0,
+    [1] = 1,
+    [2] = 2,
+    [3] = 4,
+    [4 ... 7] = 8,
+    [8 ... 15] = 16,
+    [16 ... 31] = 32,
+    [32 ... 127] = 64,
+    [128 ... 255] = 128
 
-  ck_free(a_extras);
-}
+};
 
-/* Move process to the network namespace "netns_name" */
+static u16 count_class_lookup16[65536];
 
-static void move_process_to_netns()
+EXP_ST void init_count_class16(void)
 {
-  const char *netns_path_fmt = "/var/run/netns/%s";
-  char netns_path[272]; /* 15 for "/var/.." + 256 for netns name + 1 '\0' */
-  int netns_fd;
 
-  if (strlen(netns_name) > 256)
-    FATAL("Network namespace name \"%s\" is too long", netns_name);
+  u32 b1, b2;
 
-  sprintf(netns_path, netns_path_fmt, netns_name);
+  for (b1 = 0; b1 < 256; b1++)
+    for (b2 = 0; b2 < 256; b2++)
+      count_class_lookup16[(b1 << 8) + b2] =
+          (count_class_lookup8[b1] << 8) |
+          count_class_lookup8[b2];
+}
 
-  netns_fd = open(netns_path, O_RDONLY);
-  if (netns_fd == -1)
-    PFATAL("Unable to open %s", netns_path);
+#ifdef WORD_SIZE_64
 
-  if (setns(netns_fd, CLONE_NEWNET) == -1)
-    PFATAL("setns failed");
-}
+static inline void classify_counts(u64 *mem)
+{
 
-/* Spin up fork server (instrumented mode only). The idea is explained here:
+  u32 i = MAP_SIZE >> 3;
 
-   http://lcamtuf.blogspot.com/2014/10/fuzzing-binaries-without-execve.html
+  while (i--)
+  {
 
-   In essence, the instrumentation allows us to skip execve(), and just keep
-   cloning a stopped child. So, we just execute once, and then send commands
-   through a pipe. The other part of this logic is in afl-as.h. */
+    /* Optimize for sparse bitmaps. */
 
-EXP_ST void init_forkserver(char **argv)
-{
+    if (unlikely(*mem))
+    {
 
-  static struct itimerval it;
-  int st_pipe[2], ctl_pipe[2];
-  int status;
-  s32 rlen;
+      u16 *mem16 = (u16 *)mem;
 
-  ACTF("Spinning up the fork server...");
+      mem16[0] = count_class_lookup16[mem16[0]];
+      mem16[1] = count_class_lookup16[mem16[1]];
+      mem16[2] = count_class_lookup16[mem16[2]];
+      mem16[3] = count_class_lookup16[mem16[3]];
+    }
 
-  if (pipe(st_pipe) || pipe(ctl_pipe))
-    PFATAL("pipe() failed");
+    mem++;
+  }
+}
 
-  forksrv_pid = fork();
+#else
 
-  if (forksrv_pid < 0)
-    PFATAL("fork() failed");
+static inline void classify_counts(u32 *mem)
+{
 
-  if (!forksrv_pid)
-  {
+  u32 i = MAP_SIZE >> 2;
 
-    struct rlimit r;
+  while (i--)
+  {
 
-    /* Umpf. On OpenBSD, the default fd limit for root users is set to
-       soft 128. Let's try to fix that... */
+    /* Optimize for sparse bitmaps. */
 
-    if (!getrlimit(RLIMIT_NOFILE, &r) && r.rlim_cur < FORKSRV_FD + 2)
+    if (unlikely(*mem))
     {
 
-      r.rlim_cur = FORKSRV_FD + 2;
-      setrlimit(RLIMIT_NOFILE, &r); /* Ignore errors */
-    }
+      u16 *mem16 = (u16 *)mem;
 
-    if (mem_limit)
-    {
+      mem16[0] = count_class_lookup16[mem16[0]];
+      mem16[1] = count_class_lookup16[mem16[1]];
+    }
 
-      r.rlim_max = r.rlim_cur = ((rlim_t)mem_limit) << 20;
+    mem++;
+  }
+}
 
-#ifdef RLIMIT_AS
+#endif /* ^WORD_SIZE_64 */
 
-      setrlimit(RLIMIT_AS, &r); /* Ignore errors */
+/* Get rid of shared memory (atexit handler). */
 
-#else
+static void remove_shm(void)
+{
 
-      /* This takes care of OpenBSD, which doesn't have RLIMIT_AS, but
-         according to reliable sources, RLIMIT_DATA covers anonymous
-         maps - so we should be getting good protection against OOM bugs. */
+  shmctl(shm_id, IPC_RMID, NULL);
+}
 
-      setrlimit(RLIMIT_DATA, &r); /* Ignore errors */
+/* Compact trace bytes into a smaller bitmap. We effectively just drop the
+   count information here. This is called only sporadically, for some
+   new paths. */
 
-#endif /* ^RLIMIT_AS */
-    }
+static void minimize_bits(u8 *dst, u8 *src)
+{
 
-    /* Dumping cores is slow and can lead to anomalies if SIGKILL is delivered
-       before the dump is complete. */
+  u32 i = 0;
 
-    r.rlim_max = r.rlim_cur = 0;
+  while (i < MAP_SIZE)
+  {
 
-    setrlimit(RLIMIT_CORE, &r); /* Ignore errors */
+    if (*(src++))
+      dst[i >> 3] |= 1 << (i & 7);
+    i++;
+  }
+}
 
-    /* Move the process to the different namespace. */
+/* When we bump into a new path, we call this to see if the path appears
+   more "favorable" than any of the existing ones. The purpose of the
+   "favorables" is to have a minimal set of paths that trigger all the bits
+   seen in the bitmap so far, and focus on fuzzing them at the expense of
+   the rest.
 
-    if (netns_name)
-      move_process_to_netns();
+   The first step of the process is to maintain a list of top_rated[] entries
+   for every byte in the bitmap. We win that slot if there is no previous
+   contender, or if the contender has smaller unique state count or
+   it has a more favorable speed x size factor. */
 
-    /* Isolate the process and configure standard descriptors. If out_file is
-       specified, stdin is /dev/null; otherwise, out_fd is cloned instead. */
+static void update_bitmap_score(struct queue_entry *q)
+{
 
-    setsid();
+  u32 i;
+  u64 fav_factor = q->exec_us * q->len;
 
-    dup2(dev_null_fd, 1);
-    dup2(dev_null_fd, 2);
+  /* For every byte set in trace_bits[], see if there is a previous winner,
+     and how it compares to us. */
 
-    if (out_file)
-    {
+  for (i = 0; i < MAP_SIZE; i++)
 
-      dup2(dev_null_fd, 0);
-    }
-    else
+    if (trace_bits[i])
     {
 
-      dup2(out_fd, 0);
-      close(out_fd);
-    }
-
-    /* Set up control and status pipes, close the unneeded original fds. */
+      if (top_rated[i])
+      {
 
-    if (dup2(ctl_pipe[0], FORKSRV_FD) < 0)
-      PFATAL("dup2() failed");
-    if (dup2(st_pipe[1], FORKSRV_FD + 1) < 0)
-      PFATAL("dup2() failed");
+        /* AFLNet check unique state count first */
 
-    close(ctl_pipe[0]);
-    close(ctl_pipe[1]);
-    close(st_pipe[0]);
-    close(st_pipe[1]);
+        if (q->unique_state_count < top_rated[i]->unique_state_count)
+          continue;
 
-    close(out_dir_fd);
-    close(dev_null_fd);
-    close(dev_urandom_fd);
-    close(fileno(plot_file));
+        /* Faster-executing or smaller test cases are favored. */
 
-    /* This should improve performance a bit, since it stops the linker from
-       doing extra work post-fork(). */
+        if ((q->unique_state_count < top_rated[i]->unique_state_count) && (fav_factor > top_rated[i]->exec_us * top_rated[i]->len))
+          continue;
 
-    if (!getenv("LD_BIND_LAZY"))
-      setenv("LD_BIND_NOW", "1", 0);
+        /* Looks like we're going to win. Decrease ref count for the
+           previous winner, discard its trace_bits[] if necessary. */
 
-    /* Set sane defaults for ASAN if nothing else specified. */
+        if (!--top_rated[i]->tc_ref)
+        {
+          ck_free(top_rated[i]->trace_mini);
+          top_rated[i]->trace_mini = 0;
+        }
+      }
 
-    setenv("ASAN_OPTIONS", "abort_on_error=1:"
-                           "detect_leaks=0:"
-                           "symbolize=0:"
-                           "allocator_may_return_null=1",
-           0);
+      /* Insert ourselves as the new winner. */
 
-    /* MSAN is tricky, because it doesn't support abort_on_error=1 at this
-       point. So, we do this in a very hacky way. */
+      top_rated[i] = q;
+      q->tc_ref++;
 
-    setenv("MSAN_OPTIONS", "exit_code=" STRINGIFY(MSAN_ERROR) ":"
-                                                              "symbolize=0:"
-                                                              "abort_on_error=1:"
-                                                              "allocator_may_return_null=1:"
-                                                              "msan_track_origins=0",
-           0);
+      if (!q->trace_mini)
+      {
+        q->trace_mini = ck_alloc(MAP_SIZE >> 3);
+        minimize_bits(q->trace_mini, trace_bits);
+      }
 
-    execv(target_path, argv);
+      score_changed = 1;
+    }
+}
 
-    /* Use a distinctive bitmap signature to tell the parent about execv()
-       falling through. */
-
-    *(u32 *)trace_bits = EXEC_FAIL_SIG;
-    exit(0);
-  }
-
-  /* Close the unneeded endpoints. */
-
-  close(ctl_pipe[0]);
-  close(st_pipe[1]);
-
-  fsrv_ctl_fd = ctl_pipe[1];
-  fsrv_st_fd = st_pipe[0];
+/* The second part of the mechanism discussed above is a routine that
+   goes over top_rated[] entries, and then sequentially grabs winners for
+   previously-unseen bytes (temp_v) and marks them as favored, at least
+   until the next run. The favored entries are given more air time during
+   all fuzzing steps. */
 
-  /* Wait for the fork server to come up, but don't wait too long. */
+static void cull_queue(void)
+{
 
-  it.it_value.tv_sec = ((exec_tmout * FORK_WAIT_MULT) / 1000);
-  it.it_value.tv_usec = ((exec_tmout * FORK_WAIT_MULT) % 1000) * 1000;
+  struct queue_entry *q;
+  static u8 temp_v[MAP_SIZE >> 3];
+  u32 i;
 
-  setitimer(ITIMER_REAL, &it, NULL);
+  if (dumb_mode || !score_changed)
+    return;
 
-  rlen = read(fsrv_st_fd, &status, 4);
+  score_changed = 0;
 
-  it.it_value.tv_sec = 0;
-  it.it_value.tv_usec = 0;
+  memset(temp_v, 255, MAP_SIZE >> 3);
 
-  setitimer(ITIMER_REAL, &it, NULL);
+  queued_favored = 0;
+  pending_favored = 0;
 
-  /* If we have a four-byte "hello" message from the server, we're all set.
-     Otherwise, try to figure out what went wrong. */
+  q = queue;
 
-  if (rlen == 4)
+  while (q)
   {
-    OKF("All right - fork server is up.");
-    return;
+    if (!q->is_initial_seed)
+      q->favored = 0;
+    q = q->next;
   }
 
-  if (child_timed_out)
-    FATAL("Timeout while initializing fork server (adjusting -t may help)");
-
-  if (waitpid(forksrv_pid, &status, 0) <= 0)
-    PFATAL("waitpid() failed");
-
-  if (WIFSIGNALED(status))
-  {
-
-    if (mem_limit && mem_limit < 500 && uses_asan)
-    {
+  /* Let's see if anything in the bitmap isn't captured in temp_v.
+     If yes, and if it has a top_rated[] contender, let's use it. */
 
-      SAYF("\n" cLRD "[-] " cRST
-           "Whoops, the target binary crashed suddenly, before receiving any input\n"
-           "    from the fuzzer! Since it seems to be built with ASAN and you have a\n"
-           "    restrictive memory limit configured, this is expected; please read\n"
-           "    %s/notes_for_asan.txt for help.\n",
-           doc_path);
-    }
-    else if (!mem_limit)
+  for (i = 0; i < MAP_SIZE; i++)
+    if (top_rated[i] && (temp_v[i >> 3] & (1 << (i & 7))))
     {
 
-      SAYF("\n" cLRD "[-] " cRST
-           "Whoops, the target binary crashed suddenly, before receiving any input\n"
-           "    from the fuzzer! There are several probable explanations:\n\n"
-
-           "    - The binary is just buggy and explodes entirely on its own. If so, you\n"
-           "      need to fix the underlying problem or find a better replacement.\n\n"
+      u32 j = MAP_SIZE >> 3;
 
-#ifdef __APPLE__
+      /* Remove all bits belonging to the current entry from temp_v. */
 
-           "    - On MacOS X, the semantics of fork() syscalls are non-standard and may\n"
-           "      break afl-fuzz performance optimizations when running platform-specific\n"
-           "      targets. To fix this, set AFL_NO_FORKSRV=1 in the environment.\n\n"
+      while (j--)
+        if (top_rated[i]->trace_mini[j])
+          temp_v[j] &= ~top_rated[i]->trace_mini[j];
 
-#endif /* __APPLE__ */
+      top_rated[i]->favored = 1;
+      queued_favored++;
 
-           "    - Less likely, there is a horrible bug in the fuzzer. If other options\n"
-           "      fail, poke <lcamtuf@coredump.cx> for troubleshooting tips.\n");
+      // if (!top_rated[i]->was_fuzzed) pending_favored++;
+      /* AFLNet takes into account more information to make this decision */
+      if ((top_rated[i]->generating_state_id == target_state_id || top_rated[i]->is_initial_seed) && (get_was_fuzzed(get_state_index(target_state_id), top_rated[i]->index) == WF_NOT_FUZZED))
+        pending_favored++;
     }
-    else
-    {
 
-      SAYF("\n" cLRD "[-] " cRST
-           "Whoops, the target binary crashed suddenly, before receiving any input\n"
-           "    from the fuzzer! There are several probable explanations:\n\n"
-
-           "    - The current memory limit (%s) is too restrictive, causing the\n"
-           "      target to hit an OOM condition in the dynamic linker. Try bumping up\n"
-           "      the limit with the -m setting in the command line. A simple way confirm\n"
-           "      this diagnosis would be:\n\n"
-
-#ifdef RLIMIT_AS
-           "      ( ulimit -Sv $[%llu << 10]; /path/to/fuzzed_app )\n\n"
-#else
-           "      ( ulimit -Sd $[%llu << 10]; /path/to/fuzzed_app )\n\n"
-#endif /* ^RLIMIT_AS */
-
-           "      Tip: you can use http://jwilk.net/software/recidivm to quickly\n"
-           "      estimate the required amount of virtual memory for the binary.\n\n"
-
-           "    - The binary is just buggy and explodes entirely on its own. If so, you\n"
-           "      need to fix the underlying problem or find a better replacement.\n\n"
+  q = queue;
 
-#ifdef __APPLE__
+  while (q)
+  {
+    mark_as_redundant(q, !q->favored);
+    q = q->next;
+  }
+}
 
-           "    - On MacOS X, the semantics of fork() syscalls are non-standard and may\n"
-           "      break afl-fuzz performance optimizations when running platform-specific\n"
-           "      targets. To fix this, set AFL_NO_FORKSRV=1 in the environment.\n\n"
+/* Configure shared memory and virgin_bits. This is called at startup. */
 
-#endif /* __APPLE__ */
+EXP_ST void setup_shm(void)
+{
 
-           "    - Less likely, there is a horrible bug in the fuzzer. If other options\n"
-           "      fail, poke <lcamtuf@coredump.cx> for troubleshooting tips.\n",
-           DMS(mem_limit << 20), mem_limit - 1);
-    }
+  u8 *shm_str;
 
-    FATAL("Fork server crashed with signal %d", WTERMSIG(status));
-  }
+  if (!in_bitmap)
+    memset(virgin_bits, 255, MAP_SIZE);
 
-  if (*(u32 *)trace_bits == EXEC_FAIL_SIG)
-    FATAL("Unable to execute target application ('%s')", argv[0]);
+  memset(virgin_tmout, 255, MAP_SIZE);
+  memset(virgin_crash, 255, MAP_SIZE);
 
-  if (mem_limit && mem_limit < 500 && uses_asan)
-  {
+  shm_id = shmget(IPC_PRIVATE, SHM_SIZE, IPC_CREAT | IPC_EXCL | 0600);
 
-    SAYF("\n" cLRD "[-] " cRST
-         "Hmm, looks like the target binary terminated before we could complete a\n"
-         "    handshake with the injected code. Since it seems to be built with ASAN and\n"
-         "    you have a restrictive memory limit configured, this is expected; please\n"
-         "    read %s/notes_for_asan.txt for help.\n",
-         doc_path);
-  }
-  else if (!mem_limit)
-  {
+  if (shm_id < 0)
+    PFATAL("shmget() failed");
 
-    SAYF("\n" cLRD "[-] " cRST
-         "Hmm, looks like the target binary terminated before we could complete a\n"
-         "    handshake with the injected code. Perhaps there is a horrible bug in the\n"
-         "    fuzzer. Poke <lcamtuf@coredump.cx> for troubleshooting tips.\n");
-  }
-  else
-  {
+  atexit(remove_shm);
 
-    SAYF("\n" cLRD "[-] " cRST
-         "Hmm, looks like the target binary terminated before we could complete a\n"
-         "    handshake with the injected code. There are %s probable explanations:\n\n"
+  shm_str = alloc_printf("%d", shm_id);
 
-         "%s"
-         "    - The current memory limit (%s) is too restrictive, causing an OOM\n"
-         "      fault in the dynamic linker. This can be fixed with the -m option. A\n"
-         "      simple way to confirm the diagnosis may be:\n\n"
+  /* If somebody is asking us to fuzz instrumented binaries in dumb mode,
+     we don't want them to detect instrumentation, since we won't be sending
+     fork server commands. This should be replaced with better auto-detection
+     later on, perhaps? */
 
-#ifdef RLIMIT_AS
-         "      ( ulimit -Sv $[%llu << 10]; /path/to/fuzzed_app )\n\n"
-#else
-         "      ( ulimit -Sd $[%llu << 10]; /path/to/fuzzed_app )\n\n"
-#endif /* ^RLIMIT_AS */
+  if (!dumb_mode)
+    setenv(SHM_ENV_VAR, shm_str, 1);
 
-         "      Tip: you can use http://jwilk.net/software/recidivm to quickly\n"
-         "      estimate the required amount of virtual memory for the binary.\n\n"
+  ck_free(shm_str);
 
-         "    - Less likely, there is a horrible bug in the fuzzer. If other options\n"
-         "      fail, poke <lcamtuf@coredump.cx> for troubleshooting tips.\n",
-         getenv(DEFER_ENV_VAR) ? "three" : "two",
-         getenv(DEFER_ENV_VAR) ? "    - You are using deferred forkserver, but __AFL_INIT() is never\n"
-                                 "      reached before the program terminates.\n\n"
-                               : "",
-         DMS(mem_limit << 20), mem_limit - 1);
-  }
+  trace_bits = shmat(shm_id, NULL, 0);
 
-  FATAL("Fork server handshake failed");
+  if (!trace_bits)
+    PFATAL("shmat() failed");
 }
 
-/* Execute target application, monitoring for timeouts. Return status
-   information. The called program will update trace_bits[]. */
+/* Load postprocessor, if available. */
 
-static u8 run_target(char **argv, u32 timeout)
+static void setup_post(void)
 {
 
-  static struct itimerval it;
-  static u32 prev_timed_out = 0;
-  static u64 exec_ms = 0;
+  void *dh;
+  u8 *fn = getenv("AFL_POST_LIBRARY");
+  u32 tlen = 6;
 
-  int status = 0;
-  u32 tb4;
+  if (!fn)
+    return;
 
-  child_timed_out = 0;
+  ACTF("Loading postprocessor from '%s'...", fn);
 
-  /* After this memset, trace_bits[] are effectively volatile, so we
-     must prevent any earlier operations from venturing into that
-     territory. */
+  dh = dlopen(fn, RTLD_NOW);
+  if (!dh)
+    FATAL("%s", dlerror());
 
-  memset(trace_bits, 0, MAP_SIZE);
-  MEM_BARRIER();
+  post_handler = dlsym(dh, "afl_postprocess");
+  if (!post_handler)
+    FATAL("Symbol 'afl_postprocess' not found.");
 
-  /* If we're running in "dumb" mode, we can't rely on the fork server
-     logic compiled into the target program, so we will just keep calling
-     execve(). There is a bit of code duplication between here and
-     init_forkserver(), but c'est la vie. */
+  /* Do a quick test. It's better to segfault now than later =) */
 
-  if (dumb_mode == 1 || no_forkserver)
-  {
+  post_handler("hello", &tlen);
 
-    child_pid = fork();
+  OKF("Postprocessor installed successfully.");
+}
 
-    if (child_pid < 0)
-      PFATAL("fork() failed");
+void get_seeds_with_messsage_types(const char *in_dir, khash_t(strSet) * message_types_set)
+{
+  struct dirent **nl_files;
+  int nl_cnt = scandir(in_dir, &nl_files, NULL, alphasort);
+  if (nl_cnt < 0)
+  {
+    printf("Error in reading the directory %s\n", in_dir);
+    exit(1);
+  }
 
-    if (!child_pid)
+  // traverse the directory to read the files
+  for (int i = 0; i < nl_cnt; i++)
+  {
+    char *nl_file_name = nl_files[i]->d_name;
+    // skip the . and .. files and files whose name includes "enriched"
+    if (strcmp(nl_file_name, ".") == 0 || strcmp(nl_file_name, "..") == 0 || strstr(nl_file_name, "enriched") != NULL)
     {
+      continue;
+    }
+    char *nl_file_path = malloc(strlen(in_dir) + strlen(nl_file_name) + 2);
+    strcpy(nl_file_path, in_dir);
+    strcat(nl_file_path, "/");
+    strcat(nl_file_path, nl_file_name);
+    // printf("## File path: %s\n", nl_file_path);
 
-      struct rlimit r;
-
-      if (mem_limit)
-      {
-
-        r.rlim_max = r.rlim_cur = ((rlim_t)mem_limit) << 20;
-
-#ifdef RLIMIT_AS
+    FILE *nl_file = fopen(nl_file_path, "r");
+    if (nl_file == NULL)
+    {
+      printf("Error in opening the file %s\n", nl_file_path);
+      exit(1);
+    }
 
-        setrlimit(RLIMIT_AS, &r); /* Ignore errors */
+    // read the whole file into a buffer
+    fseek(nl_file, 0, SEEK_END);
+    size_t fsize = ftell(nl_file);
+    fseek(nl_file, 0, SEEK_SET);
+    char *nl_file_content = malloc(fsize + 1);
+    fread(nl_file_content, fsize, 1, nl_file);
+    nl_file_content[fsize] = '\0';
+    // printf("## File content:\n %s\n", nl_file_content);
+    fclose(nl_file);
+    free(nl_file_path);
 
-#else
+    u32 region_count = 0;
+    region_t *regions = (*extract_requests)(nl_file_content, fsize, &region_count);
 
-        setrlimit(RLIMIT_DATA, &r); /* Ignore errors */
+    khash_t(strSet) *messages = duplicate_hash(message_types_set); // duplicate the message set
 
-#endif /* ^RLIMIT_AS */
+    for (int j = 0; j < region_count; j++)
+    { 
+      // remove all messages that are observed
+      int header_len = 0;
+      while (regions[j].start_byte + header_len < regions[j].end_byte 
+      && nl_file_content[regions[j].start_byte + header_len] != ' ' 
+      && nl_file_content[regions[j].start_byte + header_len] != '\r' 
+      && nl_file_content[regions[j].start_byte + header_len] != '\n'
+      && nl_file_content[regions[j].start_byte + header_len] != '\\')
+      {
+        header_len++;
       }
 
-      r.rlim_max = r.rlim_cur = 0;
-
-      setrlimit(RLIMIT_CORE, &r); /* Ignore errors */
-
-      /* Move the process to the different namespace. */
-
-      if (netns_name)
-        move_process_to_netns();
+      char *header = ck_alloc(header_len + 1);
+      memcpy(header, nl_file_content + regions[j].start_byte, header_len);
+      header[header_len] = '\0';
 
-      /* Isolate the process and configure standard descriptors. If out_file is
-         specified, stdin is /dev/null; otherwise, out_fd is cloned instead. */
+      khiter_t k = kh_get(strSet, messages, header);
+      if (kh_exist(messages, k))
+      {
+        kh_del(strSet, messages, k);
+      }
+      ck_free(header);
+    }
 
-      setsid();
+    ck_free(regions);
 
-      dup2(dev_null_fd, 1);
-      dup2(dev_null_fd, 2);
+    if(kh_size(messages) == 0) 
+    {
+      kh_destroy(strSet,messages);
+      // No missing message types, cannot enrich
+      WARNF("Message %s already has all message types. Skipping enrichment",nl_file_name);
+      continue;
+    }
 
-      if (out_file)
+    while(kh_size(messages) > MAX_ENRICHMENT_CORPUS_SIZE) 
+    {
+      khiter_t x =UR(kh_end(messages));
+      if (kh_exist(messages, x))
       {
-
-        dup2(dev_null_fd, 0);
+        kh_del(strSet, messages, x);
       }
-      else
-      {
+    }
 
-        dup2(out_fd, 0);
-        close(out_fd);
-      }
+    message_set_list message_subsets = message_combinations(messages,MAX_ENRICHMENT_MESSAGE_TYPES);
 
-      /* On Linux, would be faster to use O_CLOEXEC. Maybe TODO. */
+    for(int i = 0;i < kv_size(message_subsets);i++) {
 
-      close(dev_null_fd);
-      close(out_dir_fd);
-      close(dev_urandom_fd);
-      close(fileno(plot_file));
+      khash_t(strSet)* subset = kv_A(message_subsets,i); 
 
-      /* Set sane defaults for ASAN if nothing else specified. */
+      // Try enriching the sequence
+        char *client_request_answer = enrich_sequence(nl_file_content, subset);
 
-      setenv("ASAN_OPTIONS", "abort_on_error=1:"
-                             "detect_leaks=0:"
-                             "symbolize=0:"
-                             "allocator_may_return_null=1",
-             0);
+        if (client_request_answer == NULL)
+          continue;
 
-      setenv("MSAN_OPTIONS", "exit_code=" STRINGIFY(MSAN_ERROR) ":"
-                                                                "symbolize=0:"
-                                                                "msan_track_origins=0",
-             0);
+        // Check whether the client_request_answer is the same as the nl_file_content or if the client_request_answer is empty
+        char *formatted_nl_file_content = format_string(nl_file_content);
+        char *unescaped_client_requests = unescape_string(client_request_answer);
+        char *formatted_unescaped_client_requests = format_string(unescaped_client_requests);
+        // printf("## Formatted answer from LLM:\n %s\n", formatted_unescaped_client_requests);
+        // printf("## Formatted file content:\n %s\n", formatted_nl_file_content);
+        if (formatted_unescaped_client_requests == NULL || strcmp(formatted_unescaped_client_requests, formatted_nl_file_content) == 0)
+        {
+          printf("## Skip the same seed\n");
+          continue;
+        }
 
-      execv(target_path, argv);
+        unescaped_client_requests = format_request_message(unescaped_client_requests);
 
-      /* Use a distinctive bitmap value to tell the parent about execv()
-         falling through. */
+        // Create the file in the same directory with the name enriched_state_<file_name>
+        char *enriched_file_name = malloc(strlen(nl_file_name) + 10 + 20);
+        strcpy(enriched_file_name, "enriched_");
+        sprintf(enriched_file_name+9,"%d_",i);
+        strcat(enriched_file_name, nl_file_name);
+        char *enriched_file_path = malloc(strlen(in_dir) + strlen(enriched_file_name) + 2);
+        strcpy(enriched_file_path, in_dir);
+        strcat(enriched_file_path, "/");
+        strcat(enriched_file_path, enriched_file_name);
+        
+        // printf("## Enriched file path: %s\n", enriched_file_path);
 
-      *(u32 *)trace_bits = EXEC_FAIL_SIG;
-      exit(0);
+        write_new_seeds(enriched_file_path, unescaped_client_requests);
+
+        free(enriched_file_name);
+        free(enriched_file_path);
     }
-  }
-  else
-  {
 
-    s32 res;
+    for(int i = 0;i < kv_size(message_subsets);i++) {
+      khash_t(strSet)* subset = kv_A(message_subsets,i);
+      kh_destroy(strSet,subset);
+    } 
 
-    /* In non-dumb mode, we have the fork server up and running, so simply
-       tell it to have at it, and then read back PID. */
+    kh_destroy(strSet, messages);
+  }
+}
 
-    if ((res = write(fsrv_ctl_fd, &prev_timed_out, 4)) != 4)
-    {
+/* Enrich the testcases before startup */
+static void enrich_testcases(void)
+{
+  ACTF("Enriching test cases from LLM...");
 
-      if (stop_soon)
-        return 0;
-      RPFATAL(res, "Unable to request new process from fork server (OOM?)");
-    }
+  // char *message_prompt = construct_prompt_for_protocol_message_types(protocol_name);
 
-    if ((res = read(fsrv_st_fd, &child_pid, 4)) != 4)
-    {
+  // // Get protocol states
+  // get_protocol_message_types(message_prompt, message_type_set);
 
-      if (stop_soon)
-        return 0;
-      RPFATAL(res, "Unable to request new process from fork server (OOM?)");
-    }
+  // free(message_prompt);
 
-    if (child_pid <= 0)
-      FATAL("Fork server is misbehaving (OOM?)");
-  }
+  // Get seeds to states and save them to the in_dir
+  get_seeds_with_messsage_types(in_dir, message_types_set);
+}
 
-  /* Configure timeout, as requested by user, then wait for child to terminate. */
+/* Read all testcases from the input directory, then queue them for testing.
+   Called at startup. */
 
-  it.it_value.tv_sec = (timeout / 1000);
-  it.it_value.tv_usec = (timeout % 1000) * 1000;
+static void read_testcases(void)
+{
 
-  setitimer(ITIMER_REAL, &it, NULL);
+  struct dirent **nl;
+  s32 nl_cnt;
+  u32 i;
+  u8 *fn;
 
-  /* The SIGALRM handler simply kills the child_pid and sets child_timed_out. */
+  /* AFLNet: set this flag to enable request extractions while adding new seed to the queue */
+  corpus_read_or_sync = 1;
 
-  if (dumb_mode == 1 || no_forkserver)
-  {
-    if (use_net)
-      send_over_network();
-    if (waitpid(child_pid, &status, 0) <= 0)
-      PFATAL("waitpid() failed");
-  }
+  /* Auto-detect non-in-place resumption attempts. */
+
+  fn = alloc_printf("%s/queue", in_dir);
+  if (!access(fn, F_OK))
+    in_dir = fn;
   else
-  {
-    if (use_net)
-      send_over_network();
-    s32 res;
+    ck_free(fn);
 
-    if ((res = read(fsrv_st_fd, &status, 4)) != 4)
-    {
+  ACTF("Scanning '%s'...", in_dir);
 
-      if (stop_soon)
-        return 0;
-      RPFATAL(res, "Unable to communicate with fork server (OOM?)");
-    }
-  }
+  /* We use scandir() + alphasort() rather than readdir() because otherwise,
+     the ordering  of test cases would vary somewhat randomly and would be
+     difficult to control. */
 
-  if (!WIFSTOPPED(status))
-    child_pid = 0;
+  nl_cnt = scandir(in_dir, &nl, NULL, alphasort);
 
-  getitimer(ITIMER_REAL, &it);
-  exec_ms = (u64)timeout - (it.it_value.tv_sec * 1000 +
-                            it.it_value.tv_usec / 1000);
+  if (nl_cnt < 0)
+  {
 
-  it.it_value.tv_sec = 0;
-  it.it_value.tv_usec = 0;
+    if (errno == ENOENT || errno == ENOTDIR)
 
-  setitimer(ITIMER_REAL, &it, NULL);
+      SAYF("\n" cLRD "[-] " cRST
+           "The input directory does not seem to be valid - try again. The fuzzer needs\n"
+           "    one or more test case to start with - ideally, a small file under 1 kB\n"
+           "    or so. The cases must be stored as regular files directly in the input\n"
+           "    directory.\n");
 
-  total_execs++;
-// Usage: export CFLAGS="-D SHORT_BENCH" or export CFLGAS="-D LONG_BENCH"
-#ifdef LONG_BENCH
-  if (total_execs == 1000000)
-  {
-    OKF("AFLNet: Done!");
-    raise(SIGINT);
+    PFATAL("Unable to open '%s'", in_dir);
   }
-#elif SHORT_BENCH
-  if (total_execs == 10000)
+
+  if (shuffle_queue && nl_cnt > 1)
   {
-    OKF("AFLNet: Done!");
-    raise(SIGINT);
-  }
-#else
-#endif
 
-  /* Any subsequent operations on trace_bits must not be moved by the
-     compiler below this point. Past this location, trace_bits[] behave
-     very normally and do not have to be treated as volatile. */
+    ACTF("Shuffling queue...");
+    shuffle_ptrs((void **)nl, nl_cnt);
+  }
 
-  MEM_BARRIER();
+  for (i = 0; i < nl_cnt; i++)
+  {
 
-  tb4 = *(u32 *)trace_bits;
+    struct stat st;
 
-#ifdef WORD_SIZE_64
-  classify_counts((u64 *)trace_bits);
-#else
-  classify_counts((u32 *)trace_bits);
-#endif /* ^WORD_SIZE_64 */
+    u8 *fn = alloc_printf("%s/%s", in_dir, nl[i]->d_name);
+    u8 *dfn = alloc_printf("%s/.state/deterministic_done/%s", in_dir, nl[i]->d_name);
 
-  prev_timed_out = child_timed_out;
+    u8 passed_det = 0;
 
-  /* Report outcome to caller. */
+    free(nl[i]); /* not tracked */
 
-  if (WIFSIGNALED(status) && !stop_soon)
-  {
+    if (lstat(fn, &st) || access(fn, R_OK))
+      PFATAL("Unable to access '%s'", fn);
 
-    kill_signal = WTERMSIG(status);
+    /* This also takes care of . and .. */
 
-    if (child_timed_out && kill_signal == SIGKILL)
-      return FAULT_TMOUT;
+    if (!S_ISREG(st.st_mode) || !st.st_size || strstr(fn, "/README.txt"))
+    {
 
-    if (kill_signal == SIGTERM)
-      return FAULT_NONE;
+      ck_free(fn);
+      ck_free(dfn);
+      continue;
+    }
 
-    return FAULT_CRASH;
-  }
+    if (st.st_size > MAX_FILE)
+      FATAL("Test case '%s' is too big (%s, limit is %s)", fn,
+            DMS(st.st_size), DMS(MAX_FILE));
 
-  /* A somewhat nasty hack for MSAN, which doesn't support abort_on_error and
-     must use a special exit code. */
+    /* Check for metadata that indicates that deterministic fuzzing
+       is complete for this entry. We don't want to repeat deterministic
+       fuzzing when resuming aborted scans, because it would be pointless
+       and probably very time-consuming. */
 
-  if (uses_asan && WEXITSTATUS(status) == MSAN_ERROR)
-  {
-    kill_signal = 0;
-    return FAULT_CRASH;
+    if (!access(dfn, F_OK))
+      passed_det = 1;
+    ck_free(dfn);
+
+    add_to_queue(fn, st.st_size, passed_det);
   }
 
-  if ((dumb_mode == 1 || no_forkserver) && tb4 == EXEC_FAIL_SIG)
-    return FAULT_ERROR;
+  /* AFLNet: unset this flag to disable request extractions while adding new seed to the queue */
+  corpus_read_or_sync = 0;
 
-  /* It makes sense to account for the slowest units only if the testcase was run
-  under the user defined timeout. */
-  if (!(timeout > exec_tmout) && (slowest_exec_ms < exec_ms))
+  free(nl); /* not tracked */
+
+  if (!queued_paths)
   {
-    slowest_exec_ms = exec_ms;
+
+    SAYF("\n" cLRD "[-] " cRST
+         "Looks like there are no valid test cases in the input directory! The fuzzer\n"
+         "    needs one or more test case to start with - ideally, a small file under\n"
+         "    1 kB or so. The cases must be stored as regular files directly in the\n"
+         "    input directory.\n");
+
+    FATAL("No usable test cases in '%s'", in_dir);
   }
 
-  return FAULT_NONE;
+  last_path_time = 0;
+  queued_at_start = queued_paths;
 }
 
-/* Write modified data to file for testing. If out_file is set, the old file
-   is unlinked and a new one is created. Otherwise, out_fd is rewound and
-   truncated. */
+/* Helper function for load_extras. */
 
-static void write_to_testcase(void *mem, u32 len)
+static int compare_extras_len(const void *p1, const void *p2)
 {
+  struct extra_data *e1 = (struct extra_data *)p1,
+                    *e2 = (struct extra_data *)p2;
 
-  // AFLNet sends data via network so it does not need this function
+  return e1->len - e2->len;
 }
 
-static void show_stats(void);
+static int compare_extras_use_d(const void *p1, const void *p2)
+{
+  struct extra_data *e1 = (struct extra_data *)p1,
+                    *e2 = (struct extra_data *)p2;
 
-/* Calibrate a new test case. This is done when processing the input directory
-   to warn about flaky or otherwise problematic test cases early on; and when
-   new paths are discovered to detect variable behavior and so on. */
+  return e2->hit_cnt - e1->hit_cnt;
+}
 
-static u8 calibrate_case(char **argv, struct queue_entry *q, u8 *use_mem,
-                         u32 handicap, u8 from_queue)
-{
+/* Read extras from a file, sort by size. */
 
-  static u8 first_trace[MAP_SIZE];
+static void load_extras_file(u8 *fname, u32 *min_len, u32 *max_len,
+                             u32 dict_level)
+{
 
-  u8 fault = 0, new_bits = 0, var_detected = 0,
-     first_run = (q->exec_cksum == 0);
+  FILE *f;
+  u8 buf[MAX_LINE];
+  u8 *lptr;
+  u32 cur_line = 0;
 
-  u64 start_us, stop_us;
+  f = fopen(fname, "r");
 
-  s32 old_sc = stage_cur, old_sm = stage_max;
-  u32 use_tmout = exec_tmout;
-  u8 *old_sn = stage_name;
+  if (!f)
+    PFATAL("Unable to open '%s'", fname);
 
-  /* Be a bit more generous about timeouts when resuming sessions, or when
-     trying to calibrate already-added finds. This helps avoid trouble due
-     to intermittent latency. */
+  while ((lptr = fgets(buf, MAX_LINE, f)))
+  {
 
-  if (!from_queue || resuming_fuzz)
-    use_tmout = MAX(exec_tmout + CAL_TMOUT_ADD,
-                    exec_tmout * CAL_TMOUT_PERC / 100);
+    u8 *rptr, *wptr;
+    u32 klen = 0;
 
-  q->cal_failed++;
+    cur_line++;
 
-  stage_name = "calibration";
-  stage_max = fast_cal ? 3 : CAL_CYCLES;
+    /* Trim on left and right. */
 
-  /* Make sure the forkserver is up before we do anything, and let's not
-     count its spin-up time toward binary calibration. */
+    while (isspace(*lptr))
+      lptr++;
 
-  if (dumb_mode != 1 && !no_forkserver && !forksrv_pid)
-    init_forkserver(argv);
+    rptr = lptr + strlen(lptr) - 1;
+    while (rptr >= lptr && isspace(*rptr))
+      rptr--;
+    rptr++;
+    *rptr = 0;
 
-  if (q->exec_cksum)
-    memcpy(first_trace, trace_bits, MAP_SIZE);
+    /* Skip empty lines and comments. */
 
-  start_us = get_cur_time_us();
+    if (!*lptr || *lptr == '#')
+      continue;
 
-  for (stage_cur = 0; stage_cur < stage_max; stage_cur++)
-  {
+    /* All other lines must end with '"', which we can consume. */
 
-    u32 cksum;
+    rptr--;
 
-    if (!first_run && !(stage_cur % stats_update_freq))
-      show_stats();
+    if (rptr < lptr || *rptr != '"')
+      FATAL("Malformed name=\"value\" pair in line %u.", cur_line);
 
-    write_to_testcase(use_mem, q->len);
+    *rptr = 0;
 
-    fault = run_target(argv, use_tmout);
+    /* Skip alphanumerics and dashes (label). */
 
-    /* stop_soon is set by the handler for Ctrl+C. When it's pressed,
-       we want to bail out quickly. */
+    while (isalnum(*lptr) || *lptr == '_')
+      lptr++;
 
-    if (stop_soon || fault != crash_mode)
-      goto abort_calibration;
+    /* If @number follows, parse that. */
 
-    if (!dumb_mode && !stage_cur && !count_bytes(trace_bits))
+    if (*lptr == '@')
     {
-      fault = FAULT_NOINST;
-      goto abort_calibration;
+
+      lptr++;
+      if (atoi(lptr) > dict_level)
+        continue;
+      while (isdigit(*lptr))
+        lptr++;
     }
 
-    cksum = hash32(trace_bits, MAP_SIZE, HASH_CONST);
+    /* Skip whitespace and = signs. */
 
-    if (q->exec_cksum != cksum)
-    {
+    while (isspace(*lptr) || *lptr == '=')
+      lptr++;
 
-      u8 hnb = has_new_bits(virgin_bits);
-      if (hnb > new_bits)
-        new_bits = hnb;
+    /* Consume opening '"'. */
 
-      if (q->exec_cksum)
-      {
+    if (*lptr != '"')
+      FATAL("Malformed name=\"keyword\" pair in line %u.", cur_line);
 
-        u32 i;
+    lptr++;
 
-        for (i = 0; i < MAP_SIZE; i++)
-        {
+    if (!*lptr)
+      FATAL("Empty keyword in line %u.", cur_line);
 
-          if (!var_bytes[i] && first_trace[i] != trace_bits[i])
-          {
+    /* Okay, let's allocate memory and copy data between "...", handling
+       \xNN escaping, \\, and \". */
 
-            var_bytes[i] = 1;
-            stage_max = CAL_CYCLES_LONG;
-          }
-        }
+    extras = ck_realloc_block(extras, (extras_cnt + 1) *
+                                          sizeof(struct extra_data));
 
-        var_detected = 1;
-      }
-      else
-      {
+    wptr = extras[extras_cnt].data = ck_alloc(rptr - lptr);
 
-        q->exec_cksum = cksum;
-        memcpy(first_trace, trace_bits, MAP_SIZE);
-      }
-    }
-  }
+    while (*lptr)
+    {
 
-  stop_us = get_cur_time_us();
+      char *hexdigits = "0123456789abcdef";
 
-  total_cal_us += stop_us - start_us;
-  total_cal_cycles += stage_max;
+      switch (*lptr)
+      {
 
-  /* OK, let's collect some stats about the performance of this test case.
-     This is used for fuzzing air time calculations in calculate_score(). */
+      case 1 ... 31:
+      case 128 ... 255:
+        FATAL("Non-printable characters in line %u.", cur_line);
 
-  q->exec_us = (stop_us - start_us) / stage_max;
-  q->bitmap_size = count_bytes(trace_bits);
-  q->handicap = handicap;
-  q->cal_failed = 0;
+      case '\\':
 
-  total_bitmap_size += q->bitmap_size;
-  total_bitmap_entries++;
+        lptr++;
 
-  update_bitmap_score(q);
+        if (*lptr == '\\' || *lptr == '"')
+        {
+          *(wptr++) = *(lptr++);
+          klen++;
+          break;
+        }
 
-  /* If this case didn't result in new output from the instrumentation, tell
-     parent. This is a non-critical problem, but something to warn the user
-     about. */
+        if (*lptr != 'x' || !isxdigit(lptr[1]) || !isxdigit(lptr[2]))
+          FATAL("Invalid escaping (not \\xNN) in line %u.", cur_line);
 
-  if (!dumb_mode && first_run && !fault && !new_bits)
-    fault = FAULT_NOBITS;
+        *(wptr++) =
+            ((strchr(hexdigits, tolower(lptr[1])) - hexdigits) << 4) |
+            (strchr(hexdigits, tolower(lptr[2])) - hexdigits);
 
-abort_calibration:
+        lptr += 3;
+        klen++;
 
-  if (new_bits == 2 && !q->has_new_cov)
-  {
-    q->has_new_cov = 1;
-    queued_with_cov++;
-  }
+        break;
 
-  /* Mark variable paths. */
+      default:
 
-  if (var_detected)
-  {
+        *(wptr++) = *(lptr++);
+        klen++;
+      }
+    }
 
-    var_byte_count = count_bytes(var_bytes);
+    extras[extras_cnt].len = klen;
 
-    if (!q->var_behavior)
-    {
-      mark_as_variable(q);
-      queued_variable++;
-    }
-  }
+    if (extras[extras_cnt].len > MAX_DICT_FILE)
+      FATAL("Keyword too big in line %u (%s, limit is %s)", cur_line,
+            DMS(klen), DMS(MAX_DICT_FILE));
 
-  stage_name = old_sn;
-  stage_cur = old_sc;
-  stage_max = old_sm;
+    if (*min_len > klen)
+      *min_len = klen;
+    if (*max_len < klen)
+      *max_len = klen;
 
-  if (!first_run)
-    show_stats();
+    extras_cnt++;
+  }
 
-  return fault;
+  fclose(f);
 }
 
-/* Examine map coverage. Called once, for first test case. */
+/* Read extras from the extras directory and sort them by size. */
 
-static void check_map_coverage(void)
+static void load_extras(u8 *dir)
 {
 
-  u32 i;
-
-  if (count_bytes(trace_bits) < 100)
-    return;
+  DIR *d;
+  struct dirent *de;
+  u32 min_len = MAX_DICT_FILE, max_len = 0, dict_level = 0;
+  u8 *x;
 
-  for (i = (1 << (MAP_SIZE_POW2 - 1)); i < MAP_SIZE; i++)
-    if (trace_bits[i])
-      return;
+  /* If the name ends with @, extract level and continue. */
 
-  WARNF("Recompile binary with newer version of afl to improve coverage!");
-}
+  if ((x = strchr(dir, '@')))
+  {
 
-/* Perform dry run of all test cases to confirm that the app is working as
-   expected. This is done only for the initial inputs, and only once. */
+    *x = 0;
+    dict_level = atoi(x + 1);
+  }
 
-static void perform_dry_run(char **argv)
-{
+  ACTF("Loading extra dictionary from '%s' (level %u)...", dir, dict_level);
 
-  struct queue_entry *q = queue;
-  u32 cal_failures = 0;
-  u8 *skip_crashes = getenv("AFL_SKIP_CRASHES");
+  d = opendir(dir);
 
-  while (q)
+  if (!d)
   {
 
-    u8 *use_mem;
-    u8 res;
-    s32 fd;
+    if (errno == ENOTDIR)
+    {
+      load_extras_file(dir, &min_len, &max_len, dict_level);
+      goto check_and_sort;
+    }
 
-    q->is_initial_seed = 1;
+    PFATAL("Unable to open '%s'", dir);
+  }
 
-    u8 *fn = strrchr(q->fname, '/') + 1;
+  if (x)
+    FATAL("Dictionary levels not supported for directories.");
 
-    ACTF("Attempting dry run with '%s'...", fn);
+  while ((de = readdir(d)))
+  {
 
-    fd = open(q->fname, O_RDONLY);
-    if (fd < 0)
-      PFATAL("Unable to open '%s'", q->fname);
+    struct stat st;
+    u8 *fn = alloc_printf("%s/%s", dir, de->d_name);
+    s32 fd;
 
-    use_mem = ck_alloc_nozero(q->len);
+    if (lstat(fn, &st) || access(fn, R_OK))
+      PFATAL("Unable to access '%s'", fn);
 
-    if (read(fd, use_mem, q->len) != q->len)
-      FATAL("Short read from '%s'", q->fname);
+    /* This also takes care of . and .. */
+    if (!S_ISREG(st.st_mode) || !st.st_size)
+    {
 
-    close(fd);
+      ck_free(fn);
+      continue;
+    }
 
-    /* AFLNet construct the kl_messages linked list for this queue entry*/
-    kl_messages = construct_kl_messages(q->fname, q->regions, q->region_count);
+    if (st.st_size > MAX_DICT_FILE)
+      FATAL("Extra '%s' is too big (%s, limit is %s)", fn,
+            DMS(st.st_size), DMS(MAX_DICT_FILE));
 
-    res = calibrate_case(argv, q, use_mem, 0, 1);
-    ck_free(use_mem);
+    if (min_len > st.st_size)
+      min_len = st.st_size;
+    if (max_len < st.st_size)
+      max_len = st.st_size;
 
-    /* Update state-aware variables (e.g., state machine, regions and their annotations */
-    if (state_aware_mode)
-      update_state_aware_variables(q, 1);
+    extras = ck_realloc_block(extras, (extras_cnt + 1) *
+                                          sizeof(struct extra_data));
 
-    /* save the seed to file for replaying */
-    u8 *fn_replay = alloc_printf("%s/replayable-queue/%s", out_dir, basename(q->fname));
-    save_kl_messages_to_file(kl_messages, fn_replay, 1, messages_sent);
-    ck_free(fn_replay);
+    extras[extras_cnt].data = ck_alloc(st.st_size);
+    extras[extras_cnt].len = st.st_size;
 
-    /* AFLNet delete the kl_messages */
-    delete_kl_messages(kl_messages);
+    fd = open(fn, O_RDONLY);
 
-    if (stop_soon)
-      return;
+    if (fd < 0)
+      PFATAL("Unable to open '%s'", fn);
 
-    if (res == crash_mode || res == FAULT_NOBITS)
-      SAYF(cGRA "    len = %u, map size = %u, exec speed = %llu us\n" cRST,
-           q->len, q->bitmap_size, q->exec_us);
+    ck_read(fd, extras[extras_cnt].data, st.st_size, fn);
 
-    switch (res)
-    {
+    close(fd);
+    ck_free(fn);
 
-    case FAULT_NONE:
+    extras_cnt++;
+  }
 
-      if (q == queue)
-        check_map_coverage();
+  closedir(d);
 
-      if (crash_mode)
-        FATAL("Test case '%s' does *NOT* crash", fn);
+check_and_sort:
 
-      break;
+  if (!extras_cnt)
+    FATAL("No usable files in '%s'", dir);
 
-    case FAULT_TMOUT:
+  qsort(extras, extras_cnt, sizeof(struct extra_data), compare_extras_len);
 
-      if (timeout_given)
-      {
+  OKF("Loaded %u extra tokens, size range %s to %s.", extras_cnt,
+      DMS(min_len), DMS(max_len));
 
-        /* The -t nn+ syntax in the command line sets timeout_given to '2' and
-           instructs afl-fuzz to tolerate but skip queue entries that time
-           out. */
+  if (max_len > 32)
+    WARNF("Some tokens are relatively large (%s) - consider trimming.",
+          DMS(max_len));
 
-        if (timeout_given > 1)
-        {
-          WARNF("Test case results in a timeout (skipping)");
-          q->cal_failed = CAL_CHANCES;
-          cal_failures++;
-          break;
-        }
+  if (extras_cnt > MAX_DET_EXTRAS)
+    WARNF("More than %u tokens - will use them probabilistically.",
+          MAX_DET_EXTRAS);
+}
 
-        SAYF("\n" cLRD "[-] " cRST
-             "The program took more than %u ms to process one of the initial test cases.\n"
-             "    Usually, the right thing to do is to relax the -t option - or to delete it\n"
-             "    altogether and allow the fuzzer to auto-calibrate. That said, if you know\n"
-             "    what you are doing and want to simply skip the unruly test cases, append\n"
-             "    '+' at the end of the value passed to -t ('-t %u+').\n",
-             exec_tmout,
-             exec_tmout);
+/* Helper function for maybe_add_auto() */
 
-        FATAL("Test case '%s' results in a timeout", fn);
-      }
-      else
-      {
+static inline u8 memcmp_nocase(u8 *m1, u8 *m2, u32 len)
+{
 
-        SAYF("\n" cLRD "[-] " cRST
-             "The program took more than %u ms to process one of the initial test cases.\n"
-             "    This is bad news; raising the limit with the -t option is possible, but\n"
-             "    will probably make the fuzzing process extremely slow.\n\n"
+  while (len--)
+    if (tolower(*(m1++)) ^ tolower(*(m2++)))
+      return 1;
+  return 0;
+}
 
-             "    If this test case is just a fluke, the other option is to just avoid it\n"
-             "    altogether, and find one that is less of a CPU hog.\n",
-             exec_tmout);
+/* Maybe add automatic extra. */
 
-        FATAL("Test case '%s' results in a timeout", fn);
-      }
+static void maybe_add_auto(u8 *mem, u32 len)
+{
 
-    case FAULT_CRASH:
+  u32 i;
 
-      if (crash_mode)
-        break;
+  /* Allow users to specify that they don't want auto dictionaries. */
 
-      if (skip_crashes)
-      {
-        WARNF("Test case results in a crash (skipping)");
-        q->cal_failed = CAL_CHANCES;
-        cal_failures++;
-        break;
-      }
+  if (!MAX_AUTO_EXTRAS || !USE_AUTO_EXTRAS)
+    return;
 
-      if (mem_limit)
-      {
+  /* Skip runs of identical bytes. */
 
-        SAYF("\n" cLRD "[-] " cRST
-             "Oops, the program crashed with one of the test cases provided. There are\n"
-             "    several possible explanations:\n\n"
+  for (i = 1; i < len; i++)
+    if (mem[0] ^ mem[i])
+      break;
 
-             "    - The test case causes known crashes under normal working conditions. If\n"
-             "      so, please remove it. The fuzzer should be seeded with interesting\n"
-             "      inputs - but not ones that cause an outright crash.\n\n"
+  if (i == len)
+    return;
 
-             "    - The current memory limit (%s) is too low for this program, causing\n"
-             "      it to die due to OOM when parsing valid files. To fix this, try\n"
-             "      bumping it up with the -m setting in the command line. If in doubt,\n"
-             "      try something along the lines of:\n\n"
+  /* Reject builtin interesting values. */
 
-#ifdef RLIMIT_AS
-             "      ( ulimit -Sv $[%llu << 10]; /path/to/binary [...] <testcase )\n\n"
-#else
-             "      ( ulimit -Sd $[%llu << 10]; /path/to/binary [...] <testcase )\n\n"
-#endif /* ^RLIMIT_AS */
+  if (len == 2)
+  {
 
-             "      Tip: you can use http://jwilk.net/software/recidivm to quickly\n"
-             "      estimate the required amount of virtual memory for the binary. Also,\n"
-             "      if you are using ASAN, see %s/notes_for_asan.txt.\n\n"
+    i = sizeof(interesting_16) >> 1;
 
-#ifdef __APPLE__
+    while (i--)
+      if (*((u16 *)mem) == interesting_16[i] ||
+          *((u16 *)mem) == SWAP16(interesting_16[i]))
+        return;
+  }
 
-             "    - On MacOS X, the semantics of fork() syscalls are non-standard and may\n"
-             "      break afl-fuzz performance optimizations when running platform-specific\n"
-             "      binaries. To fix this, set AFL_NO_FORKSRV=1 in the environment.\n\n"
+  if (len == 4)
+  {
 
-#endif /* __APPLE__ */
+    i = sizeof(interesting_32) >> 2;
 
-             "    - Least likely, there is a horrible bug in the fuzzer. If other options\n"
-             "      fail, poke <lcamtuf@coredump.cx> for troubleshooting tips.\n",
-             DMS(mem_limit << 20), mem_limit - 1, doc_path);
-      }
-      else
-      {
+    while (i--)
+      if (*((u32 *)mem) == interesting_32[i] ||
+          *((u32 *)mem) == SWAP32(interesting_32[i]))
+        return;
+  }
 
-        SAYF("\n" cLRD "[-] " cRST
-             "Oops, the program crashed with one of the test cases provided. There are\n"
-             "    several possible explanations:\n\n"
+  /* Reject anything that matches existing extras. Do a case-insensitive
+     match. We optimize by exploiting the fact that extras[] are sorted
+     by size. */
 
-             "    - The test case causes known crashes under normal working conditions. If\n"
-             "      so, please remove it. The fuzzer should be seeded with interesting\n"
-             "      inputs - but not ones that cause an outright crash.\n\n"
+  for (i = 0; i < extras_cnt; i++)
+    if (extras[i].len >= len)
+      break;
 
-#ifdef __APPLE__
+  for (; i < extras_cnt && extras[i].len == len; i++)
+    if (!memcmp_nocase(extras[i].data, mem, len))
+      return;
 
-             "    - On MacOS X, the semantics of fork() syscalls are non-standard and may\n"
-             "      break afl-fuzz performance optimizations when running platform-specific\n"
-             "      binaries. To fix this, set AFL_NO_FORKSRV=1 in the environment.\n\n"
+  /* Last but not least, check a_extras[] for matches. There are no
+     guarantees of a particular sort order. */
 
-#endif /* __APPLE__ */
+  auto_changed = 1;
 
-             "    - Least likely, there is a horrible bug in the fuzzer. If other options\n"
-             "      fail, poke <lcamtuf@coredump.cx> for troubleshooting tips.\n");
-      }
+  for (i = 0; i < a_extras_cnt; i++)
+  {
 
-      FATAL("Test case '%s' results in a crash", fn);
+    if (a_extras[i].len == len && !memcmp_nocase(a_extras[i].data, mem, len))
+    {
 
-    case FAULT_ERROR:
+      a_extras[i].hit_cnt++;
+      goto sort_a_extras;
+    }
+  }
 
-      FATAL("Unable to execute target application ('%s')", argv[0]);
+  /* At this point, looks like we're dealing with a new entry. So, let's
+     append it if we have room. Otherwise, let's randomly evict some other
+     entry from the bottom half of the list. */
 
-    case FAULT_NOINST:
+  if (a_extras_cnt < MAX_AUTO_EXTRAS)
+  {
 
-      FATAL("No instrumentation detected");
+    a_extras = ck_realloc_block(a_extras, (a_extras_cnt + 1) *
+                                              sizeof(struct extra_data));
 
-    case FAULT_NOBITS:
+    a_extras[a_extras_cnt].data = ck_memdup(mem, len);
+    a_extras[a_extras_cnt].len = len;
+    a_extras_cnt++;
+  }
+  else
+  {
 
-      useless_at_start++;
+    i = MAX_AUTO_EXTRAS / 2 +
+        UR((MAX_AUTO_EXTRAS + 1) / 2);
 
-      if (!in_bitmap && !shuffle_queue)
-        WARNF("No new instrumentation output, test case may be useless.");
+    ck_free(a_extras[i].data);
+
+    a_extras[i].data = ck_memdup(mem, len);
+    a_extras[i].len = len;
+    a_extras[i].hit_cnt = 0;
+  }
+
+sort_a_extras:
+
+  /* First, sort all auto extras by use count, descending order. */
+
+  qsort(a_extras, a_extras_cnt, sizeof(struct extra_data),
+        compare_extras_use_d);
+
+  /* Then, sort the top USE_AUTO_EXTRAS entries by size. */
+
+  qsort(a_extras, MIN(USE_AUTO_EXTRAS, a_extras_cnt),
+        sizeof(struct extra_data), compare_extras_len);
+}
+
+/* Save automatically generated extras. */
+
+static void save_auto(void)
+{
+
+  u32 i;
+
+  if (!auto_changed)
+    return;
+  auto_changed = 0;
+
+  for (i = 0; i < MIN(USE_AUTO_EXTRAS, a_extras_cnt); i++)
+  {
+
+    u8 *fn = alloc_printf("%s/queue/.state/auto_extras/auto_%06u", out_dir, i);
+    s32 fd;
+
+    fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+    if (fd < 0)
+      PFATAL("Unable to create '%s'", fn);
+
+    ck_write(fd, a_extras[i].data, a_extras[i].len, fn);
+
+    close(fd);
+    ck_free(fn);
+  }
+}
+
+/* Load automatically generated extras. */
+
+static void load_auto(void)
+{
+
+  u32 i;
+
+  for (i = 0; i < USE_AUTO_EXTRAS; i++)
+  {
+
+    u8 tmp[MAX_AUTO_EXTRA + 1];
+    u8 *fn = alloc_printf("%s/.state/auto_extras/auto_%06u", in_dir, i);
+    s32 fd, len;
 
+    fd = open(fn, O_RDONLY, 0600);
+
+    if (fd < 0)
+    {
+
+      if (errno != ENOENT)
+        PFATAL("Unable to open '%s'", fn);
+      ck_free(fn);
       break;
     }
 
-    if (q->var_behavior)
-      WARNF("Instrumentation output varies across runs.");
+    /* We read one byte more to cheaply detect tokens that are too
+       long (and skip them). */
+
+    len = read(fd, tmp, MAX_AUTO_EXTRA + 1);
+
+    if (len < 0)
+      PFATAL("Unable to read from '%s'", fn);
+
+    if (len >= MIN_AUTO_EXTRA && len <= MAX_AUTO_EXTRA)
+      maybe_add_auto(tmp, len);
+
+    close(fd);
+    ck_free(fn);
+  }
+
+  if (i)
+    OKF("Loaded %u auto-discovered dictionary tokens.", i);
+  else
+    OKF("No auto-generated dictionary tokens to reuse.");
+}
+
+/* Destroy extras. */
+
+static void destroy_extras(void)
+{
+
+  u32 i;
+
+  for (i = 0; i < extras_cnt; i++)
+    ck_free(extras[i].data);
+
+  ck_free(extras);
+
+  for (i = 0; i < a_extras_cnt; i++)
+    ck_free(a_extras[i].data);
+
+  ck_free(a_extras);
+}
+
+/* Create a private network namespace for this process (-G) and bring up its loopback
+   interface, without moving into it: only the server and our end of the connection go
+   there, the rest of afl-fuzz (e.g., the LLM requests) keeps the network it started with.
+   Each worker (-J) calls this again, so every server can have net_port to itself */
+
+static void create_private_netns(void)
+{
+  struct ifreq ifr;
+  s32 fd;
+
+  if (host_netns_fd < 0)
+  {
+    host_netns_fd = open("/proc/self/ns/net", O_RDONLY | O_CLOEXEC);
+    if (host_netns_fd < 0)
+      PFATAL("Unable to open /proc/self/ns/net");
+  }
+
+  if (unshare(CLONE_NEWNET))
+    PFATAL("Unable to create a network namespace (-G)");
+
+  fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    PFATAL("socket() failed");
+
+  memset(&ifr, 0, sizeof(ifr));
+  strcpy(ifr.ifr_name, "lo");
+
+  if (ioctl(fd, SIOCGIFFLAGS, &ifr))
+    PFATAL("Unable to get the flags of the loopback interface");
+
+  ifr.ifr_flags |= IFF_UP | IFF_RUNNING;
+
+  if (ioctl(fd, SIOCSIFFLAGS, &ifr))
+    PFATAL("Unable to bring up the loopback interface");
+
+  close(fd);
+
+  if (netns_fd >= 0)
+    close(netns_fd);
+
+  netns_fd = open("/proc/self/ns/net", O_RDONLY | O_CLOEXEC);
+  if (netns_fd < 0)
+    PFATAL("Unable to open /proc/self/ns/net");
+
+  if (setns(host_netns_fd, CLONE_NEWNET))
+    PFATAL("setns failed");
+}
+
+/* Move process to the network namespace "netns_name", or to the private one (-G) */
+
+static void move_process_to_netns()
+{
+  if (netns_pool)
+  {
+    if (setns(netns_fd, CLONE_NEWNET) == -1)
+      PFATAL("setns failed");
+    return;
+  }
+
+  const char *netns_path_fmt = "/var/run/netns/%s";
+  char netns_path[272]; /* 15 for "/var/.." + 256 for netns name + 1 '\0' */
+  int netns_fd;
+
+  if (strlen(netns_name) > 256)
+    FATAL("Network namespace name \"%s\" is too long", netns_name);
+
+  sprintf(netns_path, netns_path_fmt, netns_name);
+
+  netns_fd = open(netns_path, O_RDONLY);
+  if (netns_fd == -1)
+    PFATAL("Unable to open %s", netns_path);
+
+  if (setns(netns_fd, CLONE_NEWNET) == -1)
+    PFATAL("setns failed");
+}
+
+/* Spin up fork server (instrumented mode only). The idea is explained here:
+
+   http://lcamtuf.blogspot.com/2014/10/fuzzing-binaries-without-execve.html
+
+   In essence, the instrumentation allows us to skip execve(), and just keep
+   cloning a stopped child. So, we just execute once, and then send commands
+   through a pipe. The other part of this logic is in afl-as.h. */
+
+EXP_ST void init_forkserver(char **argv)
+{
+
+  static struct itimerval it;
+  int st_pipe[2], ctl_pipe[2], ls_pipe[2] = {-1, -1};
+  int status;
+  s32 rlen;
+
+  ACTF("Spinning up the fork server...");
+
+  if (pipe(st_pipe) || pipe(ctl_pipe))
+    PFATAL("pipe() failed");
+
+  /* Both ends are non-blocking: a server that keeps reporting after we gave up
+     on the handshake must not stall on a full pipe. */
+
+  if (use_net && pipe2(ls_pipe, O_NONBLOCK))
+    PFATAL("pipe() failed");
+
+  forksrv_pid = fork();
+
+  if (forksrv_pid < 0)
+    PFATAL("fork() failed");
+
+  if (!forksrv_pid)
+  {
+
+    struct rlimit r;
+
+    /* Umpf. On OpenBSD, the default fd limit for root users is set to
+       soft 128. Let's try to fix that... */
+
+    if (!getrlimit(RLIMIT_NOFILE, &r) && r.rlim_cur < DESOCK_BELL_FD + 1)
+    {
+
+      r.rlim_cur = DESOCK_BELL_FD + 1;
+      setrlimit(RLIMIT_NOFILE, &r); /* Ignore errors */
+    }
+
+    if (mem_limit)
+    {
+
+      r.rlim_max = r.rlim_cur = ((rlim_t)mem_limit) << 20;
+
+#ifdef RLIMIT_AS
+
+      setrlimit(RLIMIT_AS, &r); /* Ignore errors */
+
+#else
+
+      /* This takes care of OpenBSD, which doesn't have RLIMIT_AS, but
+         according to reliable sources, RLIMIT_DATA covers anonymous
+         maps - so we should be getting good protection against OOM bugs. */
+
+      setrlimit(RLIMIT_DATA, &r); /* Ignore errors */
+
+#endif /* ^RLIMIT_AS */
+    }
+
+    /* Dumping cores is slow and can lead to anomalies if SIGKILL is delivered
+       before the dump is complete. */
+
+    r.rlim_max = r.rlim_cur = 0;
+
+    setrlimit(RLIMIT_CORE, &r); /* Ignore errors */
+
+    /* Move the process to the different namespace. */
+
+    if (netns_name || netns_pool)
+      move_process_to_netns();
+
+    /* Isolate the process and configure standard descriptors. If out_file is
+       specified, stdin is /dev/null; otherwise, out_fd is cloned instead. */
+
+    setsid();
+
+    dup2(dev_null_fd, 1);
+    dup2(dev_null_fd, 2);
+
+    if (out_file)
+    {
+
+      dup2(dev_null_fd, 0);
+    }
+    else
+    {
+
+      dup2(out_fd, 0);
+      close(out_fd);
+    }
+
+    /* Set up control and status pipes, close the unneeded original fds. */
+
+    if (dup2(ctl_pipe[0], FORKSRV_FD) < 0)
+      PFATAL("dup2() failed");
+    if (dup2(st_pipe[1], FORKSRV_FD + 1) < 0)
+      PFATAL("dup2() failed");
+    if (use_net && dup2(ls_pipe[1], LISTEN_FD) < 0)
+      PFATAL("dup2() failed");
+    if (use_desock)
+      dup_desock_fds();
+
+    close(ctl_pipe[0]);
+    close(ctl_pipe[1]);
+    close(st_pipe[0]);
+    close(st_pipe[1]);
+
+    if (use_net)
+    {
+      close(ls_pipe[0]);
+      close(ls_pipe[1]);
+    }
+
+    close(out_dir_fd);
+    close(dev_null_fd);
+    close(dev_urandom_fd);
+    close(fileno(plot_file));
+
+    /* This should improve performance a bit, since it stops the linker from
+       doing extra work post-fork(). */
+
+    if (!getenv("LD_BIND_LAZY"))
+      setenv("LD_BIND_NOW", "1", 0);
+
+    /* Set sane defaults for ASAN if nothing else specified. */
+
+    setenv("ASAN_OPTIONS", "abort_on_error=1:"
+                           "detect_leaks=0:"
+                           "symbolize=0:"
+                           "allocator_may_return_null=1",
+           0);
+
+    /* MSAN is tricky, because it doesn't support abort_on_error=1 at this
+       point. So, we do this in a very hacky way. */
+
+    setenv("MSAN_OPTIONS", "exit_code=" STRINGIFY(MSAN_ERROR) ":"
+                                                              "symbolize=0:"
+                                                              "abort_on_error=1:"
+                                                              "allocator_may_return_null=1:"
+                                                              "msan_track_origins=0",
+           0);
+
+    execv(target_path, argv);
+
+    /* Use a distinctive bitmap signature to tell the parent about execv()
+       falling through. */
+
+    *(u32 *)trace_bits = EXEC_FAIL_SIG;
+    exit(0);
+  }
+
+  /* Close the unneeded endpoints. */
+
+  close(ctl_pipe[0]);
+  close(st_pipe[1]);
+
+  fsrv_ctl_fd = ctl_pipe[1];
+  fsrv_st_fd = st_pipe[0];
+
+  if (use_net)
+  {
+    close(ls_pipe[1]);
+    listen_fd = ls_pipe[0];
+  }
+
+  /* Wait for the fork server to come up, but don't wait too long. */
+
+  it.it_value.tv_sec = ((exec_tmout * FORK_WAIT_MULT) / 1000);
+  it.it_value.tv_usec = ((exec_tmout * FORK_WAIT_MULT) % 1000) * 1000;
+
+  setitimer(ITIMER_REAL, &it, NULL);
+
+  rlen = read(fsrv_st_fd, &status, 4);
+
+  it.it_value.tv_sec = 0;
+  it.it_value.tv_usec = 0;
+
+  setitimer(ITIMER_REAL, &it, NULL);
+
+  /* If we have a four-byte "hello" message from the server, we're all set.
+     Otherwise, try to figure out what went wrong. */
+
+  if (rlen == 4)
+  {
+    OKF("All right - fork server is up.");
+
+    if (use_net && !use_desock && (status & FS_OPT_LISTEN_READY))
+    {
+      OKF("The runtime reports when the server is listening, -D is not needed.");
+      listen_ready = 1;
+    }
+
+    if (status & FS_OPT_DEFER_AUTO)
+    {
+      OKF(cPIN "Fork server deferred until the server waited for a connection.");
+      deferred_mode = 1;
+
+      if (status & FS_OPT_DEFER_THREADS)
+        WARNF("The server was running several threads by then; the forked servers only have one.");
+    }
+
+    return;
+  }
+
+  if (child_timed_out)
+    FATAL("Timeout while initializing fork server (adjusting -t may help)");
+
+  if (waitpid(forksrv_pid, &status, 0) <= 0)
+    PFATAL("waitpid() failed");
+
+  if (WIFSIGNALED(status))
+  {
+
+    if (mem_limit && mem_limit < 500 && uses_asan)
+    {
+
+      SAYF("\n" cLRD "[-] " cRST
+           "Whoops, the target binary crashed suddenly, before receiving any input\n"
+           "    from the fuzzer! Since it seems to be built with ASAN and you have a\n"
+           "    restrictive memory limit configured, this is expected; please read\n"
+           "    %s/notes_for_asan.txt for help.\n",
+           doc_path);
+    }
+    else if (!mem_limit)
+    {
+
+      SAYF("\n" cLRD "[-] " cRST
+           "Whoops, the target binary crashed suddenly, before receiving any input\n"
+           "    from the fuzzer! There are several probable explanations:\n\n"
+
+           "    - The binary is just buggy and explodes entirely on its own. If so, you\n"
+           "      need to fix the underlying problem or find a better replacement.\n\n"
+
+#ifdef __APPLE__
+
+           "    - On MacOS X, the semantics of fork() syscalls are non-standard and may\n"
+           "      break afl-fuzz performance optimizations when running platform-specific\n"
+           "      targets. To fix this, set AFL_NO_FORKSRV=1 in the environment.\n\n"
+
+#endif /* __APPLE__ */
+
+           "    - Less likely, there is a horrible bug in the fuzzer. If other options\n"
+           "      fail, poke <lcamtuf@coredump.cx> for troubleshooting tips.\n");
+    }
+    else
+    {
+
+      SAYF("\n" cLRD "[-] " cRST
+           "Whoops, the target binary crashed suddenly, before receiving any input\n"
+           "    from the fuzzer! There are several probable explanations:\n\n"
+
+           "    - The current memory limit (%s) is too restrictive, causing the\n"
+           "      target to hit an OOM condition in the dynamic linker. Try bumping up\n"
+           "      the limit with the -m setting in the command line. A simple way confirm\n"
+           "      this diagnosis would be:\n\n"
+
+#ifdef RLIMIT_AS
+           "      ( ulimit -Sv $[%llu << 10]; /path/to/fuzzed_app )\n\n"
+#else
+           "      ( ulimit -Sd $[%llu << 10]; /path/to/fuzzed_app )\n\n"
+#endif /* ^RLIMIT_AS */
+
+           "      Tip: you can use http://jwilk.net/software/recidivm to quickly\n"
+           "      estimate the required amount of virtual memory for the binary.\n\n"
+
+           "    - The binary is just buggy and explodes entirely on its own. If so, you\n"
+           "      need to fix the underlying problem or find a better replacement.\n\n"
+
+#ifdef __APPLE__
+
+           "    - On MacOS X, the semantics of fork() syscalls are non-standard and may\n"
+           "      break afl-fuzz performance optimizations when running platform-specific\n"
+           "      targets. To fix this, set AFL_NO_FORKSRV=1 in the environment.\n\n"
+
+#endif /* __APPLE__ */
+
+           "    - Less likely, there is a horrible bug in the fuzzer. If other options\n"
+           "      fail, poke <lcamtuf@coredump.cx> for troubleshooting tips.\n",
+           DMS(mem_limit << 20), mem_limit - 1);
+    }
+
+    FATAL("Fork server crashed with signal %d", WTERMSIG(status));
+  }
+
+  if (*(u32 *)trace_bits == EXEC_FAIL_SIG)
+    FATAL("Unable to execute target application ('%s')", argv[0]);
+
+  if (mem_limit && mem_limit < 500 && uses_asan)
+  {
+
+    SAYF("\n" cLRD "[-] " cRST
+         "Hmm, looks like the target binary terminated before we could complete a\n"
+         "    handshake with the injected code. Since it seems to be built with ASAN and\n"
+         "    you have a restrictive memory limit configured, this is expected; please\n"
+         "    read %s/notes_for_asan.txt for help.\n",
+         doc_path);
+  }
+  else if (!mem_limit)
+  {
+
+    SAYF("\n" cLRD "[-] " cRST
+         "Hmm, looks like the target binary terminated before we could complete a\n"
+         "    handshake with the injected code. Perhaps there is a horrible bug in the\n"
+         "    fuzzer. Poke <lcamtuf@coredump.cx> for troubleshooting tips.\n");
+  }
+  else
+  {
+
+    SAYF("\n" cLRD "[-] " cRST
+         "Hmm, looks like the target binary terminated before we could complete a\n"
+         "    handshake with the injected code. There are %s probable explanations:\n\n"
+
+         "%s"
+         "    - The current memory limit (%s) is too restrictive, causing an OOM\n"
+         "      fault in the dynamic linker. This can be fixed with the -m option. A\n"
+         "      simple way to confirm the diagnosis may be:\n\n"
+
+#ifdef RLIMIT_AS
+         "      ( ulimit -Sv $[%llu << 10]; /path/to/fuzzed_app )\n\n"
+#else
+         "      ( ulimit -Sd $[%llu << 10]; /path/to/fuzzed_app )\n\n"
+#endif /* ^RLIMIT_AS */
+
+         "      Tip: you can use http://jwilk.net/software/recidivm to quickly\n"
+         "      estimate the required amount of virtual memory for the binary.\n\n"
+
+         "    - Less likely, there is a horrible bug in the fuzzer. If other options\n"
+         "      fail, poke <lcamtuf@coredump.cx> for troubleshooting tips.\n",
+         getenv(DEFER_ENV_VAR) ? "three" : "two",
+         getenv(DEFER_ENV_VAR) ? "    - You are using deferred forkserver, but __AFL_INIT() is never\n"
+                                 "      reached before the program terminates.\n\n"
+                               : "",
+         DMS(mem_limit << 20), mem_limit - 1);
+  }
+
+  FATAL("Fork server handshake failed");
+}
+
+/* Execute target application, monitoring for timeouts. Return status
+   information. The called program will update trace_bits[]. */
+
+static u8 run_target(char **argv, u32 timeout)
+{
+
+  static u32 prev_timed_out = 0;
+  static u64 exec_ms = 0;
+
+  int status = 0;
+  u32 tb4;
+
+  child_timed_out = 0;
+  teardown_killed = 0;
+
+  /* Any other execution needs the fork server, which waits for the parked
+     server (-Z) as long as it is around. */
+
+  if (snap_root_pid > 0 && !snap_in_use)
+    snapshot_drop();
+
+  /* After this memset, trace_bits[] are effectively volatile, so we
+     must prevent any earlier operations from venturing into that
+     territory. A fork of the parked server starts with the coverage of M1
+     instead. */
+
+  if (snap_in_use)
+    memcpy(trace_bits, snap_trace_bits, MAP_SIZE);
+  else
+    memset(trace_bits, 0, MAP_SIZE);
+  MEM_BARRIER();
+
+  phase_begin();
+
+  /* Clean up what the previous server left behind before the next one starts.
+     Forks of the parked server keep the environment M1 left behind. */
+
+  if (use_net && !snap_in_use)
+    cleanup_server_env();
+
+  if (use_desock && !snap_in_use)
+    reset_desock();
+
+  if (use_net)
+    phase_mark(PHASE_CLEANUP);
+
+  /* If we're running in "dumb" mode, we can't rely on the fork server
+     logic compiled into the target program, so we will just keep calling
+     execve(). There is a bit of code duplication between here and
+     init_forkserver(), but c'est la vie. */
+
+  if (snap_in_use)
+  {
+
+    snapshot_fork();
+    snap_execs++;
+  }
+  else if (dumb_mode == 1 || no_forkserver)
+  {
+
+    int ls_pipe[2] = {-1, -1};
+
+    /* A fresh listen-ready pipe per execution: seeing EOF on it tells us the
+       child is gone without ever listening. */
+
+    if (use_net && listen_ready && pipe(ls_pipe))
+      PFATAL("pipe() failed");
+
+    child_pid = fork();
+
+    if (child_pid < 0)
+      PFATAL("fork() failed");
+
+    if (!child_pid)
+    {
+
+      struct rlimit r;
+
+      if (mem_limit)
+      {
+
+        r.rlim_max = r.rlim_cur = ((rlim_t)mem_limit) << 20;
+
+#ifdef RLIMIT_AS
+
+        setrlimit(RLIMIT_AS, &r); /* Ignore errors */
+
+#else
+
+        setrlimit(RLIMIT_DATA, &r); /* Ignore errors */
+
+#endif /* ^RLIMIT_AS */
+      }
+
+      r.rlim_max = r.rlim_cur = 0;
+
+      setrlimit(RLIMIT_CORE, &r); /* Ignore errors */
+
+      /* Move the process to the different namespace. */
+
+      if (netns_name || netns_pool)
+        move_process_to_netns();
+
+      /* Isolate the process and configure standard descriptors. If out_file is
+         specified, stdin is /dev/null; otherwise, out_fd is cloned instead. */
+
+      setsid();
+
+      dup2(dev_null_fd, 1);
+      dup2(dev_null_fd, 2);
+
+      if (out_file)
+      {
+
+        dup2(dev_null_fd, 0);
+      }
+      else
+      {
+
+        dup2(out_fd, 0);
+        close(out_fd);
+      }
+
+      if (ls_pipe[1] >= 0)
+      {
+        dup2(ls_pipe[1], LISTEN_FD);
+        close(ls_pipe[0]);
+        close(ls_pipe[1]);
+      }
+
+      if (use_desock)
+        dup_desock_fds();
+
+      /* On Linux, would be faster to use O_CLOEXEC. Maybe TODO. */
+
+      close(dev_null_fd);
+      close(out_dir_fd);
+      close(dev_urandom_fd);
+      close(fileno(plot_file));
+
+      /* Set sane defaults for ASAN if nothing else specified. */
+
+      setenv("ASAN_OPTIONS", "abort_on_error=1:"
+                             "detect_leaks=0:"
+                             "symbolize=0:"
+                             "allocator_may_return_null=1",
+             0);
+
+      setenv("MSAN_OPTIONS", "exit_code=" STRINGIFY(MSAN_ERROR) ":"
+                                                                "symbolize=0:"
+                                                                "msan_track_origins=0",
+             0);
+
+      execv(target_path, argv);
+
+      /* Use a distinctive bitmap value to tell the parent about execv()
+         falling through. */
+
+      *(u32 *)trace_bits = EXEC_FAIL_SIG;
+      exit(0);
+    }
+
+    if (ls_pipe[0] >= 0)
+    {
+      close(ls_pipe[1]);
+      fcntl(ls_pipe[0], F_SETFL, O_NONBLOCK);
+      listen_fd = ls_pipe[0];
+    }
+  }
+  else
+  {
+
+    s32 res;
+
+    /* A server that stopped itself after its last session is resumed by the
+       fork server instead of forked anew, up to persist_sessions (-p) times.
+       Past that, kill it; prev_timed_out makes the fork server write it off. */
+
+    if (server_stopped && persist_sessions && server_sessions >= persist_sessions)
+    {
+      kill(child_pid, SIGKILL);
+      prev_timed_out = 1;
+      server_stopped = 0;
+    }
+
+    /* With -L, a server still waiting for a connection simply gets the next one. */
+
+    server_reused = reuse_server();
+    reuse_fresh = 0;
+
+    if (server_reused)
+    {
+      server_sessions++;
+      server_resumes++;
+    }
+    else
+    {
+
+      /* In non-dumb mode, we have the fork server up and running, so simply
+         tell it to have at it, and then read back PID. */
+
+      if ((res = write(fsrv_ctl_fd, &prev_timed_out, 4)) != 4)
+      {
+
+        if (stop_soon)
+          return 0;
+        RPFATAL(res, "Unable to request new process from fork server (OOM?)");
+      }
+
+      if ((res = read(fsrv_st_fd, &child_pid, 4)) != 4)
+      {
+
+        if (stop_soon)
+          return 0;
+        RPFATAL(res, "Unable to request new process from fork server (OOM?)");
+      }
+
+      if (child_pid <= 0)
+        FATAL("Fork server is misbehaving (OOM?)");
+
+      if (server_stopped)
+      {
+        server_sessions++;
+        server_resumes++;
+      }
+      else
+        server_sessions = 1;
+    }
+  }
+
+  phase_mark(PHASE_FORK);
+
+  /* Configure timeout, as requested by user, then wait for child to terminate. */
+
+  arm_timer(exec_tmr_fd, timeout);
+
+  /* Every wait from here on also watches the timer. Once it fires, the server is killed and
+     child_timed_out is set (see check_exec_timeout()). */
+
+  if (snap_in_use)
+  {
+    send_over_network();
+    status = snapshot_wait();
+  }
+  else if (dumb_mode == 1 || no_forkserver)
+  {
+    if (use_net)
+      send_over_network();
+
+    // the server just parked after M1 (-Z) stays around
+    if (snap_root_pid <= 0)
+    {
+      s32 pidfd = -1;
+
+#ifdef SYS_pidfd_open
+      pidfd = syscall(SYS_pidfd_open, child_pid, 0);
+#endif /* SYS_pidfd_open */
+
+      wait_for_child_gone(pidfd, -1);
+
+      if (pidfd >= 0)
+        close(pidfd);
+
+      if (waitpid(child_pid, &status, 0) <= 0)
+        PFATAL("waitpid() failed");
+    }
+
+    if (listen_fd >= 0)
+    {
+      close(listen_fd);
+      listen_fd = -1;
+    }
+  }
+  else
+  {
+    if (use_net)
+      send_over_network();
+    s32 res;
+
+    // a server kept for the next session (-L) has no status to report
+    if (snap_root_pid <= 0 && !server_alive)
+      wait_for_child_gone(-1, -1);
+
+    if (snap_root_pid <= 0 && !server_alive && (res = read(fsrv_st_fd, &status, 4)) != 4)
+    {
+
+      if (stop_soon)
+        return 0;
+      RPFATAL(res, "Unable to communicate with fork server (OOM?)");
+    }
+  }
+
+  if (!WIFSTOPPED(status) && !server_alive)
+    child_pid = 0;
+
+  server_stopped = WIFSTOPPED(status);
+
+  phase_mark(PHASE_TEARDOWN);
+  phase_commit();
+
+  exec_ms = (u64)timeout - timer_left_us(exec_tmr_fd) / 1000;
+
+  arm_timer(exec_tmr_fd, 0);
+
+  total_execs++;
+// Usage: export CFLAGS="-D SHORT_BENCH" or export CFLGAS="-D LONG_BENCH"
+#ifdef LONG_BENCH
+  if (total_execs == 1000000)
+  {
+    OKF("AFLNet: Done!");
+    raise(SIGINT);
+  }
+#elif SHORT_BENCH
+  if (total_execs == 10000)
+  {
+    OKF("AFLNet: Done!");
+    raise(SIGINT);
+  }
+#else
+#endif
+
+  /* Any subsequent operations on trace_bits must not be moved by the
+     compiler below this point. Past this location, trace_bits[] behave
+     very normally and do not have to be treated as volatile. */
+
+  MEM_BARRIER();
+
+  tb4 = *(u32 *)trace_bits;
+
+#ifdef WORD_SIZE_64
+  classify_counts((u64 *)trace_bits);
+#else
+  classify_counts((u32 *)trace_bits);
+#endif /* ^WORD_SIZE_64 */
+
+  prev_timed_out = child_timed_out;
+
+  /* Report outcome to caller. */
+
+  if (WIFSIGNALED(status) && !stop_soon)
+  {
+
+    kill_signal = WTERMSIG(status);
+
+    if (child_timed_out && kill_signal == SIGKILL)
+      return FAULT_TMOUT;
+
+    if (kill_signal == SIGTERM || (kill_signal == SIGKILL && teardown_killed))
+      return FAULT_NONE;
+
+    return FAULT_CRASH;
+  }
+
+  /* A somewhat nasty hack for MSAN, which doesn't support abort_on_error and
+     must use a special exit code. */
+
+  if (uses_asan && WEXITSTATUS(status) == MSAN_ERROR)
+  {
+    kill_signal = 0;
+    return FAULT_CRASH;
+  }
+
+  if ((dumb_mode == 1 || no_forkserver) && tb4 == EXEC_FAIL_SIG)
+    return FAULT_ERROR;
+
+  /* It makes sense to account for the slowest units only if the testcase was run
+  under the user defined timeout. */
+  if (!(timeout > exec_tmout) && (slowest_exec_ms < exec_ms))
+  {
+    slowest_exec_ms = exec_ms;
+  }
+
+  return FAULT_NONE;
+}
+
+/* Write modified data to file for testing. If out_file is set, the old file
+   is unlinked and a new one is created. Otherwise, out_fd is rewound and
+   truncated. */
+
+static void write_to_testcase(void *mem, u32 len)
+{
+
+  // AFLNet sends data via network so it does not need this function
+}
+
+static void show_stats(void);
+static struct worker *dry_run_ahead(struct queue_entry *q);
+static s32 replay_cal_run(u32 n, u64 *us);
+static void release_cal_worker(void);
+
+/* Calibrate a new test case. This is done when processing the input directory
+   to warn about flaky or otherwise problematic test cases early on; and when
+   new paths are discovered to detect variable behavior and so on. */
+
+static u8 calibrate_case(char **argv, struct queue_entry *q, u8 *use_mem,
+                         u32 handicap, u8 from_queue)
+{
+
+  static u8 first_trace[MAP_SIZE];
+
+  u8 fault = 0, new_bits = 0, var_detected = 0,
+     first_run = (q->exec_cksum == 0);
+
+  /* New finds are calibrated adaptively (see CAL_CYCLES_MIN in config.h): each run is a
+     whole network session, so stop as soon as the trace and the state sequence look stable,
+     unless the test case reaches a state known to be flaky. */
+
+  u8 adaptive = !from_queue && use_net && !fast_cal, flaky = 0, seq_varied = 0;
+  u32 prev_cksum = 0, first_seq = 0, prev_seq = 0, stable = 0;
+
+  u64 start_us, stop_us, replay_us = 0;
+
+  s32 old_sc = stage_cur, old_sm = stage_max;
+  u32 use_tmout = exec_tmout;
+  u8 *old_sn = stage_name;
+
+  /* Be a bit more generous about timeouts when resuming sessions, or when
+     trying to calibrate already-added finds. This helps avoid trouble due
+     to intermittent latency. */
+
+  if (!from_queue || resuming_fuzz)
+    use_tmout = MAX(exec_tmout + CAL_TMOUT_ADD,
+                    exec_tmout * CAL_TMOUT_PERC / 100);
+
+  q->cal_failed++;
+
+  stage_name = "calibration";
+  stage_max = fast_cal ? 3 : CAL_CYCLES;
+
+  /* Make sure the forkserver is up before we do anything, and let's not
+     count its spin-up time toward binary calibration. */
+
+  if (dumb_mode != 1 && !no_forkserver && !forksrv_pid)
+    init_forkserver(argv);
+
+  /* With -L, the first run gets a new server, as when the test case is replayed; the
+     others reuse it, so that what depends on earlier sessions shows up as variable. */
+
+  reuse_fresh = 1;
+
+  if (q->exec_cksum)
+    memcpy(first_trace, trace_bits, MAP_SIZE);
+
+  start_us = get_cur_time_us();
+
+  for (stage_cur = 0; stage_cur < stage_max; stage_cur++)
+  {
+
+    u32 cksum;
+
+    if (!first_run && !(stage_cur % stats_update_freq))
+      show_stats();
+
+    write_to_testcase(use_mem, q->len);
+
+    // in the dry run, a worker (-J) may have run it already
+    s32 replayed = replay_cal_run(stage_cur, &replay_us);
+    fault = replayed >= 0 ? replayed : run_target(argv, use_tmout);
+
+    /* stop_soon is set by the handler for Ctrl+C. When it's pressed,
+       we want to bail out quickly. */
+
+    if (stop_soon || fault != crash_mode)
+      goto abort_calibration;
+
+    if (!dumb_mode && !stage_cur && !count_bytes(trace_bits))
+    {
+      fault = FAULT_NOINST;
+      goto abort_calibration;
+    }
+
+    cksum = hash32(trace_bits, MAP_SIZE, HASH_CONST);
+
+    if (q->exec_cksum != cksum)
+    {
+
+      u8 hnb = has_new_bits(virgin_bits);
+      if (hnb > new_bits)
+        new_bits = hnb;
+
+      if (q->exec_cksum)
+      {
+
+        u32 i;
+
+        for (i = 0; i < MAP_SIZE; i++)
+        {
+
+          if (!var_bytes[i] && first_trace[i] != trace_bits[i])
+          {
+
+            var_bytes[i] = 1;
+            stage_max = CAL_CYCLES_LONG;
+          }
+        }
+
+        var_detected = 1;
+      }
+      else
+      {
+
+        q->exec_cksum = cksum;
+        memcpy(first_trace, trace_bits, MAP_SIZE);
+      }
+    }
+
+    if (adaptive)
+    {
+      u32 seq = hash_state_sequence(&flaky);
+
+      if (!stage_cur)
+        first_seq = seq;
+      else if (seq != first_seq)
+        seq_varied = 1;
+
+      if (stage_cur && cksum == prev_cksum && seq == prev_seq)
+        stable++;
+      else
+        stable = 0;
+
+      prev_cksum = cksum;
+      prev_seq = seq;
+
+      if (!flaky && !var_detected && stage_cur + 1 >= CAL_CYCLES_MIN && stable >= CAL_STABLE_RUNS)
+      {
+        cal_runs_saved += stage_max - stage_cur - 1;
+        stage_max = stage_cur + 1;
+      }
+    }
+  }
+
+  if (adaptive)
+    update_state_calibration(var_detected || seq_varied);
+
+  stop_us = get_cur_time_us() + replay_us;
+
+  total_cal_us += stop_us - start_us;
+  total_cal_cycles += stage_max;
+
+  /* OK, let's collect some stats about the performance of this test case.
+     This is used for fuzzing air time calculations in calculate_score(). */
+
+  q->exec_us = (stop_us - start_us) / stage_max;
+  q->bitmap_size = count_bytes(trace_bits);
+  q->handicap = handicap;
+  q->cal_failed = 0;
+
+  total_bitmap_size += q->bitmap_size;
+  total_bitmap_entries++;
+
+  update_bitmap_score(q);
+
+  /* If this case didn't result in new output from the instrumentation, tell
+     parent. This is a non-critical problem, but something to warn the user
+     about. */
+
+  if (!dumb_mode && first_run && !fault && !new_bits)
+    fault = FAULT_NOBITS;
+
+abort_calibration:
+
+  if (new_bits == 2 && !q->has_new_cov)
+  {
+    q->has_new_cov = 1;
+    queued_with_cov++;
+  }
+
+  /* Mark variable paths. */
+
+  if (var_detected)
+  {
+
+    var_byte_count = count_bytes(var_bytes);
+
+    if (!q->var_behavior)
+    {
+      mark_as_variable(q);
+      queued_variable++;
+    }
+  }
+
+  stage_name = old_sn;
+  stage_cur = old_sc;
+  stage_max = old_sm;
+
+  if (!first_run)
+    show_stats();
+
+  return fault;
+}
+
+/* Examine map coverage. Called once, for first test case. */
+
+static void check_map_coverage(void)
+{
+
+  u32 i;
+
+  if (count_bytes(trace_bits) < 100)
+    return;
+
+  for (i = (1 << (MAP_SIZE_POW2 - 1)); i < MAP_SIZE; i++)
+    if (trace_bits[i])
+      return;
+
+  WARNF("Recompile binary with newer version of afl to improve coverage!");
+}
+
+/* Perform dry run of all test cases to confirm that the app is working as
+   expected. This is done only for the initial inputs, and only once. */
+
+static void perform_dry_run(char **argv)
+{
+
+  struct queue_entry *q = queue;
+  u32 cal_failures = 0;
+  u8 *skip_crashes = getenv("AFL_SKIP_CRASHES");
+
+  while (q)
+  {
+
+    u8 *use_mem;
+    u8 res;
+    s32 fd;
+
+    q->is_initial_seed = 1;
+
+    u8 *fn = strrchr(q->fname, '/') + 1;
+
+    ACTF("Attempting dry run with '%s'...", fn);
+
+    fd = open(q->fname, O_RDONLY);
+    if (fd < 0)
+      PFATAL("Unable to open '%s'", q->fname);
+
+    use_mem = ck_alloc_nozero(q->len);
+
+    if (read(fd, use_mem, q->len) != q->len)
+      FATAL("Short read from '%s'", q->fname);
+
+    close(fd);
+
+    /* AFLNet construct the kl_messages linked list for this queue entry*/
+    kl_messages = construct_kl_messages(q->fname, q->regions, q->region_count);
+
+    /* With workers (-J), the test cases ahead run on their servers meanwhile. The results
+       are taken in queue order all the same, so the outcome does not depend on which
+       finishes first. */
+
+    if (worker_count)
+      cal_worker = dry_run_ahead(q);
+
+    if (stop_soon)
+      return;
+
+    res = calibrate_case(argv, q, use_mem, 0, 1);
+    ck_free(use_mem);
+
+    release_cal_worker();
+
+    /* Update state-aware variables (e.g., state machine, regions and their annotations */
+    if (state_aware_mode)
+      update_state_aware_variables(q, 1);
+
+    /* save the seed to file for replaying */
+    u8 *fn_replay = alloc_printf("%s/replayable-queue/%s", out_dir, basename(q->fname));
+    save_kl_messages_to_file(kl_messages, fn_replay, 1, messages_sent);
+    ck_free(fn_replay);
+
+    /* AFLNet delete the kl_messages */
+    delete_kl_messages(kl_messages);
+
+    if (stop_soon)
+      return;
+
+    if (res == crash_mode || res == FAULT_NOBITS)
+      SAYF(cGRA "    len = %u, map size = %u, exec speed = %llu us\n" cRST,
+           q->len, q->bitmap_size, q->exec_us);
+
+    switch (res)
+    {
+
+    case FAULT_NONE:
+
+      if (q == queue)
+        check_map_coverage();
+
+      if (crash_mode)
+        FATAL("Test case '%s' does *NOT* crash", fn);
+
+      break;
+
+    case FAULT_TMOUT:
+
+      if (timeout_given)
+      {
+
+        /* The -t nn+ syntax in the command line sets timeout_given to '2' and
+           instructs afl-fuzz to tolerate but skip queue entries that time
+           out. */
+
+        if (timeout_given > 1)
+        {
+          WARNF("Test case results in a timeout (skipping)");
+          q->cal_failed = CAL_CHANCES;
+          cal_failures++;
+          break;
+        }
+
+        SAYF("\n" cLRD "[-] " cRST
+             "The program took more than %u ms to process one of the initial test cases.\n"
+             "    Usually, the right thing to do is to relax the -t option - or to delete it\n"
+             "    altogether and allow the fuzzer to auto-calibrate. That said, if you know\n"
+             "    what you are doing and want to simply skip the unruly test cases, append\n"
+             "    '+' at the end of the value passed to -t ('-t %u+').\n",
+             exec_tmout,
+             exec_tmout);
+
+        FATAL("Test case '%s' results in a timeout", fn);
+      }
+      else
+      {
+
+        SAYF("\n" cLRD "[-] " cRST
+             "The program took more than %u ms to process one of the initial test cases.\n"
+             "    This is bad news; raising the limit with the -t option is possible, but\n"
+             "    will probably make the fuzzing process extremely slow.\n\n"
+
+             "    If this test case is just a fluke, the other option is to just avoid it\n"
+             "    altogether, and find one that is less of a CPU hog.\n",
+             exec_tmout);
+
+        FATAL("Test case '%s' results in a timeout", fn);
+      }
+
+    case FAULT_CRASH:
+
+      if (crash_mode)
+        break;
+
+      if (skip_crashes)
+      {
+        WARNF("Test case results in a crash (skipping)");
+        q->cal_failed = CAL_CHANCES;
+        cal_failures++;
+        break;
+      }
+
+      if (mem_limit)
+      {
+
+        SAYF("\n" cLRD "[-] " cRST
+             "Oops, the program crashed with one of the test cases provided. There are\n"
+             "    several possible explanations:\n\n"
+
+             "    - The test case causes known crashes under normal working conditions. If\n"
+             "      so, please remove it. The fuzzer should be seeded with interesting\n"
+             "      inputs - but not ones that cause an outright crash.\n\n"
+
+             "    - The current memory limit (%s) is too low for this program, causing\n"
+             "      it to die due to OOM when parsing valid files. To fix this, try\n"
+             "      bumping it up with the -m setting in the command line. If in doubt,\n"
+             "      try something along the lines of:\n\n"
+
+#ifdef RLIMIT_AS
+             "      ( ulimit -Sv $[%llu << 10]; /path/to/binary [...] <testcase )\n\n"
+#else
+             "      ( ulimit -Sd $[%llu << 10]; /path/to/binary [...] <testcase )\n\n"
+#endif /* ^RLIMIT_AS */
+
+             "      Tip: you can use http://jwilk.net/software/recidivm to quickly\n"
+             "      estimate the required amount of virtual memory for the binary. Also,\n"
+             "      if you are using ASAN, see %s/notes_for_asan.txt.\n\n"
+
+#ifdef __APPLE__
+
+             "    - On MacOS X, the semantics of fork() syscalls are non-standard and may\n"
+             "      break afl-fuzz performance optimizations when running platform-specific\n"
+             "      binaries. To fix this, set AFL_NO_FORKSRV=1 in the environment.\n\n"
+
+#endif /* __APPLE__ */
+
+             "    - Least likely, there is a horrible bug in the fuzzer. If other options\n"
+             "      fail, poke <lcamtuf@coredump.cx> for troubleshooting tips.\n",
+             DMS(mem_limit << 20), mem_limit - 1, doc_path);
+      }
+      else
+      {
+
+        SAYF("\n" cLRD "[-] " cRST
+             "Oops, the program crashed with one of the test cases provided. There are\n"
+             "    several possible explanations:\n\n"
+
+             "    - The test case causes known crashes under normal working conditions. If\n"
+             "      so, please remove it. The fuzzer should be seeded with interesting\n"
+             "      inputs - but not ones that cause an outright crash.\n\n"
+
+#ifdef __APPLE__
+
+             "    - On MacOS X, the semantics of fork() syscalls are non-standard and may\n"
+             "      break afl-fuzz performance optimizations when running platform-specific\n"
+             "      binaries. To fix this, set AFL_NO_FORKSRV=1 in the environment.\n\n"
+
+#endif /* __APPLE__ */
+
+             "    - Least likely, there is a horrible bug in the fuzzer. If other options\n"
+             "      fail, poke <lcamtuf@coredump.cx> for troubleshooting tips.\n");
+      }
+
+      FATAL("Test case '%s' results in a crash", fn);
+
+    case FAULT_ERROR:
+
+      FATAL("Unable to execute target application ('%s')", argv[0]);
+
+    case FAULT_NOINST:
+
+      FATAL("No instrumentation detected");
+
+    case FAULT_NOBITS:
+
+      useless_at_start++;
+
+      if (!in_bitmap && !shuffle_queue)
+        WARNF("No new instrumentation output, test case may be useless.");
+
+      break;
+    }
+
+    if (q->var_behavior)
+      WARNF("Instrumentation output varies across runs.");
+
+    q = q->next;
+  }
+
+  if (cal_failures)
+  {
+
+    if (cal_failures == queued_paths)
+      FATAL("All test cases time out%s, giving up!",
+            skip_crashes ? " or crash" : "");
+
+    WARNF("Skipped %u test cases (%0.02f%%) due to timeouts%s.", cal_failures,
+          ((double)cal_failures) * 100 / queued_paths,
+          skip_crashes ? " or crashes" : "");
+
+    if (cal_failures * 5 > queued_paths)
+      WARNF(cLRD "High percentage of rejected test cases, check settings!");
+  }
+
+  OKF("All test cases processed.");
+}
+
+/* Helper function: link() if possible, copy otherwise. */
+
+static void link_or_copy(u8 *old_path, u8 *new_path)
+{
+
+  s32 i = link(old_path, new_path);
+  s32 sfd, dfd;
+  u8 *tmp;
+
+  if (!i)
+    return;
+
+  sfd = open(old_path, O_RDONLY);
+  if (sfd < 0)
+    PFATAL("Unable to open '%s'", old_path);
+
+  dfd = open(new_path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+  if (dfd < 0)
+    PFATAL("Unable to create '%s'", new_path);
+
+  tmp = ck_alloc(64 * 1024);
+
+  while ((i = read(sfd, tmp, 64 * 1024)) > 0)
+    ck_write(dfd, tmp, i, new_path);
+
+  if (i < 0)
+    PFATAL("read() failed");
+
+  ck_free(tmp);
+  close(sfd);
+  close(dfd);
+}
+
+static void nuke_resume_dir(void);
+
+/* Create hard links for input test cases in the output directory, choosing
+   good names and pivoting accordingly. */
+
+static void pivot_inputs(void)
+{
+
+  struct queue_entry *q = queue;
+  u32 id = 0;
+
+  ACTF("Creating hard links for all input files...");
+
+  while (q)
+  {
+
+    u8 *nfn, *rsl = strrchr(q->fname, '/');
+    u32 orig_id;
+
+    if (!rsl)
+      rsl = q->fname;
+    else
+      rsl++;
+
+      /* If the original file name conforms to the syntax and the recorded
+         ID matches the one we'd assign, just use the original file name.
+         This is valuable for resuming fuzzing runs. */
+
+#ifndef SIMPLE_FILES
+#define CASE_PREFIX "id:"
+#else
+#define CASE_PREFIX "id_"
+#endif /* ^!SIMPLE_FILES */
+
+    if (!strncmp(rsl, CASE_PREFIX, 3) &&
+        sscanf(rsl + 3, "%06u", &orig_id) == 1 && orig_id == id)
+    {
+
+      u8 *src_str;
+      u32 src_id;
+
+      resuming_fuzz = 1;
+      nfn = alloc_printf("%s/queue/%s", out_dir, rsl);
+
+      /* Since we're at it, let's also try to find parent and figure out the
+         appropriate depth for this entry. */
+
+      src_str = strchr(rsl + 3, ':');
+
+      if (src_str && sscanf(src_str + 1, "%06u", &src_id) == 1)
+      {
+
+        struct queue_entry *s = queue;
+        while (src_id-- && s)
+          s = s->next;
+        if (s)
+          q->depth = s->depth + 1;
+
+        if (max_depth < q->depth)
+          max_depth = q->depth;
+      }
+    }
+    else
+    {
+
+      /* No dice - invent a new name, capturing the original one as a
+         substring. */
+
+#ifndef SIMPLE_FILES
+
+      u8 *use_name = strstr(rsl, ",orig:");
+
+      if (use_name)
+        use_name += 6;
+      else
+        use_name = rsl;
+      nfn = alloc_printf("%s/queue/id:%06u,orig:%s", out_dir, id, use_name);
+
+#else
+
+      nfn = alloc_printf("%s/queue/id_%06u", out_dir, id);
+
+#endif /* ^!SIMPLE_FILES */
+    }
+
+    /* Pivot to the new queue entry. */
+
+    link_or_copy(q->fname, nfn);
+    ck_free(q->fname);
+    q->fname = nfn;
+
+    /* Make sure that the passed_det value carries over, too. */
+
+    if (q->passed_det)
+      mark_as_det_done(q);
+
+    q = q->next;
+    id++;
+  }
+
+  if (in_place_resume)
+    nuke_resume_dir();
+}
+
+#ifndef SIMPLE_FILES
+
+/* Construct a file name for a new test case, capturing the operation
+   that led to its discovery. Uses a static buffer. */
+
+static u8 *describe_op(u8 hnb)
+{
+
+  static u8 ret[256];
+
+  if (syncing_party)
+  {
+
+    sprintf(ret, "sync:%s,src:%06u", syncing_party, syncing_case);
+  }
+  else
+  {
+
+    sprintf(ret, "src:%06u", current_entry);
+
+    if (splicing_with >= 0)
+      sprintf(ret + strlen(ret), "+%06u", splicing_with);
+
+    sprintf(ret + strlen(ret), ",op:%s", stage_short);
+
+    if (stage_cur_byte >= 0)
+    {
+
+      sprintf(ret + strlen(ret), ",pos:%u", stage_cur_byte);
+
+      if (stage_val_type != STAGE_VAL_NONE)
+        sprintf(ret + strlen(ret), ",val:%s%+d",
+                (stage_val_type == STAGE_VAL_BE) ? "be:" : "",
+                stage_cur_val);
+    }
+    else
+      sprintf(ret + strlen(ret), ",rep:%u", stage_cur_val);
+  }
+
+  if (hnb == 2)
+    strcat(ret, ",+cov");
+
+  return ret;
+}
+
+#endif /* !SIMPLE_FILES */
+
+/* Write a message accompanying the crash directory :-) */
+
+static void write_crash_readme(void)
+{
+
+  u8 *fn = alloc_printf("%s/replayable-crashes/README.txt", out_dir);
+  s32 fd;
+  FILE *f;
+
+  fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, 0600);
+  ck_free(fn);
+
+  /* Do not die on errors here - that would be impolite. */
+
+  if (fd < 0)
+    return;
+
+  f = fdopen(fd, "w");
+
+  if (!f)
+  {
+    close(fd);
+    return;
+  }
+
+  fprintf(f, "Command line used to find this crash:\n\n"
+
+             "%s\n\n"
+
+             "If you can't reproduce a bug outside of afl-fuzz, be sure to set the same\n"
+             "memory limit. The limit used for this fuzzing session was %s.\n\n"
+
+             "Need a tool to minimize test cases before investigating the crashes or sending\n"
+             "them to a vendor? Check out the afl-tmin that comes with the fuzzer!\n\n"
+
+             "Found any cool bugs in open-source tools using afl-fuzz? If yes, please drop\n"
+             "me a mail at <lcamtuf@coredump.cx> once the issues are fixed - I'd love to\n"
+             "add your finds to the gallery at:\n\n"
+
+             "  http://lcamtuf.coredump.cx/afl/\n\n"
+
+             "Thanks :-)\n",
+
+          orig_cmdline, DMS(mem_limit << 20)); /* ignore errors */
+
+  fclose(f);
+}
+
+/* Check if the result of an execve() during routine fuzzing is interesting,
+   save or queue the input test case for further analysis if so. Returns 1 if
+   entry is saved, 0 otherwise. */
+
+static u8 save_if_interesting(char **argv, void *mem, u32 len, u8 fault)
+{
+
+  u8 *fn = "";
+  u8 hnb;
+  // s32 fd;
+  u8 keeping = 0, res;
+
+  if (fault == crash_mode)
+  {
+
+    /* Keep only if there are new bits in the map, add to queue for
+       future fuzzing, etc. */
+
+    if (!(hnb = has_new_bits(virgin_bits)))
+    {
+      if (crash_mode)
+        total_crashes++;
+      return 0;
+    }
+
+#ifndef SIMPLE_FILES
+
+    fn = alloc_printf("%s/queue/id:%06u,%s", out_dir, queued_paths,
+                      describe_op(hnb));
+
+#else
+
+    fn = alloc_printf("%s/queue/id_%06u", out_dir, queued_paths);
+
+#endif /* ^!SIMPLE_FILES */
+
+    u32 full_len = save_kl_messages_to_file(kl_messages, fn, 0, messages_sent);
+
+    /* We use the actual length of all messages (full_len), not the len of the mutated message subsequence (len)*/
+    add_to_queue(fn, full_len, 0);
+
+    if (state_aware_mode)
+      update_state_aware_variables(queue_top, 0);
+
+    /* save the seed to file for replaying */
+    u8 *fn_replay = alloc_printf("%s/replayable-queue/%s", out_dir, basename(queue_top->fname));
+    save_kl_messages_to_file(kl_messages, fn_replay, 1, messages_sent);
+    ck_free(fn_replay);
+
+    if (hnb == 2)
+    {
+      queue_top->has_new_cov = 1;
+      queued_with_cov++;
+    }
+
+    queue_top->exec_cksum = hash32(trace_bits, MAP_SIZE, HASH_CONST);
+
+    /* Try to calibrate inline; this also calls update_bitmap_score() when
+       successful. */
+
+    res = calibrate_case(argv, queue_top, mem, queue_cycle - 1, 0);
+
+    if (res == FAULT_ERROR)
+      FATAL("Unable to execute target application");
+
+    /*fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) PFATAL("Unable to create '%s'", fn);
+    ck_write(fd, mem, len, fn);
+    close(fd);*/
+
+    keeping = 1;
+  }
+
+  switch (fault)
+  {
+
+  case FAULT_TMOUT:
+
+    /* Timeouts are not very interesting, but we're still obliged to keep
+       a handful of samples. We use the presence of new bits in the
+       hang-specific bitmap as a signal of uniqueness. In "dumb" mode, we
+       just keep everything. */
+
+    total_tmouts++;
+
+    if (unique_hangs >= KEEP_UNIQUE_HANG)
+      return keeping;
+
+    if (!dumb_mode)
+    {
+
+#ifdef WORD_SIZE_64
+      simplify_trace((u64 *)trace_bits);
+#else
+      simplify_trace((u32 *)trace_bits);
+#endif /* ^WORD_SIZE_64 */
+
+      if (!has_new_bits(virgin_tmout))
+        return keeping;
+    }
+
+    unique_tmouts++;
+
+    /* Before saving, we make sure that it's a genuine hang by re-running
+       the target with a more generous timeout (unless the default timeout
+       is already generous). */
+
+    if (exec_tmout < hang_tmout)
+    {
+
+      u8 new_fault;
+      write_to_testcase(mem, len);
+      new_fault = run_target(argv, hang_tmout);
+
+      /* A corner case that one user reported bumping into: increasing the
+         timeout actually uncovers a crash. Make sure we don't discard it if
+         so. */
+
+      if (!stop_soon && new_fault == FAULT_CRASH)
+        goto keep_as_crash;
+
+      if (stop_soon || new_fault != FAULT_TMOUT)
+        return keeping;
+    }
+
+#ifndef SIMPLE_FILES
+
+    fn = alloc_printf("%s/replayable-hangs/id:%06llu,%s", out_dir,
+                      unique_hangs, describe_op(0));
+
+#else
+
+    fn = alloc_printf("%s/replayable-hangs/id_%06llu", out_dir,
+                      unique_hangs);
+
+#endif /* ^!SIMPLE_FILES */
+
+    unique_hangs++;
+
+    last_hang_time = get_cur_time();
+
+    break;
+
+  case FAULT_CRASH:
+
+  keep_as_crash:
+
+    /* This is handled in a manner roughly similar to timeouts,
+       except for slightly different limits and no need to re-run test
+       cases. */
+
+    total_crashes++;
+
+    if (unique_crashes >= KEEP_UNIQUE_CRASH)
+      return keeping;
+
+    if (!dumb_mode)
+    {
+
+#ifdef WORD_SIZE_64
+      simplify_trace((u64 *)trace_bits);
+#else
+      simplify_trace((u32 *)trace_bits);
+#endif /* ^WORD_SIZE_64 */
+
+      if (!has_new_bits(virgin_crash))
+        return keeping;
+    }
+
+    if (!unique_crashes)
+      write_crash_readme();
+
+#ifndef SIMPLE_FILES
+
+    fn = alloc_printf("%s/replayable-crashes/id:%06llu,sig:%02u,%s", out_dir,
+                      unique_crashes, kill_signal, describe_op(0));
+
+#else
+
+    fn = alloc_printf("%s/replayable-crashes/id_%06llu_%02u", out_dir, unique_crashes,
+                      kill_signal);
+
+#endif /* ^!SIMPLE_FILES */
+
+    unique_crashes++;
+
+    last_crash_time = get_cur_time();
+    last_crash_execs = total_execs;
+
+    break;
+
+  case FAULT_ERROR:
+    FATAL("Unable to execute target application");
+
+  default:
+    return keeping;
+  }
+
+  /* If we're here, we apparently want to save the crash or hang
+     test case, too. */
+
+  save_kl_messages_to_file(kl_messages, fn, 1, messages_sent);
+
+  /*fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, 0600);
+  if (fd < 0) PFATAL("Unable to create '%s'", fn);
+  ck_write(fd, mem, len, fn);
+  close(fd);*/
+
+  ck_free(fn);
+
+  return keeping;
+}
+
+/* When resuming, try to find the queue position to start from. This makes sense
+   only when resuming, and when we can find the original fuzzer_stats. */
+
+static u32 find_start_position(void)
+{
+
+  static u8 tmp[4096]; /* Ought to be enough for anybody. */
+
+  u8 *fn, *off;
+  s32 fd, i;
+  u32 ret;
+
+  if (!resuming_fuzz)
+    return 0;
+
+  if (in_place_resume)
+    fn = alloc_printf("%s/fuzzer_stats", out_dir);
+  else
+    fn = alloc_printf("%s/../fuzzer_stats", in_dir);
+
+  fd = open(fn, O_RDONLY);
+  ck_free(fn);
+
+  if (fd < 0)
+    return 0;
+
+  i = read(fd, tmp, sizeof(tmp) - 1);
+  (void)i; /* Ignore errors */
+  close(fd);
+
+  off = strstr(tmp, "cur_path          : ");
+  if (!off)
+    return 0;
+
+  ret = atoi(off + 20);
+  if (ret >= queued_paths)
+    ret = 0;
+  return ret;
+}
+
+/* The same, but for timeouts. The idea is that when resuming sessions without
+   -t given, we don't want to keep auto-scaling the timeout over and over
+   again to prevent it from growing due to random flukes. */
+
+static void find_timeout(void)
+{
+
+  static u8 tmp[4096]; /* Ought to be enough for anybody. */
+
+  u8 *fn, *off;
+  s32 fd, i;
+  u32 ret;
+
+  if (!resuming_fuzz)
+    return;
+
+  if (in_place_resume)
+    fn = alloc_printf("%s/fuzzer_stats", out_dir);
+  else
+    fn = alloc_printf("%s/../fuzzer_stats", in_dir);
+
+  fd = open(fn, O_RDONLY);
+  ck_free(fn);
+
+  if (fd < 0)
+    return;
+
+  i = read(fd, tmp, sizeof(tmp) - 1);
+  (void)i; /* Ignore errors */
+  close(fd);
+
+  off = strstr(tmp, "exec_timeout      : ");
+  if (!off)
+    return;
+
+  ret = atoi(off + 20);
+  if (ret <= 4)
+    return;
+
+  exec_tmout = ret;
+  timeout_given = 3;
+}
+
+/* Update stats file for unattended monitoring. */
+
+static void write_stats_file(double bitmap_cvg, double stability, double eps)
+{
+
+  static double last_bcvg, last_stab, last_eps;
+  static struct rusage usage;
+
+  u8 *fn = alloc_printf("%s/fuzzer_stats", out_dir);
+  s32 fd;
+  FILE *f;
+  u32 i;
+
+  fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+  if (fd < 0)
+    PFATAL("Unable to create '%s'", fn);
+
+  ck_free(fn);
+
+  f = fdopen(fd, "w");
+
+  if (!f)
+    PFATAL("fdopen() failed");
+
+  /* Keep last values in case we're called from another context
+     where exec/sec stats and such are not readily available. */
+
+  if (!bitmap_cvg && !stability && !eps)
+  {
+    bitmap_cvg = last_bcvg;
+    stability = last_stab;
+    eps = last_eps;
+  }
+  else
+  {
+    last_bcvg = bitmap_cvg;
+    last_stab = stability;
+    last_eps = eps;
+  }
+
+  fprintf(f, "start_time        : %llu\n"
+             "last_update       : %llu\n"
+             "fuzzer_pid        : %u\n"
+             "cycles_done       : %llu\n"
+             "execs_done        : %llu\n"
+             "execs_per_sec     : %0.02f\n"
+             "paths_total       : %u\n"
+             "paths_favored     : %u\n"
+             "paths_found       : %u\n"
+             "paths_imported    : %u\n"
+             "max_depth         : %u\n"
+             "cur_path          : %u\n" /* Must match find_start_position() */
+             "pending_favs      : %u\n"
+             "pending_total     : %u\n"
+             "variable_paths    : %u\n"
+             "stability         : %0.02f%%\n"
+             "bitmap_cvg        : %0.02f%%\n"
+             "unique_crashes    : %llu\n"
+             "unique_hangs      : %llu\n"
+             "last_path         : %llu\n"
+             "last_crash        : %llu\n"
+             "last_hang         : %llu\n"
+             "execs_since_crash : %llu\n"
+             "exec_timeout      : %u\n" /* Must match find_timeout() */
+             "afl_banner        : %s\n"
+             "afl_version       : " VERSION "\n"
+             "target_mode       : %s%s%s%s%s%s%s\n"
+             "command_line      : %s\n"
+             "slowest_exec_ms   : %llu\n",
+          start_time / 1000, get_cur_time() / 1000, getpid(),
+          queue_cycle ? (queue_cycle - 1) : 0, total_execs, eps,
+          queued_paths, queued_favored, queued_discovered, queued_imported,
+          max_depth, current_entry, pending_favored, pending_not_fuzzed,
+          queued_variable, stability, bitmap_cvg, unique_crashes,
+          unique_hangs, last_path_time / 1000, last_crash_time / 1000,
+          last_hang_time / 1000, total_execs - last_crash_execs,
+          exec_tmout, use_banner,
+          qemu_mode ? "qemu " : "", dumb_mode ? " dumb " : "",
+          no_forkserver ? "no_forksrv " : "", crash_mode ? "crash " : "",
+          persistent_mode ? "persistent " : "", deferred_mode ? "deferred " : "",
+          (qemu_mode || dumb_mode || no_forkserver || crash_mode ||
+           persistent_mode || deferred_mode)
+              ? ""
+              : "default",
+          orig_cmdline, slowest_exec_ms);
 
-    q = q->next;
+  fprintf(f, "teardown_avg_us   : %llu\n"
+             "teardown_kills    : %llu\n"
+             "cleanup_runs      : %llu\n"
+             "cleanup_skips     : %llu\n"
+             "response_buf_peak : %u\n"
+             "response_buf_cap  : %u\n"
+             "snapshot_execs    : %llu\n"
+             "snapshot_builds   : %llu\n"
+             "snapshot_parks    : %llu\n"
+             "server_resumes    : %llu\n"
+             "exec_workers      : %u\n"
+             "cal_execs         : %llu\n"
+             "cal_exec_share    : %0.02f%%\n"
+             "cal_runs_saved    : %llu\n",
+          teardown_count ? teardown_us_total / teardown_count : 0, teardown_kills,
+          cleanup_runs, cleanup_skips, response_buf_peak, response_buf_cap,
+          snap_execs, snap_builds, snap_parks, server_resumes, worker_count,
+          total_cal_cycles, total_execs ? ((double)total_cal_cycles) * 100 / total_execs : 0,
+          cal_runs_saved);
+
+  for (i = 0; i < PHASE_COUNT; i++)
+  {
+    u8 key[32];
+
+    sprintf(key, "%s_p50_us", phase_names[i]);
+    fprintf(f, "%-18s: %llu\n", key, phase_percentile(i, 50));
+    sprintf(key, "%s_p99_us", phase_names[i]);
+    fprintf(f, "%-18s: %llu\n", key, phase_percentile(i, 99));
   }
+  /* ignore errors */
 
-  if (cal_failures)
+  /* Get rss value from the children
+     We must have killed the forkserver process and called waitpid
+     before calling getrusage */
+  if (getrusage(RUSAGE_CHILDREN, &usage))
   {
-
-    if (cal_failures == queued_paths)
-      FATAL("All test cases time out%s, giving up!",
-            skip_crashes ? " or crash" : "");
-
-    WARNF("Skipped %u test cases (%0.02f%%) due to timeouts%s.", cal_failures,
-          ((double)cal_failures) * 100 / queued_paths,
-          skip_crashes ? " or crashes" : "");
-
-    if (cal_failures * 5 > queued_paths)
-      WARNF(cLRD "High percentage of rejected test cases, check settings!");
+    WARNF("getrusage failed");
+  }
+  else if (usage.ru_maxrss == 0)
+  {
+    fprintf(f, "peak_rss_mb       : not available while afl is running\n");
+  }
+  else
+  {
+#ifdef __APPLE__
+    fprintf(f, "peak_rss_mb       : %zu\n", usage.ru_maxrss >> 20);
+#else
+    fprintf(f, "peak_rss_mb       : %zu\n", usage.ru_maxrss >> 10);
+#endif /* ^__APPLE__ */
   }
 
-  OKF("All test cases processed.");
+  fclose(f);
 }
 
-/* Helper function: link() if possible, copy otherwise. */
+/* Update the plot file if there is a reason to. */
 
-static void link_or_copy(u8 *old_path, u8 *new_path)
+static void maybe_update_plot_file(double bitmap_cvg, double eps)
 {
 
-  s32 i = link(old_path, new_path);
-  s32 sfd, dfd;
-  u8 *tmp;
+  static u32 prev_qp, prev_pf, prev_pnf, prev_ce, prev_md, prev_nodes, prev_edges, prev_chat_times;
+  static u64 prev_qc, prev_uc, prev_uh;
+  u32 i;
 
-  if (!i)
+  if (prev_qp == queued_paths && prev_pf == pending_favored &&
+      prev_pnf == pending_not_fuzzed && prev_ce == current_entry &&
+      prev_qc == queue_cycle && prev_uc == unique_crashes &&
+      prev_uh == unique_hangs && prev_md == max_depth &&
+      prev_nodes == ipsm->node_count && prev_edges == ipsm->edge_count &&
+      prev_chat_times == chat_times)
     return;
 
-  sfd = open(old_path, O_RDONLY);
-  if (sfd < 0)
-    PFATAL("Unable to open '%s'", old_path);
+  prev_qp = queued_paths;
+  prev_pf = pending_favored;
+  prev_pnf = pending_not_fuzzed;
+  prev_ce = current_entry;
+  prev_qc = queue_cycle;
+  prev_uc = unique_crashes;
+  prev_uh = unique_hangs;
+  prev_md = max_depth;
+  prev_nodes = ipsm->node_count;
+  prev_edges = ipsm->edge_count;
+  prev_chat_times = chat_times;
 
-  dfd = open(new_path, O_WRONLY | O_CREAT | O_EXCL, 0600);
-  if (dfd < 0)
-    PFATAL("Unable to create '%s'", new_path);
+  /* Fields in the file:
 
-  tmp = ck_alloc(64 * 1024);
+     unix_time, cycles_done, cur_path, paths_total, paths_not_fuzzed,
+     favored_not_fuzzed, unique_crashes, unique_hangs, max_depth,
+     execs_per_sec, n_nodes, n_edges, chat_times, then the p50 and p99
+     latency (us) of each execution phase */
 
-  while ((i = read(sfd, tmp, 64 * 1024)) > 0)
-    ck_write(dfd, tmp, i, new_path);
+  fprintf(plot_file,
+          "%llu, %llu, %u, %u, %u, %u, %0.02f%%, %llu, %llu, %u, %0.02f, %d, %d, %d",
+          get_cur_time() / 1000, queue_cycle - 1, current_entry, queued_paths,
+          pending_not_fuzzed, pending_favored, bitmap_cvg, unique_crashes,
+          unique_hangs, max_depth, eps, ipsm->node_count, ipsm->edge_count, chat_times); /* ignore errors */
 
-  if (i < 0)
-    PFATAL("read() failed");
+  for (i = 0; i < PHASE_COUNT; i++)
+    fprintf(plot_file, ", %llu, %llu", phase_percentile(i, 50), phase_percentile(i, 99));
+  fprintf(plot_file, "\n");
 
-  ck_free(tmp);
-  close(sfd);
-  close(dfd);
+  fflush(plot_file);
 }
 
-static void nuke_resume_dir(void);
-
-/* Create hard links for input test cases in the output directory, choosing
-   good names and pivoting accordingly. */
+/* A helper function for maybe_delete_out_dir(), deleting all prefixed
+   files in a directory. */
 
-static void pivot_inputs(void)
+static u8 delete_files(u8 *path, u8 *prefix)
 {
 
-  struct queue_entry *q = queue;
-  u32 id = 0;
-
-  ACTF("Creating hard links for all input files...");
-
-  while (q)
-  {
-
-    u8 *nfn, *rsl = strrchr(q->fname, '/');
-    u32 orig_id;
+  DIR *d;
+  struct dirent *d_ent;
 
-    if (!rsl)
-      rsl = q->fname;
-    else
-      rsl++;
+  d = opendir(path);
 
-      /* If the original file name conforms to the syntax and the recorded
-         ID matches the one we'd assign, just use the original file name.
-         This is valuable for resuming fuzzing runs. */
+  if (!d)
+    return 0;
 
-#ifndef SIMPLE_FILES
-#define CASE_PREFIX "id:"
-#else
-#define CASE_PREFIX "id_"
-#endif /* ^!SIMPLE_FILES */
+  while ((d_ent = readdir(d)))
+  {
 
-    if (!strncmp(rsl, CASE_PREFIX, 3) &&
-        sscanf(rsl + 3, "%06u", &orig_id) == 1 && orig_id == id)
+    if (d_ent->d_name[0] != '.' && (!prefix ||
+                                    !strncmp(d_ent->d_name, prefix, strlen(prefix))))
     {
 
-      u8 *src_str;
-      u32 src_id;
-
-      resuming_fuzz = 1;
-      nfn = alloc_printf("%s/queue/%s", out_dir, rsl);
-
-      /* Since we're at it, let's also try to find parent and figure out the
-         appropriate depth for this entry. */
+      u8 *fname = alloc_printf("%s/%s", path, d_ent->d_name);
+      if (unlink(fname))
+        PFATAL("Unable to delete '%s'", fname);
+      ck_free(fname);
+    }
+  }
 
-      src_str = strchr(rsl + 3, ':');
+  closedir(d);
 
-      if (src_str && sscanf(src_str + 1, "%06u", &src_id) == 1)
-      {
+  return !!rmdir(path);
+}
 
-        struct queue_entry *s = queue;
-        while (src_id-- && s)
-          s = s->next;
-        if (s)
-          q->depth = s->depth + 1;
+/* Get the number of runnable processes, with some simple smoothing. */
 
-        if (max_depth < q->depth)
-          max_depth = q->depth;
-      }
-    }
-    else
-    {
+static double get_runnable_processes(void)
+{
 
-      /* No dice - invent a new name, capturing the original one as a
-         substring. */
+  static double res;
 
-#ifndef SIMPLE_FILES
+#if defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__)
 
-      u8 *use_name = strstr(rsl, ",orig:");
+  /* I don't see any portable sysctl or so that would quickly give us the
+     number of runnable processes; the 1-minute load average can be a
+     semi-decent approximation, though. */
 
-      if (use_name)
-        use_name += 6;
-      else
-        use_name = rsl;
-      nfn = alloc_printf("%s/queue/id:%06u,orig:%s", out_dir, id, use_name);
+  if (getloadavg(&res, 1) != 1)
+    return 0;
 
 #else
 
-      nfn = alloc_printf("%s/queue/id_%06u", out_dir, id);
-
-#endif /* ^!SIMPLE_FILES */
-    }
-
-    /* Pivot to the new queue entry. */
+  /* On Linux, /proc/stat is probably the best way; load averages are
+     computed in funny ways and sometimes don't reflect extremely short-lived
+     processes well. */
 
-    link_or_copy(q->fname, nfn);
-    ck_free(q->fname);
-    q->fname = nfn;
+  FILE *f = fopen("/proc/stat", "r");
+  u8 tmp[1024];
+  u32 val = 0;
 
-    /* Make sure that the passed_det value carries over, too. */
+  if (!f)
+    return 0;
 
-    if (q->passed_det)
-      mark_as_det_done(q);
+  while (fgets(tmp, sizeof(tmp), f))
+  {
 
-    q = q->next;
-    id++;
+    if (!strncmp(tmp, "procs_running ", 14) ||
+        !strncmp(tmp, "procs_blocked ", 14))
+      val += atoi(tmp + 14);
   }
 
-  if (in_place_resume)
-    nuke_resume_dir();
-}
-
-#ifndef SIMPLE_FILES
-
-/* Construct a file name for a new test case, capturing the operation
-   that led to its discovery. Uses a static buffer. */
-
-static u8 *describe_op(u8 hnb)
-{
-
-  static u8 ret[256];
+  fclose(f);
 
-  if (syncing_party)
+  if (!res)
   {
 
-    sprintf(ret, "sync:%s,src:%06u", syncing_party, syncing_case);
+    res = val;
   }
   else
   {
 
-    sprintf(ret, "src:%06u", current_entry);
-
-    if (splicing_with >= 0)
-      sprintf(ret + strlen(ret), "+%06u", splicing_with);
-
-    sprintf(ret + strlen(ret), ",op:%s", stage_short);
-
-    if (stage_cur_byte >= 0)
-    {
-
-      sprintf(ret + strlen(ret), ",pos:%u", stage_cur_byte);
-
-      if (stage_val_type != STAGE_VAL_NONE)
-        sprintf(ret + strlen(ret), ",val:%s%+d",
-                (stage_val_type == STAGE_VAL_BE) ? "be:" : "",
-                stage_cur_val);
-    }
-    else
-      sprintf(ret + strlen(ret), ",rep:%u", stage_cur_val);
+    res = res * (1.0 - 1.0 / AVG_SMOOTHING) +
+          ((double)val) * (1.0 / AVG_SMOOTHING);
   }
 
-  if (hnb == 2)
-    strcat(ret, ",+cov");
-
-  return ret;
-}
+#endif /* ^(__APPLE__ || __FreeBSD__ || __OpenBSD__) */
 
-#endif /* !SIMPLE_FILES */
+  return res;
+}
 
-/* Write a message accompanying the crash directory :-) */
+/* Delete the temporary directory used for in-place session resume. */
 
-static void write_crash_readme(void)
+static void nuke_resume_dir(void)
 {
 
-  u8 *fn = alloc_printf("%s/replayable-crashes/README.txt", out_dir);
-  s32 fd;
-  FILE *f;
+  u8 *fn;
 
-  fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, 0600);
+  fn = alloc_printf("%s/_resume/.state/deterministic_done", out_dir);
+  if (delete_files(fn, CASE_PREFIX))
+    goto dir_cleanup_failed;
   ck_free(fn);
 
-  /* Do not die on errors here - that would be impolite. */
-
-  if (fd < 0)
-    return;
-
-  f = fdopen(fd, "w");
+  fn = alloc_printf("%s/_resume/.state/auto_extras", out_dir);
+  if (delete_files(fn, "auto_"))
+    goto dir_cleanup_failed;
+  ck_free(fn);
 
-  if (!f)
-  {
-    close(fd);
-    return;
-  }
+  fn = alloc_printf("%s/_resume/.state/redundant_edges", out_dir);
+  if (delete_files(fn, CASE_PREFIX))
+    goto dir_cleanup_failed;
+  ck_free(fn);
 
-  fprintf(f, "Command line used to find this crash:\n\n"
+  fn = alloc_printf("%s/_resume/.state/variable_behavior", out_dir);
+  if (delete_files(fn, CASE_PREFIX))
+    goto dir_cleanup_failed;
+  ck_free(fn);
 
-             "%s\n\n"
+  fn = alloc_printf("%s/_resume/.state", out_dir);
+  if (rmdir(fn) && errno != ENOENT)
+    goto dir_cleanup_failed;
+  ck_free(fn);
 
-             "If you can't reproduce a bug outside of afl-fuzz, be sure to set the same\n"
-             "memory limit. The limit used for this fuzzing session was %s.\n\n"
+  fn = alloc_printf("%s/_resume", out_dir);
+  if (delete_files(fn, CASE_PREFIX))
+    goto dir_cleanup_failed;
+  ck_free(fn);
 
-             "Need a tool to minimize test cases before investigating the crashes or sending\n"
-             "them to a vendor? Check out the afl-tmin that comes with the fuzzer!\n\n"
+  return;
 
-             "Found any cool bugs in open-source tools using afl-fuzz? If yes, please drop\n"
-             "me a mail at <lcamtuf@coredump.cx> once the issues are fixed - I'd love to\n"
-             "add your finds to the gallery at:\n\n"
+dir_cleanup_failed:
 
-             "  http://lcamtuf.coredump.cx/afl/\n\n"
+  FATAL("_resume directory cleanup failed");
+}
 
-             "Thanks :-)\n",
+/* Delete fuzzer output directory if we recognize it as ours, if the fuzzer
+   is not currently running, and if the last run time isn't too great. */
 
-          orig_cmdline, DMS(mem_limit << 20)); /* ignore errors */
+static void maybe_delete_out_dir(void)
+{
 
-  fclose(f);
-}
+  FILE *f;
+  u8 *fn = alloc_printf("%s/fuzzer_stats", out_dir);
 
-/* Check if the result of an execve() during routine fuzzing is interesting,
-   save or queue the input test case for further analysis if so. Returns 1 if
-   entry is saved, 0 otherwise. */
+  /* See if the output directory is locked. If yes, bail out. If not,
+     create a lock that will persist for the lifetime of the process
+     (this requires leaving the descriptor open).*/
 
-static u8 save_if_interesting(char **argv, void *mem, u32 len, u8 fault)
-{
+  out_dir_fd = open(out_dir, O_RDONLY);
+  if (out_dir_fd < 0)
+    PFATAL("Unable to open '%s'", out_dir);
 
-  u8 *fn = "";
-  u8 hnb;
-  // s32 fd;
-  u8 keeping = 0, res;
+#ifndef __sun
 
-  if (fault == crash_mode)
+  if (flock(out_dir_fd, LOCK_EX | LOCK_NB) && errno == EWOULDBLOCK)
   {
 
-    /* Keep only if there are new bits in the map, add to queue for
-       future fuzzing, etc. */
+    SAYF("\n" cLRD "[-] " cRST
+         "Looks like the job output directory is being actively used by another\n"
+         "    instance of afl-fuzz. You will need to choose a different %s\n"
+         "    or stop the other process first.\n",
+         sync_id ? "fuzzer ID" : "output location");
 
-    if (!(hnb = has_new_bits(virgin_bits)))
-    {
-      if (crash_mode)
-        total_crashes++;
-      return 0;
-    }
+    FATAL("Directory '%s' is in use", out_dir);
+  }
 
-#ifndef SIMPLE_FILES
+#endif /* !__sun */
 
-    fn = alloc_printf("%s/queue/id:%06u,%s", out_dir, queued_paths,
-                      describe_op(hnb));
+  f = fopen(fn, "r");
 
-#else
+  if (f)
+  {
 
-    fn = alloc_printf("%s/queue/id_%06u", out_dir, queued_paths);
+    u64 start_time, last_update;
 
-#endif /* ^!SIMPLE_FILES */
+    if (fscanf(f, "start_time     : %llu\n"
+                  "last_update    : %llu\n",
+               &start_time, &last_update) != 2)
+      FATAL("Malformed data in '%s'", fn);
 
-    u32 full_len = save_kl_messages_to_file(kl_messages, fn, 0, messages_sent);
+    fclose(f);
 
-    /* We use the actual length of all messages (full_len), not the len of the mutated message subsequence (len)*/
-    add_to_queue(fn, full_len, 0);
+    /* Let's see how much work is at stake. */
 
-    if (state_aware_mode)
-      update_state_aware_variables(queue_top, 0);
+    if (!in_place_resume && last_update - start_time > OUTPUT_GRACE * 60)
+    {
 
-    /* save the seed to file for replaying */
-    u8 *fn_replay = alloc_printf("%s/replayable-queue/%s", out_dir, basename(queue_top->fname));
-    save_kl_messages_to_file(kl_messages, fn_replay, 1, messages_sent);
-    ck_free(fn_replay);
+      SAYF("\n" cLRD "[-] " cRST
+           "The job output directory already exists and contains the results of more\n"
+           "    than %u minutes worth of fuzzing. To avoid data loss, afl-fuzz will *NOT*\n"
+           "    automatically delete this data for you.\n\n"
 
-    if (hnb == 2)
-    {
-      queue_top->has_new_cov = 1;
-      queued_with_cov++;
+           "    If you wish to start a new session, remove or rename the directory manually,\n"
+           "    or specify a different output location for this job. To resume the old\n"
+           "    session, put '-' as the input directory in the command line ('-i -') and\n"
+           "    try again.\n",
+           OUTPUT_GRACE);
+
+      FATAL("At-risk data found in '%s'", out_dir);
     }
+  }
 
-    queue_top->exec_cksum = hash32(trace_bits, MAP_SIZE, HASH_CONST);
+  ck_free(fn);
 
-    /* Try to calibrate inline; this also calls update_bitmap_score() when
-       successful. */
+  /* The idea for in-place resume is pretty simple: we temporarily move the old
+     queue/ to a new location that gets deleted once import to the new queue/
+     is finished. If _resume/ already exists, the current queue/ may be
+     incomplete due to an earlier abort, so we want to use the old _resume/
+     dir instead, and we let rename() fail silently. */
 
-    res = calibrate_case(argv, queue_top, mem, queue_cycle - 1, 0);
+  if (in_place_resume)
+  {
 
-    if (res == FAULT_ERROR)
-      FATAL("Unable to execute target application");
+    u8 *orig_q = alloc_printf("%s/queue", out_dir);
 
-    /*fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, 0600);
-    if (fd < 0) PFATAL("Unable to create '%s'", fn);
-    ck_write(fd, mem, len, fn);
-    close(fd);*/
+    in_dir = alloc_printf("%s/_resume", out_dir);
 
-    keeping = 1;
-  }
+    rename(orig_q, in_dir); /* Ignore errors */
 
-  switch (fault)
+    OKF("Output directory exists, will attempt session resume.");
+
+    ck_free(orig_q);
+  }
+  else
   {
 
-  case FAULT_TMOUT:
+    OKF("Output directory exists but deemed OK to reuse.");
+  }
 
-    /* Timeouts are not very interesting, but we're still obliged to keep
-       a handful of samples. We use the presence of new bits in the
-       hang-specific bitmap as a signal of uniqueness. In "dumb" mode, we
-       just keep everything. */
+  ACTF("Deleting old session data...");
 
-    total_tmouts++;
+  /* Okay, let's get the ball rolling! First, we need to get rid of the entries
+     in <out_dir>/.synced/.../id:*, if any are present. */
 
-    if (unique_hangs >= KEEP_UNIQUE_HANG)
-      return keeping;
+  if (!in_place_resume)
+  {
 
-    if (!dumb_mode)
-    {
+    fn = alloc_printf("%s/.synced", out_dir);
+    if (delete_files(fn, NULL))
+      goto dir_cleanup_failed;
+    ck_free(fn);
+  }
 
-#ifdef WORD_SIZE_64
-      simplify_trace((u64 *)trace_bits);
-#else
-      simplify_trace((u32 *)trace_bits);
-#endif /* ^WORD_SIZE_64 */
+  /* Next, we need to clean up <out_dir>/queue/.state/ subdirectories: */
 
-      if (!has_new_bits(virgin_tmout))
-        return keeping;
-    }
+  fn = alloc_printf("%s/queue/.state/deterministic_done", out_dir);
+  if (delete_files(fn, CASE_PREFIX))
+    goto dir_cleanup_failed;
+  ck_free(fn);
 
-    unique_tmouts++;
+  fn = alloc_printf("%s/queue/.state/auto_extras", out_dir);
+  if (delete_files(fn, "auto_"))
+    goto dir_cleanup_failed;
+  ck_free(fn);
 
-    /* Before saving, we make sure that it's a genuine hang by re-running
-       the target with a more generous timeout (unless the default timeout
-       is already generous). */
+  fn = alloc_printf("%s/queue/.state/redundant_edges", out_dir);
+  if (delete_files(fn, CASE_PREFIX))
+    goto dir_cleanup_failed;
+  ck_free(fn);
 
-    if (exec_tmout < hang_tmout)
-    {
+  fn = alloc_printf("%s/queue/.state/variable_behavior", out_dir);
+  if (delete_files(fn, CASE_PREFIX))
+    goto dir_cleanup_failed;
+  ck_free(fn);
 
-      u8 new_fault;
-      write_to_testcase(mem, len);
-      new_fault = run_target(argv, hang_tmout);
+  /* Then, get rid of the .state subdirectory itself (should be empty by now)
+     and everything matching <out_dir>/queue/id:*. */
 
-      /* A corner case that one user reported bumping into: increasing the
-         timeout actually uncovers a crash. Make sure we don't discard it if
-         so. */
+  fn = alloc_printf("%s/queue/.state", out_dir);
+  if (rmdir(fn) && errno != ENOENT)
+    goto dir_cleanup_failed;
+  ck_free(fn);
 
-      if (!stop_soon && new_fault == FAULT_CRASH)
-        goto keep_as_crash;
+  fn = alloc_printf("%s/queue", out_dir);
+  if (delete_files(fn, CASE_PREFIX))
+    goto dir_cleanup_failed;
+  ck_free(fn);
 
-      if (stop_soon || new_fault != FAULT_TMOUT)
-        return keeping;
-    }
+  /* All right, let's do <out_dir>/replayable-crashes/id:* and <out_dir>/replayable-hangs/id:*. */
 
-#ifndef SIMPLE_FILES
+  if (!in_place_resume)
+  {
 
-    fn = alloc_printf("%s/replayable-hangs/id:%06llu,%s", out_dir,
-                      unique_hangs, describe_op(0));
+    fn = alloc_printf("%s/replayable-crashes/README.txt", out_dir);
+    unlink(fn); /* Ignore errors */
+    ck_free(fn);
+  }
 
-#else
+  fn = alloc_printf("%s/replayable-crashes", out_dir);
 
-    fn = alloc_printf("%s/replayable-hangs/id_%06llu", out_dir,
-                      unique_hangs);
+  /* Make backup of the crashes directory if it's not empty and if we're
+     doing in-place resume. */
 
-#endif /* ^!SIMPLE_FILES */
+  if (in_place_resume && rmdir(fn))
+  {
 
-    unique_hangs++;
+    time_t cur_t = time(0);
+    struct tm *t = localtime(&cur_t);
 
-    last_hang_time = get_cur_time();
+#ifndef SIMPLE_FILES
 
-    break;
+    u8 *nfn = alloc_printf("%s.%04u-%02u-%02u-%02u:%02u:%02u", fn,
+                           t->tm_year + 1900, t->tm_mon + 1, t->tm_mday,
+                           t->tm_hour, t->tm_min, t->tm_sec);
 
-  case FAULT_CRASH:
+#else
 
-  keep_as_crash:
+    u8 *nfn = alloc_printf("%s_%04u%02u%02u%02u%02u%02u", fn,
+                           t->tm_year + 1900, t->tm_mon + 1, t->tm_mday,
+                           t->tm_hour, t->tm_min, t->tm_sec);
 
-    /* This is handled in a manner roughly similar to timeouts,
-       except for slightly different limits and no need to re-run test
-       cases. */
+#endif /* ^!SIMPLE_FILES */
 
-    total_crashes++;
+    rename(fn, nfn); /* Ignore errors. */
+    ck_free(nfn);
+  }
 
-    if (unique_crashes >= KEEP_UNIQUE_CRASH)
-      return keeping;
+  if (delete_files(fn, CASE_PREFIX))
+    goto dir_cleanup_failed;
+  ck_free(fn);
 
-    if (!dumb_mode)
-    {
+  fn = alloc_printf("%s/replayable-hangs", out_dir);
 
-#ifdef WORD_SIZE_64
-      simplify_trace((u64 *)trace_bits);
-#else
-      simplify_trace((u32 *)trace_bits);
-#endif /* ^WORD_SIZE_64 */
+  /* Backup hangs, too. */
 
-      if (!has_new_bits(virgin_crash))
-        return keeping;
-    }
+  if (in_place_resume && rmdir(fn))
+  {
 
-    if (!unique_crashes)
-      write_crash_readme();
+    time_t cur_t = time(0);
+    struct tm *t = localtime(&cur_t);
 
 #ifndef SIMPLE_FILES
 
-    fn = alloc_printf("%s/replayable-crashes/id:%06llu,sig:%02u,%s", out_dir,
-                      unique_crashes, kill_signal, describe_op(0));
+    u8 *nfn = alloc_printf("%s.%04u-%02u-%02u-%02u:%02u:%02u", fn,
+                           t->tm_year + 1900, t->tm_mon + 1, t->tm_mday,
+                           t->tm_hour, t->tm_min, t->tm_sec);
 
 #else
 
-    fn = alloc_printf("%s/replayable-crashes/id_%06llu_%02u", out_dir, unique_crashes,
-                      kill_signal);
+    u8 *nfn = alloc_printf("%s_%04u%02u%02u%02u%02u%02u", fn,
+                           t->tm_year + 1900, t->tm_mon + 1, t->tm_mday,
+                           t->tm_hour, t->tm_min, t->tm_sec);
 
 #endif /* ^!SIMPLE_FILES */
 
-    unique_crashes++;
+    rename(fn, nfn); /* Ignore errors. */
+    ck_free(nfn);
+  }
 
-    last_crash_time = get_cur_time();
-    last_crash_execs = total_execs;
+  if (delete_files(fn, CASE_PREFIX))
+    goto dir_cleanup_failed;
+  ck_free(fn);
 
-    break;
+  /* Delete regions. */
 
-  case FAULT_ERROR:
-    FATAL("Unable to execute target application");
+  fn = alloc_printf("%s/regions", out_dir);
+  if (delete_files(fn, ""))
+    goto dir_cleanup_failed;
+  ck_free(fn);
 
-  default:
-    return keeping;
-  }
+  /* Delete replayable-queue. */
 
-  /* If we're here, we apparently want to save the crash or hang
-     test case, too. */
+  fn = alloc_printf("%s/replayable-queue", out_dir);
+  if (delete_files(fn, ""))
+    goto dir_cleanup_failed;
+  ck_free(fn);
 
-  save_kl_messages_to_file(kl_messages, fn, 1, messages_sent);
+  /* Delete the old ipsm.dot and ipsm.bin */
+  fn = alloc_printf("%s/ipsm.dot", out_dir);
+  if (unlink(fn) && errno != ENOENT)
+    goto dir_cleanup_failed;
+  ck_free(fn);
 
-  /*fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, 0600);
-  if (fd < 0) PFATAL("Unable to create '%s'", fn);
-  ck_write(fd, mem, len, fn);
-  close(fd);*/
+  fn = alloc_printf("%s/ipsm.bin", out_dir);
+  if (unlink(fn) && errno != ENOENT)
+    goto dir_cleanup_failed;
+  ck_free(fn);
 
+  /* Delete the old replayable-new-ipsm-paths folder */
+  fn = alloc_printf("%s/replayable-new-ipsm-paths", out_dir);
+  if (delete_files(fn, ""))
+    goto dir_cleanup_failed;
   ck_free(fn);
 
-  return keeping;
-}
+  /* Delete the old responses-ipsm folder */
+  fn = alloc_printf("%s/responses-ipsm", out_dir);
+  if (delete_files(fn, ""))
+    goto dir_cleanup_failed;
+  ck_free(fn);
 
-/* When resuming, try to find the queue position to start from. This makes sense
-   only when resuming, and when we can find the original fuzzer_stats. */
+  /* Delete the old protocol-grammars folder */
+  fn = alloc_printf("%s/protocol-grammars", out_dir);
+  if (delete_files(fn, ""))
+    goto dir_cleanup_failed;
+  ck_free(fn);
 
-static u32 find_start_position(void)
-{
+  /* Delete the old stall-interactions folder */
+  fn = alloc_printf("%s/stall-interactions", out_dir);
+  if (delete_files(fn, ""))
+    goto dir_cleanup_failed;
+  ck_free(fn);
 
-  static u8 tmp[4096]; /* Ought to be enough for anybody. */
+  /* And now, for some finishing touches. */
 
-  u8 *fn, *off;
-  s32 fd, i;
-  u32 ret;
+  fn = alloc_printf("%s/.cur_input", out_dir);
+  if (unlink(fn) && errno != ENOENT)
+    goto dir_cleanup_failed;
+  ck_free(fn);
 
-  if (!resuming_fuzz)
-    return 0;
+  fn = alloc_printf("%s/fuzz_bitmap", out_dir);
+  if (unlink(fn) && errno != ENOENT)
+    goto dir_cleanup_failed;
+  ck_free(fn);
 
-  if (in_place_resume)
+  if (!in_place_resume)
+  {
     fn = alloc_printf("%s/fuzzer_stats", out_dir);
-  else
-    fn = alloc_printf("%s/../fuzzer_stats", in_dir);
+    if (unlink(fn) && errno != ENOENT)
+      goto dir_cleanup_failed;
+    ck_free(fn);
+  }
 
-  fd = open(fn, O_RDONLY);
+  fn = alloc_printf("%s/plot_data", out_dir);
+  if (unlink(fn) && errno != ENOENT)
+    goto dir_cleanup_failed;
   ck_free(fn);
 
-  if (fd < 0)
-    return 0;
+  OKF("Output dir cleanup successful.");
 
-  i = read(fd, tmp, sizeof(tmp) - 1);
-  (void)i; /* Ignore errors */
-  close(fd);
+  /* Wow... is that all? If yes, celebrate! */
 
-  off = strstr(tmp, "cur_path          : ");
-  if (!off)
-    return 0;
+  return;
 
-  ret = atoi(off + 20);
-  if (ret >= queued_paths)
-    ret = 0;
-  return ret;
+dir_cleanup_failed:
+
+  SAYF("\n" cLRD "[-] " cRST
+       "Whoops, the fuzzer tried to reuse your output directory, but bumped into\n"
+       "    some files that shouldn't be there or that couldn't be removed - so it\n"
+       "    decided to abort! This happened while processing this path:\n\n"
+
+       "    %s\n\n"
+       "    Please examine and manually delete the files, or specify a different\n"
+       "    output location for the tool.\n",
+       fn);
+
+  FATAL("Output directory cleanup failed");
 }
 
-/* The same, but for timeouts. The idea is that when resuming sessions without
-   -t given, we don't want to keep auto-scaling the timeout over and over
-   again to prevent it from growing due to random flukes. */
+static void check_term_size(void);
 
-static void find_timeout(void)
+/* A spiffy retro stats screen! This is called every stats_update_freq
+   execve() calls, plus in several other circumstances. */
+
+static void show_stats(void)
 {
 
-  static u8 tmp[4096]; /* Ought to be enough for anybody. */
+  static u64 last_stats_ms, last_plot_ms, last_ms, last_execs;
+  static double avg_exec;
+  double t_byte_ratio, stab_ratio;
 
-  u8 *fn, *off;
-  s32 fd, i;
-  u32 ret;
+  u64 cur_ms;
+  u32 t_bytes, t_bits;
 
-  if (!resuming_fuzz)
-    return;
+  u32 banner_len, banner_pad;
+  u8 tmp[256];
 
-  if (in_place_resume)
-    fn = alloc_printf("%s/fuzzer_stats", out_dir);
-  else
-    fn = alloc_printf("%s/../fuzzer_stats", in_dir);
+  cur_ms = get_cur_time();
 
-  fd = open(fn, O_RDONLY);
-  ck_free(fn);
+  /* If not enough time has passed since last UI update, bail out. */
 
-  if (fd < 0)
+  if (cur_ms - last_ms < 1000 / UI_TARGET_HZ)
     return;
 
-  i = read(fd, tmp, sizeof(tmp) - 1);
-  (void)i; /* Ignore errors */
-  close(fd);
+  /* Check if we're past the 10 minute mark. */
 
-  off = strstr(tmp, "exec_timeout      : ");
-  if (!off)
-    return;
+  if (cur_ms - start_time > 10 * 60 * 1000)
+    run_over10m = 1;
 
-  ret = atoi(off + 20);
-  if (ret <= 4)
-    return;
+  /* Calculate smoothed exec speed stats. */
 
-  exec_tmout = ret;
-  timeout_given = 3;
-}
+  if (!last_execs)
+  {
 
-/* Update stats file for unattended monitoring. */
+    avg_exec = ((double)total_execs) * 1000 / (cur_ms - start_time);
+  }
+  else
+  {
 
-static void write_stats_file(double bitmap_cvg, double stability, double eps)
-{
+    double cur_avg = ((double)(total_execs - last_execs)) * 1000 /
+                     (cur_ms - last_ms);
 
-  static double last_bcvg, last_stab, last_eps;
-  static struct rusage usage;
+    /* If there is a dramatic (5x+) jump in speed, reset the indicator
+       more quickly. */
 
-  u8 *fn = alloc_printf("%s/fuzzer_stats", out_dir);
-  s32 fd;
-  FILE *f;
+    if (cur_avg * 5 < avg_exec || cur_avg / 5 > avg_exec)
+      avg_exec = cur_avg;
 
-  fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    avg_exec = avg_exec * (1.0 - 1.0 / AVG_SMOOTHING) +
+               cur_avg * (1.0 / AVG_SMOOTHING);
+  }
 
-  if (fd < 0)
-    PFATAL("Unable to create '%s'", fn);
+  last_ms = cur_ms;
+  last_execs = total_execs;
 
-  ck_free(fn);
+  /* Tell the callers when to contact us (as measured in execs). */
 
-  f = fdopen(fd, "w");
+  stats_update_freq = avg_exec / (UI_TARGET_HZ * 10);
+  if (!stats_update_freq)
+    stats_update_freq = 1;
 
-  if (!f)
-    PFATAL("fdopen() failed");
+  /* Do some bitmap stats. */
 
-  /* Keep last values in case we're called from another context
-     where exec/sec stats and such are not readily available. */
+  t_bytes = count_non_255_bytes(virgin_bits);
+  t_byte_ratio = ((double)t_bytes * 100) / MAP_SIZE;
 
-  if (!bitmap_cvg && !stability && !eps)
-  {
-    bitmap_cvg = last_bcvg;
-    stability = last_stab;
-    eps = last_eps;
-  }
+  if (t_bytes)
+    stab_ratio = 100 - ((double)var_byte_count) * 100 / t_bytes;
   else
-  {
-    last_bcvg = bitmap_cvg;
-    last_stab = stability;
-    last_eps = eps;
-  }
+    stab_ratio = 100;
 
-  fprintf(f, "start_time        : %llu\n"
-             "last_update       : %llu\n"
-             "fuzzer_pid        : %u\n"
-             "cycles_done       : %llu\n"
-             "execs_done        : %llu\n"
-             "execs_per_sec     : %0.02f\n"
-             "paths_total       : %u\n"
-             "paths_favored     : %u\n"
-             "paths_found       : %u\n"
-             "paths_imported    : %u\n"
-             "max_depth         : %u\n"
-             "cur_path          : %u\n" /* Must match find_start_position() */
-             "pending_favs      : %u\n"
-             "pending_total     : %u\n"
-             "variable_paths    : %u\n"
-             "stability         : %0.02f%%\n"
-             "bitmap_cvg        : %0.02f%%\n"
-             "unique_crashes    : %llu\n"
-             "unique_hangs      : %llu\n"
-             "last_path         : %llu\n"
-             "last_crash        : %llu\n"
-             "last_hang         : %llu\n"
-             "execs_since_crash : %llu\n"
-             "exec_timeout      : %u\n" /* Must match find_timeout() */
-             "afl_banner        : %s\n"
-             "afl_version       : " VERSION "\n"
-             "target_mode       : %s%s%s%s%s%s%s\n"
-             "command_line      : %s\n"
-             "slowest_exec_ms   : %llu\n",
-          start_time / 1000, get_cur_time() / 1000, getpid(),
-          queue_cycle ? (queue_cycle - 1) : 0, total_execs, eps,
-          queued_paths, queued_favored, queued_discovered, queued_imported,
-          max_depth, current_entry, pending_favored, pending_not_fuzzed,
-          queued_variable, stability, bitmap_cvg, unique_crashes,
-          unique_hangs, last_path_time / 1000, last_crash_time / 1000,
-          last_hang_time / 1000, total_execs - last_crash_execs,
-          exec_tmout, use_banner,
-          qemu_mode ? "qemu " : "", dumb_mode ? " dumb " : "",
-          no_forkserver ? "no_forksrv " : "", crash_mode ? "crash " : "",
-          persistent_mode ? "persistent " : "", deferred_mode ? "deferred " : "",
-          (qemu_mode || dumb_mode || no_forkserver || crash_mode ||
-           persistent_mode || deferred_mode)
-              ? ""
-              : "default",
-          orig_cmdline, slowest_exec_ms);
-  /* ignore errors */
+  /* Roughly every minute, update fuzzer stats and save auto tokens. */
 
-  /* Get rss value from the children
-     We must have killed the forkserver process and called waitpid
-     before calling getrusage */
-  if (getrusage(RUSAGE_CHILDREN, &usage))
-  {
-    WARNF("getrusage failed");
-  }
-  else if (usage.ru_maxrss == 0)
-  {
-    fprintf(f, "peak_rss_mb       : not available while afl is running\n");
-  }
-  else
+  if (cur_ms - last_stats_ms > STATS_UPDATE_SEC * 1000)
   {
-#ifdef __APPLE__
-    fprintf(f, "peak_rss_mb       : %zu\n", usage.ru_maxrss >> 20);
-#else
-    fprintf(f, "peak_rss_mb       : %zu\n", usage.ru_maxrss >> 10);
-#endif /* ^__APPLE__ */
+
+    last_stats_ms = cur_ms;
+    write_stats_file(t_byte_ratio, stab_ratio, avg_exec);
+    save_auto();
+    write_bitmap();
+    write_ipsm();
   }
 
-  fclose(f);
-}
+  /* Every now and then, write plot data. */
 
-/* Update the plot file if there is a reason to. */
+  if (cur_ms - last_plot_ms > PLOT_UPDATE_SEC * 1000)
+  {
 
-static void maybe_update_plot_file(double bitmap_cvg, double eps)
-{
+    last_plot_ms = cur_ms;
+    maybe_update_plot_file(t_byte_ratio, avg_exec);
+  }
 
-  static u32 prev_qp, prev_pf, prev_pnf, prev_ce, prev_md, prev_nodes, prev_edges, prev_chat_times;
-  static u64 prev_qc, prev_uc, prev_uh;
+  /* Honor AFL_EXIT_WHEN_DONE and AFL_BENCH_UNTIL_CRASH. */
 
-  if (prev_qp == queued_paths && prev_pf == pending_favored &&
-      prev_pnf == pending_not_fuzzed && prev_ce == current_entry &&
-      prev_qc == queue_cycle && prev_uc == unique_crashes &&
-      prev_uh == unique_hangs && prev_md == max_depth &&
-      prev_nodes == agnnodes(ipsm) && prev_edges == agnedges(ipsm) &&
-      prev_chat_times == chat_times)
-    return;
+  if (!dumb_mode && cycles_wo_finds > 100 && !pending_not_fuzzed &&
+      getenv("AFL_EXIT_WHEN_DONE"))
+    stop_soon = 2;
 
-  prev_qp = queued_paths;
-  prev_pf = pending_favored;
-  prev_pnf = pending_not_fuzzed;
-  prev_ce = current_entry;
-  prev_qc = queue_cycle;
-  prev_uc = unique_crashes;
-  prev_uh = unique_hangs;
-  prev_md = max_depth;
-  prev_nodes = agnnodes(ipsm);
-  prev_edges = agnedges(ipsm);
-  prev_chat_times = chat_times;
+  if (total_crashes && getenv("AFL_BENCH_UNTIL_CRASH"))
+    stop_soon = 2;
 
-  /* Fields in the file:
+  /* If we're not on TTY, bail out. */
 
-     unix_time, cycles_done, cur_path, paths_total, paths_not_fuzzed,
-     favored_not_fuzzed, unique_crashes, unique_hangs, max_depth,
-     execs_per_sec, n_nodes, n_edges, chat_times */
+  if (not_on_tty)
+    return;
 
-  fprintf(plot_file,
-          "%llu, %llu, %u, %u, %u, %u, %0.02f%%, %llu, %llu, %u, %0.02f, %d, %d, %d\n",
-          get_cur_time() / 1000, queue_cycle - 1, current_entry, queued_paths,
-          pending_not_fuzzed, pending_favored, bitmap_cvg, unique_crashes,
-          unique_hangs, max_depth, eps, agnnodes(ipsm), agnedges(ipsm), chat_times); /* ignore errors */
+  /* Compute some mildly useful bitmap stats. */
 
-  fflush(plot_file);
-}
+  t_bits = (MAP_SIZE << 3) - count_bits(virgin_bits);
 
-/* A helper function for maybe_delete_out_dir(), deleting all prefixed
-   files in a directory. */
+  /* Now, for the visuals... */
 
-static u8 delete_files(u8 *path, u8 *prefix)
-{
+  if (clear_screen)
+  {
 
-  DIR *d;
-  struct dirent *d_ent;
+    SAYF(TERM_CLEAR CURSOR_HIDE);
+    clear_screen = 0;
 
-  d = opendir(path);
+    check_term_size();
+  }
 
-  if (!d)
-    return 0;
+  SAYF(TERM_HOME);
 
-  while ((d_ent = readdir(d)))
+  if (term_too_small)
   {
 
-    if (d_ent->d_name[0] != '.' && (!prefix ||
-                                    !strncmp(d_ent->d_name, prefix, strlen(prefix))))
-    {
+    SAYF(cBRI "Your terminal is too small to display the UI.\n"
+              "Please resize terminal window to at least 80x25.\n" cRST);
 
-      u8 *fname = alloc_printf("%s/%s", path, d_ent->d_name);
-      if (unlink(fname))
-        PFATAL("Unable to delete '%s'", fname);
-      ck_free(fname);
-    }
+    return;
   }
 
-  closedir(d);
+  /* Let's start by drawing a centered banner. */
 
-  return !!rmdir(path);
-}
+  banner_len = (crash_mode ? 24 : 22) + strlen(VERSION) + strlen(use_banner);
+  banner_pad = (80 - banner_len) / 2;
+  memset(tmp, ' ', banner_pad);
 
-/* Get the number of runnable processes, with some simple smoothing. */
+  sprintf(tmp + banner_pad, "%s " cLCY VERSION cLGN " (%s)", crash_mode ? cPIN "peruvian were-rabbit" : cYEL "american fuzzy lop", use_banner);
 
-static double get_runnable_processes(void)
-{
+  SAYF("\n%s\n\n", tmp);
 
-  static double res;
+  /* "Handy" shortcuts for drawing boxes... */
 
-#if defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__)
+#define bSTG bSTART cGRA
+#define bH2 bH bH
+#define bH5 bH2 bH2 bH
+#define bH10 bH5 bH5
+#define bH20 bH10 bH10
+#define bH30 bH20 bH10
+#define SP5 "     "
+#define SP10 SP5 SP5
+#define SP20 SP10 SP10
 
-  /* I don't see any portable sysctl or so that would quickly give us the
-     number of runnable processes; the 1-minute load average can be a
-     semi-decent approximation, though. */
+  /* Lord, forgive me this. */
 
-  if (getloadavg(&res, 1) != 1)
-    return 0;
+  SAYF(SET_G1 bSTG bLT bH bSTOP cCYA " process timing " bSTG bH30 bH5 bH2 bHB
+           bH bSTOP cCYA " overall results " bSTG bH5 bRT "\n");
 
-#else
+  if (dumb_mode)
+  {
 
-  /* On Linux, /proc/stat is probably the best way; load averages are
-     computed in funny ways and sometimes don't reflect extremely short-lived
-     processes well. */
+    strcpy(tmp, cRST);
+  }
+  else
+  {
 
-  FILE *f = fopen("/proc/stat", "r");
-  u8 tmp[1024];
-  u32 val = 0;
+    u64 min_wo_finds = (cur_ms - last_path_time) / 1000 / 60;
 
-  if (!f)
-    return 0;
+    /* First queue cycle: don't stop now! */
+    if (queue_cycle == 1 || min_wo_finds < 15)
+      strcpy(tmp, cMGN);
+    else
 
-  while (fgets(tmp, sizeof(tmp), f))
-  {
+      /* Subsequent cycles, but we're still making finds. */
+      if (cycles_wo_finds < 25 || min_wo_finds < 30)
+        strcpy(tmp, cYEL);
+      else
 
-    if (!strncmp(tmp, "procs_running ", 14) ||
-        !strncmp(tmp, "procs_blocked ", 14))
-      val += atoi(tmp + 14);
+        /* No finds for a long time and no test cases to try. */
+        if (cycles_wo_finds > 100 && !pending_not_fuzzed && min_wo_finds > 120)
+          strcpy(tmp, cLGN);
+
+        /* Default: cautiously OK to stop? */
+        else
+          strcpy(tmp, cLBL);
   }
 
-  fclose(f);
+  SAYF(bV bSTOP "        run time : " cRST "%-34s " bSTG bV bSTOP
+                "  cycles done : %s%-5s  " bSTG bV "\n",
+       DTD(cur_ms, start_time), tmp, DI(queue_cycle - 1));
+
+  /* We want to warn people about not seeing new paths after a full cycle,
+     except when resuming fuzzing or running in non-instrumented mode. */
 
-  if (!res)
+  if (!dumb_mode && (last_path_time || resuming_fuzz || queue_cycle == 1 ||
+                     in_bitmap || crash_mode))
   {
 
-    res = val;
+    SAYF(bV bSTOP "   last new path : " cRST "%-34s ",
+         DTD(cur_ms, last_path_time));
   }
   else
   {
 
-    res = res * (1.0 - 1.0 / AVG_SMOOTHING) +
-          ((double)val) * (1.0 / AVG_SMOOTHING);
+    if (dumb_mode)
+
+      SAYF(bV bSTOP "   last new path : " cPIN "n/a" cRST
+                    " (non-instrumented mode)        ");
+
+    else
+
+      SAYF(bV bSTOP "   last new path : " cRST "none yet " cLRD
+                    "(odd, check syntax!)      ");
   }
 
-#endif /* ^(__APPLE__ || __FreeBSD__ || __OpenBSD__) */
+  SAYF(bSTG bV bSTOP "  total paths : " cRST "%-5s  " bSTG bV "\n",
+       DI(queued_paths));
 
-  return res;
-}
+  /* Highlight crashes in red if found, denote going over the KEEP_UNIQUE_CRASH
+     limit with a '+' appended to the count. */
 
-/* Delete the temporary directory used for in-place session resume. */
+  sprintf(tmp, "%s%s", DI(unique_crashes),
+          (unique_crashes >= KEEP_UNIQUE_CRASH) ? "+" : "");
 
-static void nuke_resume_dir(void)
-{
+  SAYF(bV bSTOP " last uniq crash : " cRST "%-34s " bSTG bV bSTOP
+                " uniq crashes : %s%-6s " bSTG bV "\n",
+       DTD(cur_ms, last_crash_time), unique_crashes ? cLRD : cRST,
+       tmp);
 
-  u8 *fn;
+  sprintf(tmp, "%s%s", DI(unique_hangs),
+          (unique_hangs >= KEEP_UNIQUE_HANG) ? "+" : "");
 
-  fn = alloc_printf("%s/_resume/.state/deterministic_done", out_dir);
-  if (delete_files(fn, CASE_PREFIX))
-    goto dir_cleanup_failed;
-  ck_free(fn);
+  SAYF(bV bSTOP "  last uniq hang : " cRST "%-34s " bSTG bV bSTOP
+                "   uniq hangs : " cRST "%-6s " bSTG bV "\n",
+       DTD(cur_ms, last_hang_time), tmp);
 
-  fn = alloc_printf("%s/_resume/.state/auto_extras", out_dir);
-  if (delete_files(fn, "auto_"))
-    goto dir_cleanup_failed;
-  ck_free(fn);
+  SAYF(bVR bH bSTOP cCYA " cycle progress " bSTG bH20 bHB bH bSTOP cCYA
+                         " map coverage " bSTG bH bHT bH20 bH2 bH bVL "\n");
 
-  fn = alloc_printf("%s/_resume/.state/redundant_edges", out_dir);
-  if (delete_files(fn, CASE_PREFIX))
-    goto dir_cleanup_failed;
-  ck_free(fn);
+  /* This gets funny because we want to print several variable-length variables
+     together, but then cram them into a fixed-width field - so we need to
+     put them in a temporary buffer first. */
 
-  fn = alloc_printf("%s/_resume/.state/variable_behavior", out_dir);
-  if (delete_files(fn, CASE_PREFIX))
-    goto dir_cleanup_failed;
-  ck_free(fn);
+  sprintf(tmp, "%s%s (%0.02f%%)", DI(current_entry),
+          queue_cur->favored ? "" : "*",
+          ((double)current_entry * 100) / queued_paths);
 
-  fn = alloc_printf("%s/_resume/.state", out_dir);
-  if (rmdir(fn) && errno != ENOENT)
-    goto dir_cleanup_failed;
-  ck_free(fn);
+  SAYF(bV bSTOP "  now processing : " cRST "%-17s " bSTG bV bSTOP, tmp);
 
-  fn = alloc_printf("%s/_resume", out_dir);
-  if (delete_files(fn, CASE_PREFIX))
-    goto dir_cleanup_failed;
-  ck_free(fn);
+  sprintf(tmp, "%0.02f%% / %0.02f%%", ((double)queue_cur->bitmap_size) * 100 / MAP_SIZE, t_byte_ratio);
 
-  return;
+  SAYF("    map density : %s%-21s " bSTG bV "\n", t_byte_ratio > 70 ? cLRD : ((t_bytes < 200 && !dumb_mode) ? cPIN : cRST), tmp);
 
-dir_cleanup_failed:
+  sprintf(tmp, "%s (%0.02f%%)", DI(cur_skipped_paths),
+          ((double)cur_skipped_paths * 100) / queued_paths);
 
-  FATAL("_resume directory cleanup failed");
-}
+  SAYF(bV bSTOP " paths timed out : " cRST "%-17s " bSTG bV, tmp);
 
-/* Delete fuzzer output directory if we recognize it as ours, if the fuzzer
-   is not currently running, and if the last run time isn't too great. */
+  sprintf(tmp, "%0.02f bits/tuple",
+          t_bytes ? (((double)t_bits) / t_bytes) : 0);
 
-static void maybe_delete_out_dir(void)
-{
+  SAYF(bSTOP " count coverage : " cRST "%-21s " bSTG bV "\n", tmp);
 
-  FILE *f;
-  u8 *fn = alloc_printf("%s/fuzzer_stats", out_dir);
+  SAYF(bVR bH bSTOP cCYA " stage progress " bSTG bH20 bX bH bSTOP cCYA
+                         " findings in depth " bSTG bH20 bVL "\n");
 
-  /* See if the output directory is locked. If yes, bail out. If not,
-     create a lock that will persist for the lifetime of the process
-     (this requires leaving the descriptor open).*/
+  sprintf(tmp, "%s (%0.02f%%)", DI(queued_favored),
+          ((double)queued_favored) * 100 / queued_paths);
 
-  out_dir_fd = open(out_dir, O_RDONLY);
-  if (out_dir_fd < 0)
-    PFATAL("Unable to open '%s'", out_dir);
+  /* Yeah... it's still going on... halp? */
 
-#ifndef __sun
+  SAYF(bV bSTOP "  now trying : " cRST "%-21s " bSTG bV bSTOP
+                " favored paths : " cRST "%-22s " bSTG bV "\n",
+       stage_name, tmp);
 
-  if (flock(out_dir_fd, LOCK_EX | LOCK_NB) && errno == EWOULDBLOCK)
+  if (!stage_max)
   {
 
-    SAYF("\n" cLRD "[-] " cRST
-         "Looks like the job output directory is being actively used by another\n"
-         "    instance of afl-fuzz. You will need to choose a different %s\n"
-         "    or stop the other process first.\n",
-         sync_id ? "fuzzer ID" : "output location");
+    sprintf(tmp, "%s/-", DI(stage_cur));
+  }
+  else
+  {
 
-    FATAL("Directory '%s' is in use", out_dir);
+    sprintf(tmp, "%s/%s (%0.02f%%)", DI(stage_cur), DI(stage_max),
+            ((double)stage_cur) * 100 / stage_max);
   }
 
-#endif /* !__sun */
+  SAYF(bV bSTOP " stage execs : " cRST "%-21s " bSTG bV bSTOP, tmp);
 
-  f = fopen(fn, "r");
+  sprintf(tmp, "%s (%0.02f%%)", DI(queued_with_cov),
+          ((double)queued_with_cov) * 100 / queued_paths);
 
-  if (f)
-  {
+  SAYF("  new edges on : " cRST "%-22s " bSTG bV "\n", tmp);
 
-    u64 start_time, last_update;
+  sprintf(tmp, "%s (%s%s unique)", DI(total_crashes), DI(unique_crashes),
+          (unique_crashes >= KEEP_UNIQUE_CRASH) ? "+" : "");
 
-    if (fscanf(f, "start_time     : %llu\n"
-                  "last_update    : %llu\n",
-               &start_time, &last_update) != 2)
-      FATAL("Malformed data in '%s'", fn);
+  if (crash_mode)
+  {
 
-    fclose(f);
+    SAYF(bV bSTOP " total execs : " cRST "%-21s " bSTG bV bSTOP
+                  "   new crashes : %s%-22s " bSTG bV "\n",
+         DI(total_execs),
+         unique_crashes ? cLRD : cRST, tmp);
+  }
+  else
+  {
 
-    /* Let's see how much work is at stake. */
+    SAYF(bV bSTOP " total execs : " cRST "%-21s " bSTG bV bSTOP
+                  " total crashes : %s%-22s " bSTG bV "\n",
+         DI(total_execs),
+         unique_crashes ? cLRD : cRST, tmp);
+  }
 
-    if (!in_place_resume && last_update - start_time > OUTPUT_GRACE * 60)
-    {
+  /* Show a warning about slow execution. */
 
-      SAYF("\n" cLRD "[-] " cRST
-           "The job output directory already exists and contains the results of more\n"
-           "    than %u minutes worth of fuzzing. To avoid data loss, afl-fuzz will *NOT*\n"
-           "    automatically delete this data for you.\n\n"
+  if (avg_exec < 100)
+  {
 
-           "    If you wish to start a new session, remove or rename the directory manually,\n"
-           "    or specify a different output location for this job. To resume the old\n"
-           "    session, put '-' as the input directory in the command line ('-i -') and\n"
-           "    try again.\n",
-           OUTPUT_GRACE);
+    sprintf(tmp, "%s/sec (%s)", DF(avg_exec), avg_exec < 20 ? "zzzz..." : "slow!");
 
-      FATAL("At-risk data found in '%s'", out_dir);
-    }
+    SAYF(bV bSTOP "  exec speed : " cLRD "%-21s ", tmp);
   }
+  else
+  {
 
-  ck_free(fn);
-
-  /* The idea for in-place resume is pretty simple: we temporarily move the old
-     queue/ to a new location that gets deleted once import to the new queue/
-     is finished. If _resume/ already exists, the current queue/ may be
-     incomplete due to an earlier abort, so we want to use the old _resume/
-     dir instead, and we let rename() fail silently. */
+    sprintf(tmp, "%s/sec", DF(avg_exec));
+    SAYF(bV bSTOP "  exec speed : " cRST "%-21s ", tmp);
+  }
 
-  if (in_place_resume)
-  {
+  sprintf(tmp, "%s (%s%s unique)", DI(total_tmouts), DI(unique_tmouts),
+          (unique_hangs >= KEEP_UNIQUE_HANG) ? "+" : "");
 
-    u8 *orig_q = alloc_printf("%s/queue", out_dir);
+  SAYF(bSTG bV bSTOP "  total tmouts : " cRST "%-22s " bSTG bV "\n", tmp);
 
-    in_dir = alloc_printf("%s/_resume", out_dir);
+  /* Aaaalmost there... hold on! */
 
-    rename(orig_q, in_dir); /* Ignore errors */
+  SAYF(bVR bH cCYA bSTOP " fuzzing strategy yields " bSTG bH10 bH bHT bH10
+           bH5 bHB bH bSTOP cCYA " path geometry " bSTG bH5 bH2 bH bVL "\n");
 
-    OKF("Output directory exists, will attempt session resume.");
+  if (skip_deterministic)
+  {
 
-    ck_free(orig_q);
+    strcpy(tmp, "n/a, n/a, n/a");
   }
   else
   {
 
-    OKF("Output directory exists but deemed OK to reuse.");
+    sprintf(tmp, "%s/%s, %s/%s, %s/%s",
+            DI(stage_finds[STAGE_FLIP1]), DI(stage_cycles[STAGE_FLIP1]),
+            DI(stage_finds[STAGE_FLIP2]), DI(stage_cycles[STAGE_FLIP2]),
+            DI(stage_finds[STAGE_FLIP4]), DI(stage_cycles[STAGE_FLIP4]));
   }
 
-  ACTF("Deleting old session data...");
+  SAYF(bV bSTOP "   bit flips : " cRST "%-37s " bSTG bV bSTOP "    levels : " cRST "%-10s " bSTG bV "\n", tmp, DI(max_depth));
 
-  /* Okay, let's get the ball rolling! First, we need to get rid of the entries
-     in <out_dir>/.synced/.../id:*, if any are present. */
+  if (!skip_deterministic)
+    sprintf(tmp, "%s/%s, %s/%s, %s/%s",
+            DI(stage_finds[STAGE_FLIP8]), DI(stage_cycles[STAGE_FLIP8]),
+            DI(stage_finds[STAGE_FLIP16]), DI(stage_cycles[STAGE_FLIP16]),
+            DI(stage_finds[STAGE_FLIP32]), DI(stage_cycles[STAGE_FLIP32]));
 
-  if (!in_place_resume)
-  {
+  SAYF(bV bSTOP "  byte flips : " cRST "%-37s " bSTG bV bSTOP "   pending : " cRST "%-10s " bSTG bV "\n", tmp, DI(pending_not_fuzzed));
 
-    fn = alloc_printf("%s/.synced", out_dir);
-    if (delete_files(fn, NULL))
-      goto dir_cleanup_failed;
-    ck_free(fn);
-  }
+  if (!skip_deterministic)
+    sprintf(tmp, "%s/%s, %s/%s, %s/%s",
+            DI(stage_finds[STAGE_ARITH8]), DI(stage_cycles[STAGE_ARITH8]),
+            DI(stage_finds[STAGE_ARITH16]), DI(stage_cycles[STAGE_ARITH16]),
+            DI(stage_finds[STAGE_ARITH32]), DI(stage_cycles[STAGE_ARITH32]));
 
-  /* Next, we need to clean up <out_dir>/queue/.state/ subdirectories: */
+  SAYF(bV bSTOP " arithmetics : " cRST "%-37s " bSTG bV bSTOP "  pend fav : " cRST "%-10s " bSTG bV "\n", tmp, DI(pending_favored));
 
-  fn = alloc_printf("%s/queue/.state/deterministic_done", out_dir);
-  if (delete_files(fn, CASE_PREFIX))
-    goto dir_cleanup_failed;
-  ck_free(fn);
+  if (!skip_deterministic)
+    sprintf(tmp, "%s/%s, %s/%s, %s/%s",
+            DI(stage_finds[STAGE_INTEREST8]), DI(stage_cycles[STAGE_INTEREST8]),
+            DI(stage_finds[STAGE_INTEREST16]), DI(stage_cycles[STAGE_INTEREST16]),
+            DI(stage_finds[STAGE_INTEREST32]), DI(stage_cycles[STAGE_INTEREST32]));
 
-  fn = alloc_printf("%s/queue/.state/auto_extras", out_dir);
-  if (delete_files(fn, "auto_"))
-    goto dir_cleanup_failed;
-  ck_free(fn);
+  SAYF(bV bSTOP "  known ints : " cRST "%-37s " bSTG bV bSTOP " own finds : " cRST "%-10s " bSTG bV "\n", tmp, DI(queued_discovered));
 
-  fn = alloc_printf("%s/queue/.state/redundant_edges", out_dir);
-  if (delete_files(fn, CASE_PREFIX))
-    goto dir_cleanup_failed;
-  ck_free(fn);
+  if (!skip_deterministic)
+    sprintf(tmp, "%s/%s, %s/%s, %s/%s",
+            DI(stage_finds[STAGE_EXTRAS_UO]), DI(stage_cycles[STAGE_EXTRAS_UO]),
+            DI(stage_finds[STAGE_EXTRAS_UI]), DI(stage_cycles[STAGE_EXTRAS_UI]),
+            DI(stage_finds[STAGE_EXTRAS_AO]), DI(stage_cycles[STAGE_EXTRAS_AO]));
 
-  fn = alloc_printf("%s/queue/.state/variable_behavior", out_dir);
-  if (delete_files(fn, CASE_PREFIX))
-    goto dir_cleanup_failed;
-  ck_free(fn);
+  SAYF(bV bSTOP "  dictionary : " cRST "%-37s " bSTG bV bSTOP
+                "  imported : " cRST "%-10s " bSTG bV "\n",
+       tmp,
+       sync_id ? DI(queued_imported) : (u8 *)"n/a");
 
-  /* Then, get rid of the .state subdirectory itself (should be empty by now)
-     and everything matching <out_dir>/queue/id:*. */
+  sprintf(tmp, "%s/%s, %s/%s",
+          DI(stage_finds[STAGE_HAVOC]), DI(stage_cycles[STAGE_HAVOC]),
+          DI(stage_finds[STAGE_SPLICE]), DI(stage_cycles[STAGE_SPLICE]));
 
-  fn = alloc_printf("%s/queue/.state", out_dir);
-  if (rmdir(fn) && errno != ENOENT)
-    goto dir_cleanup_failed;
-  ck_free(fn);
+  SAYF(bV bSTOP "       havoc : " cRST "%-37s " bSTG bV bSTOP, tmp);
 
-  fn = alloc_printf("%s/queue", out_dir);
-  if (delete_files(fn, CASE_PREFIX))
-    goto dir_cleanup_failed;
-  ck_free(fn);
+  if (t_bytes)
+    sprintf(tmp, "%0.02f%%", stab_ratio);
+  else
+    strcpy(tmp, "n/a");
 
-  /* All right, let's do <out_dir>/replayable-crashes/id:* and <out_dir>/replayable-hangs/id:*. */
+  SAYF(" stability : %s%-10s " bSTG bV "\n", (stab_ratio < 85 && var_byte_count > 40) ? cLRD : ((queued_variable && (!persistent_mode || var_byte_count > 20)) ? cMGN : cRST), tmp);
 
-  if (!in_place_resume)
+  if (!bytes_trim_out)
   {
 
-    fn = alloc_printf("%s/replayable-crashes/README.txt", out_dir);
-    unlink(fn); /* Ignore errors */
-    ck_free(fn);
+    sprintf(tmp, "n/a, ");
   }
+  else
+  {
 
-  fn = alloc_printf("%s/replayable-crashes", out_dir);
+    sprintf(tmp, "%0.02f%%/%s, ",
+            ((double)(bytes_trim_in - bytes_trim_out)) * 100 / bytes_trim_in,
+            DI(trim_execs));
+  }
 
-  /* Make backup of the crashes directory if it's not empty and if we're
-     doing in-place resume. */
+  if (!blocks_eff_total)
+  {
 
-  if (in_place_resume && rmdir(fn))
+    u8 tmp2[128];
+
+    sprintf(tmp2, "n/a");
+    strcat(tmp, tmp2);
+  }
+  else
   {
 
-    time_t cur_t = time(0);
-    struct tm *t = localtime(&cur_t);
+    u8 tmp2[128];
 
-#ifndef SIMPLE_FILES
+    sprintf(tmp2, "%0.02f%%",
+            ((double)(blocks_eff_total - blocks_eff_select)) * 100 /
+                blocks_eff_total);
 
-    u8 *nfn = alloc_printf("%s.%04u-%02u-%02u-%02u:%02u:%02u", fn,
-                           t->tm_year + 1900, t->tm_mon + 1, t->tm_mday,
-                           t->tm_hour, t->tm_min, t->tm_sec);
+    strcat(tmp, tmp2);
+  }
 
-#else
+  SAYF(bV bSTOP "        trim : " cRST "%-37s " bSTG bVR bH20 bH2 bH2 bRB "\n" bLB bH30 bH20 bH2 bH bRB bSTOP cRST RESET_G1, tmp);
 
-    u8 *nfn = alloc_printf("%s_%04u%02u%02u%02u%02u%02u", fn,
-                           t->tm_year + 1900, t->tm_mon + 1, t->tm_mday,
-                           t->tm_hour, t->tm_min, t->tm_sec);
+  /* Provide some CPU utilization stats. */
 
-#endif /* ^!SIMPLE_FILES */
+  if (cpu_core_count)
+  {
 
-    rename(fn, nfn); /* Ignore errors. */
-    ck_free(nfn);
-  }
+    double cur_runnable = get_runnable_processes();
+    u32 cur_utilization = cur_runnable * 100 / cpu_core_count;
 
-  if (delete_files(fn, CASE_PREFIX))
-    goto dir_cleanup_failed;
-  ck_free(fn);
+    u8 *cpu_color = cCYA;
 
-  fn = alloc_printf("%s/replayable-hangs", out_dir);
+    /* If we could still run one or more processes, use green. */
 
-  /* Backup hangs, too. */
+    if (cpu_core_count > 1 && cur_runnable + 1 <= cpu_core_count)
+      cpu_color = cLGN;
 
-  if (in_place_resume && rmdir(fn))
-  {
+    /* If we're clearly oversubscribed, use red. */
 
-    time_t cur_t = time(0);
-    struct tm *t = localtime(&cur_t);
+    if (!no_cpu_meter_red && cur_utilization >= 150)
+      cpu_color = cLRD;
 
-#ifndef SIMPLE_FILES
+#ifdef HAVE_AFFINITY
 
-    u8 *nfn = alloc_printf("%s.%04u-%02u-%02u-%02u:%02u:%02u", fn,
-                           t->tm_year + 1900, t->tm_mon + 1, t->tm_mday,
-                           t->tm_hour, t->tm_min, t->tm_sec);
+    if (cpu_aff >= 0)
+    {
 
-#else
+      SAYF(SP10 cGRA "[cpu%03u:%s%3u%%" cGRA "]\r" cRST,
+           MIN(cpu_aff, 999), cpu_color,
+           MIN(cur_utilization, 999));
+    }
+    else
+    {
 
-    u8 *nfn = alloc_printf("%s_%04u%02u%02u%02u%02u%02u", fn,
-                           t->tm_year + 1900, t->tm_mon + 1, t->tm_mday,
-                           t->tm_hour, t->tm_min, t->tm_sec);
+      SAYF(SP10 cGRA "   [cpu:%s%3u%%" cGRA "]\r" cRST,
+           cpu_color, MIN(cur_utilization, 999));
+    }
 
-#endif /* ^!SIMPLE_FILES */
+#else
 
-    rename(fn, nfn); /* Ignore errors. */
-    ck_free(nfn);
+    SAYF(SP10 cGRA "   [cpu:%s%3u%%" cGRA "]\r" cRST,
+         cpu_color, MIN(cur_utilization, 999));
+
+#endif /* ^HAVE_AFFINITY */
   }
+  else
+    SAYF("\r");
 
-  if (delete_files(fn, CASE_PREFIX))
-    goto dir_cleanup_failed;
-  ck_free(fn);
+  /* Where the time of an execution goes, when the terminal has room for it
+     below the main screen (25 rows). */
 
-  /* Delete regions. */
+  if (use_net && total_execs && term_rows >= 29)
+  {
 
-  fn = alloc_printf("%s/regions", out_dir);
-  if (delete_files(fn, ""))
-    goto dir_cleanup_failed;
-  ck_free(fn);
+    u32 i;
 
-  /* Delete replayable-queue. */
+    SAYF("\n" cGRA "  execution phases, p50/p99:" cEOL "\n");
 
-  fn = alloc_printf("%s/replayable-queue", out_dir);
-  if (delete_files(fn, ""))
-    goto dir_cleanup_failed;
-  ck_free(fn);
+    for (i = 0; i < PHASE_COUNT; i++)
+    {
 
-  /* Delete the old ipsm.dot */
-  fn = alloc_printf("%s/ipsm.dot", out_dir);
-  if (unlink(fn) && errno != ENOENT)
-    goto dir_cleanup_failed;
-  ck_free(fn);
+      sprintf(tmp, "%s/%s", DUS(phase_percentile(i, 50)), DUS(phase_percentile(i, 99)));
+      SAYF(cGRA "%10s : " cRST "%-13s", phase_names[i], tmp);
 
-  /* Delete the old replayable-new-ipsm-paths folder */
-  fn = alloc_printf("%s/replayable-new-ipsm-paths", out_dir);
-  if (delete_files(fn, ""))
-    goto dir_cleanup_failed;
-  ck_free(fn);
+      if (i % 3 == 2)
+        SAYF(cEOL "\n");
+    }
+  }
 
-  /* Delete the old responses-ipsm folder */
-  fn = alloc_printf("%s/responses-ipsm", out_dir);
-  if (delete_files(fn, ""))
-    goto dir_cleanup_failed;
-  ck_free(fn);
+  /* Show debugging stats for AFLNet only when AFLNET_DEBUG environment variable is set */
+  if (getenv("AFLNET_DEBUG") && (atoi(getenv("AFLNET_DEBUG")) == 1) && state_aware_mode)
+  {
+    SAYF(cRST "\n\nMax_seed_region_count: %-4s, current_kl_messages_size: %-4s\n\n", DI(max_seed_region_count), DI(kl_messages->size));
+    SAYF(cRST "State IDs and its #selected_times," cCYA "#fuzzs," cLRD "#discovered_paths," cGRA "#excersing_paths:\n");
 
-  /* Delete the old protocol-grammars folder */
-  fn = alloc_printf("%s/protocol-grammars", out_dir);
-  if (delete_files(fn, ""))
-    goto dir_cleanup_failed;
-  ck_free(fn);
+    khint_t k;
+    state_info_t *state;
+    u32 i = 0;
 
-  /* Delete the old stall-interactions folder */
-  fn = alloc_printf("%s/stall-interactions", out_dir);
-  if (delete_files(fn, ""))
-    goto dir_cleanup_failed;
-  ck_free(fn);
+    for (i = 0; i < state_ids_count; i++)
+    {
+      u32 state_id = state_ids[i];
 
-  /* And now, for some finishing touches. */
+      k = kh_get(hms, khms_states, state_id);
+      if (k != kh_end(khms_states))
+      {
+        state = kh_val(khms_states, k);
+        SAYF(cRST "S%-3s:%-4s," cCYA "%-5s," cLRD "%-5s," cGRA "%-5s", DI(state->id), DI(state->selected_times), DI(state->fuzzs), DI(state->paths_discovered), DI(state->paths));
+        if ((i + 1) % 3 == 0)
+          SAYF("\n");
+      }
+    }
+  }
 
-  fn = alloc_printf("%s/.cur_input", out_dir);
-  if (unlink(fn) && errno != ENOENT)
-    goto dir_cleanup_failed;
-  ck_free(fn);
+  /* Hallelujah! */
 
-  fn = alloc_printf("%s/fuzz_bitmap", out_dir);
-  if (unlink(fn) && errno != ENOENT)
-    goto dir_cleanup_failed;
-  ck_free(fn);
+  fflush(0);
+}
 
-  if (!in_place_resume)
+/* Display quick statistics at the end of processing the input directory,
+   plus a bunch of warnings. Some calibration stuff also ended up here,
+   along with several hardcoded constants. Maybe clean up eventually. */
+
+static void show_init_stats(void)
+{
+
+  struct queue_entry *q = queue;
+  u32 min_bits = 0, max_bits = 0;
+  u64 min_us = 0, max_us = 0;
+  u64 avg_us = 0;
+  u32 max_len = 0;
+
+  if (total_cal_cycles)
+    avg_us = total_cal_us / total_cal_cycles;
+
+  while (q)
   {
-    fn = alloc_printf("%s/fuzzer_stats", out_dir);
-    if (unlink(fn) && errno != ENOENT)
-      goto dir_cleanup_failed;
-    ck_free(fn);
-  }
 
-  fn = alloc_printf("%s/plot_data", out_dir);
-  if (unlink(fn) && errno != ENOENT)
-    goto dir_cleanup_failed;
-  ck_free(fn);
+    if (!min_us || q->exec_us < min_us)
+      min_us = q->exec_us;
+    if (q->exec_us > max_us)
+      max_us = q->exec_us;
 
-  OKF("Output dir cleanup successful.");
+    if (!min_bits || q->bitmap_size < min_bits)
+      min_bits = q->bitmap_size;
+    if (q->bitmap_size > max_bits)
+      max_bits = q->bitmap_size;
 
-  /* Wow... is that all? If yes, celebrate! */
+    if (q->len > max_len)
+      max_len = q->len;
 
-  return;
+    q = q->next;
+  }
 
-dir_cleanup_failed:
+  SAYF("\n");
 
-  SAYF("\n" cLRD "[-] " cRST
-       "Whoops, the fuzzer tried to reuse your output directory, but bumped into\n"
-       "    some files that shouldn't be there or that couldn't be removed - so it\n"
-       "    decided to abort! This happened while processing this path:\n\n"
+  if (avg_us > (qemu_mode ? 50000 : 10000))
+    WARNF(cLRD "The target binary is pretty slow! See %s/perf_tips.txt.",
+          doc_path);
 
-       "    %s\n\n"
-       "    Please examine and manually delete the files, or specify a different\n"
-       "    output location for the tool.\n",
-       fn);
+  /* Let's keep things moving with slow binaries. */
 
-  FATAL("Output directory cleanup failed");
-}
+  if (avg_us > 50000)
+    havoc_div = 10; /* 0-19 execs/sec   */
+  else if (avg_us > 20000)
+    havoc_div = 5; /* 20-49 execs/sec  */
+  else if (avg_us > 10000)
+    havoc_div = 2; /* 50-100 execs/sec */
 
-static void check_term_size(void);
+  if (!resuming_fuzz)
+  {
 
-/* A spiffy retro stats screen! This is called every stats_update_freq
-   execve() calls, plus in several other circumstances. */
+    if (max_len > 50 * 1024)
+      WARNF(cLRD "Some test cases are huge (%s) - see %s/perf_tips.txt!",
+            DMS(max_len), doc_path);
+    else if (max_len > 10 * 1024)
+      WARNF("Some test cases are big (%s) - see %s/perf_tips.txt.",
+            DMS(max_len), doc_path);
 
-static void show_stats(void)
-{
+    if (useless_at_start && !in_bitmap)
+      WARNF(cLRD "Some test cases look useless. Consider using a smaller set.");
 
-  static u64 last_stats_ms, last_plot_ms, last_ms, last_execs;
-  static double avg_exec;
-  double t_byte_ratio, stab_ratio;
+    if (queued_paths > 100)
+      WARNF(cLRD "You probably have far too many input files! Consider trimming down.");
+    else if (queued_paths > 20)
+      WARNF("You have lots of input files; try starting small.");
+  }
 
-  u64 cur_ms;
-  u32 t_bytes, t_bits;
+  OKF("Here are some useful stats:\n\n"
 
-  u32 banner_len, banner_pad;
-  u8 tmp[256];
+      cGRA "    Test case count : " cRST "%u favored, %u variable, %u total\n" cGRA "       Bitmap range : " cRST "%u to %u bits (average: %0.02f bits)\n" cGRA "        Exec timing : " cRST "%s to %s us (average: %s us)\n",
+      queued_favored, queued_variable, queued_paths, min_bits, max_bits,
+      ((double)total_bitmap_size) / (total_bitmap_entries ? total_bitmap_entries : 1),
+      DI(min_us), DI(max_us), DI(avg_us));
 
-  cur_ms = get_cur_time();
+  if (!timeout_given)
+  {
 
-  /* If not enough time has passed since last UI update, bail out. */
+    /* Figure out the appropriate timeout. The basic idea is: 5x average or
+       1x max, rounded up to EXEC_TM_ROUND ms and capped at 1 second.
 
-  if (cur_ms - last_ms < 1000 / UI_TARGET_HZ)
-    return;
+       If the program is slow, the multiplier is lowered to 2x or 3x, because
+       random scheduler jitter is less likely to have any impact, and because
+       our patience is wearing thin =) */
 
-  /* Check if we're past the 10 minute mark. */
+    if (avg_us > 50000)
+      exec_tmout = avg_us * 2 / 1000;
+    else if (avg_us > 10000)
+      exec_tmout = avg_us * 3 / 1000;
+    else
+      exec_tmout = avg_us * 5 / 1000;
 
-  if (cur_ms - start_time > 10 * 60 * 1000)
-    run_over10m = 1;
+    exec_tmout = MAX(exec_tmout, max_us / 1000);
+    exec_tmout = (exec_tmout + EXEC_TM_ROUND) / EXEC_TM_ROUND * EXEC_TM_ROUND;
 
-  /* Calculate smoothed exec speed stats. */
+    if (exec_tmout > EXEC_TIMEOUT)
+      exec_tmout = EXEC_TIMEOUT;
 
-  if (!last_execs)
-  {
+    ACTF("No -t option specified, so I'll use exec timeout of %u ms.",
+         exec_tmout);
 
-    avg_exec = ((double)total_execs) * 1000 / (cur_ms - start_time);
+    timeout_given = 1;
   }
-  else
+  else if (timeout_given == 3)
   {
 
-    double cur_avg = ((double)(total_execs - last_execs)) * 1000 /
-                     (cur_ms - last_ms);
+    ACTF("Applying timeout settings from resumed session (%u ms).", exec_tmout);
+  }
 
-    /* If there is a dramatic (5x+) jump in speed, reset the indicator
-       more quickly. */
+  /* In dumb mode, re-running every timing out test case with a generous time
+     limit is very expensive, so let's select a more conservative default. */
 
-    if (cur_avg * 5 < avg_exec || cur_avg / 5 > avg_exec)
-      avg_exec = cur_avg;
+  if (dumb_mode && !getenv("AFL_HANG_TMOUT"))
+    hang_tmout = MIN(EXEC_TIMEOUT, exec_tmout * 2 + 100);
 
-    avg_exec = avg_exec * (1.0 - 1.0 / AVG_SMOOTHING) +
-               cur_avg * (1.0 / AVG_SMOOTHING);
-  }
+  OKF("All set and ready to roll!");
+}
 
-  last_ms = cur_ms;
-  last_execs = total_execs;
+/* The tail of common_fuzz_stuff(): account for an execution that has been run, by afl-fuzz
+   or by a worker (-J), and keep its input if it is interesting. Returns 1 if the entry
+   should be abandoned */
 
-  /* Tell the callers when to contact us (as measured in execs). */
+static u8 finish_fuzz_stuff(char **argv, u8 *out_buf, u32 len, u8 fault)
+{
 
-  stats_update_freq = avg_exec / (UI_TARGET_HZ * 10);
-  if (!stats_update_freq)
-    stats_update_freq = 1;
+  // Update fuzz count, no matter whether the generated test is interesting or not
+  if (state_aware_mode)
+    update_fuzzs();
 
-  /* Do some bitmap stats. */
+  if (stop_soon)
+    return 1;
 
-  t_bytes = count_non_255_bytes(virgin_bits);
-  t_byte_ratio = ((double)t_bytes * 100) / MAP_SIZE;
+  if (fault == FAULT_TMOUT)
+  {
 
-  if (t_bytes)
-    stab_ratio = 100 - ((double)var_byte_count) * 100 / t_bytes;
+    if (subseq_tmouts++ > TMOUT_LIMIT)
+    {
+      cur_skipped_paths++;
+      return 1;
+    }
+  }
   else
-    stab_ratio = 100;
+    subseq_tmouts = 0;
 
-  /* Roughly every minute, update fuzzer stats and save auto tokens. */
+  /* Users can hit us with SIGUSR1 to request the current input
+     to be abandoned. */
 
-  if (cur_ms - last_stats_ms > STATS_UPDATE_SEC * 1000)
+  if (skip_requested)
   {
 
-    last_stats_ms = cur_ms;
-    write_stats_file(t_byte_ratio, stab_ratio, avg_exec);
-    save_auto();
-    write_bitmap();
+    skip_requested = 0;
+    cur_skipped_paths++;
+    return 1;
   }
 
-  /* Every now and then, write plot data. */
+  /* This handles FAULT_ERROR for us: */
 
-  if (cur_ms - last_plot_ms > PLOT_UPDATE_SEC * 1000)
-  {
+  u8 is_interesting = save_if_interesting(argv, out_buf, len, fault);
 
-    last_plot_ms = cur_ms;
-    maybe_update_plot_file(t_byte_ratio, avg_exec);
+  if (is_interesting)
+  {
+    uninteresting_times = 0;
+  }
+  else
+  {
+    uninteresting_times++;
   }
 
-  /* Honor AFL_EXIT_WHEN_DONE and AFL_BENCH_UNTIL_CRASH. */
+  queued_discovered += is_interesting;
 
-  if (!dumb_mode && cycles_wo_finds > 100 && !pending_not_fuzzed &&
-      getenv("AFL_EXIT_WHEN_DONE"))
-    stop_soon = 2;
+  if (!(stage_cur % stats_update_freq) || stage_cur + 1 == stage_max)
+    show_stats();
 
-  if (total_crashes && getenv("AFL_BENCH_UNTIL_CRASH"))
-    stop_soon = 2;
+  return 0;
+}
 
-  /* If we're not on TTY, bail out. */
+/* Execution workers (-J). Each is a fork of afl-fuzz with a server, a fork server, a trace
+   map and desock rings of its own. During havoc and splicing, common_fuzz_stuff() hands
+   the messages of a test case to an idle worker and goes on mutating; the worker runs it
+   and leaves the outcome in its slot, where afl-fuzz picks it up and finishes the job as if
+   it had run it itself. In the dry run, the workers calibrate the test cases ahead of the
+   one afl-fuzz is on (see dry_run_ahead()). Everything else (the calibration of new finds,
+   trimming, the deterministic stages) runs on the server of afl-fuzz, as before. */
 
-  if (not_on_tty)
-    return;
+enum
+{
+  /* 00 */ WORKER_INIT,
+  /* 01 */ WORKER_IDLE,
+  /* 02 */ WORKER_JOB,
+  /* 03 */ WORKER_DONE
+};
 
-  /* Compute some mildly useful bitmap stats. */
+struct worker_slot
+{
+  u32 state;                            /* WORKER_*, futex-waited on by the worker */
+  s32 map_id, desock_id;                /* the trace map and rings of the worker */
+  u32 tmout;                            /* exec timeout of the job */
+  u32 msg_count, req_len;               /* messages in req[] and the bytes they take */
+  u8 fault, kill_signal;                /* outcome of the job ... */
+  u32 messages_sent, resp_len;          /* ... messages sent, response bytes in resp[] */
+  u64 slowest_exec_ms;
+  u32 cal_runs, cal_done;               /* dry run: calibration runs asked for, and done */
+  u32 cal_us[CAL_CYCLES_LONG];          /* ... the time each of them took */
+  u8 cal_faults[CAL_CYCLES_LONG];       /* ... their outcome */
+  u8 cal_traces[CAL_CYCLES_LONG][MAP_SIZE]; /* ... and their trace maps */
+  u8 cal_var_bytes[MAP_SIZE];           /* var_bytes[] when the job was handed out */
+  u8 req[WORKER_REQ_SIZE];              /* the message sizes, then their data */
+  u8 resp[WORKER_RESP_SIZE];            /* response_bytes[], then response_buf */
+};
 
-  t_bits = (MAP_SIZE << 3) - count_bits(virgin_bits);
+struct worker
+{
+  struct worker_slot *slot;
+  s32 pid;
+  u8 *trace_bits;                       /* the trace map of the worker, read-only */
+  u8 *buf;                              /* the test case of the job, for save_if_interesting() */
+  u32 len, buf_cap;
+  struct queue_entry *cal_q;            /* the test case it calibrates in the dry run */
+};
 
-  /* Now, for the visuals... */
+/* Turn the messages of a job back into a list */
 
-  if (clear_screen)
+static klist_t(lms) * unpack_messages(struct worker_slot *slot)
+{
+  klist_t(lms) *list = kl_init(lms);
+  u32 *sizes = (u32 *)slot->req;
+  u8 *data = slot->req + slot->msg_count * sizeof(u32);
+  u32 i;
+
+  for (i = 0; i < slot->msg_count; i++)
   {
+    message_t *m = ck_alloc(sizeof(message_t));
 
-    SAYF(TERM_CLEAR CURSOR_HIDE);
-    clear_screen = 0;
+    m->msize = sizes[i];
+    m->mdata = ck_alloc(m->msize);
+    memcpy(m->mdata, data, m->msize);
+    data += m->msize;
 
-    check_term_size();
+    *kl_pushp(lms, list) = m;
   }
 
-  SAYF(TERM_HOME);
+  return list;
+}
 
-  if (term_too_small)
-  {
+/* Pack kl_messages into the slot. Returns 0 if they do not fit */
 
-    SAYF(cBRI "Your terminal is too small to display the UI.\n"
-              "Please resize terminal window to at least 80x25.\n" cRST);
+static u8 pack_job(struct worker_slot *slot)
+{
+  kliter_t(lms) * it;
+  u32 count = 0, total = 0;
+  u32 *sizes = (u32 *)slot->req;
+  u8 *data;
 
-    return;
+  for (it = kl_begin(kl_messages); it != kl_end(kl_messages); it = kl_next(it))
+  {
+    count++;
+    total += kl_val(it)->msize;
   }
 
-  /* Let's start by drawing a centered banner. */
+  if ((u64)count * sizeof(u32) + total > WORKER_REQ_SIZE)
+    return 0;
 
-  banner_len = (crash_mode ? 24 : 22) + strlen(VERSION) + strlen(use_banner);
-  banner_pad = (80 - banner_len) / 2;
-  memset(tmp, ' ', banner_pad);
+  data = slot->req + count * sizeof(u32);
 
-  sprintf(tmp + banner_pad, "%s " cLCY VERSION cLGN " (%s)", crash_mode ? cPIN "peruvian were-rabbit" : cYEL "american fuzzy lop", use_banner);
+  for (it = kl_begin(kl_messages); it != kl_end(kl_messages); it = kl_next(it))
+  {
+    *sizes++ = kl_val(it)->msize;
+    memcpy(data, kl_val(it)->mdata, kl_val(it)->msize);
+    data += kl_val(it)->msize;
+  }
 
-  SAYF("\n%s\n\n", tmp);
+  slot->msg_count = count;
+  slot->req_len = total;
 
-  /* "Handy" shortcuts for drawing boxes... */
+  return 1;
+}
 
-#define bSTG bSTART cGRA
-#define bH2 bH bH
-#define bH5 bH2 bH2 bH
-#define bH10 bH5 bH5
-#define bH20 bH10 bH10
-#define bH30 bH20 bH10
-#define SP5 "     "
-#define SP10 SP5 SP5
-#define SP20 SP10 SP10
+/* Let afl-fuzz know that a worker has moved on */
 
-  /* Lord, forgive me this. */
+static void worker_report(struct worker_slot *slot, u32 state)
+{
+  __atomic_store_n(&slot->state, state, __ATOMIC_RELEASE);
+  __atomic_add_fetch(worker_done, 1, __ATOMIC_RELEASE);
+  desock_futex_wake(worker_done);
+}
 
-  SAYF(SET_G1 bSTG bLT bH bSTOP cCYA " process timing " bSTG bH30 bH5 bH2 bHB
-           bH bSTOP cCYA " overall results " bSTG bH5 bRT "\n");
+/* Run a test case of the dry run the way calibrate_case() is going to replay it: cal_runs
+   times, or CAL_CYCLES_LONG once its trace varies in bytes not known to vary yet, up to the
+   first unexpected fault. afl-fuzz may know of more variable bytes by the time it replays
+   the runs, so it never needs more of them than were run here */
 
-  if (dumb_mode)
-  {
+static void worker_calibrate(char **argv, struct worker_slot *slot)
+{
+  u32 runs = slot->cal_runs, first_cksum = 0, i;
 
-    strcpy(tmp, cRST);
-  }
-  else
+  reuse_fresh = 1;
+
+  for (i = 0; i < runs && i < CAL_CYCLES_LONG; i++)
   {
+    u64 start_us = get_cur_time_us();
+    u32 cksum;
 
-    u64 min_wo_finds = (cur_ms - last_path_time) / 1000 / 60;
+    slot->fault = slot->cal_faults[i] = run_target(argv, exec_tmout);
+    slot->cal_us[i] = get_cur_time_us() - start_us;
+    memcpy(slot->cal_traces[i], trace_bits, MAP_SIZE);
 
-    /* First queue cycle: don't stop now! */
-    if (queue_cycle == 1 || min_wo_finds < 15)
-      strcpy(tmp, cMGN);
-    else
+    if (stop_soon || slot->fault != crash_mode)
+    {
+      i++;
+      break;
+    }
 
-      /* Subsequent cycles, but we're still making finds. */
-      if (cycles_wo_finds < 25 || min_wo_finds < 30)
-        strcpy(tmp, cYEL);
-      else
+    cksum = hash32(trace_bits, MAP_SIZE, HASH_CONST);
 
-        /* No finds for a long time and no test cases to try. */
-        if (cycles_wo_finds > 100 && !pending_not_fuzzed && min_wo_finds > 120)
-          strcpy(tmp, cLGN);
+    if (!i)
+      first_cksum = cksum;
+    else if (cksum != first_cksum && runs < CAL_CYCLES_LONG)
+    {
+      u32 j;
 
-        /* Default: cautiously OK to stop? */
-        else
-          strcpy(tmp, cLBL);
+      for (j = 0; j < MAP_SIZE; j++)
+      {
+        if (!slot->cal_var_bytes[j] && slot->cal_traces[0][j] != trace_bits[j])
+        {
+          runs = CAL_CYCLES_LONG;
+          break;
+        }
+      }
+    }
   }
 
-  SAYF(bV bSTOP "        run time : " cRST "%-34s " bSTG bV bSTOP
-                "  cycles done : %s%-5s  " bSTG bV "\n",
-       DTD(cur_ms, start_time), tmp, DI(queue_cycle - 1));
+  slot->cal_done = i;
+}
 
-  /* We want to warn people about not seeing new paths after a full cycle,
-     except when resuming fuzzing or running in non-instrumented mode. */
+/* Main loop of a worker: run the jobs put in its slot until afl-fuzz goes away */
 
-  if (!dumb_mode && (last_path_time || resuming_fuzz || queue_cycle == 1 ||
-                     in_bitmap || crash_mode))
-  {
+static void worker_main(char **argv, struct worker_slot *slot)
+{
+  struct timespec ts = {1, 0};
+  u8 *shm_str;
 
-    SAYF(bV bSTOP "   last new path : " cRST "%-34s ",
-         DTD(cur_ms, last_path_time));
-  }
-  else
+  /* Whatever the worker and its servers print would only mess up the UI. */
+
+  dup2(dev_null_fd, 1);
+  prctl(PR_SET_PDEATHSIG, SIGTERM);
+
+#ifdef HAVE_AFFINITY
+
+  /* afl-fuzz is bound to one core; its workers should go wherever there is room. */
+
+  if (cpu_aff >= 0)
   {
+    cpu_set_t c;
+    s32 i;
 
-    if (dumb_mode)
+    CPU_ZERO(&c);
+    for (i = 0; i < cpu_core_count; i++)
+      CPU_SET(i, &c);
+    sched_setaffinity(0, sizeof(c), &c);
+  }
 
-      SAYF(bV bSTOP "   last new path : " cPIN "n/a" cRST
-                    " (non-instrumented mode)        ");
+#endif /* HAVE_AFFINITY */
 
-    else
+  /* A trace map of its own; remove_shm() takes care of it on the way out. */
 
-      SAYF(bV bSTOP "   last new path : " cRST "none yet " cLRD
-                    "(odd, check syntax!)      ");
-  }
+  shmdt(trace_bits);
 
-  SAYF(bSTG bV bSTOP "  total paths : " cRST "%-5s  " bSTG bV "\n",
-       DI(queued_paths));
+  shm_id = shmget(IPC_PRIVATE, SHM_SIZE, IPC_CREAT | IPC_EXCL | 0600);
+  if (shm_id < 0)
+    PFATAL("shmget() failed");
 
-  /* Highlight crashes in red if found, denote going over the KEEP_UNIQUE_CRASH
-     limit with a '+' appended to the count. */
+  trace_bits = shmat(shm_id, NULL, 0);
+  if (trace_bits == (void *)-1)
+    PFATAL("shmat() failed");
 
-  sprintf(tmp, "%s%s", DI(unique_crashes),
-          (unique_crashes >= KEEP_UNIQUE_CRASH) ? "+" : "");
+  shm_str = alloc_printf("%d", shm_id);
+  setenv(SHM_ENV_VAR, shm_str, 1);
+  ck_free(shm_str);
 
-  SAYF(bV bSTOP " last uniq crash : " cRST "%-34s " bSTG bV bSTOP
-                " uniq crashes : %s%-6s " bSTG bV "\n",
-       DTD(cur_ms, last_crash_time), unique_crashes ? cLRD : cRST,
-       tmp);
+  /* A network namespace of its own (-G), where the server has the port to itself. */
 
-  sprintf(tmp, "%s%s", DI(unique_hangs),
-          (unique_hangs >= KEEP_UNIQUE_HANG) ? "+" : "");
+  if (netns_pool)
+    create_private_netns();
 
-  SAYF(bV bSTOP "  last uniq hang : " cRST "%-34s " bSTG bV bSTOP
-                "   uniq hangs : " cRST "%-6s " bSTG bV "\n",
-       DTD(cur_ms, last_hang_time), tmp);
+  /* And rings of its own; without -G, the server is kept off the port the others bind to. */
 
-  SAYF(bVR bH bSTOP cCYA " cycle progress " bSTG bH20 bHB bH bSTOP cCYA
-                         " map coverage " bSTG bH bHT bH20 bH2 bH bVL "\n");
+  if (use_desock)
+  {
+    u32 persist = desock_shm->persist;
 
-  /* This gets funny because we want to print several variable-length variables
-     together, but then cram them into a fixed-width field - so we need to
-     put them in a temporary buffer first. */
+    shmdt(desock_shm);
+    close(desock_efds[0]);
+    close(desock_efds[1]);
+    close(desock_efds[2]);
 
-  sprintf(tmp, "%s%s (%0.02f%%)", DI(current_entry),
-          queue_cur->favored ? "" : "*",
-          ((double)current_entry * 100) / queued_paths);
+    create_desock();
+    desock_shm->persist = persist;
+    desock_shm->any_port = !netns_pool;
+  }
 
-  SAYF(bV bSTOP "  now processing : " cRST "%-17s " bSTG bV bSTOP, tmp);
+  setup_exec_timers();
 
-  sprintf(tmp, "%0.02f%% / %0.02f%%", ((double)queue_cur->bitmap_size) * 100 / MAP_SIZE, t_byte_ratio);
+  slot->map_id = shm_id;
+  slot->desock_id = desock_shm_id;
+  worker_report(slot, WORKER_IDLE);
 
-  SAYF("    map density : %s%-21s " bSTG bV "\n", t_byte_ratio > 70 ? cLRD : ((t_bytes < 200 && !dumb_mode) ? cPIN : cRST), tmp);
+  while (!stop_soon)
+  {
+    u32 state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+    u32 i, room;
 
-  sprintf(tmp, "%s (%0.02f%%)", DI(cur_skipped_paths),
-          ((double)cur_skipped_paths * 100) / queued_paths);
+    if (state != WORKER_JOB)
+    {
+      desock_futex_wait(&slot->state, state, &ts);
+      if (getppid() == 1)
+        break;
+      continue;
+    }
 
-  SAYF(bV bSTOP " paths timed out : " cRST "%-17s " bSTG bV, tmp);
+    kl_messages = unpack_messages(slot);
 
-  sprintf(tmp, "%0.02f bits/tuple",
-          t_bytes ? (((double)t_bits) / t_bytes) : 0);
+    if (dumb_mode != 1 && !no_forkserver && !forksrv_pid)
+      init_forkserver(argv);
 
-  SAYF(bSTOP " count coverage : " cRST "%-21s " bSTG bV "\n", tmp);
+    // the timeout may have been adjusted since we were forked
+    exec_tmout = slot->tmout;
 
-  SAYF(bVR bH bSTOP cCYA " stage progress " bSTG bH20 bX bH bSTOP cCYA
-                         " findings in depth " bSTG bH20 bVL "\n");
+    if (slot->cal_runs)
+      worker_calibrate(argv, slot);
+    else
+      slot->fault = run_target(argv, exec_tmout);
+    slot->kill_signal = kill_signal;
+    slot->slowest_exec_ms = slowest_exec_ms;
 
-  sprintf(tmp, "%s (%0.02f%%)", DI(queued_favored),
-          ((double)queued_favored) * 100 / queued_paths);
+    /* The responses, cut short if they do not fit. */
 
-  /* Yeah... it's still going on... halp? */
+    room = WORKER_RESP_SIZE - messages_sent * sizeof(u32);
 
-  SAYF(bV bSTOP "  now trying : " cRST "%-21s " bSTG bV bSTOP
-                " favored paths : " cRST "%-22s " bSTG bV "\n",
-       stage_name, tmp);
+    for (i = 0; i < messages_sent; i++)
+      ((u32 *)slot->resp)[i] = MIN(response_bytes[i], room);
 
-  if (!stage_max)
-  {
+    slot->messages_sent = messages_sent;
+    slot->resp_len = MIN((u32)response_buf_size, room);
+    memcpy(slot->resp + messages_sent * sizeof(u32), response_buf, slot->resp_len);
 
-    sprintf(tmp, "%s/-", DI(stage_cur));
-  }
-  else
-  {
+    delete_kl_messages(kl_messages);
+    kl_messages = NULL;
 
-    sprintf(tmp, "%s/%s (%0.02f%%)", DI(stage_cur), DI(stage_max),
-            ((double)stage_cur) * 100 / stage_max);
+    worker_report(slot, WORKER_DONE);
   }
 
-  SAYF(bV bSTOP " stage execs : " cRST "%-21s " bSTG bV bSTOP, tmp);
-
-  sprintf(tmp, "%s (%0.02f%%)", DI(queued_with_cov),
-          ((double)queued_with_cov) * 100 / queued_paths);
+  exit(0);
+}
 
-  SAYF("  new edges on : " cRST "%-22s " bSTG bV "\n", tmp);
+/* Fork the workers and wait for them to be ready */
 
-  sprintf(tmp, "%s (%s%s unique)", DI(total_crashes), DI(unique_crashes),
-          (unique_crashes >= KEEP_UNIQUE_CRASH) ? "+" : "");
+static void start_workers(char **argv)
+{
+  struct worker_slot *slot;
+  u32 i;
 
-  if (crash_mode)
-  {
+  ACTF("Starting %u execution workers...", worker_count);
 
-    SAYF(bV bSTOP " total execs : " cRST "%-21s " bSTG bV bSTOP
-                  "   new crashes : %s%-22s " bSTG bV "\n",
-         DI(total_execs),
-         unique_crashes ? cLRD : cRST, tmp);
-  }
-  else
-  {
+  worker_done = mmap(NULL, sizeof(u32), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (worker_done == MAP_FAILED)
+    PFATAL("mmap() failed");
 
-    SAYF(bV bSTOP " total execs : " cRST "%-21s " bSTG bV bSTOP
-                  " total crashes : %s%-22s " bSTG bV "\n",
-         DI(total_execs),
-         unique_crashes ? cLRD : cRST, tmp);
-  }
+  workers = ck_alloc(worker_count * sizeof(struct worker));
 
-  /* Show a warning about slow execution. */
+  // Output buffered now would be printed by every worker on its way out
+  fflush(NULL);
 
-  if (avg_exec < 100)
+  for (i = 0; i < worker_count; i++)
   {
+    slot = mmap(NULL, sizeof(struct worker_slot), PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (slot == MAP_FAILED)
+      PFATAL("mmap() failed");
 
-    sprintf(tmp, "%s/sec (%s)", DF(avg_exec), avg_exec < 20 ? "zzzz..." : "slow!");
+    workers[i].slot = slot;
+    workers[i].pid = fork();
 
-    SAYF(bV bSTOP "  exec speed : " cLRD "%-21s ", tmp);
-  }
-  else
-  {
+    if (workers[i].pid < 0)
+      PFATAL("fork() failed");
 
-    sprintf(tmp, "%s/sec", DF(avg_exec));
-    SAYF(bV bSTOP "  exec speed : " cRST "%-21s ", tmp);
+    if (!workers[i].pid)
+    {
+      ck_free(workers);
+      worker_main(argv, slot);
+    }
   }
 
-  sprintf(tmp, "%s (%s%s unique)", DI(total_tmouts), DI(unique_tmouts),
-          (unique_hangs >= KEEP_UNIQUE_HANG) ? "+" : "");
+  for (i = 0; i < worker_count; i++)
+  {
+    slot = workers[i].slot;
 
-  SAYF(bSTG bV bSTOP "  total tmouts : " cRST "%-22s " bSTG bV "\n", tmp);
+    while (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) == WORKER_INIT)
+    {
+      u32 seq = __atomic_load_n(worker_done, __ATOMIC_ACQUIRE);
+      struct timespec ts = {0, 100 * 1000000};
 
-  /* Aaaalmost there... hold on! */
+      if (waitpid(workers[i].pid, NULL, WNOHANG))
+        FATAL("Execution worker %u failed to start", i);
 
-  SAYF(bVR bH cCYA bSTOP " fuzzing strategy yields " bSTG bH10 bH bHT bH10
-           bH5 bHB bH bSTOP cCYA " path geometry " bSTG bH5 bH2 bH bVL "\n");
+      if (stop_soon)
+        return;
 
-  if (skip_deterministic)
-  {
+      if (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) == WORKER_INIT)
+        desock_futex_wait(worker_done, seq, &ts);
+    }
 
-    strcpy(tmp, "n/a, n/a, n/a");
+    workers[i].trace_bits = shmat(slot->map_id, NULL, SHM_RDONLY);
+    if (workers[i].trace_bits == (void *)-1)
+      PFATAL("shmat() failed");
   }
-  else
-  {
 
-    sprintf(tmp, "%s/%s, %s/%s, %s/%s",
-            DI(stage_finds[STAGE_FLIP1]), DI(stage_cycles[STAGE_FLIP1]),
-            DI(stage_finds[STAGE_FLIP2]), DI(stage_cycles[STAGE_FLIP2]),
-            DI(stage_finds[STAGE_FLIP4]), DI(stage_cycles[STAGE_FLIP4]));
-  }
+  OKF("Havoc and splicing run on %u servers besides ours (-J).", worker_count);
+}
 
-  SAYF(bV bSTOP "   bit flips : " cRST "%-37s " bSTG bV bSTOP "    levels : " cRST "%-10s " bSTG bV "\n", tmp, DI(max_depth));
+/* Terminate the workers. They remove their shared memory on the way out; in case they
+   do not get to, do it here as well */
 
-  if (!skip_deterministic)
-    sprintf(tmp, "%s/%s, %s/%s, %s/%s",
-            DI(stage_finds[STAGE_FLIP8]), DI(stage_cycles[STAGE_FLIP8]),
-            DI(stage_finds[STAGE_FLIP16]), DI(stage_cycles[STAGE_FLIP16]),
-            DI(stage_finds[STAGE_FLIP32]), DI(stage_cycles[STAGE_FLIP32]));
+static void stop_workers(void)
+{
+  u32 i;
 
-  SAYF(bV bSTOP "  byte flips : " cRST "%-37s " bSTG bV bSTOP "   pending : " cRST "%-10s " bSTG bV "\n", tmp, DI(pending_not_fuzzed));
+  if (!workers)
+    return;
 
-  if (!skip_deterministic)
-    sprintf(tmp, "%s/%s, %s/%s, %s/%s",
-            DI(stage_finds[STAGE_ARITH8]), DI(stage_cycles[STAGE_ARITH8]),
-            DI(stage_finds[STAGE_ARITH16]), DI(stage_cycles[STAGE_ARITH16]),
-            DI(stage_finds[STAGE_ARITH32]), DI(stage_cycles[STAGE_ARITH32]));
+  for (i = 0; i < worker_count; i++)
+    if (workers[i].pid > 0)
+      kill(workers[i].pid, SIGTERM);
 
-  SAYF(bV bSTOP " arithmetics : " cRST "%-37s " bSTG bV bSTOP "  pend fav : " cRST "%-10s " bSTG bV "\n", tmp, DI(pending_favored));
+  for (i = 0; i < worker_count; i++)
+  {
+    if (workers[i].pid > 0)
+      waitpid(workers[i].pid, NULL, 0);
 
-  if (!skip_deterministic)
-    sprintf(tmp, "%s/%s, %s/%s, %s/%s",
-            DI(stage_finds[STAGE_INTEREST8]), DI(stage_cycles[STAGE_INTEREST8]),
-            DI(stage_finds[STAGE_INTEREST16]), DI(stage_cycles[STAGE_INTEREST16]),
-            DI(stage_finds[STAGE_INTEREST32]), DI(stage_cycles[STAGE_INTEREST32]));
+    shmctl(workers[i].slot->map_id, IPC_RMID, NULL);
+    shmctl(workers[i].slot->desock_id, IPC_RMID, NULL);
+  }
 
-  SAYF(bV bSTOP "  known ints : " cRST "%-37s " bSTG bV bSTOP " own finds : " cRST "%-10s " bSTG bV "\n", tmp, DI(queued_discovered));
+  ck_free(workers);
+  workers = NULL;
+}
 
-  if (!skip_deterministic)
-    sprintf(tmp, "%s/%s, %s/%s, %s/%s",
-            DI(stage_finds[STAGE_EXTRAS_UO]), DI(stage_cycles[STAGE_EXTRAS_UO]),
-            DI(stage_finds[STAGE_EXTRAS_UI]), DI(stage_cycles[STAGE_EXTRAS_UI]),
-            DI(stage_finds[STAGE_EXTRAS_AO]), DI(stage_cycles[STAGE_EXTRAS_AO]));
+/* Wait until a worker is done with a job, with seq the value of worker_done before the
+   slots were last looked at. Returns 1 if a worker is gone while we are stopping */
 
-  SAYF(bV bSTOP "  dictionary : " cRST "%-37s " bSTG bV bSTOP
-                "  imported : " cRST "%-10s " bSTG bV "\n",
-       tmp,
-       sync_id ? DI(queued_imported) : (u8 *)"n/a");
+static u8 wait_for_workers(u32 seq)
+{
+  struct timespec ts = {0, 100 * 1000000};
+  u32 i;
 
-  sprintf(tmp, "%s/%s, %s/%s",
-          DI(stage_finds[STAGE_HAVOC]), DI(stage_cycles[STAGE_HAVOC]),
-          DI(stage_finds[STAGE_SPLICE]), DI(stage_cycles[STAGE_SPLICE]));
+  desock_futex_wait(worker_done, seq, &ts);
 
-  SAYF(bV bSTOP "       havoc : " cRST "%-37s " bSTG bV bSTOP, tmp);
+  if (__atomic_load_n(worker_done, __ATOMIC_ACQUIRE) != seq)
+    return 0;
 
-  if (t_bytes)
-    sprintf(tmp, "%0.02f%%", stab_ratio);
-  else
-    strcpy(tmp, "n/a");
+  // Nothing for 100ms: make sure nobody died on the job
+  for (i = 0; i < worker_count; i++)
+  {
+    if (workers[i].pid > 0 && !waitpid(workers[i].pid, NULL, WNOHANG))
+      continue;
 
-  SAYF(" stability : %s%-10s " bSTG bV "\n", (stab_ratio < 85 && var_byte_count > 40) ? cLRD : ((queued_variable && (!persistent_mode || var_byte_count > 20)) ? cMGN : cRST), tmp);
+    workers[i].pid = -1;
 
-  if (!bytes_trim_out)
-  {
+    if (stop_soon)
+      return 1;
 
-    sprintf(tmp, "n/a, ");
+    FATAL("Execution worker %u died (try without -J to see why)", i);
   }
-  else
-  {
 
-    sprintf(tmp, "%0.02f%%/%s, ",
-            ((double)(bytes_trim_in - bytes_trim_out)) * 100 / bytes_trim_in,
-            DI(trim_execs));
-  }
+  return 0;
+}
 
-  if (!blocks_eff_total)
-  {
+/* Load the outcome of the job of a worker into the globals run_target() would have set */
 
-    u8 tmp2[128];
+static void load_worker_outcome(struct worker *w)
+{
+  struct worker_slot *slot = w->slot;
 
-    sprintf(tmp2, "n/a");
-    strcat(tmp, tmp2);
-  }
-  else
-  {
+  memcpy(trace_bits, w->trace_bits, MAP_SIZE);
 
-    u8 tmp2[128];
+  if (response_buf_cap < slot->resp_len + 1)
+  {
+    response_buf = ck_realloc(response_buf, slot->resp_len + 1);
+    response_buf_cap = slot->resp_len + 1;
+  }
+  memcpy(response_buf, slot->resp + slot->messages_sent * sizeof(u32), slot->resp_len);
+  response_buf[slot->resp_len] = '\0';
+  response_buf_size = slot->resp_len;
+  exec_states_parsed = 0;
 
-    sprintf(tmp2, "%0.02f%%",
-            ((double)(blocks_eff_total - blocks_eff_select)) * 100 /
-                blocks_eff_total);
+  if (response_buf_size > response_buf_peak)
+    response_buf_peak = response_buf_size;
 
-    strcat(tmp, tmp2);
-  }
+  reserve_response_bytes(slot->messages_sent);
+  memcpy(response_bytes, slot->resp, slot->messages_sent * sizeof(u32));
+  messages_sent = slot->messages_sent;
 
-  SAYF(bV bSTOP "        trim : " cRST "%-37s " bSTG bVR bH20 bH2 bH2 bRB "\n" bLB bH30 bH20 bH2 bH bRB bSTOP cRST RESET_G1, tmp);
+  kill_signal = slot->kill_signal;
 
-  /* Provide some CPU utilization stats. */
+  if (slowest_exec_ms < slot->slowest_exec_ms)
+    slowest_exec_ms = slot->slowest_exec_ms;
+}
 
-  if (cpu_core_count)
-  {
+/* Finish the job of a worker: load its outcome, and take it from there */
 
-    double cur_runnable = get_runnable_processes();
-    u32 cur_utilization = cur_runnable * 100 / cpu_core_count;
+static u8 finish_worker_job(char **argv, struct worker *w)
+{
+  struct worker_slot *slot = w->slot;
+  klist_t(lms) *own_messages = kl_messages;
+  u8 res;
 
-    u8 *cpu_color = cCYA;
+  kl_messages = unpack_messages(slot);
 
-    /* If we could still run one or more processes, use green. */
+  load_worker_outcome(w);
+  total_execs++;
 
-    if (cpu_core_count > 1 && cur_runnable + 1 <= cpu_core_count)
-      cpu_color = cLGN;
+  res = finish_fuzz_stuff(argv, w->buf, w->len, slot->fault);
 
-    /* If we're clearly oversubscribed, use red. */
+  delete_kl_messages(kl_messages);
+  kl_messages = own_messages;
 
-    if (!no_cpu_meter_red && cur_utilization >= 150)
-      cpu_color = cLRD;
+  __atomic_store_n(&slot->state, WORKER_IDLE, __ATOMIC_RELEASE);
 
-#ifdef HAVE_AFFINITY
+  return res;
+}
 
-    if (cpu_aff >= 0)
-    {
+/* Finish every job that is done. Returns 1 if the entry should be abandoned */
 
-      SAYF(SP10 cGRA "[cpu%03u:%s%3u%%" cGRA "]\r" cRST,
-           MIN(cpu_aff, 999), cpu_color,
-           MIN(cur_utilization, 999));
-    }
-    else
-    {
+static u8 collect_workers(char **argv)
+{
+  u8 res = 0;
+  u32 i;
 
-      SAYF(SP10 cGRA "   [cpu:%s%3u%%" cGRA "]\r" cRST,
-           cpu_color, MIN(cur_utilization, 999));
-    }
+  for (i = 0; i < worker_count; i++)
+    if (__atomic_load_n(&workers[i].slot->state, __ATOMIC_ACQUIRE) == WORKER_DONE)
+      res |= finish_worker_job(argv, &workers[i]);
 
-#else
+  return res;
+}
 
-    SAYF(SP10 cGRA "   [cpu:%s%3u%%" cGRA "]\r" cRST,
-         cpu_color, MIN(cur_utilization, 999));
+/* Hand kl_messages (out_buf) to the next idle worker, finishing the jobs that are done in
+   the meantime. Returns 1 if the entry should be abandoned, 0 if the job has been handed
+   out and -1 if it does not fit in a slot, for the caller to run it */
 
-#endif /* ^HAVE_AFFINITY */
-  }
-  else
-    SAYF("\r");
+static s32 submit_to_worker(char **argv, u8 *out_buf, u32 len)
+{
+  static u32 next;
+  struct worker *w = NULL;
+  u32 i;
 
-  /* Show debugging stats for AFLNet only when AFLNET_DEBUG environment variable is set */
-  if (getenv("AFLNET_DEBUG") && (atoi(getenv("AFLNET_DEBUG")) == 1) && state_aware_mode)
+  while (1)
   {
-    SAYF(cRST "\n\nMax_seed_region_count: %-4s, current_kl_messages_size: %-4s\n\n", DI(max_seed_region_count), DI(kl_messages->size));
-    SAYF(cRST "State IDs and its #selected_times," cCYA "#fuzzs," cLRD "#discovered_paths," cGRA "#excersing_paths:\n");
+    u32 seq = __atomic_load_n(worker_done, __ATOMIC_ACQUIRE);
 
-    khint_t k;
-    state_info_t *state;
-    u32 i = 0;
+    if (collect_workers(argv))
+      return 1;
 
-    for (i = 0; i < state_ids_count; i++)
+    for (i = 0; i < worker_count; i++)
     {
-      u32 state_id = state_ids[i];
+      u32 n = (next + i) % worker_count;
 
-      k = kh_get(hms, khms_states, state_id);
-      if (k != kh_end(khms_states))
+      if (__atomic_load_n(&workers[n].slot->state, __ATOMIC_ACQUIRE) == WORKER_IDLE)
       {
-        state = kh_val(khms_states, k);
-        SAYF(cRST "S%-3s:%-4s," cCYA "%-5s," cLRD "%-5s," cGRA "%-5s", DI(state->id), DI(state->selected_times), DI(state->fuzzs), DI(state->paths_discovered), DI(state->paths));
-        if ((i + 1) % 3 == 0)
-          SAYF("\n");
+        w = &workers[n];
+        next = n + 1;
+        break;
       }
     }
+
+    if (w)
+      break;
+
+    if (wait_for_workers(seq))
+      return 1;
   }
 
-  /* Hallelujah! */
+  if (!pack_job(w->slot))
+    return -1;
 
-  fflush(0);
-}
+  if (w->buf_cap < len)
+  {
+    w->buf = ck_realloc(w->buf, len);
+    w->buf_cap = len;
+  }
+  memcpy(w->buf, out_buf, len);
+  w->len = len;
 
-/* Display quick statistics at the end of processing the input directory,
-   plus a bunch of warnings. Some calibration stuff also ended up here,
-   along with several hardcoded constants. Maybe clean up eventually. */
+  w->slot->tmout = exec_tmout;
+  w->slot->cal_runs = 0;
 
-static void show_init_stats(void)
-{
+  __atomic_store_n(&w->slot->state, WORKER_JOB, __ATOMIC_RELEASE);
+  desock_futex_wake(&w->slot->state);
 
-  struct queue_entry *q = queue;
-  u32 min_bits = 0, max_bits = 0;
-  u64 min_us = 0, max_us = 0;
-  u64 avg_us = 0;
-  u32 max_len = 0;
+  return 0;
+}
 
-  if (total_cal_cycles)
-    avg_us = total_cal_us / total_cal_cycles;
+/* Wait for every job handed out to be done, and finish them. Returns 1 if the entry should
+   be abandoned */
 
-  while (q)
+static u8 drain_workers(char **argv)
+{
+  u8 res = 0;
+
+  while (1)
   {
+    u32 seq = __atomic_load_n(worker_done, __ATOMIC_ACQUIRE);
+    u8 busy = 0;
+    u32 i;
 
-    if (!min_us || q->exec_us < min_us)
-      min_us = q->exec_us;
-    if (q->exec_us > max_us)
-      max_us = q->exec_us;
+    res |= collect_workers(argv);
 
-    if (!min_bits || q->bitmap_size < min_bits)
-      min_bits = q->bitmap_size;
-    if (q->bitmap_size > max_bits)
-      max_bits = q->bitmap_size;
+    for (i = 0; i < worker_count; i++)
+      if (__atomic_load_n(&workers[i].slot->state, __ATOMIC_ACQUIRE) == WORKER_JOB)
+        busy = 1;
 
-    if (q->len > max_len)
-      max_len = q->len;
+    if (!busy)
+      return res;
 
-    q = q->next;
+    if (wait_for_workers(seq))
+      return 1;
   }
+}
 
-  SAYF("\n");
-
-  if (avg_us > (qemu_mode ? 50000 : 10000))
-    WARNF(cLRD "The target binary is pretty slow! See %s/perf_tips.txt.",
-          doc_path);
+/* Dry run: hand the test cases from q on to the idle workers, then wait for the one that
+   has q and load its outcome for calibrate_case() to replay. Returns that worker, or NULL
+   if q runs on our server (it did not fit in a slot, or we are stopping) */
 
-  /* Let's keep things moving with slow binaries. */
+static struct worker *dry_run_ahead(struct queue_entry *q)
+{
+  static struct queue_entry *next_q;
+  klist_t(lms) *own_messages = kl_messages;
+  struct worker *w = NULL;
+  u32 i;
 
-  if (avg_us > 50000)
-    havoc_div = 10; /* 0-19 execs/sec   */
-  else if (avg_us > 20000)
-    havoc_div = 5; /* 20-49 execs/sec  */
-  else if (avg_us > 10000)
-    havoc_div = 2; /* 50-100 execs/sec */
+  if (q == queue)
+    next_q = q;
 
-  if (!resuming_fuzz)
+  for (i = 0; i < worker_count && next_q; i++)
   {
+    struct worker *n = &workers[i];
 
-    if (max_len > 50 * 1024)
-      WARNF(cLRD "Some test cases are huge (%s) - see %s/perf_tips.txt!",
-            DMS(max_len), doc_path);
-    else if (max_len > 10 * 1024)
-      WARNF("Some test cases are big (%s) - see %s/perf_tips.txt.",
-            DMS(max_len), doc_path);
+    if (__atomic_load_n(&n->slot->state, __ATOMIC_ACQUIRE) != WORKER_IDLE || n->cal_q)
+      continue;
 
-    if (useless_at_start && !in_bitmap)
-      WARNF(cLRD "Some test cases look useless. Consider using a smaller set.");
+    kl_messages = construct_kl_messages(next_q->fname, next_q->regions, next_q->region_count);
 
-    if (queued_paths > 100)
-      WARNF(cLRD "You probably have far too many input files! Consider trimming down.");
-    else if (queued_paths > 20)
-      WARNF("You have lots of input files; try starting small.");
+    if (pack_job(n->slot))
+    {
+      n->cal_q = next_q;
+      n->slot->tmout = resuming_fuzz ? MAX(exec_tmout + CAL_TMOUT_ADD, exec_tmout * CAL_TMOUT_PERC / 100)
+                                     : exec_tmout;
+      n->slot->cal_runs = fast_cal ? 3 : CAL_CYCLES;
+      memcpy(n->slot->cal_var_bytes, var_bytes, MAP_SIZE);
+
+      __atomic_store_n(&n->slot->state, WORKER_JOB, __ATOMIC_RELEASE);
+      desock_futex_wake(&n->slot->state);
+    }
+    else
+      i--; // try the next one on the same worker
+
+    delete_kl_messages(kl_messages);
+    next_q = next_q->next;
   }
 
-  OKF("Here are some useful stats:\n\n"
+  kl_messages = own_messages;
 
-      cGRA "    Test case count : " cRST "%u favored, %u variable, %u total\n" cGRA "       Bitmap range : " cRST "%u to %u bits (average: %0.02f bits)\n" cGRA "        Exec timing : " cRST "%s to %s us (average: %s us)\n",
-      queued_favored, queued_variable, queued_paths, min_bits, max_bits,
-      ((double)total_bitmap_size) / (total_bitmap_entries ? total_bitmap_entries : 1),
-      DI(min_us), DI(max_us), DI(avg_us));
+  for (i = 0; i < worker_count; i++)
+    if (workers[i].cal_q == q)
+      w = &workers[i];
 
-  if (!timeout_given)
+  if (!w)
+    return NULL;
+
+  while (__atomic_load_n(&w->slot->state, __ATOMIC_ACQUIRE) != WORKER_DONE)
   {
+    u32 seq = __atomic_load_n(worker_done, __ATOMIC_ACQUIRE);
 
-    /* Figure out the appropriate timeout. The basic idea is: 5x average or
-       1x max, rounded up to EXEC_TM_ROUND ms and capped at 1 second.
+    if (__atomic_load_n(&w->slot->state, __ATOMIC_ACQUIRE) == WORKER_DONE)
+      break;
 
-       If the program is slow, the multiplier is lowered to 2x or 3x, because
-       random scheduler jitter is less likely to have any impact, and because
-       our patience is wearing thin =) */
+    if (wait_for_workers(seq))
+      return NULL;
+  }
 
-    if (avg_us > 50000)
-      exec_tmout = avg_us * 2 / 1000;
-    else if (avg_us > 10000)
-      exec_tmout = avg_us * 3 / 1000;
-    else
-      exec_tmout = avg_us * 5 / 1000;
+  load_worker_outcome(w);
+  total_execs += w->slot->cal_done;
 
-    exec_tmout = MAX(exec_tmout, max_us / 1000);
-    exec_tmout = (exec_tmout + EXEC_TM_ROUND) / EXEC_TM_ROUND * EXEC_TM_ROUND;
+  return w;
+}
 
-    if (exec_tmout > EXEC_TIMEOUT)
-      exec_tmout = EXEC_TIMEOUT;
+/* Run n of the calibration of the test case in cal_worker: put its trace map in place and
+   add the time it took to *us. Returns its fault, or -1 if the worker did not run it */
 
-    ACTF("No -t option specified, so I'll use exec timeout of %u ms.",
-         exec_tmout);
+static s32 replay_cal_run(u32 n, u64 *us)
+{
+  struct worker_slot *slot;
 
-    timeout_given = 1;
-  }
-  else if (timeout_given == 3)
-  {
+  if (!cal_worker || n >= cal_worker->slot->cal_done)
+    return -1;
 
-    ACTF("Applying timeout settings from resumed session (%u ms).", exec_tmout);
-  }
+  slot = cal_worker->slot;
 
-  /* In dumb mode, re-running every timing out test case with a generous time
-     limit is very expensive, so let's select a more conservative default. */
+  memcpy(trace_bits, slot->cal_traces[n], MAP_SIZE);
+  *us += slot->cal_us[n];
 
-  if (dumb_mode && !getenv("AFL_HANG_TMOUT"))
-    hang_tmout = MIN(EXEC_TIMEOUT, exec_tmout * 2 + 100);
+  return slot->cal_faults[n];
+}
 
-  OKF("All set and ready to roll!");
+/* Done with the outcome in cal_worker: the worker can take the next test case */
+
+static void release_cal_worker(void)
+{
+  if (!cal_worker)
+    return;
+
+  cal_worker->cal_q = NULL;
+  __atomic_store_n(&cal_worker->slot->state, WORKER_IDLE, __ATOMIC_RELEASE);
+  cal_worker = NULL;
 }
 
 /* Write a modified test case, run program, process results. Handle
@@ -6256,57 +9075,25 @@ EXP_ST u8 common_fuzz_stuff(char **argv, u8 *out_buf, u32 len)
 
   /* End of AFLNet code */
 
-  fault = run_target(argv, exec_tmout);
-
-  // Update fuzz count, no matter whether the generated test is interesting or not
-  if (state_aware_mode)
-    update_fuzzs();
-
-  if (stop_soon)
-    return 1;
-
-  if (fault == FAULT_TMOUT)
-  {
-
-    if (subseq_tmouts++ > TMOUT_LIMIT)
-    {
-      cur_skipped_paths++;
-      return 1;
-    }
-  }
-  else
-    subseq_tmouts = 0;
-
-  /* Users can hit us with SIGUSR1 to request the current input
-     to be abandoned. */
+  /* During havoc and splicing with -J, a worker runs it while we go on mutating */
 
-  if (skip_requested)
+  if (workers_async)
   {
+    s32 res = submit_to_worker(argv, out_buf, len);
 
-    skip_requested = 0;
-    cur_skipped_paths++;
-    return 1;
+    if (res >= 0)
+      return res;
   }
 
-  /* This handles FAULT_ERROR for us: */
-
-  u8 is_interesting = save_if_interesting(argv, out_buf, len, fault);
-
-  if (is_interesting)
-  {
-    uninteresting_times = 0;
-  }
-  else
-  {
-    uninteresting_times++;
-  }
+  /* With -Z, run M2 and M3 in a fork of a server that went through M1 already */
 
-  queued_discovered += is_interesting;
+  if (prefix_snapshot && M2_prev)
+    snap_in_use = snapshot_prepare(argv);
 
-  if (!(stage_cur % stats_update_freq) || stage_cur + 1 == stage_max)
-    show_stats();
+  fault = run_target(argv, exec_tmout);
+  snap_in_use = 0;
 
-  return 0;
+  return finish_fuzz_stuff(argv, out_buf, len, fault);
 }
 
 /* Helper to choose random block len for block operations in fuzz_one().
@@ -6995,7 +9782,7 @@ AFLNET_REGIONS_SELECTION:;
             if (!stop_soon && !queue_cur->cal_failed && !queue_cur->was_fuzzed)
             {
               queue_cur->was_fuzzed = 1;
-              was_fuzzed_map[get_state_index(target_state_id)][queue_cur->index] = 1;
+              set_was_fuzzed(get_state_index(target_state_id), queue_cur->index, WF_FUZZED);
               pending_not_fuzzed--;
               if (queue_cur->favored)
                 pending_favored--;
@@ -8187,6 +10974,10 @@ havoc_stage:
   range *ranges = ck_alloc(rc * sizeof(range));
   memcpy(ranges, original_ranges.a, rc * sizeof(range));
 
+  /* The workers (-J) run what we come up with from here on. */
+
+  workers_async = worker_count > 0;
+
   for (stage_cur = 0; stage_cur < stage_max; stage_cur++)
   {
 
@@ -8784,6 +11575,14 @@ havoc_stage:
       havoc_queued = queued_paths;
     }
   }
+
+  if (workers_async)
+  {
+    workers_async = 0;
+    if (drain_workers(argv))
+      goto abandon_entry;
+  }
+
   kv_destroy(original_ranges);
   ck_free(ranges);
 
@@ -8909,6 +11708,12 @@ retry_splicing:
 
 abandon_entry:
 
+  if (workers_async)
+  {
+    workers_async = 0;
+    drain_workers(argv);
+  }
+
   splicing_with = -1;
 
   /* Update pending_not_fuzzed count if we made it through the calibration
@@ -8917,7 +11722,7 @@ abandon_entry:
   if (!stop_soon && !queue_cur->cal_failed && !queue_cur->was_fuzzed)
   {
     queue_cur->was_fuzzed = 1;
-    was_fuzzed_map[get_state_index(target_state_id)][queue_cur->index] = 1;
+    set_was_fuzzed(get_state_index(target_state_id), queue_cur->index, WF_FUZZED);
     pending_not_fuzzed--;
     if (queue_cur->favored)
       pending_favored--;
@@ -9388,10 +12193,13 @@ static void check_term_size(void)
   struct winsize ws;
 
   term_too_small = 0;
+  term_rows = 0;
 
   if (ioctl(1, TIOCGWINSZ, &ws))
     return;
 
+  term_rows = ws.ws_row;
+
   if (ws.ws_row == 0 && ws.ws_col == 0)
     return;
   if (ws.ws_row < 25 || ws.ws_col < 80)
@@ -9428,14 +12236,31 @@ static void usage(u8 *argv0)
        "  -N netinfo    - server information (e.g., tcp://127.0.0.1/8554)\n"
        "  -P protocol   - application protocol to be tested (e.g., RTSP, FTP, DTLS12, DNS, SMTP, SSH, TLS)\n"
        "  -D usec       - waiting time (in micro seconds) for the server to initialize\n"
+       "                  (only used if the server does not report when it listens)\n"
        "  -W msec       - waiting time (in miliseconds) for receiving the first response to each input sent\n"
        "  -w usec       - waiting time (in micro seconds) for receiving follow-up responses\n"
+       "  -r            - stop waiting as soon as a response is complete (see README.md)\n"
+       "  -U            - talk to the server through shared memory instead of sockets\n"
+       "                  (preload libdesock.so into the server, see README.md)\n"
+       "  -Z            - fork M2/M3 executions from a server parked after M1 (needs -U)\n"
+       "  -p sessions   - persistent mode: restart the server after this many sessions;\n"
+       "                  with -U, a connection closed by the server ends a session\n"
+       "  -L sessions   - keep a server that survived a session for the next ones,\n"
+       "                  up to this many; restart it on crashes and hangs\n"
+       "  -J workers    - run the dry run, havoc and splicing on this many more servers\n"
+       "                  at once (needs -U or -G)\n"
+       "  -v            - let the server's sleeps and idle timeouts pass in virtual time\n"
+       "                  (preload libvtime.so into the server, see README.md)\n"
        "  -e netnsname  - run server in a different network namespace\n"
+       "  -G            - run server in a private network namespace, one per instance\n"
+       "                  and per worker, so that they can all use the same port\n"
        "  -K            - send SIGTERM to gracefully terminate the server (see README.md)\n"
        "  -E            - enable state aware mode (see README.md)\n"
        "  -R            - enable region-level mutation operators (see README.md)\n"
        "  -F            - enable false negative reduction mode (see README.md)\n"
        "  -c cleanup    - name or full path to the server cleanup script (see README.md)\n"
+       "  -O dir        - directory changed by the server: cleanup only runs if it changed,\n"
+       "                  without -c it is restored from a snapshot (see README.md)\n"
        "  -q algo       - state selection algorithm (See aflnet.h for all available options)\n"
        "  -s algo       - seed selection algorithm (See aflnet.h for all available options)\n\n"
 
@@ -9459,6 +12284,7 @@ EXP_ST void setup_dirs_fds(void)
 
   u8 *tmp;
   s32 fd;
+  u32 i;
 
   ACTF("Setting up output directories...");
 
@@ -9625,7 +12451,11 @@ EXP_ST void setup_dirs_fds(void)
 
   fprintf(plot_file, "# unix_time, cycles_done, cur_path, paths_total, "
                      "pending_total, pending_favs, map_size, unique_crashes, "
-                     "unique_hangs, max_depth, execs_per_sec, n_nodes, n_edges, chat_times\n");
+                     "unique_hangs, max_depth, execs_per_sec, n_nodes, n_edges, chat_times");
+
+  for (i = 0; i < PHASE_COUNT; i++)
+    fprintf(plot_file, ", %s_p50, %s_p99", phase_names[i], phase_names[i]);
+  fprintf(plot_file, "\n");
   /* ignore errors */
 }
 
@@ -10019,11 +12849,14 @@ EXP_ST void setup_signal_handlers(void)
   sigaction(SIGINT, &sa, NULL);
   sigaction(SIGTERM, &sa, NULL);
 
-  /* Exec timeout notifications. */
+  /* Exec timeout notifications: SIGALRM while the fork server starts up, timerfds
+     afterwards (see arm_timer()). */
 
   sa.sa_handler = handle_timeout;
   sigaction(SIGALRM, &sa, NULL);
 
+  setup_exec_timers();
+
   /* Window resize */
 
   sa.sa_handler = handle_resize;
@@ -10216,7 +13049,7 @@ int main(int argc, char **argv)
   gettimeofday(&tv, &tz);
   srandom(tv.tv_sec ^ tv.tv_usec ^ getpid());
 
-  while ((opt = getopt(argc, argv, "+i:o:f:m:t:T:dnCB:S:M:x:QN:D:W:w:e:P:KEq:s:RFc:l:")) > 0)
+  while ((opt = getopt(argc, argv, "+i:o:f:m:t:T:dnCB:S:M:x:QN:D:W:w:e:P:KEq:s:RFc:l:rO:UZp:J:GL:v")) > 0)
 
     switch (opt)
     {
@@ -10456,6 +13289,65 @@ int main(int argc, char **argv)
       socket_timeout = 1;
       break;
 
+    case 'O': /* directory modified by the server under test */
+      if (cleanup_dir)
+        FATAL("Multiple -O options not supported");
+      cleanup_dir = optarg;
+      break;
+
+    case 'U': /* shared-memory transport */
+      if (use_desock)
+        FATAL("Multiple -U options not supported");
+      use_desock = 1;
+      break;
+
+    case 'Z': /* prefix snapshot */
+      if (prefix_snapshot)
+        FATAL("Multiple -Z options not supported");
+      prefix_snapshot = 1;
+      break;
+
+    case 'p': /* sessions per server process in persistent mode */
+      if (persist_sessions)
+        FATAL("Multiple -p options not supported");
+      if (sscanf(optarg, "%u", &persist_sessions) < 1 || !persist_sessions)
+        FATAL("Bad syntax used for -p");
+      break;
+
+    case 'L': /* sessions per server process when reusing it */
+      if (reuse_sessions)
+        FATAL("Multiple -L options not supported");
+      if (sscanf(optarg, "%u", &reuse_sessions) < 1 || !reuse_sessions)
+        FATAL("Bad syntax used for -L");
+      break;
+
+    case 'v': /* virtual time */
+      if (virtual_time)
+        FATAL("Multiple -v options not supported");
+      virtual_time = 1;
+      break;
+
+    case 'G': /* private network namespaces */
+      if (netns_pool)
+        FATAL("Multiple -G options not supported");
+      netns_pool = 1;
+      break;
+
+    case 'J': /* execution workers */
+      if (worker_count)
+        FATAL("Multiple -J options not supported");
+      if (sscanf(optarg, "%u", &worker_count) < 1 || !worker_count)
+        FATAL("Bad syntax used for -J");
+      if (worker_count > WORKER_MAX)
+        FATAL("At most %u workers are supported", WORKER_MAX);
+      break;
+
+    case 'r': /* return from receiving as soon as a reply is complete */
+      if (detect_response_end)
+        FATAL("Multiple -r options not supported");
+      detect_response_end = 1;
+      break;
+
     case 'e': /* network namespace name */
       if (netns_name)
         FATAL("Multiple -e options not supported");
@@ -10471,21 +13363,26 @@ int main(int argc, char **argv)
       {
         extract_requests = &extract_requests_rtsp;
         extract_response_codes = &extract_response_codes_rtsp;
+        response_complete = &response_complete_rtsp;
       }
       else if (!strcmp(optarg, "FTP"))
       {
         extract_requests = &extract_requests_ftp;
         extract_response_codes = &extract_response_codes_ftp;
+        response_complete = &response_complete_ftp;
       }
       else if (!strcmp(optarg, "DTLS12"))
       {
         extract_requests = &extract_requests_dtls12;
         extract_response_codes = &extract_response_codes_dtls12;
+        response_complete = &response_complete_dtls12;
       }
       else if (!strcmp(optarg, "DNS"))
       {
         extract_requests = &extract_requests_dns;
         extract_response_codes = &extract_response_codes_dns;
+        response_complete = &response_complete_dns;
+        reply_matches = &reply_matches_dns;
       }
       else if (!strcmp(optarg, "DICOM"))
       {
@@ -10496,6 +13393,7 @@ int main(int argc, char **argv)
       {
         extract_requests = &extract_requests_smtp;
         extract_response_codes = &extract_response_codes_smtp;
+        response_complete = &response_complete_smtp;
       }
       else if (!strcmp(optarg, "SSH"))
       {
@@ -10506,21 +13404,25 @@ int main(int argc, char **argv)
       {
         extract_requests = &extract_requests_tls;
         extract_response_codes = &extract_response_codes_tls;
+        response_complete = &response_complete_tls;
       }
       else if (!strcmp(optarg, "SIP"))
       {
         extract_requests = &extract_requests_sip;
         extract_response_codes = &extract_response_codes_sip;
+        response_complete = &response_complete_sip;
       }
       else if (!strcmp(optarg, "HTTP"))
       {
         extract_requests = &extract_requests_http;
         extract_response_codes = &extract_response_codes_http;
+        response_complete = &response_complete_http;
       }
       else if (!strcmp(optarg, "IPP"))
       {
         extract_requests = &extract_requests_ipp;
         extract_response_codes = &extract_response_codes_ipp;
+        response_complete = &response_complete_ipp;
       }
       else
       {
@@ -10598,13 +13500,18 @@ int main(int argc, char **argv)
   if (!protocol_selected)
     FATAL("Please specify the protocol to be tested using the -P option");
 
-  if (netns_name)
+  if (!detect_response_end)
+    response_complete = NULL;
+  else if (!response_complete)
+    WARNF("End-of-response detection is not available for this protocol, -r has no effect.");
+
+  if (netns_name || netns_pool)
   {
     if (check_ep_capability(CAP_SYS_ADMIN, argv[0]) != 0)
       FATAL("Could not run the server under test in a \"%s\" network namespace "
             "without CAP_SYS_ADMIN capability.\n You can set it by invoking "
             "afl-fuzz with sudo or by \"$ setcap cap_sys_admin+ep /path/to/afl-fuzz\".",
-            netns_name);
+            netns_name ? netns_name : (u8 *)"private");
   }
 
   setup_signal_handlers();
@@ -10627,6 +13534,74 @@ int main(int argc, char **argv)
 
   if (getenv("AFL_NO_FORKSRV"))
     no_forkserver = 1;
+
+  if (prefix_snapshot && !use_desock)
+    FATAL("-Z needs the shared-memory transport (-U)");
+
+  if (netns_pool)
+  {
+    if (netns_name)
+      FATAL("-e and -G are mutually exclusive");
+    if (!use_net || (ntohl(inet_addr(net_ip)) >> 24) != 127)
+      FATAL("-G needs a loopback address (127.x.x.x) in -N, the only one in a private namespace");
+  }
+
+  if (persist_sessions && (dumb_mode == 1 || no_forkserver))
+    FATAL("-p needs the fork server");
+
+  if (reuse_sessions && (dumb_mode == 1 || no_forkserver || !use_net))
+    FATAL("-L needs the fork server and a server to talk to (-N)");
+
+  if (reuse_sessions && prefix_snapshot)
+    FATAL("-L and -Z are mutually exclusive");
+
+  /* The servers of the workers must not get in each other's way: each one
+     has a network namespace of its own (-G) or, over shared memory, none of
+     them has the port to itself. */
+
+  if (worker_count)
+  {
+    if (!use_desock && !netns_pool)
+      FATAL("-J needs the shared-memory transport (-U) or private network namespaces (-G)");
+    if (prefix_snapshot)
+      FATAL("-J and -Z are mutually exclusive");
+    if (cleanup_script || cleanup_dir)
+      FATAL("-J cannot be combined with -c or -O: the servers would share what they clean up");
+  }
+
+  /* Tell the runtime (or a preloaded liblistenready.so) which port to report
+     on. Without a fork server there is no hello message announcing support,
+     so just try it and fall back if the server stays silent. */
+
+  if (use_net && !use_desock)
+  {
+    u8 port_str[8];
+    sprintf(port_str, "%u", net_port);
+    setenv(LISTEN_ENV_VAR, port_str, 1);
+
+    if (dumb_mode == 1 || no_forkserver)
+      listen_ready = 1;
+  }
+
+  /* libvtime.so lets the server wait for input this long for real before
+     its clocks skip ahead: time enough for afl-fuzz to send the next
+     message. Over sockets, that is after waiting out a response, or the
+     lack of one; libdesock.so says right away when the server is idle. */
+
+  if (virtual_time)
+  {
+    u8 grace_str[16];
+    u32 grace = VTIME_GRACE_USECS;
+
+    if (!use_desock)
+      grace += poll_wait_msecs * 1000 + socket_timeout_usecs;
+
+    sprintf(grace_str, "%u", grace);
+    setenv(VTIME_ENV_VAR, grace_str, 1);
+
+    if (!getenv("AFL_PRELOAD") || !strstr(getenv("AFL_PRELOAD"), "libvtime"))
+      WARNF("-v has no effect unless libvtime.so is in AFL_PRELOAD");
+  }
   if (getenv("AFL_NO_CPU_RED"))
     no_cpu_meter_red = 1;
   if (getenv("AFL_NO_ARITH"))
@@ -10674,10 +13649,21 @@ int main(int argc, char **argv)
   setup_shm();
   init_count_class16();
 
+  if (use_desock)
+    setup_desock();
+
+  if (netns_pool)
+  {
+    create_private_netns();
+    OKF("Running the server in a private network namespace (-G).");
+  }
+
   setup_ipsm();
 
   setup_dirs_fds();
 
+  setup_server_cleanup();
+
   if (protocol_selected)
   {
     protocol_patterns = kl_init(rang);
@@ -10704,6 +13690,31 @@ int main(int argc, char **argv)
 
   check_binary(argv[optind]);
 
+  /* Persistent mode over the network: a session ends when the server gets
+     back to __AFL_LOOP() or, if it does not call it, when it closes the
+     connection (-p over shared memory). */
+
+  if (persist_sessions && !persistent_mode)
+  {
+    if (!use_desock || net_protocol != PRO_TCP)
+      FATAL("-p needs a server calling __AFL_LOOP() or TCP over shared memory (-U)");
+
+    desock_shm->persist = 1;
+    setenv(PERSIST_ENV_VAR, "1", 1);
+    persistent_mode = 1;
+  }
+
+  persistent_net = use_net && persistent_mode && !(dumb_mode == 1 || no_forkserver);
+
+  if (persistent_net && prefix_snapshot)
+    FATAL("-Z is not supported in persistent mode");
+
+  if (reuse_sessions && persistent_net)
+  {
+    WARNF("The server is persistent already, ignoring -L");
+    reuse_sessions = 0;
+  }
+
   start_time = get_cur_time();
 
   if (qemu_mode)
@@ -10711,6 +13722,9 @@ int main(int argc, char **argv)
   else
     use_argv = argv + optind;
 
+  if (worker_count)
+    start_workers(use_argv);
+
   perform_dry_run(use_argv);
 
   cull_queue();
@@ -10721,6 +13735,7 @@ int main(int argc, char **argv)
 
   write_stats_file(0, 0, 0);
   save_auto();
+  write_ipsm();
 
   if (stop_soon)
     goto stop_fuzzing;
@@ -10760,6 +13775,7 @@ int main(int argc, char **argv)
         if (k != kh_end(khms_states))
         {
           kh_val(khms_states, k)->selected_times++;
+          mark_state_stale(kh_val(khms_states, k));
         }
 
         selected_seed = choose_seed(target_state_id, seed_selection_algo);
@@ -10896,11 +13912,14 @@ int main(int argc, char **argv)
   }
 
   write_bitmap();
+  write_ipsm();
   write_stats_file(0, 0, 0);
   save_auto();
 
 stop_fuzzing:
 
+  stop_workers();
+
   SAYF(CURSOR_SHOW cLRD "\n\n+++ Testing aborted %s +++\n" cRST,
        stop_soon == 2 ? "programmatically" : "by user");
 
@@ -1,9 +1,22 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
 #include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -897,6 +910,22 @@ region_t *extract_requests_ipp(unsigned char *buf, unsigned int buf_size, unsign
   return regions;
 }
 
+/* Where the states returned by the last extract_response_codes_*() call end in the buffer */
+u32 *state_ends = NULL;
+static u32 state_ends_cap = 0;
+
+/* Record that the last state (the state_count-th) ends end bytes into the buffer */
+static void set_state_end(unsigned int state_count, unsigned int end)
+{
+  if (state_count > state_ends_cap)
+  {
+    state_ends_cap = MAX(state_count, state_ends_cap * 2);
+    state_ends = (u32 *)ck_realloc(state_ends, state_ends_cap * sizeof(u32));
+  }
+
+  state_ends[state_count - 1] = end;
+}
+
 unsigned int *extract_response_codes_smtp(unsigned char *buf, unsigned int buf_size, unsigned int *state_count_ref)
 {
   char *mem;
@@ -931,6 +960,7 @@ unsigned int *extract_response_codes_smtp(unsigned char *buf, unsigned int buf_s
       state_count++;
       state_sequence = (unsigned int *)ck_realloc(state_sequence, state_count * sizeof(unsigned int));
       state_sequence[state_count - 1] = message_code;
+      set_state_end(state_count, byte_count);
       mem_count = 0;
     }
     else
@@ -984,6 +1014,7 @@ unsigned int *extract_response_codes_ssh(unsigned char *buf, unsigned int buf_si
       if (state_sequence == NULL)
         PFATAL("Unable realloc a memory region to store state sequence");
       state_sequence[state_count - 1] = 256; // Identification
+      set_state_end(state_count, byte_count);
     }
     else
     {
@@ -1002,6 +1033,7 @@ unsigned int *extract_response_codes_ssh(unsigned char *buf, unsigned int buf_si
       if (state_sequence == NULL)
         PFATAL("Unable realloc a memory region to store state sequence");
       state_sequence[state_count - 1] = message_code;
+      set_state_end(state_count, byte_count + message_size - 2);
       /* If this is a KEY exchange related message */
       if ((message_code >= 20) && (message_code <= 49))
       {
@@ -1062,6 +1094,9 @@ unsigned int *extract_response_codes_tls(unsigned char *buf, unsigned int buf_si
       u16 *size_buf = (u16 *)&mem[3];
       u16 message_size = (u16)ntohs(*size_buf);
 
+      // The record is counted once this much of it is in, even if the payload is cut short
+      unsigned int code_end = byte_count;
+
       // and skip the payload
       unsigned int bytes_to_skip = message_size - 1;
       unsigned int temp_count = 0;
@@ -1081,6 +1116,7 @@ unsigned int *extract_response_codes_tls(unsigned char *buf, unsigned int buf_si
       state_count++;
       state_sequence = (unsigned int *)ck_realloc(state_sequence, state_count * sizeof(unsigned int));
       state_sequence[state_count - 1] = message_code;
+      set_state_end(state_count, code_end);
       mem_count = 0;
     }
     else
@@ -1121,6 +1157,7 @@ unsigned int *extract_response_codes_dicom(unsigned char *buf, unsigned int buf_
   unsigned int message_code = buf[0]; // return PDU type as status code
   state_sequence = (unsigned int *)ck_realloc(state_sequence, state_count * sizeof(unsigned int));
   state_sequence[state_count - 1] = message_code;
+  set_state_end(state_count, 1);
 
   *state_count_ref = state_count;
   return state_sequence;
@@ -1157,6 +1194,7 @@ unsigned int *extract_response_codes_dns(unsigned char *buf, unsigned int buf_si
       state_count++;
       state_sequence = (unsigned int *)ck_realloc(state_sequence, state_count * sizeof(unsigned int));
       state_sequence[state_count - 1] = message_code;
+      set_state_end(state_count, byte_count - 4); // right after the zero byte, before the jump
       mem_count = 0;
     }
     else
@@ -1390,6 +1428,7 @@ unsigned int *extract_response_codes_dtls12(unsigned char *buf, unsigned int buf
       state_count++;
       state_sequence = (unsigned int *)ck_realloc(state_sequence, state_count * sizeof(unsigned int));
       state_sequence[state_count - 1] = status_code;
+      set_state_end(state_count, byte_count + 14); // the record is read past the buffer if it is cut short
       byte_count += record_length;
     }
     else
@@ -1441,6 +1480,7 @@ unsigned int *extract_response_codes_rtsp(unsigned char *buf, unsigned int buf_s
         state_count++;
         state_sequence = (unsigned int *)ck_realloc(state_sequence, state_count * sizeof(unsigned int));
         state_sequence[state_count - 1] = message_code;
+        set_state_end(state_count, byte_count);
         mem_count = 0;
       }
       else
@@ -1499,6 +1539,7 @@ unsigned int *extract_response_codes_ftp(unsigned char *buf, unsigned int buf_si
       state_count++;
       state_sequence = (unsigned int *)ck_realloc(state_sequence, state_count * sizeof(unsigned int));
       state_sequence[state_count - 1] = message_code;
+      set_state_end(state_count, byte_count);
       mem_count = 0;
     }
     else
@@ -1556,6 +1597,7 @@ unsigned int *extract_response_codes_sip(unsigned char *buf, unsigned int buf_si
         state_count++;
         state_sequence = (unsigned int *)ck_realloc(state_sequence, state_count * sizeof(unsigned int));
         state_sequence[state_count - 1] = message_code;
+        set_state_end(state_count, byte_count);
         mem_count = 0;
       }
       else
@@ -1618,6 +1660,7 @@ unsigned int *extract_response_codes_http(unsigned char *buf, unsigned int buf_s
         state_count++;
         state_sequence = (unsigned int *)ck_realloc(state_sequence, state_count * sizeof(unsigned int));
         state_sequence[state_count - 1] = message_code;
+        set_state_end(state_count, byte_count);
         mem_count = 0;
       }
       else
@@ -1697,6 +1740,7 @@ unsigned int *extract_response_codes_ipp(unsigned char *buf, unsigned int buf_si
           PFATAL("Unable realloc a memory region to store state sequence");
 
         state_sequence[state_count - 1] = message_code;
+        set_state_end(state_count, byte_count);
 
         mem_count = 0;
       }
@@ -1906,6 +1950,286 @@ region_t *convert_kl_messages_to_regions(klist_t(lms) * kl_messages, u32 *region
   return regions;
 }
 
+// Protocol-specific functions for detecting the end of a response
+
+/* Check if the last line of an FTP/SMTP reply is a final "NNN " (or bare "NNN") line.
+   Intermediate lines of multi-line replies use "NNN-" and do not end the reply */
+static int reply_code_line_complete(unsigned char *buf, unsigned int buf_size)
+{
+  unsigned int line_start;
+
+  if (buf_size < 4 || buf[buf_size - 1] != 0x0A)
+    return 0;
+
+  line_start = buf_size - 1;
+  while (line_start > 0 && buf[line_start - 1] != 0x0A)
+    line_start--;
+
+  if (buf_size - line_start < 4)
+    return 0;
+
+  if (!isdigit(buf[line_start]) || !isdigit(buf[line_start + 1]) || !isdigit(buf[line_start + 2]))
+    return 0;
+
+  return (buf[line_start + 3] == ' ') || (buf[line_start + 3] == 0x0D) || (buf[line_start + 3] == 0x0A);
+}
+
+int response_complete_smtp(unsigned char *buf, unsigned int buf_size)
+{
+  return reply_code_line_complete(buf, buf_size);
+}
+
+int response_complete_ftp(unsigned char *buf, unsigned int buf_size)
+{
+  return reply_code_line_complete(buf, buf_size);
+}
+
+/* Case-insensitive check if the header line at buf starts with the given field name */
+static int header_field_is(unsigned char *buf, unsigned int line_len, const char *name)
+{
+  unsigned int name_len = strlen(name);
+
+  if (line_len < name_len)
+    return 0;
+
+  return strncasecmp((char *)buf, name, name_len) == 0;
+}
+
+/* Check if buf holds a sequence of complete HTTP-like messages (start line, headers and body).
+   The body is delimited by Content-Length or chunked transfer encoding. If neither is present,
+   the body is empty unless length_required is set -- then (as in HTTP) the body runs until
+   the server closes the connection and the reply cannot be declared complete early */
+static int http_like_messages_complete(unsigned char *buf, unsigned int buf_size, unsigned char length_required)
+{
+  unsigned int byte_count = 0;
+
+  if (buf_size == 0)
+    return 0;
+
+  while (byte_count < buf_size)
+  {
+    unsigned int header_end = byte_count;
+    unsigned int line_start = byte_count;
+    unsigned int status_code = 0;
+    long content_length = -1;
+    unsigned char chunked = 0;
+
+    // Locate the empty line terminating the headers
+    while (header_end + 3 < buf_size && memcmp(&buf[header_end], "\r\n\r\n", 4))
+      header_end++;
+    if (header_end + 3 >= buf_size)
+      return 0;
+
+    // Status code of the start line, e.g. "HTTP/1.1 200 OK" or "SIP/2.0 180 Ringing"
+    while (line_start < header_end && buf[line_start] != ' ')
+      line_start++;
+    if (line_start + 4 <= header_end)
+      status_code = atoi((char *)&buf[line_start + 1]);
+
+    // Walk the header lines
+    line_start = byte_count;
+    while (line_start < header_end)
+    {
+      unsigned int line_end = line_start;
+      while (line_end < header_end && buf[line_end] != 0x0D)
+        line_end++;
+
+      unsigned int line_len = line_end - line_start;
+      if (header_field_is(&buf[line_start], line_len, "content-length:"))
+        content_length = strtol((char *)&buf[line_start + 15], NULL, 10);
+      else if (header_field_is(&buf[line_start], line_len, "l:")) // SIP compact form
+        content_length = strtol((char *)&buf[line_start + 2], NULL, 10);
+      else if (header_field_is(&buf[line_start], line_len, "transfer-encoding:"))
+      {
+        unsigned int i;
+        for (i = line_start + 18; i + 7 <= line_end; i++)
+          if (!strncasecmp((char *)&buf[i], "chunked", 7))
+            chunked = 1;
+      }
+
+      line_start = line_end + 2;
+    }
+
+    byte_count = header_end + 4;
+
+    if (chunked)
+    {
+      // <hex size>\r\n<data>\r\n ... 0\r\n<trailers>\r\n
+      while (1)
+      {
+        unsigned int size_end = byte_count;
+        while (size_end + 1 < buf_size && memcmp(&buf[size_end], "\r\n", 2))
+          size_end++;
+        if (size_end + 1 >= buf_size)
+          return 0;
+
+        unsigned long chunk_size = strtoul((char *)&buf[byte_count], NULL, 16);
+        byte_count = size_end + 2;
+
+        if (chunk_size == 0)
+        {
+          // skip the trailers up to the final empty line
+          while (byte_count + 1 < buf_size && memcmp(&buf[byte_count], "\r\n", 2))
+          {
+            while (byte_count + 1 < buf_size && memcmp(&buf[byte_count], "\r\n", 2))
+              byte_count++;
+            byte_count += 2;
+          }
+          if (byte_count + 1 >= buf_size)
+            return 0;
+          byte_count += 2;
+          break;
+        }
+
+        if (buf_size - byte_count < chunk_size + 2)
+          return 0;
+        byte_count += chunk_size + 2;
+      }
+    }
+    else if (content_length >= 0)
+    {
+      if (buf_size - byte_count < content_length)
+        return 0;
+      byte_count += content_length;
+    }
+    else if (length_required)
+    {
+      // 1xx, 204 and 304 responses never carry a body
+      if (!((status_code >= 100 && status_code < 200) || status_code == 204 || status_code == 304))
+        return 0;
+    }
+  }
+
+  return 1;
+}
+
+int response_complete_rtsp(unsigned char *buf, unsigned int buf_size)
+{
+  return http_like_messages_complete(buf, buf_size, 0);
+}
+
+int response_complete_sip(unsigned char *buf, unsigned int buf_size)
+{
+  return http_like_messages_complete(buf, buf_size, 0);
+}
+
+int response_complete_http(unsigned char *buf, unsigned int buf_size)
+{
+  return http_like_messages_complete(buf, buf_size, 1);
+}
+
+int response_complete_ipp(unsigned char *buf, unsigned int buf_size)
+{
+  return http_like_messages_complete(buf, buf_size, 1);
+}
+
+/* Handshake messages after which a server always sends more of the same flight */
+static int handshake_flight_continues(unsigned char hs_msg_type)
+{
+  switch (hs_msg_type)
+  {
+  case 0x02: // ServerHello
+  case 0x0B: // Certificate
+  case 0x0C: // ServerKeyExchange
+  case 0x0D: // CertificateRequest
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+int response_complete_tls(unsigned char *buf, unsigned int buf_size)
+{
+  unsigned int byte_count = 0;
+  unsigned char last_content_type = 0;
+  unsigned char last_hs_msg_type = 0xFF;
+
+  if (buf_size == 0)
+    return 0;
+
+  // The reply must consist of whole records (5 bytes header + payload)
+  while (byte_count < buf_size)
+  {
+    if (buf_size - byte_count < 5)
+      return 0;
+
+    unsigned int record_length = read_bytes_to_uint32(buf, byte_count + 3, 2);
+    if (buf_size - byte_count - 5 < record_length)
+      return 0;
+
+    last_content_type = buf[byte_count];
+    if (last_content_type == 0x16)
+    {
+      // walk the (plaintext) handshake messages in this record: 1 byte type, 3 bytes length
+      unsigned int hs_offset = byte_count + 5;
+      while (hs_offset + 4 <= byte_count + 5 + record_length)
+      {
+        last_hs_msg_type = buf[hs_offset];
+        hs_offset += 4 + read_bytes_to_uint32(buf, hs_offset + 1, 3);
+      }
+    }
+
+    byte_count += 5 + record_length;
+  }
+
+  if (last_content_type == 0x16 && handshake_flight_continues(last_hs_msg_type))
+    return 0;
+
+  return 1;
+}
+
+int response_complete_dtls12(unsigned char *buf, unsigned int buf_size)
+{
+  unsigned int byte_count = 0;
+  unsigned char last_content_type = 0;
+  unsigned char last_hs_msg_type = 0xFF;
+
+  if (buf_size == 0)
+    return 0;
+
+  // The reply must consist of whole records (13 bytes header + payload)
+  while (byte_count < buf_size)
+  {
+    if (buf_size - byte_count < 13)
+      return 0;
+
+    unsigned int record_length = read_bytes_to_uint32(buf, byte_count + 11, 2);
+    if (buf_size - byte_count - 13 < record_length)
+      return 0;
+
+    last_content_type = buf[byte_count];
+    if (last_content_type == HS_CONTENT_TYPE)
+    {
+      // DTLS handshake fragments have a 12 bytes header; the fragment length is in bytes 9-11
+      unsigned int hs_offset = byte_count + 13;
+      while (hs_offset + 12 <= byte_count + 13 + record_length)
+      {
+        last_hs_msg_type = buf[hs_offset];
+        hs_offset += 12 + read_bytes_to_uint32(buf, hs_offset + 9, 3);
+      }
+    }
+
+    byte_count += 13 + record_length;
+  }
+
+  if (last_content_type == HS_CONTENT_TYPE && handshake_flight_continues(last_hs_msg_type))
+    return 0;
+
+  return 1;
+}
+
+int response_complete_dns(unsigned char *buf, unsigned int buf_size)
+{
+  // One datagram carries the whole answer; anything shorter than the 12 bytes header is not one
+  return buf_size >= 12;
+}
+
+int reply_matches_dns(unsigned char *req, unsigned int req_len, unsigned char *resp, unsigned int resp_len)
+{
+  // The reply repeats the 16-bit ID of the query
+  return req_len >= 2 && resp_len >= 2 && req[0] == resp[0] && req[1] == resp[1];
+}
+
 // Network communication functions
 
 int net_send(int sockfd, struct timeval timeout, char *mem, unsigned int len)
@@ -1979,6 +2303,1019 @@ int net_recv(int sockfd, struct timeval timeout, int poll_w, char **response_buf
   return 0;
 }
 
+// Event-driven session engine
+
+/* Growth step of the response buffer; recv() always gets at least this much room */
+#define NET_SESSION_CHUNK 4096
+
+/* Datagrams moved per recvmmsg()/sendmmsg() call, and the room each one gets */
+#define NET_SESSION_MMSG 16
+#define NET_SESSION_DGRAM_MAX 65536
+
+static u8 *net_session_dgram_buf; /* NET_SESSION_MMSG receive slots, allocated on first use */
+static int net_session_tmr_fd = -1; /* Deadline of the current wait, shared by all sessions */
+static char *net_session_order_buf; /* Replies being put in request order, kept across batches */
+static u32 net_session_order_cap;
+
+static unsigned long long net_session_now_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* Wait until one of the wanted events is reported for the session socket or the deadline
+   (in microseconds, monotonic) passes. Returns 1 if ready, 0 on timeout, -1 on error or once
+   the exec timeout (see net_session_watch) has passed. The deadline is a timerfd in the same
+   epoll set as the socket, so it is kept to the microsecond rather than rounded up to the
+   next millisecond, and signals do not cut the wait short. */
+static int net_session_wait(net_session_t *s, u32 wanted, unsigned long long deadline)
+{
+  struct epoll_event evs[4];
+  struct itimerspec its;
+
+  if (s->timed_out)
+    return -1;
+
+  if (net_session_now_us() >= deadline)
+    return 0;
+
+  // re-arming also discards an expiration left over from a previous wait
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = deadline / 1000000ULL;
+  its.it_value.tv_nsec = (deadline % 1000000ULL) * 1000;
+  if (timerfd_settime(net_session_tmr_fd, TFD_TIMER_ABSTIME, &its, NULL))
+    return -1;
+
+  while (1)
+  {
+    u8 ready = 0, expired = 0;
+    int i, rv;
+
+    rv = epoll_wait(s->epfd, evs, 4, -1);
+    if (rv < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+
+    for (i = 0; i < rv; i++)
+    {
+      int fd = evs[i].data.fd;
+
+      if (fd == net_session_tmr_fd)
+      {
+        expired = 1;
+      }
+      else if (fd == s->exec_fd)
+      {
+        // left for the caller to consume, it has the server to kill
+        s->timed_out = 1;
+        return -1;
+      }
+      else if (s->shm)
+      {
+        eventfd_t bell;
+
+        if (fd == s->child_fd)
+          s->peer_closed = 1; // the caller still drains what the server left behind
+        else
+          eventfd_read(s->fd, &bell);
+        ready = 1;
+      }
+      else if (evs[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP | wanted))
+      {
+        ready = 1; // on errors, the next syscall will report what happened
+      }
+    }
+
+    if (ready)
+      return 1;
+
+    if (expired)
+    {
+      u64 ticks;
+
+      if (read(net_session_tmr_fd, &ticks, sizeof(ticks)) < 0 && errno != EAGAIN)
+        return -1;
+      return 0;
+    }
+  }
+}
+
+/* Put the deadline timer into the epoll set of a new session */
+static int net_session_add_timer(net_session_t *s)
+{
+  struct epoll_event ev;
+
+  if (net_session_tmr_fd < 0)
+  {
+    net_session_tmr_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (net_session_tmr_fd < 0)
+      return 1;
+  }
+
+  ev.events = EPOLLIN;
+  ev.data.fd = net_session_tmr_fd;
+  return epoll_ctl(s->epfd, EPOLL_CTL_ADD, net_session_tmr_fd, &ev) < 0;
+}
+
+int net_session_watch(net_session_t *s, int exec_fd)
+{
+  struct epoll_event ev;
+
+  ev.events = EPOLLIN;
+  ev.data.fd = exec_fd;
+  if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, exec_fd, &ev) < 0)
+    return 1;
+
+  s->exec_fd = exec_fd;
+  return 0;
+}
+
+int net_session_open(net_session_t *s, int sockfd, u32 gap_usecs, int (*complete)(unsigned char *buf, unsigned int buf_size))
+{
+  struct epoll_event ev;
+  int flags;
+
+  memset(s, 0, sizeof(net_session_t));
+  s->fd = sockfd;
+  s->gap_msecs = (gap_usecs + 999) / 1000;
+  s->complete = complete;
+  s->child_fd = -1;
+  s->exec_fd = -1;
+
+  flags = fcntl(sockfd, F_GETFL);
+  if (flags < 0 || fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) < 0)
+    return 1;
+
+  int type;
+  socklen_t type_len = sizeof(type);
+  if (getsockopt(sockfd, SOL_SOCKET, SO_TYPE, &type, &type_len) == 0 && type == SOCK_DGRAM)
+    s->dgram = 1;
+
+  s->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (s->epfd < 0)
+    return 1;
+
+  ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  ev.data.fd = sockfd;
+  if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, sockfd, &ev) < 0 || net_session_add_timer(s))
+  {
+    close(s->epfd);
+    s->epfd = -1;
+    return 1;
+  }
+
+  return 0;
+}
+
+int net_session_open_shm(net_session_t *s, desock_shm_t *shm, int *efds, int child_fd, u32 gap_usecs, int (*complete)(unsigned char *buf, unsigned int buf_size))
+{
+  struct epoll_event ev;
+
+  memset(s, 0, sizeof(net_session_t));
+  s->shm = shm;
+  s->accept_fd = efds[0];
+  s->conn_fd = efds[1];
+  s->fd = efds[2];
+  s->child_fd = child_fd;
+  s->exec_fd = -1;
+  s->gap_msecs = (gap_usecs + 999) / 1000;
+  s->complete = complete;
+
+  s->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (s->epfd < 0)
+    return 1;
+
+  // level-triggered: net_session_wait() resets the bell every time it rings
+  ev.events = EPOLLIN;
+  ev.data.fd = s->fd;
+  if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->fd, &ev) < 0)
+    goto ERR;
+
+  ev.data.fd = child_fd;
+  if (child_fd >= 0 && epoll_ctl(s->epfd, EPOLL_CTL_ADD, child_fd, &ev) < 0)
+    goto ERR;
+
+  if (net_session_add_timer(s))
+    goto ERR;
+
+  return 0;
+
+ERR:
+  close(s->epfd);
+  s->epfd = -1;
+  return 1;
+}
+
+/* Shared-memory counterpart of connect(): queue one connection and wait for the server to take it */
+static int net_session_connect_shm(net_session_t *s, u32 max_tries)
+{
+  unsigned long long deadline = net_session_now_us() + (max_tries > 1000 ? max_tries : 1000) * 1000ULL;
+
+  if (eventfd_write(s->accept_fd, 1))
+    return 1;
+
+  while (!__atomic_load_n(&s->shm->accepts, __ATOMIC_ACQUIRE))
+  {
+    if (s->peer_closed || net_session_wait(s, EPOLLIN, deadline) <= 0)
+      return 1;
+  }
+
+  return 0;
+}
+
+int net_session_connect(net_session_t *s, struct sockaddr *addr, socklen_t addr_len, u32 max_tries)
+{
+  u32 tries;
+
+  if (s->shm)
+    return net_session_connect_shm(s, max_tries);
+
+  for (tries = 0; tries < max_tries; tries++)
+  {
+    if (connect(s->fd, addr, addr_len) == 0)
+      return 0;
+
+    if (errno == EINPROGRESS || errno == EALREADY)
+    {
+      int err = 0;
+      socklen_t err_len = sizeof(err);
+
+      // 1s is the same overall budget the retry loop below gives a slow server
+      if (net_session_wait(s, EPOLLOUT, net_session_now_us() + 1000000ULL) <= 0)
+        return 1;
+      if (getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &err_len) == 0 && err == 0)
+        return 0;
+      if (err != ECONNREFUSED)
+        return 1;
+    }
+    else if (errno == EISCONN)
+    {
+      return 0;
+    }
+    else if (errno == ECONNABORTED)
+    {
+      // Linux reports the refusal of the previous attempt once more; the socket can be reused now
+      continue;
+    }
+    else if (errno != ECONNREFUSED && errno != EINTR)
+    {
+      return 1;
+    }
+
+    // the server is not listening yet, its initial startup time is varied
+    usleep(1000);
+  }
+
+  return 1;
+}
+
+/* Queue len bytes in the request ring, waiting at most gap_msecs for room each time it is
+   full. A datagram is only queued as a whole, behind its 4-byte length. */
+static int net_session_send_shm(net_session_t *s, char *mem, unsigned int len)
+{
+  desock_ring_t *r = &s->shm->req;
+  unsigned int byte_count = 0;
+  u32 hdr = s->shm->dgram ? 4 : 0;
+
+  // like a socket whose peer is gone (EPIPE)
+  if (s->peer_closed || __atomic_load_n(&s->shm->conn_closed, __ATOMIC_ACQUIRE))
+    return -1;
+
+  if (hdr && len > DESOCK_RING_SIZE - hdr)
+    len = DESOCK_RING_SIZE - hdr;
+
+  while (byte_count < len)
+  {
+    u32 room = desock_ring_room(r);
+
+    if (room > hdr && (!hdr || room >= len + hdr))
+    {
+      u32 n = room - hdr;
+
+      if (n > len - byte_count)
+        n = len - byte_count;
+      if (hdr)
+        desock_ring_put(r, 0, (u8 *)&len, hdr);
+      desock_ring_put(r, hdr, (u8 *)&mem[byte_count], n);
+      desock_ring_publish(r, hdr + n);
+      byte_count += n;
+
+      if (eventfd_write(s->conn_fd, 1))
+        return -1;
+      continue;
+    }
+
+    // the ring is full: ask the server to ring the bell once it has made room
+    __atomic_store_n(&r->waiting, 1, __ATOMIC_SEQ_CST);
+    if (desock_ring_room(r) != room)
+      continue;
+
+    int rv = net_session_wait(s, EPOLLIN, net_session_now_us() + s->gap_msecs * 1000ULL);
+    if (rv < 0 || s->peer_closed)
+      return -1;
+    if (rv == 0)
+      return byte_count;
+  }
+
+  return byte_count;
+}
+
+int net_session_send(net_session_t *s, char *mem, unsigned int len)
+{
+  unsigned int byte_count = 0;
+
+  if (s->shm)
+    return net_session_send_shm(s, mem, len);
+
+  while (byte_count < len)
+  {
+    int n = send(s->fd, &mem[byte_count], len - byte_count, MSG_NOSIGNAL);
+
+    if (n > 0)
+    {
+      byte_count += n;
+      continue;
+    }
+
+    if (n == 0)
+      return byte_count;
+
+    if (errno == EINTR)
+      continue;
+
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+      return -1;
+
+    // send buffer full: wait for the server to drain it
+    int rv = net_session_wait(s, EPOLLOUT, net_session_now_us() + s->gap_msecs * 1000ULL);
+    if (rv < 0)
+      return -1;
+    if (rv == 0)
+      return byte_count;
+  }
+
+  return byte_count;
+}
+
+/* Make sure the response buffer has room for len + extra bytes and the NUL terminator */
+static void net_session_reserve(net_session_t *s, char **response_buf, unsigned int len, u32 extra)
+{
+  u32 new_cap;
+
+  if (s->buf_cap >= len + extra + 1)
+    return;
+
+  new_cap = s->buf_cap ? s->buf_cap : NET_SESSION_CHUNK;
+  while (new_cap < len + extra + 1)
+    new_cap *= 2;
+  *response_buf = (char *)ck_realloc(*response_buf, new_cap);
+  s->buf_cap = new_cap;
+}
+
+/* Collect responses from the response ring. Besides the timeouts, this stops as soon as the
+   server has consumed every request and blocked waiting for more: whatever it had to say
+   about them is in the ring by then. */
+static int net_session_recv_shm(net_session_t *s, u32 first_msecs, char **response_buf, unsigned int *len)
+{
+  desock_shm_t *shm = s->shm;
+  desock_ring_t *r = &shm->resp;
+  unsigned long long deadline = net_session_now_us() + first_msecs * 1000ULL;
+  unsigned int start = *len;
+  u8 got_data = 0;
+
+  while (1)
+  {
+    // sample the server state first: responses it made before going idle are in the ring now
+    u8 gone = s->peer_closed || __atomic_load_n(&shm->conn_closed, __ATOMIC_ACQUIRE);
+    u8 idle = __atomic_load_n(&shm->idle_at, __ATOMIC_ACQUIRE) == shm->req.head;
+    u32 used = desock_ring_used(r);
+
+    if (used)
+    {
+      net_session_reserve(s, response_buf, *len, used);
+      desock_ring_peek(r, 0, (u8 *)&(*response_buf)[*len], used);
+      desock_ring_consume(r, used);
+      *len += used;
+      (*response_buf)[*len] = '\0';
+      got_data = 1;
+
+      if (__atomic_load_n(&r->waiting, __ATOMIC_SEQ_CST))
+      {
+        __atomic_store_n(&r->waiting, 0, __ATOMIC_RELAXED);
+        desock_futex_wake(&r->tail);
+      }
+    }
+
+    if (gone)
+    {
+      s->peer_closed = 1;
+      return 0;
+    }
+
+    if (idle)
+      return 0;
+
+    if (got_data && s->complete && s->complete((unsigned char *)&(*response_buf)[start], *len - start))
+      return 0;
+
+    if (got_data)
+    {
+      deadline = net_session_now_us() + s->gap_msecs * 1000ULL;
+      got_data = 0;
+    }
+
+    int rv = net_session_wait(s, EPOLLIN, deadline);
+    if (rv < 0)
+      return 1;
+    if (rv == 0)
+      return 0;
+  }
+}
+
+/* Move up to NET_SESSION_MMSG pending datagrams to the response buffer with one recvmmsg()
+   and remember where each of them ends. Returns their number, or -1 with errno set. */
+static int net_session_recv_dgrams(net_session_t *s, char **response_buf, unsigned int *len)
+{
+  struct mmsghdr msgs[NET_SESSION_MMSG];
+  struct iovec iov[NET_SESSION_MMSG];
+  u32 total = 0;
+  int i, n;
+
+  if (!net_session_dgram_buf)
+    net_session_dgram_buf = ck_alloc_nozero(NET_SESSION_MMSG * NET_SESSION_DGRAM_MAX);
+
+  memset(msgs, 0, sizeof(msgs));
+  for (i = 0; i < NET_SESSION_MMSG; i++)
+  {
+    iov[i].iov_base = net_session_dgram_buf + i * NET_SESSION_DGRAM_MAX;
+    iov[i].iov_len = NET_SESSION_DGRAM_MAX;
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  n = recvmmsg(s->fd, msgs, NET_SESSION_MMSG, MSG_DONTWAIT, NULL);
+  if (n <= 0)
+    return n;
+
+  for (i = 0; i < n; i++)
+    total += msgs[i].msg_len;
+
+  net_session_reserve(s, response_buf, *len, total);
+
+  if (s->dgram_count + n > s->dgram_cap)
+  {
+    s->dgram_cap = (s->dgram_count + n) * 2;
+    s->dgram_ends = (u32 *)ck_realloc(s->dgram_ends, s->dgram_cap * sizeof(u32));
+  }
+
+  for (i = 0; i < n; i++)
+  {
+    memcpy(&(*response_buf)[*len], iov[i].iov_base, msgs[i].msg_len);
+    *len += msgs[i].msg_len;
+    s->dgram_ends[s->dgram_count++] = *len;
+  }
+  (*response_buf)[*len] = '\0';
+
+  return n;
+}
+
+int net_session_recv(net_session_t *s, u32 first_msecs, char **response_buf, unsigned int *len)
+{
+  unsigned long long deadline;
+  unsigned int start = *len;
+  u8 got_data = 0;
+
+  // a buffer not grown by us (e.g. freed and reset by the caller) has no spare room
+  if (!*response_buf)
+    s->buf_cap = s->dgram_count = 0;
+
+  if (s->shm)
+    return net_session_recv_shm(s, first_msecs, response_buf, len);
+
+  if (s->peer_closed)
+    return 0;
+
+  deadline = net_session_now_us() + first_msecs * 1000ULL;
+
+  while (1)
+  {
+    // Edge-triggered: drain the socket completely before going back to epoll_wait
+    while (1)
+    {
+      int n;
+
+      net_session_reserve(s, response_buf, *len, NET_SESSION_CHUNK);
+
+      if (s->dgram)
+      {
+        n = net_session_recv_dgrams(s, response_buf, len);
+
+        if (n > 0)
+          got_data = 1;
+
+        // every new datagram raises another edge, so a short batch means the queue is empty
+        if (n == NET_SESSION_MMSG || (n < 0 && errno == EINTR))
+          continue;
+        if (n >= 0 || errno == EAGAIN || errno == EWOULDBLOCK)
+          break;
+
+        return 1;
+      }
+
+      n = recv(s->fd, &(*response_buf)[*len], s->buf_cap - *len - 1, 0);
+
+      if (n > 0)
+      {
+        *len += n;
+        (*response_buf)[*len] = '\0';
+        got_data = 1;
+        continue;
+      }
+
+      if (n == 0)
+      {
+        s->peer_closed = 1;
+        return 0;
+      }
+
+      if (errno == EINTR)
+        continue;
+
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+
+      // ECONNREFUSED on UDP and ECONNRESET on TCP are reported as errors, like net_recv did
+      return 1;
+    }
+
+    // the server has nothing more queued: stop right here if the reply is known to be complete
+    if (got_data && s->complete && s->complete((unsigned char *)&(*response_buf)[start], *len - start))
+      return 0;
+
+    // once the response has started, only wait for the gap between two chunks
+    if (got_data)
+    {
+      deadline = net_session_now_us() + s->gap_msecs * 1000ULL;
+      got_data = 0;
+    }
+
+    int rv = net_session_wait(s, EPOLLIN, deadline);
+    if (rv < 0)
+      return 1;
+    if (rv == 0)
+      return 0;
+  }
+}
+
+/* Send as many datagrams as possible, waiting up to gap_msecs for socket space each time the
+   kernel takes none. Returns the number sent, or -1 if the very first one failed. */
+static int net_session_send_batch(net_session_t *s, struct iovec *reqs, unsigned int count)
+{
+  struct mmsghdr msgs[NET_SESSION_MMSG];
+  unsigned int sent = 0;
+
+  while (sent < count)
+  {
+    unsigned int i, batch = count - sent < NET_SESSION_MMSG ? count - sent : NET_SESSION_MMSG;
+    int n;
+
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < batch; i++)
+    {
+      msgs[i].msg_hdr.msg_iov = &reqs[sent + i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    n = sendmmsg(s->fd, msgs, batch, MSG_NOSIGNAL);
+
+    if (n > 0)
+    {
+      sent += n;
+      continue;
+    }
+
+    if (errno == EINTR)
+      continue;
+
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+      return sent ? (int)sent : -1;
+
+    if (net_session_wait(s, EPOLLOUT, net_session_now_us() + s->gap_msecs * 1000ULL) <= 0)
+      return sent;
+  }
+
+  return sent;
+}
+
+int net_session_exchange_batch(net_session_t *s, struct iovec *reqs, unsigned int count, u32 first_msecs,
+                               int (*matches)(unsigned char *req, unsigned int req_len, unsigned char *resp, unsigned int resp_len),
+                               char **response_buf, unsigned int *len, u32 *ends)
+{
+  unsigned int base = *len, first = s->dgram_count, pending, i, j;
+  u32 *owner = NULL;
+  u8 *answered;
+  int sent;
+
+  sent = net_session_send_batch(s, reqs, count);
+  if (sent <= 0)
+    return sent;
+
+  answered = ck_alloc(sent);
+  pending = sent;
+
+  while (pending)
+  {
+    u32 before = s->dgram_count;
+    int rc = net_session_recv(s, first_msecs, response_buf, len);
+
+    // A failed wait can still have appended replies; give them owners before giving up
+    if (s->dgram_count == before)
+      break;
+
+    owner = (u32 *)ck_realloc(owner, (s->dgram_count - first) * sizeof(u32));
+
+    for (j = before; j < s->dgram_count; j++)
+    {
+      unsigned int start = j ? s->dgram_ends[j - 1] : 0;
+      u32 o = sent - 1, dup = sent;
+
+      for (i = 0; i < (unsigned int)sent; i++)
+      {
+        if (!matches((unsigned char *)reqs[i].iov_base, reqs[i].iov_len,
+                     (unsigned char *)&(*response_buf)[start], s->dgram_ends[j] - start))
+          continue;
+        if (!answered[i])
+          break;
+        if (dup == (u32)sent)
+          dup = i;
+      }
+
+      if (i < (unsigned int)sent)
+      {
+        o = i;
+        answered[i] = 1;
+        pending--;
+      }
+      else if (dup < (u32)sent)
+      {
+        o = dup; // a second reply to the same request
+      }
+
+      owner[j - first] = o;
+    }
+
+    if (rc)
+      break;
+  }
+
+  // Lay the replies out in request order, in place; the early response before base stays
+  if (s->dgram_count > first)
+  {
+    unsigned int pos = base;
+    u32 n = s->dgram_count - first;
+    u32 *starts = ck_alloc(n * 2 * sizeof(u32)), *sizes = starts + n;
+
+    for (j = 0; j < n; j++)
+    {
+      starts[j] = (first + j ? s->dgram_ends[first + j - 1] : 0) - base;
+      sizes[j] = s->dgram_ends[first + j] - base - starts[j];
+    }
+
+    if (net_session_order_cap < *len - base)
+    {
+      net_session_order_cap = (*len - base) * 2;
+      net_session_order_buf = (char *)ck_realloc(net_session_order_buf, net_session_order_cap);
+    }
+    memcpy(net_session_order_buf, &(*response_buf)[base], *len - base);
+
+    for (i = 0; i < (unsigned int)sent; i++)
+    {
+      for (j = 0; j < n; j++)
+      {
+        if (owner[j] != i)
+          continue;
+        memcpy(&(*response_buf)[pos], &net_session_order_buf[starts[j]], sizes[j]);
+        pos += sizes[j];
+        s->dgram_ends[first + j] = pos;
+      }
+      ends[i] = pos;
+    }
+
+    ck_free(starts);
+  }
+  else
+  {
+    for (i = 0; i < (unsigned int)sent; i++)
+      ends[i] = base;
+  }
+
+  ck_free(owner);
+  ck_free(answered);
+
+  return sent;
+}
+
+int net_session_finish(net_session_t *s, u32 msecs)
+{
+  unsigned long long deadline = net_session_now_us() + msecs * 1000ULL;
+  char scratch[4096];
+
+  if (s->dgram)
+    return 1;
+
+  if (s->shm)
+  {
+    // as in net_session_close(), a server blocked on a full ring gets an error from then on
+    __atomic_store_n(&s->shm->closed, 1, __ATOMIC_SEQ_CST);
+    eventfd_write(s->conn_fd, 1);
+    desock_futex_wake(&s->shm->resp.tail);
+
+    while (!s->peer_closed && !__atomic_load_n(&s->shm->conn_closed, __ATOMIC_ACQUIRE))
+    {
+      if (net_session_wait(s, EPOLLIN, deadline) <= 0)
+        return 0;
+    }
+
+    return 1;
+  }
+
+  if (!s->peer_closed && shutdown(s->fd, SHUT_WR))
+    return 0;
+
+  while (!s->peer_closed)
+  {
+    ssize_t n = recv(s->fd, scratch, sizeof(scratch), 0);
+
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+      s->peer_closed = 1; // a reset is as good as a close
+    else if (n < 0 && errno != EINTR && net_session_wait(s, EPOLLIN, deadline) <= 0)
+      return 0;
+  }
+
+  return 1;
+}
+
+void net_session_close(net_session_t *s)
+{
+  if (s->shm)
+  {
+    // EOF for the server; the eventfds belong to the caller
+    __atomic_store_n(&s->shm->closed, 1, __ATOMIC_SEQ_CST);
+    eventfd_write(s->conn_fd, 1);
+    desock_futex_wake(&s->shm->resp.tail);
+    s->fd = -1;
+  }
+
+  if (s->dgram_ends)
+    ck_free(s->dgram_ends);
+  s->dgram_ends = NULL;
+
+  if (s->epfd >= 0)
+    close(s->epfd);
+  if (s->fd >= 0)
+    close(s->fd);
+  s->epfd = -1;
+  s->fd = -1;
+}
+
+void net_session_detach(net_session_t *s)
+{
+  if (s->epfd >= 0)
+    close(s->epfd);
+  s->epfd = -1;
+  s->fd = -1;
+}
+
+// Implemented state machine (IPSM)
+
+ipsm_t *ipsm_create(void)
+{
+  ipsm_t *g = (ipsm_t *)ck_alloc(sizeof(ipsm_t));
+
+  g->index = kh_init(hm32);
+  return g;
+}
+
+void ipsm_destroy(ipsm_t *g)
+{
+  u32 i;
+
+  for (i = 0; i < g->node_count; i++)
+    ck_free(g->nodes[i].edges);
+
+  ck_free(g->nodes);
+  kh_destroy(hm32, g->index);
+  ck_free(g);
+}
+
+s32 ipsm_find(ipsm_t *g, u32 id)
+{
+  khint_t k = kh_get(hm32, g->index, id);
+
+  return k == kh_end(g->index) ? -1 : (s32)kh_val(g->index, k);
+}
+
+u32 ipsm_add_state(ipsm_t *g, u32 id, u64 now, u8 initial, u8 *added)
+{
+  int absent;
+  khint_t k = kh_put(hm32, g->index, id, &absent);
+  ipsm_node_t *node;
+
+  *added = absent > 0;
+  if (!*added)
+    return kh_val(g->index, k);
+
+  if (g->node_count == g->node_cap)
+  {
+    g->node_cap = g->node_cap ? g->node_cap * 2 : 16;
+    g->nodes = (ipsm_node_t *)ck_realloc(g->nodes, g->node_cap * sizeof(ipsm_node_t));
+  }
+
+  node = &g->nodes[g->node_count];
+  memset(node, 0, sizeof(ipsm_node_t));
+  node->id = id;
+  node->first_seen = now;
+  node->initial = initial;
+
+  kh_val(g->index, k) = g->node_count;
+  return g->node_count++;
+}
+
+u8 ipsm_add_transition(ipsm_t *g, u32 from, u32 to, u64 now, u8 initial)
+{
+  ipsm_node_t *node = &g->nodes[from];
+  ipsm_edge_t *edge;
+  u32 i;
+
+  // Few transitions leave any one state, a linear search is all it takes
+  for (i = 0; i < node->edge_count; i++)
+  {
+    if (node->edges[i].to == to)
+    {
+      node->edges[i].hits++;
+      return 0;
+    }
+  }
+
+  if (node->edge_count == node->edge_cap)
+  {
+    node->edge_cap = node->edge_cap ? node->edge_cap * 2 : 4;
+    node->edges = (ipsm_edge_t *)ck_realloc(node->edges, node->edge_cap * sizeof(ipsm_edge_t));
+  }
+
+  edge = &node->edges[node->edge_count++];
+  edge->to = to;
+  edge->hits = 1;
+  edge->first_seen = now;
+  edge->initial = initial;
+
+  g->edge_count++;
+  return 1;
+}
+
+void ipsm_write_dot(ipsm_t *g, FILE *f)
+{
+  u32 i, j;
+
+  fprintf(f, "digraph g {\n\tnode [color=black];\n\tedge [color=black];\n");
+
+  // State ids are printed as signed numbers, as in the names of the replayable paths
+  for (i = 0; i < g->node_count; i++)
+    fprintf(f, "\t%d\t[color=%s, first_seen=%llu];\n", (int)g->nodes[i].id,
+            g->nodes[i].initial ? "blue" : "red", g->nodes[i].first_seen);
+
+  for (i = 0; i < g->node_count; i++)
+  {
+    ipsm_node_t *node = &g->nodes[i];
+
+    for (j = 0; j < node->edge_count; j++)
+      fprintf(f, "\t%d -> %d\t[color=%s, hits=%u, first_seen=%llu];\n", (int)node->id,
+              (int)g->nodes[node->edges[j].to].id, node->edges[j].initial ? "blue" : "red",
+              node->edges[j].hits, node->edges[j].first_seen);
+  }
+
+  fprintf(f, "}\n");
+}
+
+void ipsm_write_bin(ipsm_t *g, FILE *f)
+{
+  u32 version = 1, flags, i, j;
+
+  fwrite("IPSM", 4, 1, f);
+  fwrite(&version, sizeof(u32), 1, f);
+  fwrite(&g->node_count, sizeof(u32), 1, f);
+  fwrite(&g->edge_count, sizeof(u32), 1, f);
+
+  for (i = 0; i < g->node_count; i++)
+  {
+    flags = g->nodes[i].initial;
+    fwrite(&g->nodes[i].id, sizeof(u32), 1, f);
+    fwrite(&flags, sizeof(u32), 1, f);
+    fwrite(&g->nodes[i].first_seen, sizeof(u64), 1, f);
+  }
+
+  for (i = 0; i < g->node_count; i++)
+  {
+    ipsm_node_t *node = &g->nodes[i];
+
+    for (j = 0; j < node->edge_count; j++)
+    {
+      flags = node->edges[j].initial;
+      fwrite(&node->id, sizeof(u32), 1, f);
+      fwrite(&g->nodes[node->edges[j].to].id, sizeof(u32), 1, f);
+      fwrite(&node->edges[j].hits, sizeof(u32), 1, f);
+      fwrite(&flags, sizeof(u32), 1, f);
+      fwrite(&node->edges[j].first_seen, sizeof(u64), 1, f);
+    }
+  }
+}
+
+// Fenwick tree of weights
+
+fenwick_t *fenwick_create(void)
+{
+  return (fenwick_t *)ck_alloc(sizeof(fenwick_t));
+}
+
+void fenwick_destroy(fenwick_t *t)
+{
+  ck_free(t->tree);
+  ck_free(t->weight);
+  ck_free(t);
+}
+
+void fenwick_set(fenwick_t *t, u32 idx, u64 weight)
+{
+  u64 delta;
+  u32 i;
+
+  if (idx >= t->cap)
+  {
+    u32 cap = t->cap ? t->cap : 16;
+
+    while (cap <= idx)
+      cap *= 2;
+
+    // Rebuild the partial sums for the new size in linear time
+    t->weight = (u64 *)ck_realloc(t->weight, cap * sizeof(u64));
+    ck_free(t->tree);
+    t->tree = (u64 *)ck_alloc((cap + 1) * sizeof(u64));
+    t->cap = cap;
+
+    for (i = 1; i <= cap; i++)
+    {
+      t->tree[i] += t->weight[i - 1];
+      if (i + (i & -i) <= cap)
+        t->tree[i + (i & -i)] += t->tree[i];
+    }
+  }
+
+  if (idx >= t->count)
+    t->count = idx + 1;
+
+  delta = weight - t->weight[idx];
+  t->weight[idx] = weight;
+
+  // Unsigned wrap-around takes care of weights that go down
+  for (i = idx + 1; i <= t->cap; i += i & -i)
+    t->tree[i] += delta;
+}
+
+u64 fenwick_total(fenwick_t *t)
+{
+  u64 sum = 0;
+  u32 i;
+
+  for (i = t->cap; i; i -= i & -i)
+    sum += t->tree[i];
+
+  return sum;
+}
+
+u32 fenwick_find(fenwick_t *t, u64 val)
+{
+  u32 pos = 0, step;
+
+  if (!t->cap)
+    return 0;
+
+  // cap is a power of two, so the descent starts from the root
+  for (step = t->cap; step; step >>= 1)
+  {
+    if (pos + step <= t->cap && t->tree[pos + step] <= val)
+    {
+      pos += step;
+      val -= t->tree[pos];
+    }
+  }
+
+  return pos < t->count ? pos : t->count - 1;
+}
+
 // Utility function
 
 void save_regions_to_file(region_t *regions, unsigned int region_count, unsigned char *fname)
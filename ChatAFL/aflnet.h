@@ -3,8 +3,11 @@
 
 #include "klist.h"
 #include "khash.h"
+#include "desock.h"
 #include <arpa/inet.h>
 #include <poll.h>
+#include <stdio.h>
+#include <sys/uio.h>
 
 typedef struct {
   int start_byte;                 /* The start byte, negative if unknown. */
@@ -27,9 +30,12 @@ typedef struct {
   u32 selected_times;         /* total number of times this state has been targeted/selected */
   u32 fuzzs;                  /* Total number of fuzzs (i.e., inputs generated) */
   u32 score;                  /* current score of the state */
+  u8 score_stale;             /* score inputs changed since the score was last computed */
   u32 selected_seed_index;    /* the recently selected seed index */
   void **seeds;               /* keeps all seeds reaching this state -- can be casted to struct queue_entry* */
   u32 seeds_count;            /* total number of seeds, it must be equal the size of the seeds array */
+  u32 cal_count;              /* calibrations of new finds reaching this state */
+  u32 cal_variable;           /* ... and how many of them showed variable behavior */
 } state_info_t;
 
 enum {
@@ -53,6 +59,9 @@ KHASH_SET_INIT_INT(hs32)
 // Initialize a hash table with int key and value is of type state_info_t
 KHASH_INIT(hms, khint32_t, state_info_t *, 1, kh_int_hash_func, kh_int_hash_equal)
 
+// Initialize a hash table with int key and value is of type u32 (e.g., a state index)
+KHASH_MAP_INIT_INT(hm32, u32)
+
 // Functions for extracting requests and responses
 
 /*To add support for a new application protocol, please add corresponding function declartion and implementation
@@ -71,6 +80,13 @@ unsigned int* extract_response_codes_http(unsigned char* buf, unsigned int buf_s
 unsigned int* extract_response_codes_ipp(unsigned char* buf, unsigned int buf_size, unsigned int* state_count_ref);
 extern unsigned int* (*extract_response_codes)(unsigned char* buf, unsigned int buf_size, unsigned int* state_count_ref);
 
+/* For every state but the initial one in the sequence returned by the last call of one of the
+   functions above, how many bytes of the buffer had been parsed when it was recognized. Parsing
+   only the first n bytes would give the states ending at most n bytes in, so one pass over the
+   responses tells which of them every message got. New functions report each state they add
+   through set_state_end() in aflnet.c. */
+extern u32 *state_ends;
+
 region_t* extract_requests_smtp(unsigned char* buf, unsigned int buf_size, unsigned int* region_count_ref);
 region_t* extract_requests_ssh(unsigned char* buf, unsigned int buf_size, unsigned int* region_count_ref);
 region_t* extract_requests_tls(unsigned char* buf, unsigned int buf_size, unsigned int* region_count_ref);
@@ -84,12 +100,101 @@ region_t* extract_requests_http(unsigned char* buf, unsigned int buf_size, unsig
 region_t* extract_requests_ipp(unsigned char* buf, unsigned int buf_size, unsigned int* region_count_ref);
 extern region_t* (*extract_requests)(unsigned char* buf, unsigned int buf_size, unsigned int* region_count_ref);
 
+/* Response-complete predicates: return 1 once buf holds a whole reply, so that receiving can stop
+   without waiting for the timeout. Protocols without a reliable end marker (SSH, DICOM) have none */
+int response_complete_smtp(unsigned char* buf, unsigned int buf_size);
+int response_complete_ftp(unsigned char* buf, unsigned int buf_size);
+int response_complete_rtsp(unsigned char* buf, unsigned int buf_size);
+int response_complete_sip(unsigned char* buf, unsigned int buf_size);
+int response_complete_http(unsigned char* buf, unsigned int buf_size);
+int response_complete_ipp(unsigned char* buf, unsigned int buf_size);
+int response_complete_tls(unsigned char* buf, unsigned int buf_size);
+int response_complete_dtls12(unsigned char* buf, unsigned int buf_size);
+int response_complete_dns(unsigned char* buf, unsigned int buf_size);
+extern int (*response_complete)(unsigned char* buf, unsigned int buf_size);
+
+// Reply matching: tell whether a reply answers a given request. Protocols that have one
+// carry no state from one request to the next, so their requests can be sent in a batch
+int reply_matches_dns(unsigned char* req, unsigned int req_len, unsigned char* resp, unsigned int resp_len);
+extern int (*reply_matches)(unsigned char* req, unsigned int req_len, unsigned char* resp, unsigned int resp_len);
+
 // Network communication functions
 
 // Two wrappers for sending and receiving data over socket
 int net_send(int sockfd, struct timeval timeout, char *mem, unsigned int len);
 int net_recv(int sockfd, struct timeval timeout, int poll_w, char **response_buf, unsigned int *len);
 
+// Event-driven session engine used by afl-fuzz. The socket is switched to non-blocking
+// mode and registered once (edge-triggered) in a private epoll set; every operation first
+// tries the syscall and only waits on the epoll set once the kernel reports EAGAIN.
+
+typedef struct {
+  int fd;                 /* Non-blocking TCP/UDP socket talking to the server */
+  int epfd;               /* Epoll set the socket is registered in */
+  u8 peer_closed;         /* Set once EOF/hang-up has been observed */
+  u32 buf_cap;            /* Allocated capacity of the attached response buffer */
+  u32 gap_msecs;          /* Max silence between two chunks of one response */
+  int (*complete)(unsigned char *buf, unsigned int buf_size); /* Optional response-complete predicate */
+  u8 dgram;               /* UDP: datagrams are received in batches and kept apart */
+  u32 *dgram_ends;        /* UDP: end offset of every datagram in the response buffer */
+  u32 dgram_count, dgram_cap;
+  desock_shm_t *shm;      /* Shared-memory transport (-U), NULL when talking over fd */
+  int accept_fd;          /* -U: eventfd to kick to connect */
+  int conn_fd;            /* -U: eventfd to kick when requests are queued */
+  int child_fd;           /* -U: readable once the server is gone (optional) */
+  int exec_fd;            /* Readable once the exec timeout has passed (optional) */
+  u8 timed_out;           /* Set once exec_fd was seen readable */
+} net_session_t;
+
+/* Attach sockfd to a fresh session. If complete is not NULL, a receive returns as soon as it
+   reports the bytes received so far as a whole reply. Returns 0 on success, 1 on error. */
+int net_session_open(net_session_t *s, int sockfd, u32 gap_usecs, int (*complete)(unsigned char *buf, unsigned int buf_size));
+
+/* Attach to the shared-memory transport instead: efds are the accept, conn and bell eventfds
+   described in desock.h, and child_fd (or -1) becomes readable when the server exits. The bell
+   takes the place of the socket, so every other call works as for a socket session. */
+int net_session_open_shm(net_session_t *s, desock_shm_t *shm, int *efds, int child_fd, u32 gap_usecs, int (*complete)(unsigned char *buf, unsigned int buf_size));
+
+/* Also wake up when exec_fd (the exec timeout timerfd of afl-fuzz) becomes readable. From then
+   on, the session is timed out: every call returns at once, as if on error. Returns 0 on
+   success, 1 on error. */
+int net_session_watch(net_session_t *s, int exec_fd);
+
+/* Connect to the server, retrying up to max_tries times (1ms apart) while it is refused.
+   With -U, wait as long (but at least 1s) for the server to accept. Returns 0 once connected,
+   1 otherwise. */
+int net_session_connect(net_session_t *s, struct sockaddr *addr, socklen_t addr_len, u32 max_tries);
+
+/* Send len bytes, waiting at most gap_msecs for socket space each time the send buffer is full.
+   Returns the number of bytes sent or -1 on error (same contract as net_send). */
+int net_session_send(net_session_t *s, char *mem, unsigned int len);
+
+/* Append everything the server sends to *response_buf: wait up to first_msecs for the first
+   byte, then keep reading until the socket stays silent for gap_msecs or the reply is complete.
+   Returns 1 on error, 0 otherwise (same contract as net_recv). */
+int net_session_recv(net_session_t *s, u32 first_msecs, char **response_buf, unsigned int *len);
+
+/* UDP only: send count datagrams with as few sendmmsg() calls as possible, then collect the
+   replies (see net_session_recv) until every request has one. Each reply is attributed to the
+   earliest request it matches, or to the last request if it matches none; the replies are
+   appended to *response_buf in request order and ends[i] is set to the buffer size once those
+   to requests 0..i are in. Returns the number of requests sent or -1 on error. */
+int net_session_exchange_batch(net_session_t *s, struct iovec *reqs, unsigned int count, u32 first_msecs,
+                               int (*matches)(unsigned char *req, unsigned int req_len, unsigned char *resp, unsigned int resp_len),
+                               char **response_buf, unsigned int *len, u32 *ends);
+
+/* End the session from this side (EOF on a TCP socket or the shared-memory connection) and
+   wait up to msecs for the server to close its end, discarding whatever it still sends.
+   Returns 1 once it has (UDP: at once), 0 on timeout or error. */
+int net_session_finish(net_session_t *s, u32 msecs);
+
+/* Close the socket (or the shared-memory connection) and the epoll set */
+void net_session_close(net_session_t *s);
+
+/* Release a shared-memory session without closing the connection, which the server keeps
+   using (e.g., while parked in a prefix snapshot) */
+void net_session_detach(net_session_t *s);
+
 // kl_messages manipulating functions
 
 /* Construct a new linked list to store all messages from a list of regions */
@@ -113,6 +218,78 @@ region_t* convert_kl_messages_to_regions(klist_t(lms) *kl_messages, u32* region_
 /* Load responses from a file. */
 char** get_responses_from_file(u8 *fname,u32 **response_bytes,u32* max_count,u32 *buffer_len);
 
+// Implemented state machine (IPSM)
+
+/* States get a dense index in the order they are discovered; the transitions leaving a state
+   are kept in an array next to it. Times are in milliseconds since fuzzing started */
+
+typedef struct {
+  u32 to;                     /* index of the target state */
+  u32 hits;                   /* number of seeds taking this transition */
+  u64 first_seen;             /* when it was first taken */
+  u8 initial;                 /* first taken by an initial seed (dry run) */
+} ipsm_edge_t;
+
+typedef struct {
+  u32 id;                     /* state id */
+  u64 first_seen;             /* when the state was first reached */
+  u8 initial;                 /* first reached by an initial seed (dry run) */
+  ipsm_edge_t *edges;         /* outgoing transitions */
+  u32 edge_count, edge_cap;
+} ipsm_node_t;
+
+typedef struct {
+  ipsm_node_t *nodes;         /* states, by index */
+  u32 node_count, node_cap;
+  u32 edge_count;             /* total number of transitions */
+  khash_t(hm32) *index;       /* state id -> index */
+} ipsm_t;
+
+/* Create an empty state machine */
+ipsm_t *ipsm_create(void);
+
+/* Free a state machine */
+void ipsm_destroy(ipsm_t *g);
+
+/* Get the index of a state, -1 if it has not been discovered */
+s32 ipsm_find(ipsm_t *g, u32 id);
+
+/* Get the index of a state, adding the state if it is new. *added tells which one it was */
+u32 ipsm_add_state(ipsm_t *g, u32 id, u64 now, u8 initial, u8 *added);
+
+/* Count a seed taking the transition between two states (by index). Returns 1 if the transition is new */
+u8 ipsm_add_transition(ipsm_t *g, u32 from, u32 to, u64 now, u8 initial);
+
+/* Write the state machine as a graphviz graph: what the initial seeds found is blue, the rest red */
+void ipsm_write_dot(ipsm_t *g, FILE *f);
+
+/* Write the state machine in binary form: "IPSM", then the version, the state count and the
+   transition count (u32 each), then per state its id, flags (1: initial) and first_seen time,
+   then per transition the ids of both states, hits, flags and first_seen time. Integers are
+   in host byte order; the ids, hits and flags are u32, the times u64 */
+void ipsm_write_bin(ipsm_t *g, FILE *f);
+
+// Fenwick tree of weights, for weighted random selection in O(log n)
+
+typedef struct {
+  u64 *tree;              /* 1-based partial sums */
+  u64 *weight;            /* current weight of each element */
+  u32 count, cap;         /* elements in use and allocated; unused ones weigh 0 */
+} fenwick_t;
+
+fenwick_t *fenwick_create(void);
+void fenwick_destroy(fenwick_t *t);
+
+/* Set the weight of element idx, growing the tree if it does not have that many elements yet */
+void fenwick_set(fenwick_t *t, u32 idx, u64 weight);
+
+/* Sum of all the weights */
+u64 fenwick_total(fenwick_t *t);
+
+/* Index of the element whose range of the cumulative weights holds val, i.e., the smallest idx
+   such that the weights of elements 0..idx add up to more than val. val must be below the total. */
+u32 fenwick_find(fenwick_t *t, u64 val);
+
 // Utility functions
 
 /* Save regions' information to file for debugging purpose */
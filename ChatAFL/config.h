@@ -82,6 +82,16 @@
 #define CAL_CYCLES          8
 #define CAL_CYCLES_LONG     40
 
+/* New finds are calibrated adaptively: once CAL_CYCLES_MIN runs are in and
+   the trace checksum and the state sequence have not changed for the last
+   CAL_STABLE_RUNS of them, calibration stops. Test cases reaching a state
+   that showed variable behavior in more than CAL_FLAKY_PERC percent of its
+   calibrations get all the cycles: */
+
+#define CAL_CYCLES_MIN      3
+#define CAL_STABLE_RUNS     2
+#define CAL_FLAKY_PERC      10
+
 /* Number of subsequent timeouts before abandoning an input file: */
 
 #define TMOUT_LIMIT         250
@@ -289,6 +299,7 @@
 #define AS_LOOP_ENV_VAR     "__AFL_AS_LOOPCHECK"
 #define PERSIST_ENV_VAR     "__AFL_PERSISTENT"
 #define DEFER_ENV_VAR       "__AFL_DEFER_FORKSRV"
+#define LISTEN_ENV_VAR      "__AFLNET_LISTEN_PORT"
 
 /* In-code signatures for deferred and persistent mode. */
 
@@ -308,6 +319,67 @@
 
 #define FORKSRV_FD          198
 
+/* AFLNet listen-ready handshake: the server under test writes LISTEN_READY_SIG
+   to LISTEN_FD once it listens on (TCP) or binds (UDP) the port passed in
+   LISTEN_ENV_VAR. Fork servers that can do this set FS_OPT_LISTEN_READY in
+   their hello message. If nothing arrives within LISTEN_READY_TMOUT
+   milliseconds, afl-fuzz goes back to waiting -D and retrying connect(): */
+
+#define LISTEN_FD           (FORKSRV_FD + 2)
+#define LISTEN_READY_SIG    0x4c53544e
+#define FS_OPT_LISTEN_READY 0x00000001
+#define LISTEN_READY_TMOUT  2000
+
+/* Hello bits of a fork server that was deferred automatically until the
+   server first waited for a connection (AFL_DEFER_AUTO=1 afl-clang-fast),
+   and that found the server running threads other than its own then: */
+
+#define FS_OPT_DEFER_AUTO    0x00000002
+#define FS_OPT_DEFER_THREADS 0x00000004
+
+/* Time given to the server to exit after SIGTERM (-K) before afl-fuzz sends
+   SIGKILL, in milliseconds: */
+
+#define TEARDOWN_TERM_MSECS 100
+
+/* AFLNet shared-memory transport (-U): the environment variable passing
+   "<shm id>:<port>" to libdesock.so, the eventfds it inherits (see desock.h)
+   and the size of each of its two rings. The size must be a power of two
+   large enough for the biggest test case plus a 4-byte datagram header: */
+
+#define DESOCK_ENV_VAR      "__AFLNET_DESOCK"
+#define DESOCK_ACCEPT_FD    (FORKSRV_FD + 3)
+#define DESOCK_CONN_FD      (FORKSRV_FD + 4)
+#define DESOCK_BELL_FD      (FORKSRV_FD + 5)
+#define DESOCK_RING_SIZE    (1 << 21)
+
+/* Function libdesock.so calls, if the server under test defines it, at the
+   end of each session in persistent mode (-p): */
+
+#define DESOCK_RESET_HOOK   "aflnet_reset_session"
+
+/* Virtual time (-v): the environment variable telling libvtime.so how long,
+   in microseconds, the server waits for input for real before its clocks
+   skip ahead, and the shortest such grace period. Over sockets, -W and -w
+   are added to it, as afl-fuzz waits out the responses before sending on: */
+
+#define VTIME_ENV_VAR       "__AFLNET_VTIME"
+#define VTIME_GRACE_USECS   2000
+
+/* Prefix snapshots (-Z) are given up on if the server did not park after M1
+   in any of this many first attempts: */
+
+#define SNAPSHOT_GIVE_UP    16
+
+/* Execution workers (-J): how many at most, and the room each one has for
+   the requests of an execution (the message sizes, then their data) and for
+   the responses to them (their end offsets, then the bytes). Executions that
+   do not fit are run by afl-fuzz itself; responses are cut short: */
+
+#define WORKER_MAX          64
+#define WORKER_REQ_SIZE     (2 * MAX_FILE)
+#define WORKER_RESP_SIZE    (4 * 1024 * 1024)
+
 /* Fork server init timeout multiplier: we'll wait the user-selected
    timeout plus this much for the fork server to spin up. */
 
@@ -333,6 +405,17 @@
 #define MAP_SIZE_POW2       16
 #define MAP_SIZE            (1 << MAP_SIZE_POW2)
 
+/* Right after the bitmap, the instrumentation keeps a 32-bit count of all
+   edges hit (the edge epoch), so the SHM region is a bit larger than the map.
+   After the last response, afl-fuzz waits until the epoch has stayed put for
+   EPOCH_QUIET_USECS, but never longer than EPOCH_WAIT_USECS: */
+
+#define MAP_EPOCH_OFF       MAP_SIZE
+#define SHM_SIZE            (MAP_SIZE + 4)
+
+#define EPOCH_QUIET_USECS   20
+#define EPOCH_WAIT_USECS    5000
+
 #define STATE_STR_LEN 12
 
 /* Maximum allocator request size (keep well under INT_MAX): */
@@ -0,0 +1,178 @@
+/*
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at:
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+/*
+   AFLNet - shared-memory transport (-U)
+   -------------------------------------
+
+   Layout of the SHM region shared by afl-fuzz and libdesock.so, plus the
+   byte ring helpers both sides use. afl-fuzz is the only writer of the
+   request ring and the only reader of the response ring; the server under
+   test is the other end of both.
+
+   Besides the region, three eventfds are inherited by the server at fixed
+   descriptors (see config.h):
+
+     DESOCK_ACCEPT_FD - afl-fuzz adds 1 to "connect"; the listening socket
+                        of the server is replaced with it,
+     DESOCK_CONN_FD   - afl-fuzz adds 1 whenever there are new requests;
+                        accepted (TCP) or bound (UDP) sockets are dups of it,
+     DESOCK_BELL_FD   - the server adds 1 when it produced a response,
+                        accepted the connection, closed it or went idle.
+
+   Since all of them are real descriptors, servers can keep using poll(),
+   select() or epoll on them.
+
+   With a prefix snapshot (-Z), afl-fuzz sets snap_at to the request head
+   right after the prefix. The server parks once it has consumed exactly that
+   much and waits for more, and from then on forks a child for every bump of
+   snap_go; the child carries on as if it had just read the prefix.
+
+   With several servers fuzzed side by side (-J) in one network namespace
+   (i.e., without -G), any_port is set: the socket the server binds to the
+   fuzzed port gets an ephemeral port instead, so that the servers do not get
+   in each other's way, and is taken over all the same.
+
+   In persistent mode (-p), the server stops itself with SIGSTOP once it has
+   closed the connection, and the fork server resumes it for the next
+   session. Before stopping, it calls DESOCK_RESET_HOOK if it defines one.
+*/
+
+#ifndef _HAVE_DESOCK_H
+#define _HAVE_DESOCK_H
+
+#include <string.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include "types.h"
+#include "config.h"
+
+#define DESOCK_RING_MASK (DESOCK_RING_SIZE - 1)
+
+typedef struct {
+
+  u32 head;                             /* Bytes ever written (free-running) */
+  u32 tail;                             /* Bytes ever consumed (ditto)       */
+  u32 waiting;                          /* Writer is waiting for room        */
+
+  u8  data[DESOCK_RING_SIZE];
+
+} desock_ring_t;
+
+typedef struct {
+
+  u32 attached;                         /* Set once libdesock.so mapped us   */
+  u32 dgram;                            /* Requests are framed datagrams     */
+
+  u32 accepts;                          /* Connections taken by the server   */
+  u32 conn_refs;                        /* Open copies of the connection     */
+  u32 conn_closed;                      /* The server closed the connection  */
+  u32 closed;                           /* afl-fuzz closed the connection    */
+  u32 persist;                          /* Stop once the server closed it    */
+  u32 any_port;                         /* Do not really bind the port       */
+
+  /* Request head the server had fully consumed when it last blocked waiting
+     for more input, i.e. it has nothing left to say about those requests: */
+
+  u32 idle_at;
+
+  /* Prefix snapshot (-Z): */
+
+  u32 snap_at;                          /* Request head to park at, 0: never */
+  u32 snap_parked;                      /* PID of the parked server          */
+  u32 snap_go;                          /* Bumped for every new child        */
+  u32 snap_child;                       /* PID of the latest child           */
+  u32 snap_done;                        /* Bumped once that child is gone    */
+  s32 snap_status;                      /* Its waitpid() status              */
+
+  desock_ring_t req, resp;
+
+} desock_shm_t;
+
+/* Bytes queued in / room left in a ring, as seen by its consumer / producer. */
+
+static inline u32 desock_ring_used(desock_ring_t* r) {
+
+  return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) - r->tail;
+
+}
+
+static inline u32 desock_ring_room(desock_ring_t* r) {
+
+  return DESOCK_RING_SIZE - (r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE));
+
+}
+
+/* Copy len bytes from offset off past the tail without consuming them. The
+   caller makes sure they are there. */
+
+static inline void desock_ring_peek(desock_ring_t* r, u32 off, u8* buf, u32 len) {
+
+  u32 pos   = (r->tail + off) & DESOCK_RING_MASK;
+  u32 first = DESOCK_RING_SIZE - pos;
+
+  if (first > len) first = len;
+
+  memcpy(buf, r->data + pos, first);
+  memcpy(buf + first, r->data, len - first);
+
+}
+
+static inline void desock_ring_consume(desock_ring_t* r, u32 len) {
+
+  __atomic_store_n(&r->tail, r->tail + len, __ATOMIC_SEQ_CST);
+
+}
+
+/* Append len bytes; the caller makes sure there is room. Nothing is visible
+   to the consumer until desock_ring_publish(). */
+
+static inline void desock_ring_put(desock_ring_t* r, u32 off, const u8* buf,
+                                   u32 len) {
+
+  u32 pos   = (r->head + off) & DESOCK_RING_MASK;
+  u32 first = DESOCK_RING_SIZE - pos;
+
+  if (first > len) first = len;
+
+  memcpy(r->data + pos, buf, first);
+  memcpy(r->data, buf + first, len - first);
+
+}
+
+static inline void desock_ring_publish(desock_ring_t* r, u32 len) {
+
+  __atomic_store_n(&r->head, r->head + len, __ATOMIC_SEQ_CST);
+
+}
+
+/* Wait while *addr still holds val (or until the timeout, if any) / wake up
+   everybody waiting on addr. */
+
+static inline void desock_futex_wait(u32* addr, u32 val,
+                                     const struct timespec* timeout) {
+
+  syscall(SYS_futex, addr, FUTEX_WAIT, val, timeout, NULL, 0);
+
+}
+
+static inline void desock_futex_wake(u32* addr) {
+
+  syscall(SYS_futex, addr, FUTEX_WAKE, 0x7fffffff, NULL, NULL, 0);
+
+}
+
+#endif /* !_HAVE_DESOCK_H */
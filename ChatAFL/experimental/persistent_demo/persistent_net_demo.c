@@ -0,0 +1,235 @@
+/*
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at:
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+/*
+   AFLNet - persistent mode example for network servers
+   ----------------------------------------------------
+
+   This file demonstrates persistent mode for a server fuzzed over the
+   network: one server process handles many sessions (connections) in a row
+   instead of being forked and started from scratch for every test case.
+
+   It is a tiny FTP control-connection server, so that the FTP corpus and
+   dictionary of the LightFTP benchmark can be used as-is:
+
+     afl-clang-fast persistent_net_demo.c -o persistent_net_demo
+
+     afl-fuzz -d -i ../../../benchmark/subjects/FTP/LightFTP/in-ftp \
+       -x ../../../benchmark/subjects/FTP/LightFTP/ftp.dict -o out \
+       -N tcp://127.0.0.1/2200 -P FTP -q 3 -s 3 -E -m none \
+       ./persistent_net_demo 2200
+
+   afl-fuzz notices the __AFL_LOOP() signature in the binary: it does not
+   terminate the server after each session, but closes the connection and
+   waits for the server to come back to __AFL_LOOP(), where it stops itself
+   until the next test case. Add -p to restart it more often than the loop
+   count says.
+
+   Servers that cannot be modified get the same over shared memory (-U -p N),
+   with the connection closed by the server as the end of a session. If the
+   server exports a function called aflnet_reset_session() (e.g., link with
+   -rdynamic), it is called right before stopping.
+
+   Like the other persistent mode example, this only works when compiled
+   with afl-clang-fast.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+
+/* Per-session state. Everything that one session may leave behind has to be
+   reset before the next one starts, or test cases will not be reproducible. */
+
+static char user[64];
+static char cwd[256];
+static int  logged_in;
+
+
+void aflnet_reset_session(void) {
+
+  memset(user, 0, sizeof(user));
+  strcpy(cwd, "/");
+  logged_in = 0;
+
+}
+
+
+static void reply(int fd, const char* msg) {
+
+  write(fd, msg, strlen(msg));
+
+}
+
+
+/* Handle one FTP control connection until the client goes away or quits. */
+
+static void serve(int fd) {
+
+  char buf[1024];
+  int  len = 0, n;
+
+  reply(fd, "220 persistent_net_demo ready\r\n");
+
+  while ((n = read(fd, buf + len, sizeof(buf) - 1 - len)) > 0) {
+
+    char* eol;
+
+    len += n;
+    buf[len] = 0;
+
+    while ((eol = strstr(buf, "\r\n"))) {
+
+      char* arg;
+
+      *eol = 0;
+      arg  = strchr(buf, ' ');
+      if (arg) *arg++ = 0;
+
+      if (!strcasecmp(buf, "USER") && arg) {
+
+        snprintf(user, sizeof(user), "%s", arg);
+        reply(fd, "331 Password required\r\n");
+
+      } else if (!strcasecmp(buf, "PASS")) {
+
+        if (!user[0]) {
+
+          reply(fd, "503 Login with USER first\r\n");
+
+        } else {
+
+          logged_in = 1;
+          reply(fd, "230 Logged in\r\n");
+
+        }
+
+      } else if (!strcasecmp(buf, "CWD") && arg) {
+
+        if (!logged_in) {
+
+          reply(fd, "530 Not logged in\r\n");
+
+        } else {
+
+          /* The bug: climbing above the root is not caught. abort() stands
+             in for whatever a real server would corrupt at this point. */
+
+          if (!strcmp(arg, "..")) {
+
+            char* slash = strrchr(cwd, '/');
+
+            if (slash == cwd && !cwd[1]) abort();
+            slash[slash == cwd] = 0;
+
+          } else {
+
+            if (cwd[1]) strncat(cwd, "/", sizeof(cwd) - strlen(cwd) - 1);
+            strncat(cwd, arg, sizeof(cwd) - strlen(cwd) - 1);
+
+          }
+
+          reply(fd, "250 Directory changed\r\n");
+
+        }
+
+      } else if (!strcasecmp(buf, "PWD")) {
+
+        if (logged_in) {
+
+          dprintf(fd, "257 \"%s\"\r\n", cwd);
+
+        } else reply(fd, "530 Not logged in\r\n");
+
+      } else if (!strcasecmp(buf, "QUIT")) {
+
+        reply(fd, "221 Bye\r\n");
+        return;
+
+      } else {
+
+        reply(fd, "502 Command not implemented\r\n");
+
+      }
+
+      len -= eol + 2 - buf;
+      memmove(buf, eol + 2, len + 1);
+
+    }
+
+    if (len == sizeof(buf) - 1) len = 0;
+
+  }
+
+}
+
+
+/* Main entry point. */
+
+int main(int argc, char** argv) {
+
+  struct sockaddr_in addr;
+  int ls, one = 1;
+
+  if (argc < 2) {
+
+    fprintf(stderr, "Usage: %s port\n", argv[0]);
+    return 1;
+
+  }
+
+  /* Everything that is done once per process (parsing the configuration,
+     loading keys, opening databases, listening) goes before the loop; with
+     persistent mode, its cost is shared by many sessions. */
+
+  ls = socket(AF_INET, SOCK_STREAM, 0);
+  setsockopt(ls, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family      = AF_INET;
+  addr.sin_port        = htons(atoi(argv[1]));
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  if (bind(ls, (struct sockaddr*)&addr, sizeof(addr)) || listen(ls, 1)) {
+
+    perror("bind/listen");
+    return 1;
+
+  }
+
+  /* One iteration per session. The number passed to __AFL_LOOP() is the
+     number of sessions after which the process exits and is started over,
+     to limit the impact of leaks and of state the reset misses. */
+
+  while (__AFL_LOOP(1000)) {
+
+    int fd = accept(ls, NULL, NULL);
+
+    if (fd < 0) continue;
+
+    aflnet_reset_session();
+    serve(fd);
+    close(fd);
+
+  }
+
+  close(ls);
+  return 0;
+
+}
@@ -0,0 +1,169 @@
+/*
+   AFLNet - per-execution cost of the state bookkeeping
+   ---------------------------------------------------
+
+   Times what afl-fuzz does with the state sequence of every execution once
+   the protocol parser has returned it: trimming and hashing it for the
+   novelty check, finding its distinct states and bumping their fuzzs
+   counters (update_fuzzs()). The parser is replaced with a stub that hands
+   out a copy of a fixed sequence, so that only this bookkeeping is timed,
+   and calls to malloc(), calloc() and realloc() are counted.
+
+   The harness includes afl-fuzz.c, so it builds against whichever tree -I
+   points to; build it against two checkouts to compare them. From this
+   directory:
+
+     cc -O3 -I../.. -DAFL_PATH='""' -DDOC_PATH='""' -DBIN_PATH='""' \
+       state_bench.c ../../aflnet.c ../../chat-llm.c -o state_bench \
+       -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc \
+       -ldl -lm -lcap -lcurl -ljson-c -lpcre2-8 -lpthread
+
+     ./state_bench 10 40 200
+
+   Every argument is a number of responses per execution; the responses go
+   through 22 states (0, 220 and 200..219) in a fixed pattern. The time
+   reported is the best of 7 rounds of 500k executions.
+*/
+
+#define main afl_main
+#include "afl-fuzz.c"
+#undef main
+
+#define BENCH_STATES 22
+#define BENCH_ITERS  500000
+#define BENCH_ROUNDS 7
+#define BENCH_MAX    4096
+
+static u64 alloc_calls;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t nmemb, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+
+void* __wrap_malloc(size_t size) {
+
+  alloc_calls++;
+  return __real_malloc(size);
+
+}
+
+void* __wrap_calloc(size_t nmemb, size_t size) {
+
+  alloc_calls++;
+  return __real_calloc(nmemb, size);
+
+}
+
+void* __wrap_realloc(void* ptr, size_t size) {
+
+  alloc_calls++;
+  return __real_realloc(ptr, size);
+
+}
+
+
+/* The sequence the stub parser returns, and where each state ends. */
+
+static u32 seq[BENCH_MAX], seq_len, seq_ends[BENCH_MAX];
+
+static unsigned int* stub_extract(unsigned char* buf, unsigned int buf_size,
+                                  unsigned int* state_count_ref) {
+
+  *state_count_ref = seq_len;
+  state_ends = seq_ends;
+  return ck_memdup(seq, seq_len * sizeof(u32));
+
+}
+
+
+/* Register the states the sequence goes through, as afl-fuzz would. */
+
+static void add_states(void) {
+
+  u32 i;
+  int absent;
+
+  for (i = 0; i < BENCH_STATES; i++) {
+
+    u32 id = i == 0 ? 0 : i == 1 ? 220 : 198 + i;
+    state_info_t* state = ck_alloc(sizeof(state_info_t));
+    khint_t k = kh_put(hms, khms_states, id, &absent);
+
+    state->id = id;
+    kh_val(khms_states, k) = state;
+    add_state_id(id);
+
+  }
+
+}
+
+
+static void bench(u32 responses) {
+
+  static char buf[BENCH_MAX];
+  u64 best = ~0ULL, allocs = 0;
+  u32 i, r;
+
+  seq[0] = 0;
+  seq[1] = 220;
+  seq_len = 2;
+
+  for (i = 0; i < responses; i++) seq[seq_len++] = 200 + (i * 7) % 20;
+  for (i = 0; i < seq_len; i++) seq_ends[i] = i;
+
+  reserve_response_bytes(responses);
+  for (i = 0; i < responses; i++) response_bytes[i] = i + 2;
+
+  response_buf      = buf;
+  response_buf_size = responses + 2;
+  messages_sent     = responses;
+
+  for (r = 0; r < BENCH_ROUNDS; r++) {
+
+    u64 calls = alloc_calls, start = get_cur_time_us(), took;
+
+    for (i = 0; i < BENCH_ITERS; i++) {
+
+      exec_states_parsed = 0;
+      update_fuzzs();
+
+    }
+
+    took = get_cur_time_us() - start;
+    if (took < best) best = took;
+    allocs = alloc_calls - calls;
+
+  }
+
+  SAYF("%5u responses: %6.0f ns/exec, %4.1f allocations/exec (1 is the stub)\n",
+       responses, best * 1000.0 / BENCH_ITERS, (double)allocs / BENCH_ITERS);
+
+}
+
+
+int main(int argc, char** argv) {
+
+  int i;
+
+  if (argc < 2) FATAL("Usage: %s responses [responses...]", argv[0]);
+
+  setup_ipsm();
+  init_count_class16();
+
+  extract_response_codes = stub_extract;
+  add_states();
+
+  for (i = 1; i < argc; i++) {
+
+    u32 responses = atoi(argv[i]);
+
+    if (!responses || responses > BENCH_MAX - 2)
+      FATAL("Responses per execution must be between 1 and %u", BENCH_MAX - 2);
+
+    bench(responses);
+
+  }
+
+  return 0;
+
+}
@@ -0,0 +1,1046 @@
+/*
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at:
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+/*
+
+   AFLNet - desocketing library for the shared-memory transport (-U)
+   -----------------------------------------------------------------
+
+   This Linux-only companion library lets afl-fuzz talk to the server under
+   test through shared memory instead of loopback sockets. The socket the
+   server listens on (TCP) or receives from (UDP) on the fuzzed port is
+   swapped for an eventfd, and the connection reads its requests from, and
+   writes its responses to, the two rings described in ../desock.h.
+   See README.desock for more info.
+*/
+
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/prctl.h>
+#include <sys/select.h>
+#include <sys/shm.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include "../types.h"
+#include "../config.h"
+#include "../desock.h"
+
+#ifndef __linux__
+#  error "Sorry, this library is Linux-specific for now!"
+#endif /* !__linux__ */
+
+
+/* What we know about a descriptor. Sockets on other ports and everything
+   that is not a socket are passed through; sockets that might still become
+   interesting (not bound or not listening yet) are looked at again later. */
+
+#define FD_UNKNOWN 0
+#define FD_PLAIN   1
+#define FD_LISTEN  2
+#define FD_CONN    3
+
+#define MAX_FDS    65536
+
+static desock_shm_t* __desock_shm;
+static u16 __desock_port;
+
+static u8  __desock_kind[MAX_FDS];
+static u8  __desock_moved[MAX_FDS];     /* Bound elsewhere (any_port)      */
+static u32 __desock_conns;              /* Connection copies we hold       */
+
+static struct sockaddr_storage __desock_addr;
+static socklen_t __desock_addr_len;
+static int __desock_type;
+
+
+/* Functions we wrap, resolved on first use. */
+
+static void* __desock_resolve(void** ptr, const char* name) {
+
+  if (!*ptr) *ptr = dlsym(RTLD_NEXT, name);
+  return *ptr;
+
+}
+
+#define REAL(_name) \
+  ((__typeof__(real_##_name))__desock_resolve((void**)&real_##_name, #_name))
+
+static ssize_t (*real_read)(int, void*, size_t);
+static ssize_t (*real_write)(int, const void*, size_t);
+static ssize_t (*real_readv)(int, const struct iovec*, int);
+static ssize_t (*real_writev)(int, const struct iovec*, int);
+static ssize_t (*real_recv)(int, void*, size_t, int);
+static ssize_t (*real_recvfrom)(int, void*, size_t, int, struct sockaddr*,
+                                socklen_t*);
+static ssize_t (*real_recvmsg)(int, struct msghdr*, int);
+static ssize_t (*real_send)(int, const void*, size_t, int);
+static ssize_t (*real_sendto)(int, const void*, size_t, int,
+                              const struct sockaddr*, socklen_t);
+static ssize_t (*real_sendmsg)(int, const struct msghdr*, int);
+static int (*real_socket)(int, int, int);
+static int (*real_bind)(int, const struct sockaddr*, socklen_t);
+static int (*real_accept4)(int, struct sockaddr*, socklen_t*, int);
+static int (*real_close)(int);
+static int (*real_shutdown)(int, int);
+static int (*real_getsockname)(int, struct sockaddr*, socklen_t*);
+static int (*real_getpeername)(int, struct sockaddr*, socklen_t*);
+static int (*real_getsockopt)(int, int, int, void*, socklen_t*);
+static int (*real_setsockopt)(int, int, int, const void*, socklen_t);
+static int (*real_poll)(struct pollfd*, nfds_t, int);
+static int (*real_ppoll)(struct pollfd*, nfds_t, const struct timespec*,
+                         const sigset_t*);
+static int (*real_select)(int, fd_set*, fd_set*, fd_set*, struct timeval*);
+static int (*real_epoll_ctl)(int, int, int, struct epoll_event*);
+static int (*real_epoll_wait)(int, struct epoll_event*, int, int);
+static int (*real_epoll_pwait)(int, struct epoll_event*, int, int,
+                               const sigset_t*);
+static pid_t (*real_fork)(void);
+
+
+/* Attach to the rings afl-fuzz set up for us, if any. */
+
+__attribute__((constructor)) void __desock_init(void) {
+
+  u8* str = getenv(DESOCK_ENV_VAR);
+  int shm_id;
+  u32 port;
+  void* mem;
+
+  if (!str || sscanf(str, "%d:%u", &shm_id, &port) != 2) return;
+
+  mem = shmat(shm_id, NULL, 0);
+  if (mem == (void*)-1) return;
+
+  __desock_port = port;
+  __desock_shm  = mem;
+  __atomic_store_n(&__desock_shm->attached, 1, __ATOMIC_RELEASE);
+
+}
+
+
+static inline u8 __desock_is(int fd, u8 kind) {
+
+  return __desock_shm && fd >= 0 && fd < MAX_FDS && __desock_kind[fd] == kind;
+
+}
+
+
+static void __desock_bell(void) {
+
+  u64 one = 1;
+  REAL(write)(DESOCK_BELL_FD, &one, 8);
+
+}
+
+
+static void __desock_conn_opened(void) {
+
+  __desock_conns++;
+  __atomic_add_fetch(&__desock_shm->conn_refs, 1, __ATOMIC_SEQ_CST);
+  __atomic_add_fetch(&__desock_shm->accepts, 1, __ATOMIC_RELEASE);
+  __desock_bell();
+
+}
+
+
+/* Put the eventfd shared with afl-fuzz in place of fd, keeping its
+   descriptor and file status flags. */
+
+static int __desock_replace(int fd, int efd) {
+
+  int fd_flags = fcntl(fd, F_GETFD), fl_flags = fcntl(fd, F_GETFL);
+
+  if (fd_flags < 0 || fl_flags < 0 || dup2(efd, fd) < 0) return -1;
+
+  fcntl(fd, F_SETFD, fd_flags);
+  fcntl(fd, F_SETFL, fl_flags & O_NONBLOCK);
+  return 0;
+
+}
+
+
+/* Find out whether fd is the listening (TCP) or bound (UDP) socket on the
+   fuzzed port, and if so, take it over. */
+
+static u8 __desock_classify(int fd) {
+
+  struct sockaddr_storage addr;
+  socklen_t len = sizeof(addr);
+  int type, acc;
+  socklen_t opt_len = sizeof(int);
+  u16 port;
+
+  if (!__desock_shm || fd < 0 || fd >= MAX_FDS) return FD_PLAIN;
+  if (__desock_kind[fd]) return __desock_kind[fd];
+
+  if (REAL(getsockname)(fd, (struct sockaddr*)&addr, &len)) {
+
+    if (errno == ENOTSOCK) __desock_kind[fd] = FD_PLAIN;
+    return FD_PLAIN;
+
+  }
+
+  if (addr.ss_family == AF_INET)
+    port = ntohs(((struct sockaddr_in*)&addr)->sin_port);
+  else if (addr.ss_family == AF_INET6)
+    port = ntohs(((struct sockaddr_in6*)&addr)->sin6_port);
+  else port = 0, __desock_kind[fd] = FD_PLAIN;
+
+  /* Bound to an ephemeral port by bind() below: pose as the fuzzed one. */
+
+  if (__desock_moved[fd] && port) {
+
+    port = __desock_port;
+
+    if (addr.ss_family == AF_INET)
+      ((struct sockaddr_in*)&addr)->sin_port = htons(port);
+    else
+      ((struct sockaddr_in6*)&addr)->sin6_port = htons(port);
+
+  }
+
+  if (port != __desock_port) {
+
+    if (port) __desock_kind[fd] = FD_PLAIN;
+    return FD_PLAIN;
+
+  }
+
+  if (REAL(getsockopt)(fd, SOL_SOCKET, SO_TYPE, &type, &opt_len))
+    return FD_PLAIN;
+
+  if (type == SOCK_STREAM) {
+
+    if (REAL(getsockopt)(fd, SOL_SOCKET, SO_ACCEPTCONN, &acc, &opt_len) ||
+        !acc) return FD_PLAIN;
+
+    if (__desock_replace(fd, DESOCK_ACCEPT_FD)) return FD_PLAIN;
+    __desock_kind[fd] = FD_LISTEN;
+
+  } else if (type == SOCK_DGRAM) {
+
+    if (__desock_replace(fd, DESOCK_CONN_FD)) return FD_PLAIN;
+    __desock_kind[fd] = FD_CONN;
+    __desock_conn_opened();
+
+  } else {
+
+    __desock_kind[fd] = FD_PLAIN;
+    return FD_PLAIN;
+
+  }
+
+  memcpy(&__desock_addr, &addr, len);
+  __desock_addr_len = len;
+  __desock_type = type;
+
+  return __desock_kind[fd];
+
+}
+
+
+/* The peer afl-fuzz pretends to be: the loopback address of the listener's
+   family. */
+
+static void __desock_peer(struct sockaddr* addr, socklen_t* len) {
+
+  struct sockaddr_storage peer;
+  socklen_t peer_len = __desock_addr_len;
+
+  if (!addr || !len) return;
+
+  memset(&peer, 0, sizeof(peer));
+  peer.ss_family = __desock_addr.ss_family;
+
+  if (peer.ss_family == AF_INET)
+    ((struct sockaddr_in*)&peer)->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  else
+    ((struct sockaddr_in6*)&peer)->sin6_addr = in6addr_loopback;
+
+  memcpy(addr, &peer, *len < peer_len ? *len : peer_len);
+  *len = peer_len;
+
+}
+
+
+/* Prefix snapshot (-Z): the server has consumed the prefix and waits for
+   more. Park right here and fork a child for every execution afl-fuzz asks
+   for; each child returns to the caller and reads the rest of the requests
+   from a connection that looks like it did when we parked. Only ever returns
+   in the children. */
+
+static void __desock_park(void) {
+
+  desock_shm_t* shm = __desock_shm;
+  u32 head  = shm->req.head;
+  u32 go    = __atomic_load_n(&shm->snap_go, __ATOMIC_ACQUIRE);
+  int flags = fcntl(DESOCK_CONN_FD, F_GETFL);
+  pid_t parent = getppid();
+  struct sigaction sa, old_sa;
+
+  /* Do not outlive the fork server (or afl-fuzz itself, in dumb mode). */
+
+  prctl(PR_SET_PDEATHSIG, SIGKILL);
+  if (getppid() != parent) _exit(0);
+
+  /* We reap the children, whatever the server does with SIGCHLD. */
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = SIG_DFL;
+  sigaction(SIGCHLD, &sa, &old_sa);
+
+  __atomic_store_n(&shm->snap_parked, getpid(), __ATOMIC_RELEASE);
+  __atomic_store_n(&shm->idle_at, head, __ATOMIC_RELEASE);
+  __desock_bell();
+
+  while (1) {
+
+    struct pollfd pfd = { DESOCK_CONN_FD, POLLIN, 0 };
+    int status;
+    pid_t pid;
+    u64 val;
+
+    while (__atomic_load_n(&shm->snap_go, __ATOMIC_ACQUIRE) == go)
+      desock_futex_wait(&shm->snap_go, go, NULL);
+
+    go = shm->snap_go;
+
+    /* Forget what the previous child left behind. */
+
+    if (REAL(poll)(&pfd, 1, 0) > 0) REAL(read)(DESOCK_CONN_FD, &val, 8);
+    fcntl(DESOCK_CONN_FD, F_SETFL, flags);
+
+    shm->req.tail    = shm->req.head;
+    shm->resp.tail   = shm->resp.head;
+    shm->req.waiting = shm->resp.waiting = 0;
+    shm->closed      = shm->conn_closed = 0;
+    shm->conn_refs   = __desock_conns;
+    __atomic_store_n(&shm->idle_at, shm->req.head, __ATOMIC_SEQ_CST);
+
+    pid = REAL(fork)();
+
+    if (!pid) {
+
+      sigaction(SIGCHLD, &old_sa, NULL);
+      return;
+
+    }
+
+    /* A failed fork() is reported as a child that could not even start. */
+
+    if (pid < 0) status = 0;
+
+    __atomic_store_n(&shm->snap_child, pid < 0 ? (u32)-1 : (u32)pid,
+                     __ATOMIC_RELEASE);
+    desock_futex_wake(&shm->snap_child);
+
+    while (pid > 0 && waitpid(pid, &status, 0) < 0 && errno == EINTR);
+
+    shm->snap_status = status;
+    __atomic_add_fetch(&shm->snap_done, 1, __ATOMIC_SEQ_CST);
+    desock_futex_wake(&shm->snap_done);
+    __desock_bell();
+
+  }
+
+}
+
+
+/* Persistent mode (-p): the server closed the connection, so the session is
+   over. Let the server forget about it, if it knows how, and stop until the
+   fork server resumes us for the next one (or kills us). */
+
+static void __desock_session_end(void) {
+
+  static void (*reset)(void);
+  static u8 resolved;
+  int saved_errno = errno;
+
+  if (!resolved) {
+
+    reset    = (void (*)(void))dlsym(RTLD_DEFAULT, DESOCK_RESET_HOOK);
+    resolved = 1;
+
+  }
+
+  if (reset) reset();
+
+  raise(SIGSTOP);
+  errno = saved_errno;
+
+}
+
+
+/* The server is about to wait for input. If it has consumed every request,
+   tell afl-fuzz that it is done with them (or park, see above). */
+
+static void __desock_idle(void) {
+
+  desock_shm_t* shm = __desock_shm;
+  u32 head = __atomic_load_n(&shm->req.head, __ATOMIC_ACQUIRE);
+
+  if (shm->req.tail != head || shm->idle_at == head) return;
+
+  if (shm->snap_at && shm->snap_at == head && !shm->snap_parked) {
+
+    __desock_park();
+    return;
+
+  }
+
+  __atomic_store_n(&shm->idle_at, head, __ATOMIC_RELEASE);
+  __desock_bell();
+
+}
+
+
+static u8 __desock_nonblocking(int fd, int flags) {
+
+  return (flags & MSG_DONTWAIT) || (fcntl(fd, F_GETFL) & O_NONBLOCK);
+
+}
+
+
+/* Read requests into iov, the way recvmsg() would. A datagram is returned
+   (and consumed) as a whole, truncated if it does not fit. */
+
+static ssize_t __desock_recv(int fd, const struct iovec* iov, int iovcnt,
+                             int flags, struct sockaddr* from,
+                             socklen_t* from_len) {
+
+  desock_shm_t* shm = __desock_shm;
+  desock_ring_t* r = &shm->req;
+  u32 want = 0, hdr = shm->dgram ? 4 : 0;
+  int i;
+
+  for (i = 0; i < iovcnt; i++) want += iov[i].iov_len;
+
+  while (1) {
+
+    u32 used = desock_ring_used(r);
+
+    if (used) {
+
+      u32 avail = used, n, done = 0;
+      u64 val;
+
+      if (hdr) desock_ring_peek(r, 0, (u8*)&avail, hdr);
+
+      n = want < avail ? want : avail;
+
+      for (i = 0; i < iovcnt && done < n; i++) {
+
+        u32 part = iov[i].iov_len < n - done ? iov[i].iov_len : n - done;
+
+        desock_ring_peek(r, hdr + done, iov[i].iov_base, part);
+        done += part;
+
+      }
+
+      __desock_peer(from, from_len);
+
+      if (flags & MSG_PEEK) return n;
+
+      desock_ring_consume(r, hdr ? hdr + avail : n);
+
+      /* Stop being readable once the ring is drained, unless afl-fuzz is
+         done with the connection (EOF) or raced us with more data. */
+
+      if (!desock_ring_used(r) && !shm->closed) {
+
+        struct pollfd pfd = { fd, POLLIN, 0 };
+
+        if (REAL(poll)(&pfd, 1, 0) > 0) REAL(read)(fd, &val, 8);
+        if (desock_ring_used(r)) {
+
+          val = 1;
+          REAL(write)(fd, &val, 8);
+
+        }
+
+      }
+
+      if (__atomic_load_n(&r->waiting, __ATOMIC_SEQ_CST)) {
+
+        __atomic_store_n(&r->waiting, 0, __ATOMIC_RELAXED);
+        __desock_bell();
+
+      }
+
+      return (hdr && (flags & MSG_TRUNC)) ? avail : n;
+
+    }
+
+    if (!hdr && __atomic_load_n(&shm->closed, __ATOMIC_ACQUIRE)) return 0;
+
+    __desock_idle();
+
+    if (__desock_nonblocking(fd, flags)) {
+
+      errno = EAGAIN;
+      return -1;
+
+    }
+
+    struct pollfd pfd = { fd, POLLIN, 0 };
+
+    if (REAL(poll)(&pfd, 1, -1) < 0) return -1;
+
+  }
+
+}
+
+
+/* Append iov to the response ring, waiting for afl-fuzz to make room if it
+   is full. */
+
+static ssize_t __desock_send(const struct iovec* iov, int iovcnt) {
+
+  desock_shm_t* shm = __desock_shm;
+  desock_ring_t* r = &shm->resp;
+  ssize_t total = 0;
+  int i;
+
+  for (i = 0; i < iovcnt; i++) {
+
+    u8* buf = iov[i].iov_base;
+    u32 left = iov[i].iov_len;
+
+    while (left) {
+
+      u32 room, tail;
+
+      if (__atomic_load_n(&shm->closed, __ATOMIC_ACQUIRE)) {
+
+        if (total) break;
+        errno = EPIPE;
+        return -1;
+
+      }
+
+      room = desock_ring_room(r);
+
+      if (room) {
+
+        u32 n = room < left ? room : left;
+
+        desock_ring_put(r, 0, buf, n);
+        desock_ring_publish(r, n);
+        buf += n;
+        left -= n;
+        total += n;
+        continue;
+
+      }
+
+      __atomic_store_n(&r->waiting, 1, __ATOMIC_SEQ_CST);
+      tail = __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST);
+      if (r->head - tail < DESOCK_RING_SIZE) continue;
+
+      __desock_bell();
+      desock_futex_wait(&r->tail, tail, NULL);
+
+    }
+
+  }
+
+  __desock_bell();
+  return total;
+
+}
+
+
+/* Called before the server waits for events. It is idle if it waits for
+   input on the connection (and is not just polling). */
+
+static void __desock_wait_hook(u8 conn_watched, u8 just_polling) {
+
+  if (!conn_watched || just_polling) return;
+  if (desock_ring_used(&__desock_shm->req)) return;
+
+  __desock_idle();
+
+}
+
+
+/* Socket calls. */
+
+int socket(int domain, int type, int protocol) {
+
+  int fd = REAL(socket)(domain, type, protocol);
+
+  if (fd >= 0 && fd < MAX_FDS)
+    __desock_kind[fd] = FD_UNKNOWN, __desock_moved[fd] = 0;
+  return fd;
+
+}
+
+
+/* With any_port, several instances of the server run at once: none of them
+   gets the fuzzed port, they are all given an ephemeral one. The bind() of
+   the afl-clang-fast runtime comes first and reaches ours via RTLD_NEXT. */
+
+int __desock_bind(int fd, const struct sockaddr* addr, socklen_t len) {
+
+  struct sockaddr_storage any;
+
+  if (!__desock_shm || !__desock_shm->any_port || fd < 0 || fd >= MAX_FDS ||
+      !addr || len > sizeof(any))
+    return REAL(bind)(fd, addr, len);
+
+  memcpy(&any, addr, len);
+
+  if (any.ss_family == AF_INET &&
+      ntohs(((struct sockaddr_in*)&any)->sin_port) == __desock_port)
+    ((struct sockaddr_in*)&any)->sin_port = 0;
+  else if (any.ss_family == AF_INET6 &&
+           ntohs(((struct sockaddr_in6*)&any)->sin6_port) == __desock_port)
+    ((struct sockaddr_in6*)&any)->sin6_port = 0;
+  else return REAL(bind)(fd, addr, len);
+
+  if (REAL(bind)(fd, (struct sockaddr*)&any, len)) return -1;
+
+  __desock_moved[fd] = 1;
+  return 0;
+
+}
+
+
+int bind(int fd, const struct sockaddr* addr, socklen_t len) {
+
+  return __desock_bind(fd, addr, len);
+
+}
+
+
+int accept4(int fd, struct sockaddr* addr, socklen_t* len, int flags) {
+
+  u64 val;
+  int conn;
+
+  if (__desock_classify(fd) != FD_LISTEN)
+    return REAL(accept4)(fd, addr, len, flags);
+
+  /* A blocking listener blocks here until afl-fuzz connects. */
+
+  if (REAL(read)(fd, &val, 8) != 8) return -1;
+
+  conn = fcntl(DESOCK_CONN_FD, (flags & SOCK_CLOEXEC) ? F_DUPFD_CLOEXEC :
+               F_DUPFD, 0);
+  if (conn < 0) return -1;
+
+  if (conn >= MAX_FDS) {
+
+    REAL(close)(conn);
+    errno = EMFILE;
+    return -1;
+
+  }
+
+  fcntl(conn, F_SETFL, (flags & SOCK_NONBLOCK) ? O_NONBLOCK : 0);
+
+  __desock_kind[conn] = FD_CONN;
+  __desock_conn_opened();
+  __desock_peer(addr, len);
+
+  return conn;
+
+}
+
+
+int accept(int fd, struct sockaddr* addr, socklen_t* len) {
+
+  return accept4(fd, addr, len, 0);
+
+}
+
+
+int close(int fd) {
+
+  u8 session_over = 0;
+  int ret;
+
+  if (__desock_is(fd, FD_CONN)) {
+
+    __desock_conns--;
+
+    if (!__atomic_sub_fetch(&__desock_shm->conn_refs, 1, __ATOMIC_SEQ_CST) &&
+        !__desock_shm->dgram) {
+
+      __atomic_store_n(&__desock_shm->conn_closed, 1, __ATOMIC_RELEASE);
+      __desock_bell();
+      session_over = __desock_shm->persist;
+
+    }
+
+  }
+
+  if (__desock_shm && fd >= 0 && fd < MAX_FDS)
+    __desock_kind[fd] = FD_UNKNOWN, __desock_moved[fd] = 0;
+
+  ret = REAL(close)(fd);
+
+  if (session_over) __desock_session_end();
+
+  return ret;
+
+}
+
+
+int shutdown(int fd, int how) {
+
+  if (__desock_is(fd, FD_CONN)) return 0;
+  return REAL(shutdown)(fd, how);
+
+}
+
+
+int getsockname(int fd, struct sockaddr* addr, socklen_t* len) {
+
+  if (__desock_is(fd, FD_CONN) || __desock_is(fd, FD_LISTEN)) {
+
+    memcpy(addr, &__desock_addr,
+           *len < __desock_addr_len ? *len : __desock_addr_len);
+    *len = __desock_addr_len;
+    return 0;
+
+  }
+
+  if (fd >= 0 && fd < MAX_FDS && __desock_moved[fd]) {
+
+    struct sockaddr_storage real;
+    socklen_t real_len = sizeof(real);
+
+    if (REAL(getsockname)(fd, (struct sockaddr*)&real, &real_len)) return -1;
+
+    if (real.ss_family == AF_INET)
+      ((struct sockaddr_in*)&real)->sin_port = htons(__desock_port);
+    else if (real.ss_family == AF_INET6)
+      ((struct sockaddr_in6*)&real)->sin6_port = htons(__desock_port);
+
+    memcpy(addr, &real, *len < real_len ? *len : real_len);
+    *len = real_len;
+    return 0;
+
+  }
+
+  return REAL(getsockname)(fd, addr, len);
+
+}
+
+
+int getpeername(int fd, struct sockaddr* addr, socklen_t* len) {
+
+  if (__desock_is(fd, FD_CONN)) {
+
+    __desock_peer(addr, len);
+    return 0;
+
+  }
+
+  return REAL(getpeername)(fd, addr, len);
+
+}
+
+
+int getsockopt(int fd, int level, int name, void* val, socklen_t* len) {
+
+  if (__desock_is(fd, FD_CONN) || __desock_is(fd, FD_LISTEN)) {
+
+    int ret = 0;
+
+    if (level == SOL_SOCKET && name == SO_TYPE) ret = __desock_type;
+    if (level == SOL_SOCKET && name == SO_ACCEPTCONN)
+      ret = __desock_is(fd, FD_LISTEN);
+
+    memset(val, 0, *len);
+    memcpy(val, &ret, *len < sizeof(int) ? *len : sizeof(int));
+    return 0;
+
+  }
+
+  return REAL(getsockopt)(fd, level, name, val, len);
+
+}
+
+
+int setsockopt(int fd, int level, int name, const void* val, socklen_t len) {
+
+  if (__desock_is(fd, FD_CONN) || __desock_is(fd, FD_LISTEN)) return 0;
+  return REAL(setsockopt)(fd, level, name, val, len);
+
+}
+
+
+/* Data transfer. */
+
+ssize_t recvmsg(int fd, struct msghdr* msg, int flags) {
+
+  if (__desock_classify(fd) != FD_CONN)
+    return REAL(recvmsg)(fd, msg, flags);
+
+  msg->msg_controllen = 0;
+  msg->msg_flags = 0;
+
+  return __desock_recv(fd, msg->msg_iov, msg->msg_iovlen, flags,
+                       msg->msg_name, &msg->msg_namelen);
+
+}
+
+
+ssize_t recvfrom(int fd, void* buf, size_t len, int flags,
+                 struct sockaddr* from, socklen_t* from_len) {
+
+  struct iovec iov = { buf, len };
+
+  if (__desock_classify(fd) != FD_CONN)
+    return REAL(recvfrom)(fd, buf, len, flags, from, from_len);
+
+  return __desock_recv(fd, &iov, 1, flags, from, from_len);
+
+}
+
+
+ssize_t recv(int fd, void* buf, size_t len, int flags) {
+
+  struct iovec iov = { buf, len };
+
+  if (__desock_classify(fd) != FD_CONN)
+    return REAL(recv)(fd, buf, len, flags);
+
+  return __desock_recv(fd, &iov, 1, flags, NULL, NULL);
+
+}
+
+
+ssize_t read(int fd, void* buf, size_t len) {
+
+  struct iovec iov = { buf, len };
+
+  if (!__desock_is(fd, FD_CONN)) return REAL(read)(fd, buf, len);
+  return __desock_recv(fd, &iov, 1, 0, NULL, NULL);
+
+}
+
+
+ssize_t readv(int fd, const struct iovec* iov, int iovcnt) {
+
+  if (!__desock_is(fd, FD_CONN)) return REAL(readv)(fd, iov, iovcnt);
+  return __desock_recv(fd, iov, iovcnt, 0, NULL, NULL);
+
+}
+
+
+ssize_t sendmsg(int fd, const struct msghdr* msg, int flags) {
+
+  if (!__desock_is(fd, FD_CONN)) return REAL(sendmsg)(fd, msg, flags);
+  return __desock_send(msg->msg_iov, msg->msg_iovlen);
+
+}
+
+
+ssize_t sendto(int fd, const void* buf, size_t len, int flags,
+               const struct sockaddr* to, socklen_t to_len) {
+
+  struct iovec iov = { (void*)buf, len };
+
+  if (!__desock_is(fd, FD_CONN))
+    return REAL(sendto)(fd, buf, len, flags, to, to_len);
+
+  return __desock_send(&iov, 1);
+
+}
+
+
+ssize_t send(int fd, const void* buf, size_t len, int flags) {
+
+  struct iovec iov = { (void*)buf, len };
+
+  if (!__desock_is(fd, FD_CONN)) return REAL(send)(fd, buf, len, flags);
+  return __desock_send(&iov, 1);
+
+}
+
+
+ssize_t write(int fd, const void* buf, size_t len) {
+
+  struct iovec iov = { (void*)buf, len };
+
+  if (!__desock_is(fd, FD_CONN)) return REAL(write)(fd, buf, len);
+  return __desock_send(&iov, 1);
+
+}
+
+
+ssize_t writev(int fd, const struct iovec* iov, int iovcnt) {
+
+  if (!__desock_is(fd, FD_CONN)) return REAL(writev)(fd, iov, iovcnt);
+  return __desock_send(iov, iovcnt);
+
+}
+
+
+/* _FORTIFY_SOURCE builds call these instead. The size checks are lost for
+   the connection, which never overruns the buffer anyway. */
+
+ssize_t __read_chk(int fd, void* buf, size_t len, size_t buf_len) {
+
+  if (len > buf_len) abort();
+  return read(fd, buf, len);
+
+}
+
+
+ssize_t __recv_chk(int fd, void* buf, size_t len, size_t buf_len, int flags) {
+
+  if (len > buf_len) abort();
+  return recv(fd, buf, len, flags);
+
+}
+
+
+ssize_t __recvfrom_chk(int fd, void* buf, size_t len, size_t buf_len,
+                       int flags, struct sockaddr* from,
+                       socklen_t* from_len) {
+
+  if (len > buf_len) abort();
+  return recvfrom(fd, buf, len, flags, from, from_len);
+
+}
+
+
+/* Event loops. The connection and listener are eventfds, so the kernel does
+   the waiting; we only need to spot them and report the server as idle. */
+
+static u8 __desock_poll_fds(struct pollfd* fds, nfds_t nfds) {
+
+  u8 watched = 0;
+  nfds_t i;
+
+  for (i = 0; i < nfds; i++)
+    if (__desock_classify(fds[i].fd) == FD_CONN && (fds[i].events & POLLIN))
+      watched = 1;
+
+  return watched;
+
+}
+
+
+int poll(struct pollfd* fds, nfds_t nfds, int timeout) {
+
+  if (__desock_shm) __desock_wait_hook(__desock_poll_fds(fds, nfds), !timeout);
+  return REAL(poll)(fds, nfds, timeout);
+
+}
+
+
+int __poll_chk(struct pollfd* fds, nfds_t nfds, int timeout, size_t fds_len) {
+
+  if (fds_len / sizeof(*fds) < nfds) abort();
+  return poll(fds, nfds, timeout);
+
+}
+
+
+int ppoll(struct pollfd* fds, nfds_t nfds, const struct timespec* timeout,
+          const sigset_t* sigmask) {
+
+  if (__desock_shm)
+    __desock_wait_hook(__desock_poll_fds(fds, nfds),
+                       timeout && !timeout->tv_sec && !timeout->tv_nsec);
+
+  return REAL(ppoll)(fds, nfds, timeout, sigmask);
+
+}
+
+
+int select(int nfds, fd_set* rfds, fd_set* wfds, fd_set* efds,
+           struct timeval* timeout) {
+
+  if (__desock_shm) {
+
+    u8 watched = 0;
+    int fd;
+
+    for (fd = 0; rfds && fd < nfds; fd++)
+      if (FD_ISSET(fd, rfds) && __desock_classify(fd) == FD_CONN) watched = 1;
+
+    __desock_wait_hook(watched,
+                       timeout && !timeout->tv_sec && !timeout->tv_usec);
+
+  }
+
+  return REAL(select)(nfds, rfds, wfds, efds, timeout);
+
+}
+
+
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event* ev) {
+
+  if (op == EPOLL_CTL_ADD) __desock_classify(fd);
+  return REAL(epoll_ctl)(epfd, op, fd, ev);
+
+}
+
+
+int epoll_wait(int epfd, struct epoll_event* evs, int max, int timeout) {
+
+  if (__desock_shm) __desock_wait_hook(__desock_conns > 0, !timeout);
+  return REAL(epoll_wait)(epfd, evs, max, timeout);
+
+}
+
+
+int epoll_pwait(int epfd, struct epoll_event* evs, int max, int timeout,
+                const sigset_t* sigmask) {
+
+  if (__desock_shm) __desock_wait_hook(__desock_conns > 0, !timeout);
+  return REAL(epoll_pwait)(epfd, evs, max, timeout, sigmask);
+
+}
+
+
+/* A forked child holds copies of our connections too; count them before it
+   can close anything. */
+
+pid_t fork(void) {
+
+  u32 conns = __desock_shm ? __desock_conns : 0;
+  pid_t pid;
+
+  if (conns)
+    __atomic_add_fetch(&__desock_shm->conn_refs, conns, __ATOMIC_SEQ_CST);
+
+  pid = REAL(fork)();
+
+  if (pid < 0 && conns)
+    __atomic_sub_fetch(&__desock_shm->conn_refs, conns, __ATOMIC_SEQ_CST);
+
+  return pid;
+
+}
@@ -0,0 +1,120 @@
+/*
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at:
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+/*
+
+   AFLNet - listen-ready notification for non-instrumented servers
+   ---------------------------------------------------------------
+
+   This Linux-only companion library reports to afl-fuzz when the server
+   under test starts listening on the port it is going to connect to, so
+   that afl-fuzz neither has to sleep (-D) nor to retry connect(). The
+   LLVM runtime does the same for afl-clang-fast binaries; this library is
+   meant for binaries running without a fork server (-n or AFL_NO_FORKSRV).
+   See README.listenready for more info.
+*/
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+
+#include "../types.h"
+#include "../config.h"
+
+#ifndef __linux__
+#  error "Sorry, this library is Linux-specific for now!"
+#endif /* !__linux__ */
+
+#if !defined(SYS_listen) || !defined(SYS_bind)
+#  error "Sorry, this library needs the listen() and bind() syscalls!"
+#endif /* !SYS_listen || !SYS_bind */
+
+
+static u16 __listenready_port;
+static u8  __listenready_done;
+
+
+/* Get the port to watch. */
+
+__attribute__((constructor)) void __listenready_init(void) {
+
+  u8* port_str = getenv(LISTEN_ENV_VAR);
+
+  if (port_str) __listenready_port = atoi(port_str);
+
+}
+
+
+/* Report once fd, a socket of the given type, is bound to the watched port.
+   The target may have closed or reused the descriptor, so only write to a
+   pipe. */
+
+static void __listenready_check(int fd, int type) {
+
+  struct sockaddr_storage addr;
+  struct stat st;
+  socklen_t len = sizeof(addr);
+  int sock_type;
+  socklen_t type_len = sizeof(sock_type);
+  u32 sig = LISTEN_READY_SIG;
+  u16 port;
+
+  if (!__listenready_port || __listenready_done) return;
+
+  if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &sock_type, &type_len) ||
+      sock_type != type) return;
+
+  if (getsockname(fd, (struct sockaddr*)&addr, &len)) return;
+
+  if (addr.ss_family == AF_INET)
+    port = ntohs(((struct sockaddr_in*)&addr)->sin_port);
+  else if (addr.ss_family == AF_INET6)
+    port = ntohs(((struct sockaddr_in6*)&addr)->sin6_port);
+  else return;
+
+  if (port != __listenready_port) return;
+
+  __listenready_done = 1;
+
+  if (fstat(LISTEN_FD, &st) || !S_ISFIFO(st.st_mode)) return;
+
+  if (write(LISTEN_FD, &sig, 4) == 4) close(LISTEN_FD);
+
+}
+
+
+/* TCP servers are ready once they listen(), UDP servers once they bind().
+   Both calls go straight to the kernel, so there is no need for dlsym(). */
+
+int listen(int fd, int backlog) {
+
+  int ret = syscall(SYS_listen, fd, backlog);
+
+  if (!ret) __listenready_check(fd, SOCK_STREAM);
+  return ret;
+
+}
+
+
+int bind(int fd, const struct sockaddr* addr, socklen_t len) {
+
+  int ret = syscall(SYS_bind, fd, addr, len);
+
+  if (!ret) __listenready_check(fd, SOCK_DGRAM);
+  return ret;
+
+}
@@ -0,0 +1,911 @@
+/*
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at:
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+/*
+
+   AFLNet - virtual time for the server under test (-v)
+   ----------------------------------------------------
+
+   This Linux-only companion library runs the clocks of the server under
+   test ahead whenever the server waits for time to pass: sleeps, and
+   poll(), select() and epoll timeouts that expire without any input. The
+   server sees the time it asked for go by, afl-fuzz does not have to wait
+   for it. alarm(), setitimer(ITIMER_REAL) and timerfds are moved along.
+   See README.vtime for more info.
+*/
+
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/select.h>
+#include <sys/time.h>
+#include <sys/timerfd.h>
+
+#include "../types.h"
+#include "../config.h"
+
+#ifndef __linux__
+#  error "Sorry, this library is Linux-specific for now!"
+#endif /* !__linux__ */
+
+
+#define NS_PER_SEC  1000000000LL
+#define MAX_FDS     65536
+
+/* How long a sleep waits for an alarm it skipped to, to let the signal in: */
+
+#define VTIME_ALARM_NSECS 1000000
+
+/* Everything is kept in virtual monotonic nanoseconds: the real monotonic
+   clock plus __vtime_offset. The offset only grows, and applies to all the
+   clocks that tell the time of day or the time since boot, so that they
+   stay consistent with each other. */
+
+static s64 __vtime_offset;
+static s64 __vtime_grace;               /* Real wait before skipping, 0: off */
+
+/* Timers to move along when skipping ahead. A deadline of 0 is unarmed. */
+
+struct vtimer {
+  s64 deadline;
+  s64 interval;
+  clockid_t clk;
+};
+
+static struct vtimer __vtime_alarm;
+static struct vtimer __vtime_tfd[MAX_FDS];
+static u8  __vtime_tfd_used[MAX_FDS];
+static int __vtime_tfd_max;             /* Highest timerfd seen, plus one  */
+
+static u8  __vtime_lock;                /* Guards the timers and skipping  */
+
+
+/* Resolve the next definition of a function (libc's, or that of a library
+   preloaded after us, such as libdesock.so) on first use. */
+
+static int (*real_clock_gettime)(clockid_t, struct timespec*);
+static int (*real_gettimeofday)(struct timeval*, void*);
+static int (*real_nanosleep)(const struct timespec*, struct timespec*);
+static int (*real_clock_nanosleep)(clockid_t, int, const struct timespec*,
+                                   struct timespec*);
+static int (*real_poll)(struct pollfd*, nfds_t, int);
+static int (*real_ppoll)(struct pollfd*, nfds_t, const struct timespec*,
+                         const sigset_t*);
+static int (*real_select)(int, fd_set*, fd_set*, fd_set*, struct timeval*);
+static int (*real_pselect)(int, fd_set*, fd_set*, fd_set*,
+                           const struct timespec*, const sigset_t*);
+static int (*real_epoll_pwait)(int, struct epoll_event*, int, int,
+                               const sigset_t*);
+static int (*real_setitimer)(__itimer_which_t, const struct itimerval*,
+                             struct itimerval*);
+static int (*real_getitimer)(__itimer_which_t, struct itimerval*);
+static int (*real_timerfd_create)(int, int);
+static int (*real_timerfd_settime)(int, int, const struct itimerspec*,
+                                   struct itimerspec*);
+static int (*real_timerfd_gettime)(int, struct itimerspec*);
+
+static void* __vtime_resolve(void** ptr, const char* name) {
+
+  void* fn = __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+
+  if (!fn) {
+
+    fn = dlsym(RTLD_NEXT, name);
+    if (!fn) abort();
+    __atomic_store_n(ptr, fn, __ATOMIC_RELEASE);
+
+  }
+
+  return fn;
+
+}
+
+#define REAL(_name) \
+  ((__typeof__(real_##_name))__vtime_resolve((void**)&real_##_name, #_name))
+
+
+static void __vtime_acquire(void) {
+
+  while (__atomic_test_and_set(&__vtime_lock, __ATOMIC_ACQUIRE));
+
+}
+
+
+static void __vtime_release(void) {
+
+  __atomic_clear(&__vtime_lock, __ATOMIC_RELEASE);
+
+}
+
+
+/* Clocks. Only the CPU time clocks keep running in real time. */
+
+static u8 __vtime_shifted(clockid_t clk) {
+
+  return clk >= 0 && clk != CLOCK_PROCESS_CPUTIME_ID &&
+         clk != CLOCK_THREAD_CPUTIME_ID;
+
+}
+
+
+static s64 __vtime_ts_ns(const struct timespec* ts) {
+
+  return ts->tv_sec * NS_PER_SEC + ts->tv_nsec;
+
+}
+
+
+static struct timespec __vtime_ns_ts(s64 ns) {
+
+  struct timespec ts;
+
+  if (ns < 0) ns = 0;
+
+  ts.tv_sec  = ns / NS_PER_SEC;
+  ts.tv_nsec = ns % NS_PER_SEC;
+
+  return ts;
+
+}
+
+
+static s64 __vtime_tv_ns(const struct timeval* tv) {
+
+  return (tv->tv_sec * 1000000LL + tv->tv_usec) * 1000;
+
+}
+
+
+static struct timeval __vtime_ns_tv(s64 ns) {
+
+  struct timeval tv;
+
+  if (ns < 0) ns = 0;
+
+  tv.tv_sec  = ns / NS_PER_SEC;
+  tv.tv_usec = ns % NS_PER_SEC / 1000;
+
+  return tv;
+
+}
+
+
+static s64 __vtime_real_now(void) {
+
+  struct timespec ts;
+
+  REAL(clock_gettime)(CLOCK_MONOTONIC, &ts);
+  return __vtime_ts_ns(&ts);
+
+}
+
+
+static s64 __vtime_now(void) {
+
+  return __vtime_real_now() + __atomic_load_n(&__vtime_offset, __ATOMIC_ACQUIRE);
+
+}
+
+
+/* The next expiry of a timer after now; unarmed if it has gone off for the
+   last time. Called with the lock held. */
+
+static s64 __vtime_next(struct vtimer* t, s64 now) {
+
+  if (!t->deadline || t->deadline > now) return t->deadline;
+
+  if (!t->interval) {
+
+    t->deadline = 0;
+    return 0;
+
+  }
+
+  t->deadline += ((now - t->deadline) / t->interval + 1) * t->interval;
+  return t->deadline;
+
+}
+
+
+/* The earliest timer expiry, 0 if no timer is armed. */
+
+static s64 __vtime_next_timer(void) {
+
+  s64 best, next;
+  int fd;
+
+  __vtime_acquire();
+
+  best = __vtime_next(&__vtime_alarm, __vtime_now());
+
+  for (fd = 0; fd < __vtime_tfd_max; fd++) {
+
+    if (!__vtime_tfd_used[fd]) continue;
+
+    next = __vtime_next(&__vtime_tfd[fd], __vtime_now());
+    if (next && (!best || next < best)) best = next;
+
+  }
+
+  __vtime_release();
+
+  return best;
+
+}
+
+
+/* How long the kernel should wait for a timer once we are at now. Those
+   that came due while skipping go off right away (once, like the kernel
+   would) and the periodic ones count their next period from there. */
+
+static s64 __vtime_left(struct vtimer* t, s64 now) {
+
+  s64 left = t->deadline - now;
+
+  if (left > 0) return left;
+
+  t->deadline = t->interval ? now + t->interval : 0;
+  return 1000;
+
+}
+
+
+/* Skip ahead to a virtual deadline, then hand the real timers their new
+   deadlines. Threads waiting for the same moment must not skip twice, so
+   the clocks only ever move up to it. */
+
+static void __vtime_skip_to(s64 deadline) {
+
+  s64 real, now;
+  int fd;
+
+  __vtime_acquire();
+
+  real = __vtime_real_now();
+  now  = real + __vtime_offset;
+
+  if (deadline <= now) {
+
+    __vtime_release();
+    return;
+
+  }
+
+  /* Forget what has gone off before we got here, so that it does not go
+     off a second time. */
+
+  __vtime_next(&__vtime_alarm, now);
+
+  for (fd = 0; fd < __vtime_tfd_max; fd++)
+    if (__vtime_tfd_used[fd]) __vtime_next(&__vtime_tfd[fd], now);
+
+  __atomic_store_n(&__vtime_offset, deadline - real, __ATOMIC_RELEASE);
+
+  if (__vtime_alarm.deadline) {
+
+    struct itimerval it;
+
+    it.it_value    = __vtime_ns_tv(__vtime_left(&__vtime_alarm, deadline));
+    it.it_interval = __vtime_ns_tv(__vtime_alarm.interval);
+
+    REAL(setitimer)(ITIMER_REAL, &it, NULL);
+
+  }
+
+  for (fd = 0; fd < __vtime_tfd_max; fd++) {
+
+    struct itimerspec its;
+
+    if (!__vtime_tfd_used[fd] || !__vtime_tfd[fd].deadline) continue;
+
+    its.it_value    = __vtime_ns_ts(__vtime_left(&__vtime_tfd[fd], deadline));
+    its.it_interval = __vtime_ns_ts(__vtime_tfd[fd].interval);
+
+    /* The descriptor was closed and maybe reused for something else. */
+
+    if (REAL(timerfd_settime)(fd, 0, &its, NULL)) __vtime_tfd_used[fd] = 0;
+
+  }
+
+  __vtime_release();
+
+}
+
+
+/* Sleep until a virtual deadline. A sleeping thread cannot miss any input,
+   so time skips right away, except that an alarm due first has to go off
+   and interrupt the sleep. Returns -1 (EINTR) when a signal does. */
+
+static int __vtime_sleep_until(s64 deadline) {
+
+  while (1) {
+
+    s64 alarm_at, left;
+    struct timespec ts;
+
+    __vtime_acquire();
+    alarm_at = __vtime_next(&__vtime_alarm, __vtime_now());
+    __vtime_release();
+
+    if (!alarm_at || alarm_at >= deadline) {
+
+      __vtime_skip_to(deadline);
+      return 0;
+
+    }
+
+    __vtime_skip_to(alarm_at);
+
+    left = deadline - __vtime_now();
+    if (left <= 0) return 0;
+
+    ts = __vtime_ns_ts(MIN(left, VTIME_ALARM_NSECS));
+    if (REAL(nanosleep)(&ts, NULL)) return -1;
+
+  }
+
+}
+
+
+/* Wait for events with a timeout in virtual nanoseconds (-1: none). The
+   real wait is cut to the grace period; if nothing shows up by then, the
+   server is idle and time skips to the timeout or to the next timer,
+   whichever comes first. When it is a timer, the real wait is repeated to
+   pick it up (a readable timerfd, or SIGALRM interrupting the wait). */
+
+typedef int (*vtime_wait_fn)(void* ctx, const struct timespec* ts);
+
+static int __vtime_wait(vtime_wait_fn fn, void* ctx, s64 timeout) {
+
+  s64 until = timeout < 0 ? 0 : __vtime_now() + timeout;
+
+  while (1) {
+
+    s64 timer = __vtime_next_timer(), deadline = until, left;
+    struct timespec ts;
+    int ret;
+
+    if (timer && (!deadline || timer < deadline)) deadline = timer;
+    if (!deadline) return fn(ctx, NULL);
+
+    left = deadline - __vtime_now();
+    ts   = __vtime_ns_ts(MIN(left, __vtime_grace));
+
+    ret = fn(ctx, &ts);
+    if (ret) return ret;
+
+    if (left > __vtime_grace) __vtime_skip_to(deadline);
+    if (until && __vtime_now() >= until) return 0;
+
+  }
+
+}
+
+
+/* Rounds up, so that the real wait does not come back too early. */
+
+static int __vtime_ts_ms(const struct timespec* ts) {
+
+  if (!ts) return -1;
+  return (__vtime_ts_ns(ts) + 999999) / 1000000;
+
+}
+
+
+/* Constructor. The environment variable holds the grace period in
+   microseconds; without it, the library passes everything through. */
+
+__attribute__((constructor)) static void __vtime_init(void) {
+
+  char* env = getenv(VTIME_ENV_VAR);
+
+  if (env) __vtime_grace = atoll(env) * 1000;
+
+}
+
+
+/* Clocks. */
+
+int clock_gettime(clockid_t clk, struct timespec* ts) {
+
+  int ret = REAL(clock_gettime)(clk, ts);
+
+  if (!ret && __vtime_grace && __vtime_shifted(clk))
+    *ts = __vtime_ns_ts(__vtime_ts_ns(ts) +
+                        __atomic_load_n(&__vtime_offset, __ATOMIC_ACQUIRE));
+
+  return ret;
+
+}
+
+
+int gettimeofday(struct timeval* tv, void* tz) {
+
+  int ret = REAL(gettimeofday)(tv, tz);
+
+  if (!ret && __vtime_grace) {
+
+    s64 us = tv->tv_sec * 1000000LL + tv->tv_usec +
+             __atomic_load_n(&__vtime_offset, __ATOMIC_ACQUIRE) / 1000;
+
+    tv->tv_sec  = us / 1000000;
+    tv->tv_usec = us % 1000000;
+
+  }
+
+  return ret;
+
+}
+
+
+time_t time(time_t* t) {
+
+  struct timespec ts;
+  time_t now;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  now = ts.tv_sec;
+
+  if (t) *t = now;
+  return now;
+
+}
+
+
+/* Sleeps. */
+
+int nanosleep(const struct timespec* req, struct timespec* rem) {
+
+  s64 deadline;
+
+  if (!__vtime_grace) return REAL(nanosleep)(req, rem);
+
+  if (req->tv_nsec < 0 || req->tv_nsec >= NS_PER_SEC) {
+
+    errno = EINVAL;
+    return -1;
+
+  }
+
+  deadline = __vtime_now() + __vtime_ts_ns(req);
+
+  if (__vtime_sleep_until(deadline)) {
+
+    if (rem) *rem = __vtime_ns_ts(deadline - __vtime_now());
+    return -1;
+
+  }
+
+  return 0;
+
+}
+
+
+int clock_nanosleep(clockid_t clk, int flags, const struct timespec* req,
+                    struct timespec* rem) {
+
+  s64 deadline;
+
+  if (!__vtime_grace || !__vtime_shifted(clk))
+    return REAL(clock_nanosleep)(clk, flags, req, rem);
+
+  if (req->tv_nsec < 0 || req->tv_nsec >= NS_PER_SEC) return EINVAL;
+
+  deadline = __vtime_ts_ns(req);
+
+  if (flags & TIMER_ABSTIME) {
+
+    struct timespec now;
+
+    clock_gettime(clk, &now);
+    deadline -= __vtime_ts_ns(&now);
+
+  }
+
+  deadline += __vtime_now();
+
+  if (__vtime_sleep_until(deadline)) {
+
+    if (rem && !(flags & TIMER_ABSTIME))
+      *rem = __vtime_ns_ts(deadline - __vtime_now());
+
+    return EINTR;
+
+  }
+
+  return 0;
+
+}
+
+
+int usleep(useconds_t usec) {
+
+  struct timespec ts = { usec / 1000000, usec % 1000000 * 1000 };
+
+  return nanosleep(&ts, NULL);
+
+}
+
+
+unsigned int sleep(unsigned int secs) {
+
+  struct timespec ts = { secs, 0 }, rem;
+
+  if (nanosleep(&ts, &rem)) return rem.tv_sec + !!rem.tv_nsec;
+  return 0;
+
+}
+
+
+/* Event loops. */
+
+struct vtime_poll {
+  struct pollfd* fds;
+  nfds_t nfds;
+  const sigset_t* sigmask;
+};
+
+static int __vtime_do_poll(void* ctx, const struct timespec* ts) {
+
+  struct vtime_poll* p = ctx;
+
+  return REAL(ppoll)(p->fds, p->nfds, ts, p->sigmask);
+
+}
+
+
+int poll(struct pollfd* fds, nfds_t nfds, int timeout) {
+
+  struct vtime_poll p = { fds, nfds, NULL };
+
+  if (!__vtime_grace || !timeout) return REAL(poll)(fds, nfds, timeout);
+
+  return __vtime_wait(__vtime_do_poll, &p,
+                      timeout < 0 ? -1 : timeout * 1000000LL);
+
+}
+
+
+int __poll_chk(struct pollfd* fds, nfds_t nfds, int timeout, size_t fds_len) {
+
+  if (fds_len / sizeof(*fds) < nfds) abort();
+  return poll(fds, nfds, timeout);
+
+}
+
+
+int ppoll(struct pollfd* fds, nfds_t nfds, const struct timespec* timeout,
+          const sigset_t* sigmask) {
+
+  struct vtime_poll p = { fds, nfds, sigmask };
+
+  if (!__vtime_grace || (timeout && !__vtime_ts_ns(timeout)))
+    return REAL(ppoll)(fds, nfds, timeout, sigmask);
+
+  return __vtime_wait(__vtime_do_poll, &p,
+                      timeout ? __vtime_ts_ns(timeout) : -1);
+
+}
+
+
+/* select() clears the sets it returns, so every retry starts over from a
+   copy of those passed in. */
+
+struct vtime_select {
+  int nfds;
+  fd_set *rfds, *wfds, *efds;
+  fd_set rsave, wsave, esave;
+  const sigset_t* sigmask;
+};
+
+static int __vtime_do_select(void* ctx, const struct timespec* ts) {
+
+  struct vtime_select* s = ctx;
+
+  if (s->rfds) *s->rfds = s->rsave;
+  if (s->wfds) *s->wfds = s->wsave;
+  if (s->efds) *s->efds = s->esave;
+
+  return REAL(pselect)(s->nfds, s->rfds, s->wfds, s->efds, ts, s->sigmask);
+
+}
+
+
+static int __vtime_select(int nfds, fd_set* rfds, fd_set* wfds, fd_set* efds,
+                          s64 timeout, const sigset_t* sigmask) {
+
+  struct vtime_select s;
+
+  s.nfds    = nfds;
+  s.rfds    = rfds;
+  s.wfds    = wfds;
+  s.efds    = efds;
+  s.sigmask = sigmask;
+
+  if (rfds) s.rsave = *rfds;
+  if (wfds) s.wsave = *wfds;
+  if (efds) s.esave = *efds;
+
+  return __vtime_wait(__vtime_do_select, &s, timeout);
+
+}
+
+
+int select(int nfds, fd_set* rfds, fd_set* wfds, fd_set* efds,
+           struct timeval* timeout) {
+
+  s64 ns;
+  int ret;
+
+  if (!__vtime_grace || (timeout && !timeout->tv_sec && !timeout->tv_usec))
+    return REAL(select)(nfds, rfds, wfds, efds, timeout);
+
+  ns  = timeout ? __vtime_tv_ns(timeout) : -1;
+  ret = __vtime_select(nfds, rfds, wfds, efds, ns, NULL);
+
+  /* Like Linux, leave the time not slept in the timeout. */
+
+  if (timeout && !ret) timeout->tv_sec = timeout->tv_usec = 0;
+  return ret;
+
+}
+
+
+int pselect(int nfds, fd_set* rfds, fd_set* wfds, fd_set* efds,
+            const struct timespec* timeout, const sigset_t* sigmask) {
+
+  if (!__vtime_grace || (timeout && !__vtime_ts_ns(timeout)))
+    return REAL(pselect)(nfds, rfds, wfds, efds, timeout, sigmask);
+
+  return __vtime_select(nfds, rfds, wfds, efds,
+                        timeout ? __vtime_ts_ns(timeout) : -1, sigmask);
+
+}
+
+
+struct vtime_epoll {
+  int epfd;
+  struct epoll_event* evs;
+  int max;
+  const sigset_t* sigmask;
+};
+
+static int __vtime_do_epoll(void* ctx, const struct timespec* ts) {
+
+  struct vtime_epoll* e = ctx;
+
+  return REAL(epoll_pwait)(e->epfd, e->evs, e->max, __vtime_ts_ms(ts),
+                           e->sigmask);
+
+}
+
+
+int epoll_wait(int epfd, struct epoll_event* evs, int max, int timeout) {
+
+  return epoll_pwait(epfd, evs, max, timeout, NULL);
+
+}
+
+
+int epoll_pwait(int epfd, struct epoll_event* evs, int max, int timeout,
+                const sigset_t* sigmask) {
+
+  struct vtime_epoll e = { epfd, evs, max, sigmask };
+
+  if (!__vtime_grace || !timeout)
+    return REAL(epoll_pwait)(epfd, evs, max, timeout, sigmask);
+
+  return __vtime_wait(__vtime_do_epoll, &e,
+                      timeout < 0 ? -1 : timeout * 1000000LL);
+
+}
+
+
+/* Timers. They are armed for real as asked; we only remember their virtual
+   deadlines, to know when to stop skipping ahead, and move them along when
+   we do. */
+
+static void __vtime_get(struct vtimer* t, s64 now, s64* value, s64* interval) {
+
+  *value    = __vtime_next(t, now);
+  *value    = *value ? *value - now : 0;
+  *interval = t->interval;
+
+}
+
+
+int setitimer(__itimer_which_t which, const struct itimerval* new,
+              struct itimerval* old) {
+
+  s64 now, value, interval;
+  int ret;
+
+  if (!__vtime_grace || which != ITIMER_REAL)
+    return REAL(setitimer)(which, new, old);
+
+  __vtime_acquire();
+
+  now = __vtime_now();
+  __vtime_get(&__vtime_alarm, now, &value, &interval);
+
+  ret = REAL(setitimer)(which, new, NULL);
+
+  if (!ret) {
+
+    s64 next = __vtime_tv_ns(&new->it_value);
+
+    __vtime_alarm.deadline = next ? now + next : 0;
+    __vtime_alarm.interval = __vtime_tv_ns(&new->it_interval);
+
+    if (old) {
+
+      old->it_value    = __vtime_ns_tv(value);
+      old->it_interval = __vtime_ns_tv(interval);
+
+    }
+
+  }
+
+  __vtime_release();
+
+  return ret;
+
+}
+
+
+int getitimer(__itimer_which_t which, struct itimerval* cur) {
+
+  s64 value, interval;
+
+  if (!__vtime_grace || which != ITIMER_REAL)
+    return REAL(getitimer)(which, cur);
+
+  __vtime_acquire();
+  __vtime_get(&__vtime_alarm, __vtime_now(), &value, &interval);
+  __vtime_release();
+
+  cur->it_value    = __vtime_ns_tv(value);
+  cur->it_interval = __vtime_ns_tv(interval);
+
+  return 0;
+
+}
+
+
+unsigned int alarm(unsigned int secs) {
+
+  struct itimerval it, old;
+
+  memset(&it, 0, sizeof(it));
+  it.it_value.tv_sec = secs;
+
+  if (setitimer(ITIMER_REAL, &it, &old)) return 0;
+
+  /* Like glibc, round to the nearest second, but never report an alarm that
+     is still pending as none. */
+
+  return old.it_value.tv_sec + (old.it_value.tv_usec >= 500000 ||
+                                (!old.it_value.tv_sec && old.it_value.tv_usec));
+
+}
+
+
+int timerfd_create(int clk, int flags) {
+
+  int fd = REAL(timerfd_create)(clk, flags);
+
+  if (fd >= 0 && fd < MAX_FDS && __vtime_grace) {
+
+    __vtime_acquire();
+
+    memset(&__vtime_tfd[fd], 0, sizeof(struct vtimer));
+    __vtime_tfd[fd].clk  = clk;
+    __vtime_tfd_used[fd] = __vtime_shifted(clk);
+    if (fd >= __vtime_tfd_max) __vtime_tfd_max = fd + 1;
+
+    __vtime_release();
+
+  }
+
+  return fd;
+
+}
+
+
+int timerfd_settime(int fd, int flags, const struct itimerspec* new,
+                    struct itimerspec* old) {
+
+  struct itimerspec rel;
+  s64 now, value, interval;
+  int ret;
+
+  if (!__vtime_grace || fd < 0 || fd >= MAX_FDS || !__vtime_tfd_used[fd] ||
+      new->it_value.tv_nsec < 0 || new->it_value.tv_nsec >= NS_PER_SEC)
+    return REAL(timerfd_settime)(fd, flags, new, old);
+
+  /* An absolute deadline is on the virtual clock; the kernel gets it
+     relative to now. Cancel-on-set makes no sense for a skipping clock. */
+
+  value = __vtime_ts_ns(&new->it_value);
+
+  if (value && (flags & TFD_TIMER_ABSTIME)) {
+
+    struct timespec clk_now;
+
+    clock_gettime(__vtime_tfd[fd].clk, &clk_now);
+    value = MAX(value - __vtime_ts_ns(&clk_now), 1);
+
+  }
+
+  rel.it_value    = __vtime_ns_ts(value);
+  rel.it_interval = new->it_interval;
+
+  __vtime_acquire();
+
+  now = __vtime_now();
+  __vtime_get(&__vtime_tfd[fd], now, &value, &interval);
+
+  ret = REAL(timerfd_settime)(fd, 0, &rel, NULL);
+
+  if (!ret) {
+
+    __vtime_tfd[fd].deadline = __vtime_ts_ns(&rel.it_value);
+    if (__vtime_tfd[fd].deadline) __vtime_tfd[fd].deadline += now;
+    __vtime_tfd[fd].interval = __vtime_ts_ns(&rel.it_interval);
+
+    if (old) {
+
+      old->it_value    = __vtime_ns_ts(value);
+      old->it_interval = __vtime_ns_ts(interval);
+
+    }
+
+  }
+
+  __vtime_release();
+
+  return ret;
+
+}
+
+
+int timerfd_gettime(int fd, struct itimerspec* cur) {
+
+  s64 value, interval;
+
+  if (!__vtime_grace || fd < 0 || fd >= MAX_FDS || !__vtime_tfd_used[fd])
+    return REAL(timerfd_gettime)(fd, cur);
+
+  /* Let the kernel check the descriptor. */
+
+  if (REAL(timerfd_gettime)(fd, cur)) return -1;
+
+  __vtime_acquire();
+  __vtime_get(&__vtime_tfd[fd], __vtime_now(), &value, &interval);
+  __vtime_release();
+
+  cur->it_value    = __vtime_ns_ts(value);
+  cur->it_interval = __vtime_ns_ts(interval);
+
+  return 0;
+
+}
@@ -279,6 +279,22 @@ static void edit_params(u32 argc, char** argv) {
 #endif /* ^__APPLE__ */
     "_I(); } while (0)";
 
+  /* Automatic deferral: route the calls a server makes when it waits for a
+     client through the runtime (see __afl_defer_auto_init() there). */
+
+  if (maybe_linking && getenv("AFL_DEFER_AUTO")) {
+
+#ifdef __APPLE__
+    FATAL("AFL_DEFER_AUTO is not supported on MacOS X");
+#endif /* __APPLE__ */
+
+    cc_params[cc_par_cnt++] = "-Wl,--wrap=accept,--wrap=accept4,"
+      "--wrap=recv,--wrap=recvfrom,--wrap=recvmsg,--wrap=poll,--wrap=ppoll,"
+      "--wrap=select,--wrap=pselect,--wrap=epoll_wait,--wrap=epoll_pwait,"
+      "--wrap=__recv_chk,--wrap=__recvfrom_chk,--wrap=__poll_chk";
+
+  }
+
   if (maybe_linking) {
 
     if (x_set) {
@@ -310,6 +326,13 @@ static void edit_params(u32 argc, char** argv) {
 
     }
 
+    /* The runtime's listen() and bind() look up the next definition with
+       dlsym(). */
+
+#ifndef __APPLE__
+    cc_params[cc_par_cnt++] = "-ldl";
+#endif /* !__APPLE__ */
+
   }
 
   cc_params[cc_par_cnt] = NULL;
@@ -345,7 +368,9 @@ int main(int argc, char** argv) {
          "an LLVM pass and tends to offer improved performance with slow programs.\n\n"
 
          "You can specify custom next-stage toolchain via AFL_CC and AFL_CXX. Setting\n"
-         "AFL_HARDEN enables hardening optimizations in the compiled code.\n\n",
+         "AFL_HARDEN enables hardening optimizations in the compiled code. Setting\n"
+         "AFL_DEFER_AUTO defers the fork server of network servers until they wait for\n"
+         "a connection.\n\n",
          BIN_PATH, BIN_PATH);
 
     exit(1);
@@ -150,6 +150,17 @@ bool AFLCoverage::runOnModule(Module &M) {
       IRB.CreateStore(Incr, MapPtrIdx)
           ->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
 
+      /* Bump the edge epoch kept right after the bitmap */
+
+      Value *EpochPtr = IRB.CreateBitCast(
+          IRB.CreateGEP(MapPtr, ConstantInt::get(Int32Ty, MAP_EPOCH_OFF)),
+          PointerType::get(Int32Ty, 0));
+      LoadInst *Epoch = IRB.CreateLoad(EpochPtr);
+      Epoch->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+      IRB.CreateStore(IRB.CreateAdd(Epoch, ConstantInt::get(Int32Ty, 1)),
+                      EpochPtr)
+          ->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+
       /* Set prev_loc to cur_loc >> 1 */
 
       StoreInst *Store =
@@ -26,6 +26,8 @@
    This code is the rewrite of afl-as.h's main_payload.
 */
 
+#define _GNU_SOURCE
+
 #include "../android-ashmem.h"
 #include "../config.h"
 #include "../types.h"
@@ -37,10 +39,21 @@
 #include <string.h>
 #include <assert.h>
 
+#include <dirent.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <poll.h>
+
 #include <sys/mman.h>
 #include <sys/shm.h>
 #include <sys/wait.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
 
 /* This is a somewhat ugly hack for the experimental 'trace-pc-guard' mode.
    Basically, we need to make sure that the forkserver is initialized after
@@ -57,7 +70,7 @@
    is used for instrumentation output before __afl_map_shm() has a chance to run.
    It will end up as .comm, so it shouldn't be too wasteful. */
 
-u8  __afl_area_initial[MAP_SIZE];
+u8  __afl_area_initial[SHM_SIZE];
 u8* __afl_area_ptr = __afl_area_initial;
 
 __thread u32 __afl_prev_loc;
@@ -68,6 +81,23 @@ __thread u32 __afl_prev_loc;
 static u8 is_persistent;
 
 
+/* AFLNet listen-ready handshake state: the port afl-fuzz will connect to,
+   whether the server is already listening on it, and whether this process
+   is the one being fuzzed (i.e., not the fork server itself). */
+
+static u16 listen_port;
+static u8  listen_seen, listen_armed;
+
+
+/* Automatic deferral (AFL_DEFER_AUTO=1 afl-clang-fast): the port the server
+   will be fuzzed on, its socket once it listens (TCP) or is bound (UDP), and
+   whether the fork server still waits for the server to block on it. */
+
+static u16 defer_port;
+static s32 defer_fd = -1;
+static u8  defer_armed, defer_started;
+
+
 /* SHM setup. */
 
 static void __afl_map_shm(void) {
@@ -98,19 +128,194 @@ static void __afl_map_shm(void) {
 }
 
 
+/* Tell afl-fuzz that the server is listening, once we know both that it is
+   and that we are the process under test. The descriptor may have been
+   closed or reused by the target in the meantime, so only write to a pipe. */
+
+static void __afl_notify_listen(void) {
+
+  u32 sig = LISTEN_READY_SIG;
+  struct stat st;
+
+  if (!listen_seen || !listen_armed) return;
+
+  listen_armed = 0;
+
+  if (fstat(LISTEN_FD, &st) || !S_ISFIFO(st.st_mode)) return;
+
+  if (write(LISTEN_FD, &sig, 4) == 4) close(LISTEN_FD);
+
+}
+
+
+/* Check if fd is a socket of the given type bound to the watched port. */
+
+static void __afl_check_listen(int fd, int type) {
+
+  struct sockaddr_storage addr;
+  socklen_t len = sizeof(addr);
+  int sock_type;
+  socklen_t type_len = sizeof(sock_type);
+  u16 port;
+
+  if ((!listen_port || listen_seen) && (!defer_armed || defer_fd >= 0)) return;
+
+  if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &sock_type, &type_len) ||
+      sock_type != type) return;
+
+  if (getsockname(fd, (struct sockaddr*)&addr, &len)) return;
+
+  if (addr.ss_family == AF_INET)
+    port = ntohs(((struct sockaddr_in*)&addr)->sin_port);
+  else if (addr.ss_family == AF_INET6)
+    port = ntohs(((struct sockaddr_in6*)&addr)->sin6_port);
+  else return;
+
+  if (defer_armed && port == defer_port) defer_fd = fd;
+
+  if (!listen_port || listen_seen || port != listen_port) return;
+
+  listen_seen = 1;
+  __afl_notify_listen();
+
+}
+
+
+/* TCP servers are ready once they listen(), UDP servers once they bind().
+   These definitions live in the executable, so they come before those of
+   any preloaded library (libdesock.so, liblistenready.so) as well as libc's;
+   hand the calls on to the next definition in the lookup order rather than
+   to the kernel, or a preloaded bind() would never see them. The
+   definitions are weak in case the target brings its own. */
+
+#if defined(SYS_listen) && defined(SYS_bind)
+
+static int (*next_listen)(int, int);
+static int (*next_bind)(int, const struct sockaddr*, socklen_t);
+
+__attribute__((weak)) int listen(int fd, int backlog) {
+
+  int ret;
+
+  if (!next_listen) next_listen = dlsym(RTLD_NEXT, "listen");
+
+  ret = next_listen ? next_listen(fd, backlog)
+                    : syscall(SYS_listen, fd, backlog);
+
+  if (!ret) __afl_check_listen(fd, SOCK_STREAM);
+  return ret;
+
+}
+
+
+__attribute__((weak)) int bind(int fd, const struct sockaddr* addr,
+                               socklen_t len) {
+
+  int ret;
+
+  if (!next_bind) next_bind = dlsym(RTLD_NEXT, "bind");
+
+  ret = next_bind ? next_bind(fd, addr, len)
+                  : syscall(SYS_bind, fd, addr, len);
+
+  if (!ret) __afl_check_listen(fd, SOCK_DGRAM);
+  return ret;
+
+}
+
+#  define LISTEN_HELLO FS_OPT_LISTEN_READY
+
+#else
+
+#  define LISTEN_HELLO 0
+
+#endif /* ^SYS_listen && SYS_bind */
+
+
+/* With automatic deferral, the listening socket predates the fork server and
+   is shared by all the children. Throw away what a previous child left
+   unanswered (a connection it did not accept, datagrams it did not read), so
+   that the next child does not take that for what afl-fuzz sends it. */
+
+static void __afl_drain_listen(void) {
+
+  int type;
+  socklen_t len = sizeof(type);
+  struct pollfd pfd = { .fd = defer_fd, .events = POLLIN };
+  struct timespec now = { 0, 0 };
+  u8 buf[64];
+
+  if (defer_fd < 0 ||
+      getsockopt(defer_fd, SOL_SOCKET, SO_TYPE, &type, &len)) return;
+
+  /* The socket is blocking, so only go for what is already there. These are
+     raw syscalls: poll() and friends may be wrapped, or preloaded. */
+
+#if defined(SYS_ppoll) && defined(SYS_accept4) && defined(SYS_recvfrom)
+
+  while (syscall(SYS_ppoll, &pfd, 1, &now, NULL, _NSIG / 8) > 0) {
+
+    if (type == SOCK_STREAM) {
+
+      int conn = syscall(SYS_accept4, defer_fd, NULL, NULL, 0);
+      if (conn < 0) break;
+      close(conn);
+
+    } else if (syscall(SYS_recvfrom, defer_fd, buf, sizeof(buf),
+                       MSG_DONTWAIT, NULL, NULL) < 0) break;
+
+  }
+
+#endif /* SYS_ppoll && SYS_accept4 && SYS_recvfrom */
+
+}
+
+
+/* Threads the process runs, as far as /proc tells. */
+
+static u32 __afl_thread_count(void) {
+
+  DIR* d = opendir("/proc/self/task");
+  struct dirent* de;
+  u32 cnt = 0;
+
+  if (!d) return 1;
+
+  while ((de = readdir(d)))
+    if (de->d_name[0] != '.') cnt++;
+
+  closedir(d);
+  return cnt;
+
+}
+
+
 /* Fork server logic. */
 
 static void __afl_start_forkserver(void) {
 
-  static u8 tmp[4];
+  static u32 hello = LISTEN_HELLO;
   s32 child_pid;
 
+  if (defer_started) {
+
+    hello |= FS_OPT_DEFER_AUTO;
+    if (__afl_thread_count() > 1) hello |= FS_OPT_DEFER_THREADS;
+
+  }
+
   u8  child_stopped = 0;
 
   /* Phone home and tell the parent that we're OK. If parent isn't there,
      assume we're not running in forkserver mode and just execute program. */
 
-  if (write(FORKSRV_FD + 1, tmp, 4) != 4) return;
+  if (write(FORKSRV_FD + 1, &hello, 4) != 4) {
+
+    listen_armed = 1;
+    __afl_notify_listen();
+    return;
+
+  }
 
   while (1) {
 
@@ -132,6 +337,8 @@ static void __afl_start_forkserver(void) {
 
     if (!child_stopped) {
 
+      __afl_drain_listen();
+
       /* Once woken up, create a clone of our process. */
 
       child_pid = fork();
@@ -143,6 +350,12 @@ static void __afl_start_forkserver(void) {
 
         close(FORKSRV_FD);
         close(FORKSRV_FD + 1);
+
+        /* With deferred init, the server may already be listening. */
+
+        fcntl(LISTEN_FD, F_SETFD, FD_CLOEXEC);
+        listen_armed = 1;
+        __afl_notify_listen();
         return;
   
       }
@@ -252,14 +465,110 @@ void __afl_manual_init(void) {
 }
 
 
+/* Automatic deferral. Built with AFL_DEFER_AUTO=1, afl-clang-fast links the
+   target with --wrap for the calls below, so that the target's own calls to
+   them go through __wrap_*() first; __real_*() are what they would have
+   called otherwise (libc, or a preloaded library such as libdesock.so).
+   Without --wrap, the __real_*() references stay null.
+
+   Under afl-fuzz, the fork server is then not started before main(), but the
+   first time the server calls one of these after it started listening on the
+   fuzzed port: at that point it is done initializing and about to wait for
+   afl-fuzz to connect. */
+
+#define DEFER_WRAP(_ret, _name, _params, _args) \
+  _ret __real_##_name _params __attribute__((weak)); \
+  _ret __wrap_##_name _params { \
+    if (defer_armed) __afl_defer_point(); \
+    return __real_##_name _args; \
+  }
+
+int __real_accept(int, struct sockaddr*, socklen_t*) __attribute__((weak));
+
+
+static void __afl_defer_point(void) {
+
+  if (defer_fd < 0) return;
+
+  defer_armed   = 0;
+  defer_started = 1;
+  __afl_manual_init();
+
+}
+
+
+/* Arm the deferral if the target was linked for it and is being fuzzed over
+   the network. The port comes from the listen-ready handshake or, with the
+   shared-memory transport, from libdesock.so's settings. */
+
+static u8 __afl_defer_auto_init(void) {
+
+  u8* str;
+  int shm_id;
+  u32 port = 0;
+
+  if (!__real_accept || !LISTEN_HELLO || !getenv(SHM_ENV_VAR)) return 0;
+
+  if ((str = getenv(LISTEN_ENV_VAR))) port = atoi(str);
+  else if ((str = getenv(DESOCK_ENV_VAR))) sscanf(str, "%d:%u", &shm_id, &port);
+
+  if (!port || port > 65535) return 0;
+
+  defer_port  = port;
+  defer_armed = 1;
+  return 1;
+
+}
+
+
+DEFER_WRAP(int, accept, (int fd, struct sockaddr* addr, socklen_t* len),
+           (fd, addr, len))
+DEFER_WRAP(int, accept4, (int fd, struct sockaddr* addr, socklen_t* len,
+           int flags), (fd, addr, len, flags))
+DEFER_WRAP(ssize_t, recv, (int fd, void* buf, size_t len, int flags),
+           (fd, buf, len, flags))
+DEFER_WRAP(ssize_t, recvfrom, (int fd, void* buf, size_t len, int flags,
+           struct sockaddr* addr, socklen_t* addr_len),
+           (fd, buf, len, flags, addr, addr_len))
+DEFER_WRAP(ssize_t, recvmsg, (int fd, struct msghdr* msg, int flags),
+           (fd, msg, flags))
+DEFER_WRAP(int, poll, (struct pollfd* fds, nfds_t nfds, int timeout),
+           (fds, nfds, timeout))
+DEFER_WRAP(int, ppoll, (struct pollfd* fds, nfds_t nfds,
+           const struct timespec* timeout, const sigset_t* mask),
+           (fds, nfds, timeout, mask))
+DEFER_WRAP(int, select, (int nfds, fd_set* rfds, fd_set* wfds, fd_set* efds,
+           struct timeval* timeout), (nfds, rfds, wfds, efds, timeout))
+DEFER_WRAP(int, pselect, (int nfds, fd_set* rfds, fd_set* wfds, fd_set* efds,
+           const struct timespec* timeout, const sigset_t* mask),
+           (nfds, rfds, wfds, efds, timeout, mask))
+DEFER_WRAP(int, epoll_wait, (int epfd, struct epoll_event* evs, int max,
+           int timeout), (epfd, evs, max, timeout))
+DEFER_WRAP(int, epoll_pwait, (int epfd, struct epoll_event* evs, int max,
+           int timeout, const sigset_t* mask), (epfd, evs, max, timeout, mask))
+DEFER_WRAP(ssize_t, __recv_chk, (int fd, void* buf, size_t len,
+           size_t buf_len, int flags), (fd, buf, len, buf_len, flags))
+DEFER_WRAP(ssize_t, __recvfrom_chk, (int fd, void* buf, size_t len,
+           size_t buf_len, int flags, struct sockaddr* addr,
+           socklen_t* addr_len), (fd, buf, len, buf_len, flags, addr, addr_len))
+DEFER_WRAP(int, __poll_chk, (struct pollfd* fds, nfds_t nfds, int timeout,
+           size_t fds_len), (fds, nfds, timeout, fds_len))
+
+
 /* Proper initialization routine. */
 
 __attribute__((constructor(CONST_PRIO))) void __afl_auto_init(void) {
 
+  u8* listen_str = getenv(LISTEN_ENV_VAR);
+
+  if (listen_str) listen_port = atoi(listen_str);
+
   is_persistent = !!getenv(PERSIST_ENV_VAR);
 
   if (getenv(DEFER_ENV_VAR)) return;
 
+  if (__afl_defer_auto_init()) return;
+
   __afl_manual_init();
 
 }
@@ -274,6 +583,7 @@ __attribute__((constructor(CONST_PRIO))) void __afl_auto_init(void) {
 
 void __sanitizer_cov_trace_pc_guard(uint32_t* guard) {
   __afl_area_ptr[*guard]++;
+  (*(u32*)(__afl_area_ptr + MAP_EPOCH_OFF))++;
 }
 
 
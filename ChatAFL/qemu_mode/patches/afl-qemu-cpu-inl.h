@@ -256,6 +256,7 @@ static inline void afl_maybe_log(abi_ulong cur_loc) {
   if (cur_loc >= afl_inst_rms) return;
 
   afl_area_ptr[cur_loc ^ prev_loc]++;
+  (*(uint32_t*)(afl_area_ptr + MAP_EPOCH_OFF))++;
   prev_loc = cur_loc >> 1;
 
 }